@@ -0,0 +1,190 @@
+#include "linescan.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HACK_LINESCAN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+constexpr std::string_view kWhitespace = " \t\r";
+constexpr size_t kBlockSize = 64;
+
+// One bit per byte of a 64-byte block
+struct block_masks {
+    uint64_t newline;
+    uint64_t slash;
+    // Neither whitespace nor a newline
+    uint64_t code;
+};
+
+using mask_function = block_masks (*)(const char* block);
+
+#if HACK_LINESCAN_X86
+// SSE2 is part of x86-64, so this needs no check
+block_masks masks_sse2(const char* block) {
+    block_masks masks { 0, 0, 0 };
+    for (size_t offset = 0; offset < kBlockSize; offset += 16) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + offset));
+        const __m128i newline = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n'));
+        const __m128i space = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t')));
+        const __m128i white = _mm_or_si128(_mm_or_si128(space, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\r'))), newline);
+        masks.newline |= static_cast<uint64_t>(_mm_movemask_epi8(newline)) << offset;
+        masks.slash |= static_cast<uint64_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('/')))) << offset;
+        masks.code |= static_cast<uint64_t>(~_mm_movemask_epi8(white) & 0xffff) << offset;
+    }
+    return masks;
+}
+
+__attribute__((target("avx2")))
+block_masks masks_avx2(const char* block) {
+    block_masks masks { 0, 0, 0 };
+    for (size_t offset = 0; offset < kBlockSize; offset += 32) {
+        const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + offset));
+        const __m256i newline = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n'));
+        const __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\t')));
+        const __m256i white = _mm256_or_si256(_mm256_or_si256(space, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\r'))), newline);
+        masks.newline |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(newline))) << offset;
+        masks.slash |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('/'))))) << offset;
+        masks.code |= static_cast<uint64_t>(~static_cast<uint32_t>(_mm256_movemask_epi8(white))) << offset;
+    }
+    return masks;
+}
+#else
+block_masks masks_scalar(const char* block) {
+    block_masks masks { 0, 0, 0 };
+    for (size_t index = 0; index < kBlockSize; index += 1) {
+        const char c = block[index];
+        const uint64_t bit = uint64_t { 1 } << index;
+        masks.newline |= c == '\n' ? bit : 0;
+        masks.slash |= c == '/' ? bit : 0;
+        masks.code |= c != '\n' && c != ' ' && c != '\t' && c != '\r' ? bit : 0;
+    }
+    return masks;
+}
+#endif
+
+mask_function masks_for_cpu() {
+#if HACK_LINESCAN_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? masks_avx2 : masks_sse2;
+#else
+    return masks_scalar;
+#endif
+}
+
+inline uint32_t first_bit(uint64_t mask) {
+    return __builtin_ctzll(mask);
+}
+
+inline uint32_t last_bit(uint64_t mask) {
+    return 63 - __builtin_clzll(mask);
+}
+
+}
+
+std::vector<line_span> scan_lines(std::string_view text) {
+    static const mask_function block_masks_of = masks_for_cpu();
+
+    std::vector<line_span> spans;
+    spans.reserve(text.size() / 16 + 1);
+
+    // The line being scanned: where it starts, its first and last code byte so far, and whether a comment started
+    uint32_t begin = 0;
+    bool has_code = false;
+    uint32_t code_first = 0;
+    uint32_t code_last = 0;
+    bool in_comment = false;
+
+    auto end_line = [&] (uint32_t end) {
+        spans.push_back(has_code ? line_span { begin, end, code_first, code_last - code_first + 1 } : line_span { begin, end, end, 0 });
+        begin = end + 1;
+        has_code = false;
+        in_comment = false;
+    };
+
+    for (size_t base = 0; base < text.size(); base += kBlockSize) {
+        block_masks masks;
+        if (text.size() - base >= kBlockSize) {
+            masks = block_masks_of(text.data() + base);
+        } else {
+            // The last block is padded with spaces, which are neither code nor newlines
+            char padded[kBlockSize];
+            std::memset(padded, ' ', kBlockSize);
+            std::memcpy(padded, text.data() + base, text.size() - base);
+            masks = block_masks_of(padded);
+        }
+
+        // A comment starts at a slash followed by another, which for the last byte is the first of the next block
+        const bool slash_next = base + kBlockSize < text.size() && text[base + kBlockSize] == '/';
+        const uint64_t comments = (masks.slash & (masks.slash >> 1)) | (slash_next ? masks.slash & (uint64_t { 1 } << 63) : 0);
+
+        // One round per line that ends in this block, and one for the line running on into the next
+        uint32_t cursor = 0;
+        while (cursor < kBlockSize) {
+            const uint64_t ahead = ~uint64_t { 0 } << cursor;
+            const uint64_t newlines = masks.newline & ahead;
+            const uint64_t segment = newlines != 0 ? ahead & ((newlines & -newlines) - 1) : ahead;
+            if (!in_comment) {
+                uint64_t code = masks.code & segment;
+                if (const uint64_t starts = comments & segment; starts != 0) {
+                    code &= (starts & -starts) - 1;
+                    in_comment = true;
+                }
+                if (code != 0) {
+                    if (!has_code) {
+                        code_first = base + first_bit(code);
+                        has_code = true;
+                    }
+                    code_last = base + last_bit(code);
+                }
+            }
+            if (newlines == 0) {
+                break;
+            }
+            const uint32_t newline = first_bit(newlines);
+            end_line(base + newline);
+            cursor = newline + 1;
+        }
+    }
+
+    if (begin < text.size()) {
+        end_line(text.size());
+    }
+    return spans;
+}
+
+line_span scan_line(std::string_view line) {
+    const std::string_view code = trim_whitespace(trim_comment(line));
+    const uint32_t end = line.size();
+    if (code.empty()) {
+        return line_span { 0, end, end, 0 };
+    }
+    return line_span { 0, end, static_cast<uint32_t>(code.data() - line.data()), static_cast<uint32_t>(code.size()) };
+}
+
+std::string_view trim_whitespace(std::string_view text) {
+    const auto begin = text.find_first_not_of(kWhitespace);
+    if (begin == std::string_view::npos) {
+        return text.substr(text.size());
+    }
+    const auto end = text.find_last_not_of(kWhitespace);
+    return text.substr(begin, end - begin + 1);
+}
+
+std::string_view trim_comment(std::string_view text) {
+    return text.substr(0, text.find("//"));
+}
+
+std::string remove_whitespace(std::string_view text) {
+    std::string out;
+    out.reserve(text.size());
+    std::copy_if(text.begin(), text.end(), std::back_inserter(out), [] (char c) {
+        return c != ' ' && c != '\t' && c != '\r';
+    });
+    return out;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// One line of a buffer, without its newline, and the code on it: the line up to any "//" comment, with the spaces,
+// tabs and carriage returns around it trimmed. A line without code has code_length 0 and code_begin at its end
+struct line_span {
+    uint32_t begin;
+    uint32_t end;
+    uint32_t code_begin;
+    uint32_t code_length;
+};
+
+// Splits a whole buffer into lines in one pass that finds newlines, comment starts and whitespace 32 or 16 bytes at
+// a time with AVX2 or SSE2, whichever the CPU has, or a byte at a time elsewhere. Every newline ends a line, and
+// text after the last one makes a line of its own
+std::vector<line_span> scan_lines(std::string_view text);
+
+// The span of a single line that has no newline in it, e.g. one already split off a stream
+line_span scan_line(std::string_view line);
+
+inline std::string_view code_of(std::string_view text, const line_span& span) {
+    return text.substr(span.code_begin, span.code_length);
+}
+
+// Text without the spaces, tabs and carriage returns around it
+std::string_view trim_whitespace(std::string_view text);
+// Text up to its first "//"
+std::string_view trim_comment(std::string_view text);
+// Text without any spaces, tabs or carriage returns
+std::string remove_whitespace(std::string_view text);
@@ -0,0 +1,68 @@
+#include "tooling.h"
+
+#include <spdlog/spdlog.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <system_error>
+
+tl::expected<std::string, std::string> get_file_contents(std::istream& in) {
+    if (!in) {
+        return tl::unexpected(std::strerror(errno));
+    }
+
+    std::ostringstream contents;
+    contents << in.rdbuf();
+    return contents.str();
+}
+
+tl::expected<std::string, std::string> get_file_contents(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::in);
+    auto contents = get_file_contents(file);
+    if (!contents.has_value()) {
+        return tl::unexpected(fmt::format("Cannot read {}: {}", path.string(), contents.error()));
+    }
+    return contents;
+}
+
+std::string replace_ext(const std::string& filename, const std::string& ext) {
+    auto dot_index = filename.find_last_of(".");
+    if (dot_index == std::string::npos) {
+        return filename + "." + ext;
+    }
+    return filename.substr(0, dot_index) + "." + ext;
+}
+
+std::filesystem::path default_cache_directory(const std::string& tool) {
+    if (const char* cache_home = std::getenv("XDG_CACHE_HOME"); cache_home != nullptr && cache_home[0] != '\0') {
+        return std::filesystem::path(cache_home) / tool;
+    }
+    if (const char* home = std::getenv("HOME"); home != nullptr && home[0] != '\0') {
+        return std::filesystem::path(home) / ".cache" / tool;
+    }
+    std::error_code ec;
+    return std::filesystem::temp_directory_path(ec) / (tool + "-cache");
+}
+
+tl::expected<void, std::string> set_logging_level(const std::string& level) {
+    if (level == "trace") {
+        spdlog::set_level(spdlog::level::trace);
+    } else if (level == "debug") {
+        spdlog::set_level(spdlog::level::debug);
+    } else if (level == "info") {
+        spdlog::set_level(spdlog::level::info);
+    } else if (level == "warn") {
+        spdlog::set_level(spdlog::level::warn);
+    } else if (level == "err") {
+        spdlog::set_level(spdlog::level::err);
+    } else if (level == "critical") {
+        spdlog::set_level(spdlog::level::critical);
+    } else if (level == "off") {
+        spdlog::set_level(spdlog::level::off);
+    } else {
+        return tl::unexpected(fmt::format("Invalid argument \"{}\" - allowed options: {{trace, debug, info, warn, err, critical, off}}", level));
+    }
+    return {};
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <filesystem>
+#include <istream>
+#include <string>
+#include <tl/expected.hpp>
+
+// The rest of a stream, e.g. a whole source file or stdin
+tl::expected<std::string, std::string> get_file_contents(std::istream& in);
+
+// The whole file at path; the error names the file
+tl::expected<std::string, std::string> get_file_contents(const std::filesystem::path& path);
+
+// "dir/Prog.vm" and "asm" give "dir/Prog.asm"; a name without an extension gets one
+std::string replace_ext(const std::string& filename, const std::string& ext);
+
+// $XDG_CACHE_HOME/tool, or ~/.cache/tool, or one in the temporary directory without either
+std::filesystem::path default_cache_directory(const std::string& tool);
+
+// Sets spdlog's level from the name given to a --log-level option
+tl::expected<void, std::string> set_logging_level(const std::string& level);
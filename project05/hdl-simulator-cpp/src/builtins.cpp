@@ -0,0 +1,150 @@
+#include "builtins.h"
+
+#include <spdlog/spdlog.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+
+// One part per bit, e.g. "Not(in=in[{0}], out=out[{0}]);" for bits 0..15
+std::string per_bit(std::string_view part) {
+    std::string parts;
+    for (int bit = 0; bit < 16; bit += 1) {
+        std::string line(part);
+        for (size_t at = line.find("{0}"); at != std::string::npos; at = line.find("{0}", at)) {
+            line.replace(at, 3, std::to_string(bit));
+        }
+        parts += line + "\n";
+    }
+    return parts;
+}
+
+std::string chip(std::string_view name, std::string_view pins, std::string_view parts) {
+    return fmt::format("CHIP {} {{\n{}\nPARTS:\n{}}}\n", name, pins, parts);
+}
+
+std::unordered_map<std::string_view, std::string> make_library() {
+    std::unordered_map<std::string_view, std::string> library;
+
+    library["Nand"] = "CHIP Nand { IN a, b; OUT out; BUILTIN Nand; }";
+    library["DFF"] = "CHIP DFF { IN in; OUT out; BUILTIN DFF; CLOCKED in; }";
+    library["ROM32K"] = "CHIP ROM32K { IN address[15]; OUT out[16]; BUILTIN ROM32K; }";
+    library["Keyboard"] = "CHIP Keyboard { OUT out[16]; BUILTIN Keyboard; }";
+
+    library["Not"] = chip("Not", "IN in; OUT out;", "Nand(a=in, b=in, out=out);\n");
+    library["And"] = chip("And", "IN a, b; OUT out;",
+        "Nand(a=a, b=b, out=n);\n"
+        "Nand(a=n, b=n, out=out);\n");
+    library["Or"] = chip("Or", "IN a, b; OUT out;",
+        "Nand(a=a, b=a, out=na);\n"
+        "Nand(a=b, b=b, out=nb);\n"
+        "Nand(a=na, b=nb, out=out);\n");
+    library["Xor"] = chip("Xor", "IN a, b; OUT out;",
+        "Nand(a=a, b=b, out=n);\n"
+        "Nand(a=a, b=n, out=x);\n"
+        "Nand(a=n, b=b, out=y);\n"
+        "Nand(a=x, b=y, out=out);\n");
+    library["Mux"] = chip("Mux", "IN a, b, sel; OUT out;",
+        "Nand(a=sel, b=sel, out=nsel);\n"
+        "Nand(a=a, b=nsel, out=x);\n"
+        "Nand(a=b, b=sel, out=y);\n"
+        "Nand(a=x, b=y, out=out);\n");
+    library["DMux"] = chip("DMux", "IN in, sel; OUT a, b;",
+        "Not(in=sel, out=nsel);\n"
+        "And(a=in, b=nsel, out=a);\n"
+        "And(a=in, b=sel, out=b);\n");
+
+    library["Not16"] = chip("Not16", "IN in[16]; OUT out[16];", per_bit("Not(in=in[{0}], out=out[{0}]);"));
+    library["And16"] = chip("And16", "IN a[16], b[16]; OUT out[16];", per_bit("And(a=a[{0}], b=b[{0}], out=out[{0}]);"));
+    library["Or16"] = chip("Or16", "IN a[16], b[16]; OUT out[16];", per_bit("Or(a=a[{0}], b=b[{0}], out=out[{0}]);"));
+    library["Mux16"] = chip("Mux16", "IN a[16], b[16], sel; OUT out[16];", per_bit("Mux(a=a[{0}], b=b[{0}], sel=sel, out=out[{0}]);"));
+
+    library["Or8Way"] = chip("Or8Way", "IN in[8]; OUT out;",
+        "Or(a=in[0], b=in[1], out=o1);\n"
+        "Or(a=o1, b=in[2], out=o2);\n"
+        "Or(a=o2, b=in[3], out=o3);\n"
+        "Or(a=o3, b=in[4], out=o4);\n"
+        "Or(a=o4, b=in[5], out=o5);\n"
+        "Or(a=o5, b=in[6], out=o6);\n"
+        "Or(a=o6, b=in[7], out=out);\n");
+    library["Mux4Way16"] = chip("Mux4Way16", "IN a[16], b[16], c[16], d[16], sel[2]; OUT out[16];",
+        "Mux16(a=a, b=b, sel=sel[0], out=ab);\n"
+        "Mux16(a=c, b=d, sel=sel[0], out=cd);\n"
+        "Mux16(a=ab, b=cd, sel=sel[1], out=out);\n");
+    library["Mux8Way16"] = chip("Mux8Way16", "IN a[16], b[16], c[16], d[16], e[16], f[16], g[16], h[16], sel[3]; OUT out[16];",
+        "Mux4Way16(a=a, b=b, c=c, d=d, sel=sel[0..1], out=abcd);\n"
+        "Mux4Way16(a=e, b=f, c=g, d=h, sel=sel[0..1], out=efgh);\n"
+        "Mux16(a=abcd, b=efgh, sel=sel[2], out=out);\n");
+    library["DMux4Way"] = chip("DMux4Way", "IN in, sel[2]; OUT a, b, c, d;",
+        "DMux(in=in, sel=sel[1], a=ab, b=cd);\n"
+        "DMux(in=ab, sel=sel[0], a=a, b=b);\n"
+        "DMux(in=cd, sel=sel[0], a=c, b=d);\n");
+    library["DMux8Way"] = chip("DMux8Way", "IN in, sel[3]; OUT a, b, c, d, e, f, g, h;",
+        "DMux(in=in, sel=sel[2], a=abcd, b=efgh);\n"
+        "DMux4Way(in=abcd, sel=sel[0..1], a=a, b=b, c=c, d=d);\n"
+        "DMux4Way(in=efgh, sel=sel[0..1], a=e, b=f, c=g, d=h);\n");
+
+    library["HalfAdder"] = chip("HalfAdder", "IN a, b; OUT sum, carry;",
+        "Xor(a=a, b=b, out=sum);\n"
+        "And(a=a, b=b, out=carry);\n");
+    library["FullAdder"] = chip("FullAdder", "IN a, b, c; OUT sum, carry;",
+        "HalfAdder(a=a, b=b, sum=ab, carry=c1);\n"
+        "HalfAdder(a=ab, b=c, sum=sum, carry=c2);\n"
+        "Or(a=c1, b=c2, out=carry);\n");
+    std::string adder = "HalfAdder(a=a[0], b=b[0], sum=out[0], carry=c0);\n";
+    for (int bit = 1; bit < 16; bit += 1) {
+        adder += fmt::format("FullAdder(a=a[{0}], b=b[{0}], c=c{1}, sum=out[{0}], carry=c{0});\n", bit, bit - 1);
+    }
+    library["Add16"] = chip("Add16", "IN a[16], b[16]; OUT out[16];", adder);
+    library["Inc16"] = chip("Inc16", "IN in[16]; OUT out[16];", "Add16(a=in, b[0]=true, out=out);\n");
+    library["ALU"] = chip("ALU", "IN x[16], y[16], zx, nx, zy, ny, f, no; OUT out[16], zr, ng;",
+        "Mux16(a=x, b=false, sel=zx, out=x1);\n"
+        "Not16(in=x1, out=notx1);\n"
+        "Mux16(a=x1, b=notx1, sel=nx, out=x2);\n"
+        "Mux16(a=y, b=false, sel=zy, out=y1);\n"
+        "Not16(in=y1, out=noty1);\n"
+        "Mux16(a=y1, b=noty1, sel=ny, out=y2);\n"
+        "Add16(a=x2, b=y2, out=sum);\n"
+        "And16(a=x2, b=y2, out=both);\n"
+        "Mux16(a=both, b=sum, sel=f, out=result);\n"
+        "Not16(in=result, out=notresult);\n"
+        "Mux16(a=result, b=notresult, sel=no, out=out, out[15]=ng, out[0..7]=low, out[8..15]=high);\n"
+        "Or8Way(in=low, out=nonzerolow);\n"
+        "Or8Way(in=high, out=nonzerohigh);\n"
+        "Or(a=nonzerolow, b=nonzerohigh, out=nonzero);\n"
+        "Not(in=nonzero, out=zr);\n");
+
+    library["Bit"] = chip("Bit", "IN in, load; OUT out;",
+        "Mux(a=state, b=in, sel=load, out=next);\n"
+        "DFF(in=next, out=state, out=out);\n");
+    library["Register"] = chip("Register", "IN in[16], load; OUT out[16];", per_bit("Bit(in=in[{0}], load=load, out=out[{0}]);"));
+    library["ARegister"] = chip("ARegister", "IN in[16], load; OUT out[16];", "Register(in=in, load=load, out=out);\n");
+    library["DRegister"] = chip("DRegister", "IN in[16], load; OUT out[16];", "Register(in=in, load=load, out=out);\n");
+    library["PC"] = chip("PC", "IN in[16], load, inc, reset; OUT out[16];",
+        "Inc16(in=state, out=incremented);\n"
+        "Mux16(a=state, b=incremented, sel=inc, out=counted);\n"
+        "Mux16(a=counted, b=in, sel=load, out=loaded);\n"
+        "Mux16(a=loaded, b=false, sel=reset, out=next);\n"
+        "Register(in=next, load=true, out=out, out=state);\n");
+
+    // Native RAMs, so that a computer does not simulate 16K registers and their multiplexers bit by bit
+    for (const auto& [name, width] : { std::pair { "RAM8", 3 }, { "RAM64", 6 }, { "RAM512", 9 }, { "RAM4K", 12 }, { "RAM16K", 14 }, { "Screen", 13 } }) {
+        library[name] = fmt::format("CHIP {0} {{ IN in[16], load, address[{1}]; OUT out[16]; BUILTIN {0}; CLOCKED in, load; }}", name, width);
+    }
+
+    return library;
+}
+
+}
+
+const char* builtin_chip_source(std::string_view name) {
+    static const std::unordered_map<std::string_view, std::string> library = make_library();
+    const auto it = library.find(name);
+    return it == library.end() ? nullptr : it->second.c_str();
+}
+
+bool has_builtin_model(std::string_view name) {
+    static const std::unordered_set<std::string_view> models = { "Bit", "Register", "PC", "RAM8", "RAM64", "RAM512", "RAM4K", "RAM16K", "Screen" };
+    return models.count(name) != 0;
+}
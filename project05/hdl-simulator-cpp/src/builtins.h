@@ -0,0 +1,12 @@
+#pragma once
+
+#include <string_view>
+
+// HDL source of a chip the simulator provides when the project directory has no definition of its own.
+// Gates, adders and registers are given as Nand and DFF networks; Nand, DFF, the RAMs, Screen, ROM32K and Keyboard
+// are native. Returns nullptr for names outside the library.
+const char* builtin_chip_source(std::string_view name);
+
+// Chips whose built-in definition can stand in for the directory's own when elaborating with models: Bit, Register,
+// PC, RAM8 to RAM16K and Screen
+bool has_builtin_model(std::string_view name);
@@ -0,0 +1,633 @@
+#include "compile.h"
+
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "builtins.h"
+
+namespace {
+
+constexpr uint64_t kFnvOffsetBasis = 0xcbf29ce484222325ull;
+constexpr uint64_t kFnvPrime = 0x100000001b3ull;
+
+uint64_t mix(uint64_t hash, uint64_t value) {
+    for (int byte = 0; byte < 8; byte += 1) {
+        hash = (hash ^ ((value >> (byte * 8)) & 0xff)) * kFnvPrime;
+    }
+    return hash;
+}
+
+// Cuts have at most this many leaves once mapped, one more while they are being expanded
+constexpr size_t kMaxLeaves = 3;
+constexpr size_t kMaxCutLeaves = 4;
+// Bounds on the search for the largest cone with a single-operation equivalent
+constexpr uint8_t kMaxConeGates = 10;
+constexpr size_t kMaxCuts = 48;
+
+// Truth tables of the three leaves of a cut, so a cone evaluates to the 8-bit table of its function
+constexpr uint8_t kSlotTables[kMaxLeaves] = { 0xaa, 0xcc, 0xf0 };
+
+template <typename T>
+T apply(gate_op op, T a, T b, T c) {
+    switch (op) {
+        case gate_op::kNand: return static_cast<T>(~(a & b));
+        case gate_op::kAnd: return static_cast<T>(a & b);
+        case gate_op::kOr: return static_cast<T>(a | b);
+        case gate_op::kNor: return static_cast<T>(~(a | b));
+        case gate_op::kXor: return static_cast<T>(a ^ b);
+        case gate_op::kXnor: return static_cast<T>(~(a ^ b));
+        case gate_op::kNot: return static_cast<T>(~a);
+        case gate_op::kAndNot: return static_cast<T>(a & ~b);
+        case gate_op::kOrNot: return static_cast<T>(a | ~b);
+        case gate_op::kMux: return static_cast<T>(a ^ ((a ^ b) & c));
+    }
+    return 0;
+}
+
+enum class match_kind : uint8_t {
+    kNone,
+    kConstant,
+    kAlias,
+    kGate,
+};
+
+// How to compute a function of a cut's leaves: slots are the leaves feeding a, b and c. An alias is the leaf
+// in slots[0], a constant is slots[0] (0 or 1)
+struct table_match {
+    match_kind kind;
+    gate_op op;
+    uint8_t slots[3];
+};
+
+// One operation or less for each three-input function that has one; the first offer for a table wins, so
+// commutative operations take their leaves in order
+const std::array<table_match, 256>& match_table() {
+    static const std::array<table_match, 256> table = [] {
+        std::array<table_match, 256> table {};
+        auto offer = [&] (uint8_t function, match_kind kind, gate_op op, uint8_t a, uint8_t b, uint8_t c) {
+            if (table[function].kind == match_kind::kNone) {
+                table[function] = { kind, op, { a, b, c } };
+            }
+        };
+
+        offer(0x00, match_kind::kConstant, gate_op::kNand, 0, 0, 0);
+        offer(0xff, match_kind::kConstant, gate_op::kNand, 1, 0, 0);
+        for (uint8_t x = 0; x < kMaxLeaves; x += 1) {
+            offer(kSlotTables[x], match_kind::kAlias, gate_op::kNand, x, 0, 0);
+        }
+        for (uint8_t x = 0; x < kMaxLeaves; x += 1) {
+            offer(static_cast<uint8_t>(~kSlotTables[x]), match_kind::kGate, gate_op::kNot, x, 0, 0);
+        }
+        for (const gate_op op : { gate_op::kAnd, gate_op::kOr, gate_op::kNand, gate_op::kNor, gate_op::kXor, gate_op::kXnor, gate_op::kAndNot, gate_op::kOrNot }) {
+            for (uint8_t x = 0; x < kMaxLeaves; x += 1) {
+                for (uint8_t y = 0; y < kMaxLeaves; y += 1) {
+                    if (x != y) {
+                        offer(apply<uint8_t>(op, kSlotTables[x], kSlotTables[y], 0), match_kind::kGate, op, x, y, 0);
+                    }
+                }
+            }
+        }
+        for (uint8_t x = 0; x < kMaxLeaves; x += 1) {
+            for (uint8_t y = 0; y < kMaxLeaves; y += 1) {
+                for (uint8_t z = 0; z < kMaxLeaves; z += 1) {
+                    if (x != y && y != z && x != z) {
+                        offer(apply<uint8_t>(gate_op::kMux, kSlotTables[x], kSlotTables[y], kSlotTables[z]), match_kind::kGate, gate_op::kMux, x, y, z);
+                    }
+                }
+            }
+        }
+        return table;
+    }();
+    return table;
+}
+
+// Operands a gate does not read are kNodeFalse
+struct ir_gate {
+    gate_op op;
+    uint32_t in[3];
+
+    bool operator==(const ir_gate& other) const {
+        return op == other.op && in[0] == other.in[0] && in[1] == other.in[1] && in[2] == other.in[2];
+    }
+};
+
+struct ir_gate_hash {
+    size_t operator()(const ir_gate& gate) const {
+        return mix(mix(mix(mix(kFnvOffsetBasis, static_cast<uint64_t>(gate.op)), gate.in[0]), gate.in[1]), gate.in[2]);
+    }
+};
+
+// Leaves sorted by node; gates counts the gates expanded to reach it from the cone's root
+struct cut {
+    uint32_t leaves[kMaxCutLeaves];
+    uint8_t size;
+    uint8_t gates;
+};
+
+struct mapping {
+    match_kind kind;
+    gate_op op;
+    uint32_t in[3];
+};
+
+class NetlistCompiler {
+public:
+    explicit NetlistCompiler(const Netlist& source) : source(source), base(source.gate_base) {}
+
+    Netlist compile() {
+        normalize();
+        cover();
+        return renumber();
+    }
+
+private:
+    bool is_gate(uint32_t node) const {
+        return node >= base;
+    }
+
+    const ir_gate& gate(uint32_t node) const {
+        return ir[node - base];
+    }
+
+    // Table of node's function over the leaves of a cut that node's cone is closed under
+    uint8_t cut_table(uint32_t node, const cut& c) const {
+        if (node == kNodeFalse) {
+            return 0x00;
+        }
+        if (node == kNodeTrue) {
+            return 0xff;
+        }
+        for (uint8_t slot = 0; slot < c.size; slot += 1) {
+            if (c.leaves[slot] == node) {
+                return kSlotTables[slot];
+            }
+        }
+        const ir_gate& g = gate(node);
+        return apply<uint8_t>(g.op, cut_table(g.in[0], c), cut_table(g.in[1], c), cut_table(g.in[2], c));
+    }
+
+    // Adds a non-constant node to a cut's leaves, keeping them sorted and distinct; false if it does not fit
+    static bool add_leaf(cut& c, uint32_t node) {
+        if (node == kNodeFalse || node == kNodeTrue) {
+            return true;
+        }
+        const auto end = c.leaves + c.size;
+        const auto at = std::lower_bound(c.leaves, end, node);
+        if (at != end && *at == node) {
+            return true;
+        }
+        if (c.size == kMaxCutLeaves) {
+            return false;
+        }
+        std::copy_backward(at, end, end + 1);
+        *at = node;
+        c.size += 1;
+        return true;
+    }
+
+    static bool same_leaves(const cut& a, const cut& b) {
+        return a.size == b.size && std::equal(a.leaves, a.leaves + a.size, b.leaves);
+    }
+
+    // Constant propagation and structural hashing, one gate at a time in evaluation order. Not gates feeding
+    // a gate are looked through, so double inversions vanish and Nand(Not a, Not b) becomes Or(a, b)
+    void normalize() {
+        rep.resize(source.node_count);
+        for (uint32_t node = 0; node < base; node += 1) {
+            rep[node] = node;
+        }
+        ir.reserve(source.gates.size());
+        unique.reserve(source.gates.size());
+
+        for (const schedule_step& step : source.schedule) {
+            for (uint32_t i = step.begin; i < step.end; i += 1) {
+                const netlist_gate& g = source.gates[i];
+                const ir_gate mapped { step.op, { rep[g.a], rep[g.b], rep[g.c] } };
+
+                cut c { {}, 0, 1 };
+                for (const uint32_t operand : mapped.in) {
+                    add_leaf(c, is_gate(operand) && gate(operand).op == gate_op::kNot ? gate(operand).in[0] : operand);
+                }
+
+                // Evaluated as a temporary node at the end of the gates
+                ir.push_back(mapped);
+                const uint8_t function = cut_table(base + ir.size() - 1, c);
+                ir.pop_back();
+
+                rep[base + i] = intern(match_table()[function], c);
+            }
+        }
+        spdlog::debug("Normalized {} gates to {}", source.gates.size(), ir.size());
+    }
+
+    // The node computing a match over a cut's leaves, adding a gate unless an identical one exists
+    uint32_t intern(const table_match& match, const cut& c) {
+        switch (match.kind) {
+            case match_kind::kConstant:
+                return match.slots[0] == 0 ? kNodeFalse : kNodeTrue;
+            case match_kind::kAlias:
+                return c.leaves[match.slots[0]];
+            default:
+                break;
+        }
+        ir_gate g { match.op, { kNodeFalse, kNodeFalse, kNodeFalse } };
+        const size_t operands = match.op == gate_op::kNot ? 1 : match.op == gate_op::kMux ? 3 : 2;
+        for (size_t k = 0; k < operands; k += 1) {
+            g.in[k] = c.leaves[match.slots[k]];
+        }
+        const auto [it, added] = unique.emplace(g, base + ir.size());
+        if (added) {
+            ir.push_back(g);
+        }
+        return it->second;
+    }
+
+    // Picks one operation for every gate something reads, covering the largest cone it can. Gates inside a
+    // chosen cone are only kept if another cone or a pin still reads them
+    void cover() {
+        needed.assign(ir.size(), false);
+        mappings.resize(ir.size());
+
+        auto need = [&] (uint32_t node) {
+            if (is_gate(node)) {
+                needed[node - base] = true;
+            }
+        };
+        for (const uint32_t node : roots()) {
+            need(rep[node]);
+        }
+
+        std::vector<cut> cuts;
+        for (size_t index = ir.size(); index-- > 0;) {
+            if (!needed[index]) {
+                continue;
+            }
+            const uint32_t root = base + index;
+            const ir_gate& g = ir[index];
+
+            cuts.clear();
+            cut& first = cuts.emplace_back(cut { {}, 0, 1 });
+            for (const uint32_t operand : g.in) {
+                add_leaf(first, operand);
+            }
+
+            cut best = cuts.front();
+            table_match best_match { match_kind::kNone, gate_op::kNand, {} };
+            for (size_t next = 0; next < cuts.size(); next += 1) {
+                const cut c = cuts[next];
+                if (c.size <= kMaxLeaves) {
+                    const table_match& match = match_table()[cut_table(root, c)];
+                    const bool better = best_match.kind == match_kind::kNone || c.gates > best.gates || (c.gates == best.gates && c.size < best.size);
+                    if (match.kind != match_kind::kNone && better) {
+                        best = c;
+                        best_match = match;
+                    }
+                }
+                if (c.gates >= kMaxConeGates) {
+                    continue;
+                }
+                for (uint8_t leaf = 0; leaf < c.size && cuts.size() < kMaxCuts; leaf += 1) {
+                    if (!is_gate(c.leaves[leaf])) {
+                        continue;
+                    }
+                    cut expanded = c;
+                    std::copy(expanded.leaves + leaf + 1, expanded.leaves + expanded.size, expanded.leaves + leaf);
+                    expanded.size -= 1;
+                    expanded.gates += 1;
+                    const ir_gate& inner = gate(c.leaves[leaf]);
+                    const bool fits = add_leaf(expanded, inner.in[0]) && add_leaf(expanded, inner.in[1]) && add_leaf(expanded, inner.in[2]);
+                    const auto seen = [&] (const cut& other) { return same_leaves(other, expanded); };
+                    if (fits && std::none_of(cuts.begin(), cuts.end(), seen)) {
+                        cuts.push_back(expanded);
+                    }
+                }
+            }
+
+            // A gate is always its own single-operation cone, so there is a match
+            mapping& m = mappings[index];
+            m = { best_match.kind, best_match.op, { kNodeFalse, kNodeFalse, kNodeFalse } };
+            if (best_match.kind == match_kind::kConstant) {
+                m.in[0] = best_match.slots[0] == 0 ? kNodeFalse : kNodeTrue;
+                continue;
+            }
+            const size_t operands = best_match.kind == match_kind::kAlias || best_match.op == gate_op::kNot ? 1 : best_match.op == gate_op::kMux ? 3 : 2;
+            for (size_t k = 0; k < operands; k += 1) {
+                m.in[k] = best.leaves[best_match.slots[k]];
+                need(m.in[k]);
+            }
+        }
+    }
+
+    // Nodes whose values are visible outside the gates: pins, DFF inputs and what memory ports read
+    std::vector<uint32_t> roots() const {
+        std::vector<uint32_t> nodes;
+        for (const std::vector<netlist_pin>* pins : { &source.inputs, &source.outputs, &source.internals }) {
+            for (const netlist_pin& pin : *pins) {
+                nodes.insert(nodes.end(), pin.bits.begin(), pin.bits.end());
+            }
+        }
+        for (const dff_cell& dff : source.dffs) {
+            nodes.push_back(dff.d);
+        }
+        for (const memory_port& port : source.ports) {
+            nodes.insert(nodes.end(), port.address, port.address + port.address_width);
+            nodes.insert(nodes.end(), port.in, port.in + 16);
+            nodes.push_back(port.load);
+        }
+        for (const netlist_memory& memory : source.memories) {
+            nodes.insert(nodes.end(), memory.bits.begin(), memory.bits.end());
+        }
+        return nodes;
+    }
+
+    // Levelizes the chosen operations and numbers them after the sources, grouped by level and operation
+    Netlist renumber() {
+        // Node each IR node ends up as: itself for sources, the node it aliases, or a new gate number
+        std::vector<uint32_t> target(base + ir.size());
+        std::vector<uint32_t> level(base + ir.size(), 0);
+        for (uint32_t node = 0; node < base; node += 1) {
+            target[node] = node;
+        }
+
+        // A port's level is one past its address; in and load are only read at the clock edge
+        std::vector<int32_t> port_of(base, -1);
+        for (size_t p = 0; p < source.ports.size(); p += 1) {
+            for (uint32_t bit = 0; bit < 16; bit += 1) {
+                port_of[source.ports[p].out + bit] = p;
+            }
+        }
+        std::vector<uint32_t> port_level(source.ports.size(), 0);
+        // The address of a port may come from another port, e.g. a RAM addressed by what a ROM reads
+        auto resolved_level = [&] (auto& self, uint32_t resolved) -> uint32_t {
+            if (is_gate(resolved) || port_of[resolved] < 0) {
+                return level[resolved];
+            }
+            const memory_port& port = source.ports[port_of[resolved]];
+            uint32_t& read_level = port_level[port_of[resolved]];
+            if (read_level == 0) {
+                read_level = 1;
+                for (uint32_t bit = 0; bit < port.address_width; bit += 1) {
+                    read_level = std::max(read_level, self(self, target[rep[port.address[bit]]]) + 1);
+                }
+            }
+            return read_level;
+        };
+        auto node_level = [&] (uint32_t node) {
+            return resolved_level(resolved_level, target[node]);
+        };
+
+        std::vector<uint32_t> ops;
+        for (uint32_t index = 0; index < ir.size(); index += 1) {
+            if (!needed[index]) {
+                continue;
+            }
+            const uint32_t node = base + index;
+            const mapping& m = mappings[index];
+            if (m.kind != match_kind::kGate) {
+                target[node] = m.kind == match_kind::kConstant ? m.in[0] : target[m.in[0]];
+                level[node] = level[target[node]];
+                continue;
+            }
+            target[node] = node;
+            for (const uint32_t operand : m.in) {
+                level[node] = std::max(level[node], node_level(operand) + 1);
+            }
+            ops.push_back(node);
+        }
+        // Ports whose outputs nothing reads still have to be scheduled after their address
+        for (const memory_port& port : source.ports) {
+            node_level(port.out);
+        }
+
+        std::stable_sort(ops.begin(), ops.end(), [&] (uint32_t a, uint32_t b) {
+            const gate_op op_a = mappings[a - base].op;
+            const gate_op op_b = mappings[b - base].op;
+            return level[a] != level[b] ? level[a] < level[b] : op_a < op_b;
+        });
+        std::vector<uint32_t> number(base + ir.size(), kNodeFalse);
+        for (uint32_t node = 0; node < base; node += 1) {
+            number[node] = node;
+        }
+        for (uint32_t i = 0; i < ops.size(); i += 1) {
+            number[ops[i]] = base + i;
+        }
+        auto map = [&] (uint32_t node) {
+            return number[target[rep[node]]];
+        };
+
+        Netlist netlist;
+        netlist.chip = source.chip;
+        netlist.gate_base = base;
+        netlist.node_count = base + ops.size();
+        netlist.gates.reserve(ops.size());
+
+        std::vector<uint32_t> port_order(source.ports.size());
+        for (uint32_t p = 0; p < port_order.size(); p += 1) {
+            port_order[p] = p;
+        }
+        std::stable_sort(port_order.begin(), port_order.end(), [&] (uint32_t a, uint32_t b) {
+            return port_level[a] < port_level[b];
+        });
+        std::vector<int32_t> port_index(source.ports.size(), -1);
+
+        // One step per run of equal level and operation; memory ports follow the gates of their level
+        size_t next_port = 0;
+        uint32_t max_level = 0;
+        for (size_t i = 0; i < ops.size() || next_port < port_order.size();) {
+            const uint32_t step_level = i < ops.size() ? level[ops[i]] : UINT32_MAX;
+            while (next_port < port_order.size() && port_level[port_order[next_port]] < step_level) {
+                const uint32_t begin = netlist.gates.size();
+                port_index[port_order[next_port]] = netlist.ports.size();
+                netlist.schedule.push_back({ gate_op::kNand, begin, begin, static_cast<int32_t>(netlist.ports.size()) });
+                netlist.ports.push_back(map_port(source.ports[port_order[next_port]], map));
+                max_level = std::max(max_level, port_level[port_order[next_port]]);
+                next_port += 1;
+            }
+            if (i == ops.size()) {
+                break;
+            }
+
+            const gate_op op = mappings[ops[i] - base].op;
+            const uint32_t begin = netlist.gates.size();
+            for (; i < ops.size() && level[ops[i]] == step_level && mappings[ops[i] - base].op == op; i += 1) {
+                const mapping& m = mappings[ops[i] - base];
+                netlist.gates.push_back({ number[target[m.in[0]]], number[target[m.in[1]]], number[target[m.in[2]]] });
+            }
+            netlist.schedule.push_back({ op, begin, static_cast<uint32_t>(netlist.gates.size()), -1 });
+            max_level = std::max(max_level, step_level);
+        }
+        if (netlist.schedule.empty()) {
+            netlist.schedule.push_back({ gate_op::kNand, 0, 0, -1 });
+        }
+        netlist.levels = max_level;
+
+        for (const auto& [pins, source_pins] : { std::pair { &netlist.inputs, &source.inputs }, { &netlist.outputs, &source.outputs }, { &netlist.internals, &source.internals } }) {
+            for (const netlist_pin& pin : *source_pins) {
+                netlist_pin& mapped = pins->emplace_back(netlist_pin { pin.name, {} });
+                std::transform(pin.bits.begin(), pin.bits.end(), std::back_inserter(mapped.bits), map);
+            }
+        }
+        for (const dff_cell& dff : source.dffs) {
+            netlist.dffs.push_back({ dff.q, map(dff.d) });
+        }
+        netlist.keyboard = source.keyboard;
+        for (const netlist_memory& memory : source.memories) {
+            netlist_memory& mapped = netlist.memories.emplace_back(netlist_memory { memory.chip, {}, memory.port < 0 ? -1 : port_index[memory.port] });
+            std::transform(memory.bits.begin(), memory.bits.end(), std::back_inserter(mapped.bits), map);
+        }
+        netlist.models = source.models;
+        return netlist;
+    }
+
+    template <typename Map>
+    static memory_port map_port(const memory_port& port, Map&& map) {
+        memory_port mapped = port;
+        std::transform(port.address, port.address + 15, mapped.address, map);
+        std::transform(port.in, port.in + 16, mapped.in, map);
+        mapped.load = map(port.load);
+        return mapped;
+    }
+
+    const Netlist& source;
+    const uint32_t base;
+
+    std::vector<ir_gate> ir;
+    std::unordered_map<ir_gate, uint32_t, ir_gate_hash> unique;
+    // Source node to IR node
+    std::vector<uint32_t> rep;
+
+    std::vector<bool> needed;
+    std::vector<mapping> mappings;
+};
+
+class DefinitionHasher {
+public:
+    DefinitionHasher(ChipLibrary& library, bool models) : library(library), models(models) {}
+
+    tl::expected<uint64_t, std::string> hash(const hdl_chip& chip) {
+        if (const auto it = hashes.find(&chip); it != hashes.end()) {
+            return it->second;
+        }
+        if (!active.insert(&chip).second) {
+            return tl::unexpected(fmt::format("Chip {} contains itself", chip.name));
+        }
+
+        // Parts of a library chip come from the library, as in elaboration, and so do parts with a model
+        const bool library_chip = chip.path.empty();
+        uint64_t hash = mix(mix(mix(kFnvOffsetBasis, chip.source_hash), library_chip), models);
+        for (const hdl_part& part : chip.parts) {
+            const auto found = library.find(part.chip, library_chip || (models && has_builtin_model(part.chip)));
+            if (!found.has_value()) {
+                return tl::unexpected(found.error());
+            }
+            const auto part_hash = this->hash(*found.value());
+            if (!part_hash.has_value()) {
+                return part_hash;
+            }
+            hash = mix(hash, part_hash.value());
+        }
+
+        active.erase(&chip);
+        hashes.emplace(&chip, hash);
+        return hash;
+    }
+
+private:
+    ChipLibrary& library;
+    bool models;
+    std::unordered_map<const hdl_chip*, uint64_t> hashes;
+    std::unordered_set<const hdl_chip*> active;
+};
+
+std::string operand(uint32_t node) {
+    return fmt::format("v[{}]", node);
+}
+
+}
+
+Netlist compile_netlist(const Netlist& netlist) {
+    const auto start = std::chrono::steady_clock::now();
+    Netlist compiled = NetlistCompiler(netlist).compile();
+    spdlog::debug("Compiled {}: {} gates to {} operations in {} levels in {:.3f} s", netlist.chip, netlist.gates.size(), compiled.gates.size(), compiled.levels,
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    return compiled;
+}
+
+std::string emit_cpp(const Netlist& netlist, std::string_view function) {
+    std::string code = fmt::format("// {}: {} operations in {} levels, generated by hdl-simulator-cpp\n", netlist.chip, netlist.gates.size(), netlist.levels);
+    code += fmt::format("// Nodes 0..{} are constants, inputs, DFF outputs, keyboard and memory port outputs; set them before calling\n\n", netlist.gate_base - 1);
+    code += "#include <cstdint>\n\n";
+    code += "void hdl_read_port(uint64_t* v, int port);\n\n";
+    code += fmt::format("void {}(uint64_t* v) {{\n", function);
+
+    for (const schedule_step& step : netlist.schedule) {
+        for (uint32_t i = step.begin; i < step.end; i += 1) {
+            const netlist_gate& gate = netlist.gates[i];
+            const std::string a = operand(gate.a);
+            const std::string b = operand(gate.b);
+            const std::string c = operand(gate.c);
+            std::string expression;
+            switch (step.op) {
+                case gate_op::kNand: expression = fmt::format("~({} & {})", a, b); break;
+                case gate_op::kAnd: expression = fmt::format("{} & {}", a, b); break;
+                case gate_op::kOr: expression = fmt::format("{} | {}", a, b); break;
+                case gate_op::kNor: expression = fmt::format("~({} | {})", a, b); break;
+                case gate_op::kXor: expression = fmt::format("{} ^ {}", a, b); break;
+                case gate_op::kXnor: expression = fmt::format("~({} ^ {})", a, b); break;
+                case gate_op::kNot: expression = fmt::format("~{}", a); break;
+                case gate_op::kAndNot: expression = fmt::format("{} & ~{}", a, b); break;
+                case gate_op::kOrNot: expression = fmt::format("{} | ~{}", a, b); break;
+                case gate_op::kMux: expression = fmt::format("{} ^ (({} ^ {}) & {})", a, a, b, c); break;
+            }
+            code += fmt::format("    v[{}] = {};\n", netlist.gate_base + i, expression);
+        }
+        if (step.port >= 0) {
+            code += fmt::format("    hdl_read_port(v, {});\n", step.port);
+        }
+    }
+    code += "}\n";
+    return code;
+}
+
+tl::expected<uint64_t, std::string> chip_definition_hash(ChipLibrary& library, const std::string& chip, bool models) {
+    const auto top = library.find(chip);
+    if (!top.has_value()) {
+        return tl::unexpected(top.error());
+    }
+    return DefinitionHasher(library, models).hash(*top.value());
+}
+
+tl::expected<Netlist, std::string> compile_chip(ChipLibrary& library, const std::string& chip, bool models, const NetlistCache* cache, const std::vector<std::string>& probes) {
+    auto hash = chip_definition_hash(library, chip, models);
+    if (!hash.has_value()) {
+        return tl::unexpected(hash.error());
+    }
+    for (const std::string& probe : probes) {
+        for (const char c : probe) {
+            hash.value() = mix(hash.value(), static_cast<unsigned char>(c));
+        }
+        hash.value() = mix(hash.value(), probe.size());
+    }
+    if (cache != nullptr) {
+        if (auto cached = cache->load(chip, hash.value()); cached.has_value()) {
+            spdlog::debug("Loaded compiled {} from cache", chip);
+            return std::move(cached.value());
+        }
+    }
+
+    const auto netlist = elaborate(library, chip, models, probes);
+    if (!netlist.has_value()) {
+        return tl::unexpected(netlist.error());
+    }
+    Netlist compiled = compile_netlist(netlist.value());
+    if (cache != nullptr) {
+        if (auto stored = cache->store(compiled, hash.value()); !stored.has_value()) {
+            spdlog::warn("{}", stored.error());
+        }
+    }
+    return compiled;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <tl/expected.hpp>
+
+#include "hdl.h"
+#include "netcache.h"
+#include "netlist.h"
+
+// Rewrites a netlist for repeated evaluation: constants are propagated, duplicate gates merged, chains of gates
+// with at most three inputs mapped onto one word operation (And, Or, Xor, Mux, ...) and gates nothing reads
+// dropped. Pins, stored words, DFFs and memory ports keep their nodes, so a Simulator runs the result unchanged
+Netlist compile_netlist(const Netlist& netlist);
+
+// Straight-line C++ for the gates of a netlist: one statement per gate over the node array, and a call to
+// hdl_read_port(v, port) where a ROM or RAM is read
+std::string emit_cpp(const Netlist& netlist, std::string_view function);
+
+// Hash over every chip definition the chip is built from, looked up the way elaboration looks them up
+tl::expected<uint64_t, std::string> chip_definition_hash(ChipLibrary& library, const std::string& chip, bool models);
+
+// Elaborates and compiles a chip, or loads the compiled netlist from cache when no definition has changed. Probes
+// are passed on to elaborate and are part of the cache key
+tl::expected<Netlist, std::string> compile_chip(ChipLibrary& library, const std::string& chip, bool models, const NetlistCache* cache, const std::vector<std::string>& probes = {});
@@ -0,0 +1,342 @@
+#include "hdl.h"
+
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "builtins.h"
+
+namespace {
+
+struct hdl_token {
+    std::string_view text;
+    size_t line;
+};
+
+bool is_identifier(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '.';
+}
+
+tl::expected<std::vector<hdl_token>, std::string> tokenize_hdl(std::string_view source) {
+    std::vector<hdl_token> tokens;
+    size_t line = 1;
+    size_t i = 0;
+
+    while (i < source.size()) {
+        const char c = source[i];
+        if (c == '\n') {
+            line += 1;
+            i += 1;
+        } else if (c == ' ' || c == '\t' || c == '\r') {
+            i += 1;
+        } else if (source.compare(i, 2, "//") == 0) {
+            i = std::min(source.find('\n', i), source.size());
+        } else if (source.compare(i, 2, "/*") == 0) {
+            const size_t end = source.find("*/", i + 2);
+            if (end == std::string_view::npos) {
+                return tl::unexpected(fmt::format("Line {}: unterminated comment", line));
+            }
+            line += std::count(source.begin() + i, source.begin() + end, '\n');
+            i = end + 2;
+        } else if (source.compare(i, 2, "..") == 0) {
+            tokens.push_back({ source.substr(i, 2), line });
+            i += 2;
+        } else if (is_identifier(c)) {
+            const size_t begin = i;
+            // Stop before ".." so that a[0..7] splits into 0, .. and 7
+            while (i < source.size() && is_identifier(source[i]) && source.compare(i, 2, "..") != 0) {
+                i += 1;
+            }
+            tokens.push_back({ source.substr(begin, i - begin), line });
+        } else if (c == '{' || c == '}' || c == '(' || c == ')' || c == '[' || c == ']' || c == ',' || c == ';' || c == '=' || c == ':') {
+            tokens.push_back({ source.substr(i, 1), line });
+            i += 1;
+        } else {
+            return tl::unexpected(fmt::format("Line {}: unexpected character '{}'", line, c));
+        }
+    }
+    return tokens;
+}
+
+class HdlParser {
+public:
+    explicit HdlParser(std::vector<hdl_token> tokens) : tokens(std::move(tokens)), pos(0) {}
+
+    tl::expected<hdl_chip, std::string> parse() {
+        hdl_chip chip;
+        if (auto result = expect("CHIP"); !result.has_value()) {
+            return tl::unexpected(result.error());
+        }
+        auto name = identifier();
+        if (!name.has_value()) {
+            return tl::unexpected(name.error());
+        }
+        chip.name = name.value();
+        if (auto result = expect("{"); !result.has_value()) {
+            return tl::unexpected(result.error());
+        }
+
+        while (!at("}")) {
+            if (at_end()) {
+                return tl::unexpected(fmt::format("Line {}: missing '}}' at the end of chip {}", line(), chip.name));
+            }
+            if (accept("IN")) {
+                if (auto result = pin_list(chip.inputs); !result.has_value()) {
+                    return tl::unexpected(result.error());
+                }
+            } else if (accept("OUT")) {
+                if (auto result = pin_list(chip.outputs); !result.has_value()) {
+                    return tl::unexpected(result.error());
+                }
+            } else if (accept("PARTS")) {
+                if (auto result = expect(":"); !result.has_value()) {
+                    return tl::unexpected(result.error());
+                }
+            } else if (accept("BUILTIN")) {
+                auto builtin = identifier();
+                if (!builtin.has_value()) {
+                    return tl::unexpected(builtin.error());
+                }
+                chip.builtin = builtin.value();
+                if (auto result = expect(";"); !result.has_value()) {
+                    return tl::unexpected(result.error());
+                }
+            } else if (accept("CLOCKED")) {
+                do {
+                    auto pin = identifier();
+                    if (!pin.has_value()) {
+                        return tl::unexpected(pin.error());
+                    }
+                    chip.clocked.push_back(pin.value());
+                } while (accept(","));
+                if (auto result = expect(";"); !result.has_value()) {
+                    return tl::unexpected(result.error());
+                }
+            } else {
+                auto part = parse_part();
+                if (!part.has_value()) {
+                    return tl::unexpected(part.error());
+                }
+                chip.parts.push_back(std::move(part.value()));
+            }
+        }
+        pos += 1;
+
+        if (!at_end()) {
+            return tl::unexpected(fmt::format("Line {}: unexpected '{}' after chip {}", line(), tokens[pos].text, chip.name));
+        }
+        return chip;
+    }
+
+private:
+    bool at_end() const {
+        return pos >= tokens.size();
+    }
+
+    bool at(std::string_view text) const {
+        return !at_end() && tokens[pos].text == text;
+    }
+
+    bool accept(std::string_view text) {
+        if (at(text)) {
+            pos += 1;
+            return true;
+        }
+        return false;
+    }
+
+    size_t line() const {
+        return at_end() ? (tokens.empty() ? 1 : tokens.back().line) : tokens[pos].line;
+    }
+
+    tl::expected<void, std::string> expect(std::string_view text) {
+        if (!accept(text)) {
+            return tl::unexpected(fmt::format("Line {}: expected '{}' but found '{}'", line(), text, at_end() ? "end of file" : tokens[pos].text));
+        }
+        return {};
+    }
+
+    tl::expected<std::string, std::string> identifier() {
+        if (at_end() || !is_identifier(tokens[pos].text[0]) || (tokens[pos].text[0] >= '0' && tokens[pos].text[0] <= '9')) {
+            return tl::unexpected(fmt::format("Line {}: expected a name but found '{}'", line(), at_end() ? "end of file" : tokens[pos].text));
+        }
+        return std::string(tokens[pos++].text);
+    }
+
+    tl::expected<int16_t, std::string> number() {
+        int value = 0;
+        if (!at_end()) {
+            const std::string_view text = tokens[pos].text;
+            const auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+            if (ec == std::errc() && ptr == text.data() + text.size() && value >= 0 && value < 1024) {
+                pos += 1;
+                return static_cast<int16_t>(value);
+            }
+        }
+        return tl::unexpected(fmt::format("Line {}: expected a number but found '{}'", line(), at_end() ? "end of file" : tokens[pos].text));
+    }
+
+    // IN a, b[16];
+    tl::expected<void, std::string> pin_list(std::vector<hdl_pin>& pins) {
+        do {
+            auto name = identifier();
+            if (!name.has_value()) {
+                return tl::unexpected(name.error());
+            }
+            uint16_t width = 1;
+            if (accept("[")) {
+                auto value = number();
+                if (!value.has_value()) {
+                    return tl::unexpected(value.error());
+                }
+                if (value.value() < 1 || value.value() > 16) {
+                    return tl::unexpected(fmt::format("Line {}: pin {} must be 1 to 16 bits wide", line(), name.value()));
+                }
+                width = value.value();
+                if (auto result = expect("]"); !result.has_value()) {
+                    return tl::unexpected(result.error());
+                }
+            }
+            pins.push_back({ std::move(name.value()), width });
+        } while (accept(","));
+        return expect(";");
+    }
+
+    // a, a[3] or a[0..7]
+    tl::expected<hdl_bus, std::string> bus() {
+        auto name = identifier();
+        if (!name.has_value()) {
+            return tl::unexpected(name.error());
+        }
+        hdl_bus result { std::move(name.value()), -1, -1 };
+        if (accept("[")) {
+            auto low = number();
+            if (!low.has_value()) {
+                return tl::unexpected(low.error());
+            }
+            result.low = result.high = low.value();
+            if (accept("..")) {
+                auto high = number();
+                if (!high.has_value()) {
+                    return tl::unexpected(high.error());
+                }
+                result.high = high.value();
+            }
+            if (result.high < result.low) {
+                return tl::unexpected(fmt::format("Line {}: bad sub-bus {}[{}..{}]", line(), result.name, result.low, result.high));
+            }
+            if (auto closed = expect("]"); !closed.has_value()) {
+                return tl::unexpected(closed.error());
+            }
+        }
+        return result;
+    }
+
+    // Mux16(a=x, b[0..7]=y, sel=s, out=z);
+    tl::expected<hdl_part, std::string> parse_part() {
+        hdl_part part { "", {}, line() };
+        auto chip = identifier();
+        if (!chip.has_value()) {
+            return tl::unexpected(chip.error());
+        }
+        part.chip = std::move(chip.value());
+
+        if (auto result = expect("("); !result.has_value()) {
+            return tl::unexpected(result.error());
+        }
+        do {
+            auto pin = bus();
+            if (!pin.has_value()) {
+                return tl::unexpected(pin.error());
+            }
+            if (auto result = expect("="); !result.has_value()) {
+                return tl::unexpected(result.error());
+            }
+            auto signal = bus();
+            if (!signal.has_value()) {
+                return tl::unexpected(signal.error());
+            }
+            part.connections.push_back({ std::move(pin.value()), std::move(signal.value()) });
+        } while (accept(","));
+        if (auto result = expect(")"); !result.has_value()) {
+            return tl::unexpected(result.error());
+        }
+        if (auto result = expect(";"); !result.has_value()) {
+            return tl::unexpected(result.error());
+        }
+        return part;
+    }
+
+    std::vector<hdl_token> tokens;
+    size_t pos;
+};
+
+}
+
+tl::expected<hdl_chip, std::string> parse_hdl(std::string_view source) {
+    auto tokens = tokenize_hdl(source);
+    if (!tokens.has_value()) {
+        return tl::unexpected(tokens.error());
+    }
+    return HdlParser(std::move(tokens.value())).parse();
+}
+
+ChipLibrary::ChipLibrary(const std::filesystem::path& directory) : dir(directory) {}
+
+tl::expected<const hdl_chip*, std::string> ChipLibrary::find(const std::string& name, bool builtin_only) {
+    if (!builtin_only) {
+        if (const auto it = chips.find(name); it != chips.end()) {
+            return it->second.get();
+        }
+
+        const std::filesystem::path path = dir / (name + ".hdl");
+        if (missing.count(name) == 0 && std::filesystem::exists(path)) {
+            std::ifstream file(path, std::ios::in);
+            if (!file) {
+                return tl::unexpected(fmt::format("Cannot read {}: {}", path.string(), std::strerror(errno)));
+            }
+            std::ostringstream contents;
+            contents << file.rdbuf();
+            return add(chips, name, contents.str(), path);
+        }
+        // Large chips look up Nand and friends millions of times; only check the directory once
+        missing.insert(name);
+    }
+
+    if (const auto it = builtins.find(name); it != builtins.end()) {
+        return it->second.get();
+    }
+    const char* source = builtin_chip_source(name);
+    if (source == nullptr) {
+        return tl::unexpected(fmt::format("Chip {} not found: no {}.hdl in {} and no built-in chip of that name", name, name, dir.string()));
+    }
+    return add(builtins, name, source, {});
+}
+
+tl::expected<const hdl_chip*, std::string> ChipLibrary::add(std::unordered_map<std::string, std::unique_ptr<hdl_chip>>& cache, const std::string& name, const std::string& source, const std::filesystem::path& path) {
+    const std::string origin = path.empty() ? fmt::format("built-in {}", name) : path.string();
+    spdlog::debug("Parsing chip {} from {}", name, origin);
+
+    auto chip = parse_hdl(source);
+    if (!chip.has_value()) {
+        return tl::unexpected(fmt::format("{}: {}", origin, chip.error()));
+    }
+    if (chip->name != name) {
+        return tl::unexpected(fmt::format("{}: defines chip {} instead of {}", origin, chip->name, name));
+    }
+    chip->path = path;
+    chip->source_hash = 0xcbf29ce484222325ull;
+    for (const char c : source) {
+        chip->source_hash = (chip->source_hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+    }
+
+    const hdl_chip* result = cache.emplace(name, std::make_unique<hdl_chip>(std::move(chip.value()))).first->second.get();
+    return result;
+}
+
+const std::filesystem::path& ChipLibrary::directory() const {
+    return dir;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <tl/expected.hpp>
+
+struct hdl_pin {
+    std::string name;
+    uint16_t width;
+};
+
+// A pin or signal reference such as a, a[3] or a[0..7]; low is -1 for the whole bus
+struct hdl_bus {
+    std::string name;
+    int16_t low;
+    int16_t high;
+};
+
+// pin=signal inside a part, e.g. out[0..14]=addressM
+struct hdl_connection {
+    hdl_bus pin;
+    hdl_bus signal;
+};
+
+struct hdl_part {
+    std::string chip;
+    std::vector<hdl_connection> connections;
+    size_t line;
+};
+
+struct hdl_chip {
+    std::string name;
+    std::vector<hdl_pin> inputs;
+    std::vector<hdl_pin> outputs;
+    std::vector<hdl_part> parts;
+    // Set for chips implemented natively by the simulator, e.g. "BUILTIN Nand;"
+    std::string builtin;
+    std::vector<std::string> clocked;
+    // File the chip was read from; empty for the simulator's own chip library
+    std::filesystem::path path;
+    // FNV-1a of the source text, to key compiled netlists
+    uint64_t source_hash;
+};
+
+tl::expected<hdl_chip, std::string> parse_hdl(std::string_view source);
+
+// Finds chip definitions the way the hardware simulator does: Name.hdl next to the chip under test, else the built-in chip
+class ChipLibrary {
+public:
+    explicit ChipLibrary(const std::filesystem::path& directory);
+
+    // Parsed once per name; the returned chip stays valid for the library's lifetime. Parts of built-in chips
+    // are looked up with builtin_only so that a broken Not.hdl in the directory cannot change the built-in ALU
+    tl::expected<const hdl_chip*, std::string> find(const std::string& name, bool builtin_only = false);
+
+    const std::filesystem::path& directory() const;
+
+private:
+    tl::expected<const hdl_chip*, std::string> add(std::unordered_map<std::string, std::unique_ptr<hdl_chip>>& cache, const std::string& name, const std::string& source, const std::filesystem::path& path);
+
+    std::filesystem::path dir;
+    std::unordered_map<std::string, std::unique_ptr<hdl_chip>> chips;
+    std::unordered_map<std::string, std::unique_ptr<hdl_chip>> builtins;
+    // Names with no .hdl file in the directory
+    std::unordered_set<std::string> missing;
+};
@@ -0,0 +1,274 @@
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <argparse/argparse.hpp>
+#include <tl/expected.hpp>
+#include <charconv>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+
+#include "compile.h"
+#include "hdl.h"
+#include "netlist.h"
+#include "simulator.h"
+#include "tooling.h"
+#include "verify.h"
+
+tl::expected<int64_t, std::string> parse_number(std::string_view str) {
+    int64_t value = 0;
+    const auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+    if (ec != std::errc() || ptr != str.data() + str.size()) {
+        return tl::unexpected(fmt::format("Invalid number: {}", str));
+    }
+    return value;
+}
+
+// Bit j of the vector index for the 64 lanes of one word, for the six bits that vary within a word
+constexpr uint64_t kLanePatterns[6] = {
+    0xaaaaaaaaaaaaaaaaull,
+    0xccccccccccccccccull,
+    0xf0f0f0f0f0f0f0f0ull,
+    0xff00ff00ff00ff00ull,
+    0xffff0000ffff0000ull,
+    0xffffffff00000000ull,
+};
+
+// Drives input vectors through a combinational netlist 64 * words at a time and hashes the outputs in vector
+// order, so the digest is the same for any lane width and two implementations of a chip can be compared by it
+struct sweep_result {
+    uint64_t vectors;
+    uint64_t digest;
+    double seconds;
+};
+
+sweep_result sweep(const Netlist& netlist, size_t words, uint64_t vectors, bool exhaustive, uint64_t seed) {
+    Simulator simulator(netlist, words);
+
+    std::vector<uint32_t> input_bits;
+    for (const netlist_pin& pin : netlist.inputs) {
+        input_bits.insert(input_bits.end(), pin.bits.begin(), pin.bits.end());
+    }
+    std::vector<uint32_t> output_bits;
+    for (const netlist_pin& pin : netlist.outputs) {
+        output_bits.insert(output_bits.end(), pin.bits.begin(), pin.bits.end());
+    }
+
+    uint64_t state = seed | 1;
+    auto random = [&] () {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545f4914f6cdd1dull;
+    };
+
+    uint64_t digest = 0xcbf29ce484222325ull;
+    const auto start = std::chrono::steady_clock::now();
+
+    const uint64_t blocks = (vectors + 63) / 64;
+    for (uint64_t first = 0; first < blocks; first += words) {
+        for (size_t w = 0; w < words; w += 1) {
+            const uint64_t block = first + w;
+            for (size_t j = 0; j < input_bits.size(); j += 1) {
+                uint64_t value = 0;
+                if (exhaustive) {
+                    value = j < 6 ? kLanePatterns[j] : ((block << 6) >> j) & 1 ? ~0ull : 0ull;
+                } else if (block < blocks) {
+                    value = random();
+                }
+                simulator.lane_words(input_bits[j])[w] = value;
+            }
+        }
+
+        simulator.eval();
+
+        for (size_t w = 0; w < words && first + w < blocks; w += 1) {
+            const uint64_t block = first + w;
+            const uint64_t valid = vectors - block * 64 >= 64 ? ~0ull : (1ull << (vectors - block * 64)) - 1;
+            for (const uint32_t bit : output_bits) {
+                digest = (digest ^ (simulator.lane_words(bit)[w] & valid)) * 0x100000001b3ull;
+            }
+        }
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return { vectors, digest, seconds };
+}
+
+int main(int argc, char* argv[]) {
+    auto logger = spdlog::stderr_color_mt("stderr");
+    spdlog::set_default_logger(logger);
+    spdlog::set_level(spdlog::level::info);
+
+    argparse::ArgumentParser program("hdl-simulator-cpp", "0.0.1");
+
+    program.add_argument("-l", "--log-level")
+        .help("Set verbosity for logging")
+        .default_value(std::string("info"))
+        .metavar("LEVEL")
+        .nargs(1);
+
+    program.add_argument("--exhaustive")
+        .help("Evaluate every input combination of a combinational chip (at most 32 input bits)")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--vectors")
+        .help("Evaluate this many random input vectors")
+        .metavar("COUNT")
+        .default_value(std::string("0"));
+
+    program.add_argument("--seed")
+        .help("Seed for --vectors")
+        .metavar("SEED")
+        .default_value(std::string("1"));
+
+    program.add_argument("--lanes")
+        .help("Vectors evaluated per pass: 64, 256 or 512")
+        .metavar("LANES")
+        .default_value(std::string("256"));
+
+    program.add_argument("--compile")
+        .help("Optimize the netlist into word operations before running it, caching the result per chip definition")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--cache-dir")
+        .help("Directory for compiled netlists and model checks (default: $XDG_CACHE_HOME/hdl-simulator-cpp or ~/.cache/hdl-simulator-cpp)")
+        .metavar("DIRECTORY")
+        .default_value(std::string(""));
+
+    program.add_argument("--no-cache")
+        .help("Always elaborate and compile, without reading or writing the cache")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--models")
+        .help("Use the built-in models of Bit, Register, PC, the RAMs and Screen for parts, after checking the directory's own definitions against them")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--verify")
+        .help("Check the chip against its built-in model on random inputs and exit")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--emit-cpp")
+        .help("Write the netlist's gates as straight-line C++ to a file")
+        .metavar("FILE")
+        .default_value(std::string(""));
+
+    program.add_argument("filename")
+        .help(".hdl file of the chip to elaborate")
+        .metavar("FILENAME")
+        .nargs(1);
+
+    auto args_error = [&] (const std::string& message) {
+        std::cerr << message << std::endl;
+        std::cerr << program;
+        return 1;
+    };
+
+    try {
+        program.parse_args(argc, argv);
+    } catch(const std::exception& err) {
+        return args_error(err.what());
+    }
+
+    const std::string level = program.get("--log-level");
+    if (auto result = set_logging_level(level); !result.has_value()) {
+        return args_error(result.error());
+    }
+
+    const auto vectors = parse_number(program.get("--vectors"));
+    const auto seed = parse_number(program.get("--seed"));
+    const auto lanes = parse_number(program.get("--lanes"));
+    if (!vectors.has_value() || vectors.value() < 0) {
+        return args_error(fmt::format("Invalid vector count: {}", program.get("--vectors")));
+    }
+    if (!seed.has_value()) {
+        return args_error(seed.error());
+    }
+    if (!lanes.has_value() || (lanes.value() != 64 && lanes.value() != 256 && lanes.value() != 512)) {
+        return args_error(fmt::format("Invalid lane count: {}", program.get("--lanes")));
+    }
+    const bool exhaustive = program.get<bool>("--exhaustive");
+    if (exhaustive && vectors.value() > 0) {
+        return args_error("May only use ONE OF --exhaustive or --vectors");
+    }
+
+    const std::filesystem::path filepath(program.get("filename"));
+    if (filepath.extension() != ".hdl") {
+        return args_error(fmt::format("Expected a .hdl file: {}", filepath.string()));
+    }
+
+    ChipLibrary library(filepath.has_parent_path() ? filepath.parent_path() : std::filesystem::path("."));
+
+    const bool compile = program.get<bool>("--compile");
+    const std::string chip = filepath.stem().string();
+    const std::string cache_dir = program.get("--cache-dir");
+    const NetlistCache cache(cache_dir.empty() ? default_cache_directory("hdl-simulator-cpp") : std::filesystem::path(cache_dir));
+    const NetlistCache* cache_used = program.get<bool>("--no-cache") ? nullptr : &cache;
+    const bool models = program.get<bool>("--models");
+
+    if (program.get<bool>("--verify")) {
+        const auto start = std::chrono::steady_clock::now();
+        if (auto verified = verify_chip(library, chip, cache_used); !verified.has_value()) {
+            spdlog::error("{}", verified.error());
+            return 1;
+        }
+        std::cout << fmt::format("{} matches the built-in {} ({:.3f} s)\n", chip, chip,
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        return 0;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto netlist = compile ? compile_chip(library, chip, models, cache_used) : elaborate(library, chip, models);
+    if (!netlist.has_value()) {
+        spdlog::error("Elaboration failed: {}", netlist.error());
+        return 1;
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (auto verified = verify_models(library, netlist.value(), cache_used); !verified.has_value()) {
+        spdlog::error("{}", verified.error());
+        return 1;
+    }
+
+    size_t input_bits = 0;
+    for (const netlist_pin& pin : netlist->inputs) {
+        input_bits += pin.bits.size();
+    }
+    size_t output_bits = 0;
+    for (const netlist_pin& pin : netlist->outputs) {
+        output_bits += pin.bits.size();
+    }
+    std::cout << fmt::format("{}: {} input bits, {} output bits, {} {} in {} levels, {} DFFs, {} in {:.3f} s\n",
+        netlist->chip, input_bits, output_bits, netlist->gates.size(), compile ? "operations" : "gates", netlist->levels, netlist->dffs.size(),
+        compile ? "compiled" : "elaborated", seconds);
+
+    if (const std::string emit_path = program.get("--emit-cpp"); !emit_path.empty()) {
+        std::ofstream out(emit_path, std::ios::out | std::ios::trunc);
+        out << emit_cpp(netlist.value(), fmt::format("eval_{}", netlist->chip));
+        if (!out) {
+            spdlog::error("Failed to write {}", emit_path);
+            return 1;
+        }
+    }
+
+    if (!exhaustive && vectors.value() == 0) {
+        return 0;
+    }
+    if (!netlist->dffs.empty() || !netlist->ports.empty()) {
+        spdlog::error("{} has state; only combinational chips can be swept", netlist->chip);
+        return 1;
+    }
+    if (exhaustive && input_bits > 32) {
+        spdlog::error("{} has {} input bits, too many to enumerate; use --vectors instead", netlist->chip, input_bits);
+        return 1;
+    }
+
+    const uint64_t count = exhaustive ? 1ull << input_bits : vectors.value();
+    const sweep_result result = sweep(netlist.value(), lanes.value() / 64, count, exhaustive, seed.value());
+    std::cout << fmt::format("{} vectors in {:.3f} ms ({:.1f} M vectors/s), output digest {:016x}\n",
+        result.vectors, result.seconds * 1000.0, result.seconds > 0 ? result.vectors / result.seconds / 1e6 : 0.0, result.digest);
+    return 0;
+}
@@ -0,0 +1,357 @@
+#include "netcache.h"
+
+#include <spdlog/spdlog.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <system_error>
+#include <thread>
+
+namespace {
+
+// Bump whenever the compiler or the layout below changes, so older entries are ignored
+constexpr int kFormatVersion = 2;
+
+constexpr uint64_t kFnvOffsetBasis = 0xcbf29ce484222325ull;
+constexpr uint64_t kFnvPrime = 0x100000001b3ull;
+
+uint64_t fnv1a(std::string_view data, uint64_t hash = kFnvOffsetBasis) {
+    for (const char c : data) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= kFnvPrime;
+    }
+    return hash;
+}
+
+std::string make_header(std::string_view kind, const std::string& chip, uint64_t hash) {
+    return fmt::format("// {} {} {:016x} {}", kind, kFormatVersion, hash, chip);
+}
+
+class Writer {
+public:
+    void u32(uint32_t value) {
+        data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void words(const uint32_t* values, size_t count) {
+        u32(count);
+        data.append(reinterpret_cast<const char*>(values), count * sizeof(uint32_t));
+    }
+
+    void string(const std::string& value) {
+        u32(value.size());
+        data += value;
+    }
+
+    void strings(const std::vector<std::string>& values) {
+        u32(values.size());
+        for (const std::string& value : values) {
+            string(value);
+        }
+    }
+
+    void pins(const std::vector<netlist_pin>& pins) {
+        u32(pins.size());
+        for (const netlist_pin& pin : pins) {
+            string(pin.name);
+            words(pin.bits.data(), pin.bits.size());
+        }
+    }
+
+    std::string data;
+};
+
+// Every read checks the bytes that are left, so a truncated or foreign file fails instead of overrunning
+class Reader {
+public:
+    explicit Reader(std::string_view data) : data(data), ok(true) {}
+
+    uint32_t u32() {
+        uint32_t value = 0;
+        if (data.size() < sizeof(value)) {
+            ok = false;
+            return 0;
+        }
+        std::memcpy(&value, data.data(), sizeof(value));
+        data.remove_prefix(sizeof(value));
+        return value;
+    }
+
+    std::vector<uint32_t> words() {
+        const size_t count = u32();
+        if (!ok || data.size() / sizeof(uint32_t) < count) {
+            ok = false;
+            return {};
+        }
+        std::vector<uint32_t> values(count);
+        std::memcpy(values.data(), data.data(), count * sizeof(uint32_t));
+        data.remove_prefix(count * sizeof(uint32_t));
+        return values;
+    }
+
+    std::string string() {
+        const size_t size = u32();
+        if (!ok || data.size() < size) {
+            ok = false;
+            return {};
+        }
+        std::string value(data.substr(0, size));
+        data.remove_prefix(size);
+        return value;
+    }
+
+    std::vector<std::string> strings() {
+        std::vector<std::string> values(count(4));
+        for (std::string& value : values) {
+            value = string();
+        }
+        return values;
+    }
+
+    std::vector<netlist_pin> pins() {
+        std::vector<netlist_pin> pins(count(8));
+        for (netlist_pin& pin : pins) {
+            pin.name = string();
+            pin.bits = words();
+        }
+        return pins;
+    }
+
+    // An element count, rejected when the remaining data cannot hold that many elements of min_size bytes
+    size_t count(size_t min_size) {
+        const size_t value = u32();
+        if (data.size() / min_size < value) {
+            ok = false;
+            return 0;
+        }
+        return value;
+    }
+
+    std::string_view data;
+    bool ok;
+};
+
+// Every node a netlist refers to exists, and gates only read nodes before their own
+bool is_consistent(const Netlist& netlist) {
+    const auto in_range = [&] (const std::vector<uint32_t>& bits) {
+        return std::all_of(bits.begin(), bits.end(), [&] (uint32_t bit) { return bit < netlist.node_count; });
+    };
+    if (netlist.gate_base + netlist.gates.size() != netlist.node_count) {
+        return false;
+    }
+    for (size_t i = 0; i < netlist.gates.size(); i += 1) {
+        const netlist_gate& gate = netlist.gates[i];
+        const uint32_t node = netlist.gate_base + i;
+        if (gate.a >= node || gate.b >= node || gate.c >= node) {
+            return false;
+        }
+    }
+    for (const std::vector<netlist_pin>* pins : { &netlist.inputs, &netlist.outputs, &netlist.internals }) {
+        for (const netlist_pin& pin : *pins) {
+            if (!in_range(pin.bits)) {
+                return false;
+            }
+        }
+    }
+    for (const dff_cell& dff : netlist.dffs) {
+        if (dff.q >= netlist.node_count || dff.d >= netlist.node_count) {
+            return false;
+        }
+    }
+    for (const memory_port& port : netlist.ports) {
+        if (port.kind > port_kind::kRam || port.address_width > 15 || port.out + 16 > netlist.node_count || port.load >= netlist.node_count) {
+            return false;
+        }
+        if (!in_range(std::vector<uint32_t>(port.address, port.address + 15)) || !in_range(std::vector<uint32_t>(port.in, port.in + 16))) {
+            return false;
+        }
+    }
+    for (const schedule_step& step : netlist.schedule) {
+        if (step.begin > step.end || step.end > netlist.gates.size() || step.op > gate_op::kMux || step.port >= static_cast<int32_t>(netlist.ports.size())) {
+            return false;
+        }
+    }
+    for (const netlist_memory& memory : netlist.memories) {
+        if (!in_range(memory.bits) || memory.port >= static_cast<int32_t>(netlist.ports.size())) {
+            return false;
+        }
+    }
+    return in_range(netlist.keyboard);
+}
+
+// Contents of an entry after its header line, if the file exists and the header matches
+std::optional<std::string> read_entry(const std::filesystem::path& path, const std::string& header) {
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    if (!in) {
+        return std::nullopt;
+    }
+    std::string line;
+    if (!std::getline(in, line) || line != header) {
+        spdlog::debug("Cache entry {} does not match, ignoring", path.string());
+        return std::nullopt;
+    }
+    std::ostringstream contents;
+    contents << in.rdbuf();
+    return contents.str();
+}
+
+// Test runs compile the same chip on several threads, so each writer gets its own temporary file
+tl::expected<void, std::string> write_entry(const std::filesystem::path& directory, const std::filesystem::path& path, const std::string& header, const std::string& data) {
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    if (ec) {
+        return tl::unexpected(fmt::format("Failed to create cache directory {}: {}", directory.string(), ec.message()));
+    }
+
+    std::filesystem::path tmp_path = path;
+    tmp_path += fmt::format(".{}.{}.tmp", getpid(), std::hash<std::thread::id>()(std::this_thread::get_id()));
+    {
+        std::ofstream out(tmp_path, std::ios::out | std::ios::trunc | std::ios::binary);
+        out << header << '\n';
+        out.write(data.data(), data.size());
+        if (!out) {
+            return tl::unexpected(fmt::format("Failed to write cache entry: {}", tmp_path.string()));
+        }
+    }
+
+    std::filesystem::rename(tmp_path, path, ec);
+    if (ec) {
+        const std::string message = ec.message();
+        std::filesystem::remove(tmp_path, ec);
+        return tl::unexpected(fmt::format("Failed to write cache entry {}: {}", path.string(), message));
+    }
+    return {};
+}
+
+}
+
+NetlistCache::NetlistCache(const std::filesystem::path& directory) : directory(directory) {}
+
+std::optional<Netlist> NetlistCache::load(const std::string& chip, uint64_t hash) const {
+    const std::string header = make_header("hdlcache", chip, hash);
+    const std::filesystem::path path = directory / fmt::format("{:016x}.net", fnv1a(header));
+    const auto data = read_entry(path, header);
+    if (!data.has_value()) {
+        return std::nullopt;
+    }
+
+    Reader reader(data.value());
+    Netlist netlist;
+    netlist.chip = chip;
+    netlist.node_count = reader.u32();
+    netlist.gate_base = reader.u32();
+    netlist.levels = reader.u32();
+    netlist.inputs = reader.pins();
+    netlist.outputs = reader.pins();
+    netlist.internals = reader.pins();
+
+    netlist.gates.resize(reader.count(12));
+    for (netlist_gate& gate : netlist.gates) {
+        gate.a = reader.u32();
+        gate.b = reader.u32();
+        gate.c = reader.u32();
+    }
+    netlist.dffs.resize(reader.count(8));
+    for (dff_cell& dff : netlist.dffs) {
+        dff.q = reader.u32();
+        dff.d = reader.u32();
+    }
+    netlist.ports.resize(reader.count(140));
+    for (memory_port& port : netlist.ports) {
+        port.kind = static_cast<port_kind>(reader.u32());
+        port.address_width = reader.u32();
+        for (uint32_t& bit : port.address) {
+            bit = reader.u32();
+        }
+        for (uint32_t& bit : port.in) {
+            bit = reader.u32();
+        }
+        port.load = reader.u32();
+        port.out = reader.u32();
+    }
+    netlist.keyboard = reader.words();
+    netlist.schedule.resize(reader.count(16));
+    for (schedule_step& step : netlist.schedule) {
+        step.op = static_cast<gate_op>(reader.u32());
+        step.begin = reader.u32();
+        step.end = reader.u32();
+        step.port = static_cast<int32_t>(reader.u32());
+    }
+    netlist.memories.resize(reader.count(12));
+    for (netlist_memory& memory : netlist.memories) {
+        memory.chip = reader.string();
+        memory.bits = reader.words();
+        memory.port = static_cast<int32_t>(reader.u32());
+    }
+    netlist.models = reader.strings();
+
+    if (!reader.ok || !reader.data.empty() || !is_consistent(netlist)) {
+        spdlog::debug("Cache entry {} is damaged, ignoring", path.string());
+        return std::nullopt;
+    }
+    return netlist;
+}
+
+tl::expected<void, std::string> NetlistCache::store(const Netlist& netlist, uint64_t hash) const {
+    Writer writer;
+    writer.u32(netlist.node_count);
+    writer.u32(netlist.gate_base);
+    writer.u32(netlist.levels);
+    writer.pins(netlist.inputs);
+    writer.pins(netlist.outputs);
+    writer.pins(netlist.internals);
+    writer.u32(netlist.gates.size());
+    for (const netlist_gate& gate : netlist.gates) {
+        writer.u32(gate.a);
+        writer.u32(gate.b);
+        writer.u32(gate.c);
+    }
+    writer.u32(netlist.dffs.size());
+    for (const dff_cell& dff : netlist.dffs) {
+        writer.u32(dff.q);
+        writer.u32(dff.d);
+    }
+    writer.u32(netlist.ports.size());
+    for (const memory_port& port : netlist.ports) {
+        writer.u32(static_cast<uint32_t>(port.kind));
+        writer.u32(port.address_width);
+        for (const uint32_t bit : port.address) {
+            writer.u32(bit);
+        }
+        for (const uint32_t bit : port.in) {
+            writer.u32(bit);
+        }
+        writer.u32(port.load);
+        writer.u32(port.out);
+    }
+    writer.words(netlist.keyboard.data(), netlist.keyboard.size());
+    writer.u32(netlist.schedule.size());
+    for (const schedule_step& step : netlist.schedule) {
+        writer.u32(static_cast<uint32_t>(step.op));
+        writer.u32(step.begin);
+        writer.u32(step.end);
+        writer.u32(static_cast<uint32_t>(step.port));
+    }
+    writer.u32(netlist.memories.size());
+    for (const netlist_memory& memory : netlist.memories) {
+        writer.string(memory.chip);
+        writer.words(memory.bits.data(), memory.bits.size());
+        writer.u32(static_cast<uint32_t>(memory.port));
+    }
+    writer.strings(netlist.models);
+
+    const std::string header = make_header("hdlcache", netlist.chip, hash);
+    return write_entry(directory, directory / fmt::format("{:016x}.net", fnv1a(header)), header, writer.data);
+}
+
+bool NetlistCache::is_verified(const std::string& chip, uint64_t hash) const {
+    const std::string header = make_header("hdlcheck", chip, hash);
+    return read_entry(directory / fmt::format("{:016x}.ok", fnv1a(header)), header).has_value();
+}
+
+tl::expected<void, std::string> NetlistCache::mark_verified(const std::string& chip, uint64_t hash) const {
+    const std::string header = make_header("hdlcheck", chip, hash);
+    return write_entry(directory, directory / fmt::format("{:016x}.ok", fnv1a(header)), header, "");
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <tl/expected.hpp>
+
+#include "netlist.h"
+
+// Compiled netlists stored on disk, keyed by the chip and the hash of every definition it was built from
+class NetlistCache {
+public:
+    explicit NetlistCache(const std::filesystem::path& directory);
+
+    std::optional<Netlist> load(const std::string& chip, uint64_t hash) const;
+    tl::expected<void, std::string> store(const Netlist& netlist, uint64_t hash) const;
+
+    // Whether a chip of the directory with this definition hash was found to match its built-in model
+    bool is_verified(const std::string& chip, uint64_t hash) const;
+    tl::expected<void, std::string> mark_verified(const std::string& chip, uint64_t hash) const;
+
+private:
+    std::filesystem::path directory;
+};
@@ -0,0 +1,704 @@
+#include "netlist.h"
+
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <iterator>
+#include <optional>
+
+#include "builtins.h"
+
+namespace {
+
+constexpr uint32_t kNoNode = UINT32_MAX;
+constexpr size_t kMaxDepth = 64;
+
+enum class build_kind : uint8_t {
+    kFalse,
+    kTrue,
+    kInput,
+    kWire,
+    kNand,
+    kDff,
+    kPortOut,
+    kKeyboard,
+};
+
+// Wires are placeholders for pins whose driver is connected later; a holds the driver once known
+struct build_node {
+    build_kind kind;
+    uint32_t a;
+    uint32_t b;
+};
+
+struct build_port {
+    port_kind kind;
+    uint32_t address_width;
+    uint32_t address[15];
+    uint32_t in[16];
+    uint32_t load;
+    uint32_t out[16];
+};
+
+// Storage of a built-in register or RAM for test scripts: DFF outputs, or a RAM port
+struct build_memory {
+    std::string chip;
+    std::vector<uint32_t> bits;
+    int32_t port;
+};
+
+// Pins of one chip instance by name. Chips have a handful of pins, so a linear search beats hashing; the names
+// are owned by the library chips, which outlive elaboration
+struct pin_scope {
+    std::vector<std::pair<std::string_view, std::vector<uint32_t>>> pins;
+
+    std::vector<uint32_t>* find(std::string_view name) {
+        for (auto& [pin, bits] : pins) {
+            if (pin == name) {
+                return &bits;
+            }
+        }
+        return nullptr;
+    }
+
+    std::vector<uint32_t>& add(std::string_view name, std::vector<uint32_t> bits) {
+        return pins.emplace_back(name, std::move(bits)).second;
+    }
+};
+
+// Output bits of one chip instance, plus the words it stores when it is a built-in register or RAM
+struct chip_instance {
+    std::vector<std::vector<uint32_t>> outputs;
+    std::vector<uint32_t> words;
+    int32_t port = -1;
+};
+
+class NetlistBuilder {
+public:
+    NetlistBuilder(ChipLibrary& library, bool models, const std::vector<std::string>& probes) : library(library), models(models) {
+        // Pins of the top-level chip are there anyway
+        std::copy_if(probes.begin(), probes.end(), std::back_inserter(this->probes), [] (const std::string& probe) {
+            return probe.find('.') != std::string::npos;
+        });
+        nodes.push_back({ build_kind::kFalse, 0, 0 });
+        nodes.push_back({ build_kind::kTrue, 0, 0 });
+    }
+
+    tl::expected<Netlist, std::string> build(const std::string& name, bool builtin) {
+        const auto chip = library.find(name, builtin);
+        if (!chip.has_value()) {
+            return tl::unexpected(chip.error());
+        }
+        const hdl_chip& top = *chip.value();
+
+        std::vector<std::vector<uint32_t>> inputs;
+        for (const hdl_pin& pin : top.inputs) {
+            std::vector<uint32_t>& bits = inputs.emplace_back();
+            for (uint16_t i = 0; i < pin.width; i += 1) {
+                bits.push_back(add(build_kind::kInput));
+            }
+        }
+
+        pin_scope scope;
+        const std::string path;
+        auto instance = instantiate(top, inputs, 0, &scope, this->probes.empty() ? nullptr : &path);
+        if (!instance.has_value()) {
+            return tl::unexpected(instance.error());
+        }
+        record_memory(top.name, instance.value());
+
+        Netlist netlist;
+        netlist.chip = top.name;
+        for (size_t i = 0; i < top.inputs.size(); i += 1) {
+            netlist.inputs.push_back({ top.inputs[i].name, inputs[i] });
+        }
+        for (size_t i = 0; i < top.outputs.size(); i += 1) {
+            netlist.outputs.push_back({ top.outputs[i].name, instance->outputs[i] });
+        }
+        for (const auto& [name, bits] : scope.pins) {
+            const auto is_pin = [&] (const hdl_pin& pin) { return pin.name == name; };
+            if (std::none_of(top.inputs.begin(), top.inputs.end(), is_pin) && std::none_of(top.outputs.begin(), top.outputs.end(), is_pin)) {
+                netlist.internals.push_back({ std::string(name), bits });
+            }
+        }
+        for (netlist_pin& pin : probed) {
+            if (netlist.find_pin(pin.name) == nullptr) {
+                netlist.internals.push_back(std::move(pin));
+            }
+        }
+        std::sort(netlist.internals.begin(), netlist.internals.end(), [] (const netlist_pin& a, const netlist_pin& b) {
+            return a.name < b.name;
+        });
+
+        if (auto result = finish(netlist); !result.has_value()) {
+            return tl::unexpected(fmt::format("{}: {}", top.name, result.error()));
+        }
+        return netlist;
+    }
+
+private:
+    uint32_t add(build_kind kind, uint32_t a = 0, uint32_t b = 0) {
+        nodes.push_back({ kind, a, b });
+        return nodes.size() - 1;
+    }
+
+    void record_memory(const std::string& chip, const chip_instance& instance) {
+        if (instance.words.empty() && instance.port < 0) {
+            return;
+        }
+        const auto same = [&] (const build_memory& memory) { return memory.chip == chip; };
+        if (std::none_of(memories.begin(), memories.end(), same)) {
+            memories.push_back({ chip, instance.words, instance.port });
+        }
+    }
+
+    tl::expected<chip_instance, std::string> instantiate_builtin(const hdl_chip& chip, const std::vector<std::vector<uint32_t>>& inputs) {
+        chip_instance instance;
+        if (chip.builtin == "Nand") {
+            instance.outputs.push_back({ add(build_kind::kNand, inputs[0][0], inputs[1][0]) });
+        } else if (chip.builtin == "DFF") {
+            instance.outputs.push_back({ add(build_kind::kDff, inputs[0][0]) });
+        } else if (chip.builtin == "ROM32K") {
+            build_port& port = ports.emplace_back();
+            port.kind = port_kind::kRom;
+            port.address_width = 15;
+            std::copy(inputs[0].begin(), inputs[0].end(), port.address);
+            std::fill_n(port.in, 16, kNodeFalse);
+            port.load = kNodeFalse;
+            instance.outputs.push_back(add_port_outputs());
+        } else if (chip.builtin.rfind("RAM", 0) == 0 || chip.builtin == "Screen") {
+            // IN in[16], load, address[n]
+            build_port& port = ports.emplace_back();
+            port.kind = port_kind::kRam;
+            port.address_width = inputs[2].size();
+            std::copy(inputs[2].begin(), inputs[2].end(), port.address);
+            std::copy(inputs[0].begin(), inputs[0].end(), port.in);
+            port.load = inputs[1][0];
+            instance.outputs.push_back(add_port_outputs());
+            instance.port = ports.size() - 1;
+        } else if (chip.builtin == "Keyboard") {
+            std::vector<uint32_t>& out = instance.outputs.emplace_back();
+            for (uint32_t bit = 0; bit < 16; bit += 1) {
+                out.push_back(add(build_kind::kKeyboard, 0, bit));
+            }
+        } else {
+            return tl::unexpected(fmt::format("Built-in chip {} has no native implementation", chip.builtin));
+        }
+        return instance;
+    }
+
+    // Output nodes of the port just added
+    std::vector<uint32_t> add_port_outputs() {
+        build_port& port = ports.back();
+        for (uint32_t bit = 0; bit < 16; bit += 1) {
+            port.out[bit] = add(build_kind::kPortOut, ports.size() - 1, bit);
+        }
+        return std::vector<uint32_t>(port.out, port.out + 16);
+    }
+
+    // First of the width bits of a signal in a part connection, valid until the scope changes; internal pins are
+    // created on first use with the width the pin needs
+    tl::expected<const uint32_t*, std::string> signal_bits(pin_scope& scope, const hdl_bus& signal, size_t width) {
+        if (signal.name == "true" || signal.name == "false") {
+            std::vector<uint32_t>& constant = signal.name == "true" ? all_true : all_false;
+            constant.resize(std::max(constant.size(), width), signal.name == "true" ? kNodeTrue : kNodeFalse);
+            return constant.data();
+        }
+
+        const std::vector<uint32_t>* found = scope.find(signal.name);
+        if (found == nullptr) {
+            if (signal.low >= 0) {
+                return tl::unexpected(fmt::format("internal pin {} cannot be subscripted", signal.name));
+            }
+            std::vector<uint32_t> bits;
+            for (size_t i = 0; i < width; i += 1) {
+                bits.push_back(add(build_kind::kWire, kNoNode));
+            }
+            found = &scope.add(signal.name, std::move(bits));
+        }
+
+        const std::vector<uint32_t>& bits = *found;
+        if (signal.low < 0) {
+            if (bits.size() != width) {
+                return tl::unexpected(fmt::format("{} is {} bits wide but is connected to {} bits", signal.name, bits.size(), width));
+            }
+            return bits.data();
+        }
+        if (static_cast<size_t>(signal.high) >= bits.size()) {
+            return tl::unexpected(fmt::format("{}[{}..{}] is outside the {} bits of {}", signal.name, signal.low, signal.high, bits.size(), signal.name));
+        }
+        if (static_cast<size_t>(signal.high - signal.low + 1) != width) {
+            return tl::unexpected(fmt::format("{}[{}..{}] is {} bits wide but is connected to {} bits", signal.name, signal.low, signal.high, signal.high - signal.low + 1, width));
+        }
+        return bits.data() + signal.low;
+    }
+
+    // Name of part index within its chip: the part's chip, with the index among parts of that chip when there are
+    // several, e.g. ALU or Mux16[2]
+    static std::string part_name(const hdl_chip& chip, size_t index) {
+        const std::string& name = chip.parts[index].chip;
+        const auto same = [&] (const hdl_part& part) { return part.chip == name; };
+        if (std::count_if(chip.parts.begin(), chip.parts.end(), same) == 1) {
+            return name;
+        }
+        return fmt::format("{}[{}]", name, std::count_if(chip.parts.begin(), chip.parts.begin() + index, same));
+    }
+
+    bool is_probed(const std::string& path) const {
+        return std::any_of(probes.begin(), probes.end(), [&] (const std::string& probe) {
+            return probe.size() > path.size() && probe.compare(0, path.size(), path) == 0 && probe[path.size()] == '.';
+        });
+    }
+
+    // Keeps the pins of the part at path that were asked for, looked up by name in find
+    template <typename Find>
+    void record_probes(const std::string& path, Find&& find) {
+        for (const std::string& probe : probes) {
+            if (probe.size() <= path.size() + 1 || probe.compare(0, path.size(), path) != 0 || probe[path.size()] != '.') {
+                continue;
+            }
+            const std::string_view pin = std::string_view(probe).substr(path.size() + 1);
+            if (pin.find('.') != std::string_view::npos) {
+                continue;
+            }
+            if (const std::vector<uint32_t>* bits = find(pin); bits != nullptr) {
+                probed.push_back({ probe, *bits });
+            }
+        }
+    }
+
+    // path is the hierarchical name of the instance while pins below it are probed, and nullptr otherwise
+    tl::expected<chip_instance, std::string> instantiate(const hdl_chip& chip, std::vector<std::vector<uint32_t>> inputs, size_t depth, pin_scope* top_scope, const std::string* path) {
+        if (!chip.builtin.empty()) {
+            auto instance = instantiate_builtin(chip, inputs);
+            if (path != nullptr && instance.has_value()) {
+                record_probes(*path, [&] (std::string_view name) -> const std::vector<uint32_t>* {
+                    for (size_t i = 0; i < chip.inputs.size(); i += 1) {
+                        if (chip.inputs[i].name == name) {
+                            return &inputs[i];
+                        }
+                    }
+                    for (size_t i = 0; i < chip.outputs.size(); i += 1) {
+                        if (chip.outputs[i].name == name) {
+                            return &instance->outputs[i];
+                        }
+                    }
+                    return nullptr;
+                });
+            }
+            return instance;
+        }
+        if (depth > kMaxDepth) {
+            return tl::unexpected(fmt::format("Chip {} contains itself", chip.name));
+        }
+
+        // Parts of a library chip come from the library too
+        const bool library_chip = chip.path.empty();
+
+        pin_scope local;
+        pin_scope& scope = top_scope != nullptr ? *top_scope : local;
+        for (size_t i = 0; i < chip.inputs.size(); i += 1) {
+            scope.add(chip.inputs[i].name, std::move(inputs[i]));
+        }
+        for (const hdl_pin& pin : chip.outputs) {
+            std::vector<uint32_t> bits;
+            for (uint16_t i = 0; i < pin.width; i += 1) {
+                bits.push_back(add(build_kind::kWire, kNoNode));
+            }
+            scope.add(pin.name, std::move(bits));
+        }
+
+        chip_instance instance;
+        for (size_t index = 0; index < chip.parts.size(); index += 1) {
+            const hdl_part& part = chip.parts[index];
+            auto error = [&] (const std::string& message) {
+                const std::string origin = library_chip ? fmt::format("built-in {}", chip.name) : chip.path.string();
+                return tl::unexpected(fmt::format("{}:{}: {}", origin, part.line, message));
+            };
+
+            const bool model = models && !library_chip && has_builtin_model(part.chip);
+            const auto found = library.find(part.chip, library_chip || model);
+            if (!found.has_value()) {
+                return error(found.error());
+            }
+            if (model) {
+                record_model(part.chip);
+            }
+            const hdl_chip& sub = *found.value();
+
+            // Pin index, with outputs after inputs
+            auto find_pin = [&] (const std::string& name) -> std::optional<size_t> {
+                for (size_t i = 0; i < sub.inputs.size(); i += 1) {
+                    if (sub.inputs[i].name == name) {
+                        return i;
+                    }
+                }
+                for (size_t i = 0; i < sub.outputs.size(); i += 1) {
+                    if (sub.outputs[i].name == name) {
+                        return sub.inputs.size() + i;
+                    }
+                }
+                return std::nullopt;
+            };
+
+            struct connection_range {
+                size_t pin;
+                size_t low;
+                size_t width;
+            };
+            std::vector<connection_range> ranges;
+            for (const hdl_connection& connection : part.connections) {
+                const auto pin = find_pin(connection.pin.name);
+                if (!pin.has_value()) {
+                    return error(fmt::format("chip {} has no pin {}", sub.name, connection.pin.name));
+                }
+                const uint16_t width = pin.value() < sub.inputs.size() ? sub.inputs[pin.value()].width : sub.outputs[pin.value() - sub.inputs.size()].width;
+                if (connection.pin.low < 0) {
+                    ranges.push_back({ pin.value(), 0, width });
+                } else if (connection.pin.high >= width) {
+                    return error(fmt::format("{}[{}..{}] is outside the {} bits of pin {}", connection.pin.name, connection.pin.low, connection.pin.high, width, connection.pin.name));
+                } else {
+                    ranges.push_back({ pin.value(), static_cast<size_t>(connection.pin.low), static_cast<size_t>(connection.pin.high - connection.pin.low + 1) });
+                }
+            }
+
+            // Unconnected inputs read false
+            std::vector<std::vector<uint32_t>> sub_inputs;
+            for (const hdl_pin& pin : sub.inputs) {
+                sub_inputs.emplace_back(pin.width, kNodeFalse);
+            }
+            for (size_t c = 0; c < part.connections.size(); c += 1) {
+                const connection_range& range = ranges[c];
+                if (range.pin >= sub.inputs.size()) {
+                    continue;
+                }
+                const auto bits = signal_bits(scope, part.connections[c].signal, range.width);
+                if (!bits.has_value()) {
+                    return error(bits.error());
+                }
+                std::copy_n(bits.value(), range.width, sub_inputs[range.pin].begin() + range.low);
+            }
+
+            std::string sub_path;
+            if (path != nullptr) {
+                sub_path = path->empty() ? part_name(chip, index) : fmt::format("{}.{}", *path, part_name(chip, index));
+            }
+            const bool probe_part = path != nullptr && is_probed(sub_path);
+            auto sub_instance = instantiate(sub, std::move(sub_inputs), depth + 1, nullptr, probe_part ? &sub_path : nullptr);
+            if (!sub_instance.has_value()) {
+                return sub_instance;
+            }
+
+            for (size_t c = 0; c < part.connections.size(); c += 1) {
+                const connection_range& range = ranges[c];
+                if (range.pin < sub.inputs.size()) {
+                    continue;
+                }
+                const hdl_bus& signal = part.connections[c].signal;
+                if (signal.name == "true" || signal.name == "false") {
+                    return error(fmt::format("output pin {} cannot be connected to {}", part.connections[c].pin.name, signal.name));
+                }
+                const auto bits = signal_bits(scope, signal, range.width);
+                if (!bits.has_value()) {
+                    return error(bits.error());
+                }
+                const std::vector<uint32_t>& source = sub_instance->outputs[range.pin - sub.inputs.size()];
+                for (size_t i = 0; i < range.width; i += 1) {
+                    build_node& target = nodes[bits.value()[i]];
+                    if (target.kind != build_kind::kWire) {
+                        return error(fmt::format("{} is an input pin and cannot be driven by a part", signal.name));
+                    }
+                    if (target.a != kNoNode) {
+                        return error(fmt::format("{} has more than one source", signal.name));
+                    }
+                    target.a = source[range.low + i];
+                }
+            }
+
+            record_memory(sub.name, sub_instance.value());
+            if (library_chip) {
+                instance.words.insert(instance.words.end(), sub_instance->words.begin(), sub_instance->words.end());
+            }
+        }
+
+        for (const hdl_pin& pin : chip.outputs) {
+            instance.outputs.push_back(*scope.find(pin.name));
+        }
+        if (path != nullptr && !path->empty()) {
+            record_probes(*path, [&] (std::string_view name) { return static_cast<const std::vector<uint32_t>*>(scope.find(name)); });
+        }
+        // A library Register is the word that built-in PCs, A/D registers and RAMs are made of
+        if (library_chip && chip.name == "Register") {
+            instance.words = instance.outputs[0];
+        }
+        return instance;
+    }
+
+    // Remembers a part that used its model although the directory defines the chip
+    void record_model(const std::string& chip) {
+        if (std::find(replaced.begin(), replaced.end(), chip) != replaced.end()) {
+            return;
+        }
+        if (const auto own = library.find(chip); own.has_value() && !own.value()->path.empty()) {
+            replaced.push_back(chip);
+        }
+    }
+
+    // The node a wire is connected to; undriven pins read false. kNoNode for a loop made only of wires
+    uint32_t resolve(uint32_t node) {
+        uint32_t source = node;
+        for (size_t steps = 0; nodes[source].kind == build_kind::kWire; steps += 1) {
+            if (steps > nodes.size()) {
+                return kNoNode;
+            }
+            source = nodes[source].a == kNoNode ? kNodeFalse : nodes[source].a;
+        }
+        while (nodes[node].kind == build_kind::kWire && nodes[node].a != source) {
+            const uint32_t next = nodes[node].a == kNoNode ? kNodeFalse : nodes[node].a;
+            nodes[node].a = source;
+            node = next;
+        }
+        return source;
+    }
+
+    // Levelizes the Nand gates and memory port reads, renumbers every node and fills in the netlist
+    tl::expected<void, std::string> finish(Netlist& netlist) {
+        std::vector<uint32_t> op_of(nodes.size(), kNoNode);
+        std::vector<uint32_t> nands;
+        for (uint32_t i = 0; i < nodes.size(); i += 1) {
+            if (nodes[i].kind == build_kind::kNand) {
+                op_of[i] = nands.size();
+                nands.push_back(i);
+            }
+        }
+        const uint32_t op_count = nands.size() + ports.size();
+
+        // Operands only ever point at non-wire nodes from here on
+        for (build_node& node : nodes) {
+            if (node.kind == build_kind::kNand || node.kind == build_kind::kDff) {
+                node.a = resolve(node.a);
+                if (node.kind == build_kind::kNand) {
+                    node.b = resolve(node.b);
+                }
+                if (node.a == kNoNode || node.b == kNoNode) {
+                    return tl::unexpected("pins connected in a loop with no part driving them");
+                }
+            }
+        }
+        for (build_port& port : ports) {
+            for (uint32_t* bits : { port.address, port.in, &port.load }) {
+                const size_t count = bits == port.address ? port.address_width : bits == port.in ? 16 : 1;
+                for (size_t bit = 0; bit < count; bit += 1) {
+                    bits[bit] = resolve(bits[bit]);
+                    if (bits[bit] == kNoNode) {
+                        return tl::unexpected("pins connected in a loop with no part driving them");
+                    }
+                }
+            }
+        }
+
+        auto producer = [&] (uint32_t node) -> uint32_t {
+            if (nodes[node].kind == build_kind::kNand) {
+                return op_of[node];
+            }
+            if (nodes[node].kind == build_kind::kPortOut) {
+                return nands.size() + nodes[node].a;
+            }
+            return kNoNode;
+        };
+        auto for_each_operand = [&] (uint32_t op, auto&& visit) {
+            if (op < nands.size()) {
+                visit(nodes[nands[op]].a);
+                visit(nodes[nands[op]].b);
+            } else {
+                const build_port& port = ports[op - nands.size()];
+                std::for_each(port.address, port.address + port.address_width, visit);
+            }
+        };
+
+        // Kahn's algorithm over gates and port reads; DFF outputs, inputs and constants are sources
+        std::vector<uint32_t> pending(op_count, 0);
+        std::vector<uint32_t> user_start(op_count + 1, 0);
+        for (uint32_t op = 0; op < op_count; op += 1) {
+            for_each_operand(op, [&] (uint32_t node) {
+                if (const uint32_t from = producer(node); from != kNoNode) {
+                    pending[op] += 1;
+                    user_start[from + 1] += 1;
+                }
+            });
+        }
+        for (uint32_t op = 0; op < op_count; op += 1) {
+            user_start[op + 1] += user_start[op];
+        }
+        std::vector<uint32_t> users(user_start.back());
+        std::vector<uint32_t> fill(user_start.begin(), user_start.end() - 1);
+        for (uint32_t op = 0; op < op_count; op += 1) {
+            for_each_operand(op, [&] (uint32_t node) {
+                if (const uint32_t from = producer(node); from != kNoNode) {
+                    users[fill[from]++] = op;
+                }
+            });
+        }
+
+        std::vector<uint32_t> level(op_count, 1);
+        std::vector<uint32_t> order;
+        order.reserve(op_count);
+        for (uint32_t op = 0; op < op_count; op += 1) {
+            if (pending[op] == 0) {
+                order.push_back(op);
+            }
+        }
+        for (size_t next = 0; next < order.size(); next += 1) {
+            const uint32_t op = order[next];
+            for (uint32_t u = user_start[op]; u < user_start[op + 1]; u += 1) {
+                const uint32_t user = users[u];
+                level[user] = std::max(level[user], level[op] + 1);
+                if (--pending[user] == 0) {
+                    order.push_back(user);
+                }
+            }
+        }
+        if (order.size() != op_count) {
+            return tl::unexpected(fmt::format("combinational loop through {} gates; every feedback path needs a DFF", op_count - order.size()));
+        }
+        // Stable counting sort by level
+        const uint32_t levels = order.empty() ? 0 : *std::max_element(level.begin(), level.end());
+        std::vector<uint32_t> level_start(levels + 2, 0);
+        for (const uint32_t op : order) {
+            level_start[level[op] + 1] += 1;
+        }
+        for (uint32_t l = 0; l <= levels; l += 1) {
+            level_start[l + 1] += level_start[l];
+        }
+        std::vector<uint32_t> sorted(order.size());
+        for (const uint32_t op : order) {
+            sorted[level_start[level[op]]++] = op;
+        }
+        order = std::move(sorted);
+
+        // Sources first, then gates in evaluation order
+        std::vector<uint32_t> renumbered(nodes.size(), kNoNode);
+        renumbered[0] = kNodeFalse;
+        renumbered[1] = kNodeTrue;
+        uint32_t next_id = 2;
+        for (const build_kind kind : { build_kind::kInput, build_kind::kDff, build_kind::kKeyboard }) {
+            for (uint32_t i = 0; i < nodes.size(); i += 1) {
+                if (nodes[i].kind == kind) {
+                    renumbered[i] = next_id++;
+                }
+            }
+        }
+        for (const build_port& port : ports) {
+            for (const uint32_t bit : port.out) {
+                renumbered[bit] = next_id++;
+            }
+        }
+        netlist.gate_base = next_id;
+        for (const uint32_t op : order) {
+            if (op < nands.size()) {
+                renumbered[nands[op]] = next_id++;
+            }
+        }
+        netlist.node_count = next_id;
+
+        auto map = [&] (uint32_t node) {
+            const uint32_t source = resolve(node);
+            return source == kNoNode ? kNodeFalse : renumbered[source];
+        };
+
+        // Ports are numbered in evaluation order
+        std::vector<int32_t> port_index(ports.size(), -1);
+        netlist.gates.reserve(nands.size());
+        uint32_t begin = 0;
+        for (const uint32_t op : order) {
+            if (op < nands.size()) {
+                const build_node& node = nodes[nands[op]];
+                netlist.gates.push_back({ renumbered[node.a], renumbered[node.b], kNodeFalse });
+                continue;
+            }
+            const build_port& built = ports[op - nands.size()];
+            memory_port& port = netlist.ports.emplace_back();
+            port.kind = built.kind;
+            port.address_width = built.address_width;
+            std::fill_n(port.address, 15, kNodeFalse);
+            for (size_t bit = 0; bit < built.address_width; bit += 1) {
+                port.address[bit] = renumbered[built.address[bit]];
+            }
+            for (size_t bit = 0; bit < 16; bit += 1) {
+                port.in[bit] = renumbered[built.in[bit]];
+            }
+            port.load = renumbered[built.load];
+            port.out = renumbered[built.out[0]];
+            port_index[op - nands.size()] = netlist.ports.size() - 1;
+            netlist.schedule.push_back({ gate_op::kNand, begin, static_cast<uint32_t>(netlist.gates.size()), static_cast<int32_t>(netlist.ports.size() - 1) });
+            begin = netlist.gates.size();
+        }
+        if (begin < netlist.gates.size() || netlist.schedule.empty()) {
+            netlist.schedule.push_back({ gate_op::kNand, begin, static_cast<uint32_t>(netlist.gates.size()), -1 });
+        }
+
+        for (uint32_t i = 0; i < nodes.size(); i += 1) {
+            if (nodes[i].kind == build_kind::kDff) {
+                netlist.dffs.push_back({ renumbered[i], renumbered[nodes[i].a] });
+            } else if (nodes[i].kind == build_kind::kKeyboard) {
+                netlist.keyboard.push_back(renumbered[i]);
+            }
+        }
+
+        for (std::vector<netlist_pin>* pins : { &netlist.inputs, &netlist.outputs, &netlist.internals }) {
+            for (netlist_pin& pin : *pins) {
+                std::transform(pin.bits.begin(), pin.bits.end(), pin.bits.begin(), map);
+            }
+        }
+        for (build_memory& memory : memories) {
+            std::transform(memory.bits.begin(), memory.bits.end(), memory.bits.begin(), map);
+            netlist.memories.push_back({ memory.chip, std::move(memory.bits), memory.port < 0 ? -1 : port_index[memory.port] });
+        }
+        netlist.models = replaced;
+
+        netlist.levels = order.empty() ? 0 : level[order.back()];
+        spdlog::debug("Elaborated {}: {} gates in {} levels, {} DFFs, {} memory ports", netlist.chip, netlist.gates.size(), netlist.levels, netlist.dffs.size(), netlist.ports.size());
+        return {};
+    }
+
+    ChipLibrary& library;
+    bool models;
+    std::vector<build_node> nodes;
+    std::vector<build_port> ports;
+    std::vector<uint32_t> all_true;
+    std::vector<uint32_t> all_false;
+    std::vector<build_memory> memories;
+    std::vector<std::string> replaced;
+    // Hierarchical pin names to keep, and the bits of those found
+    std::vector<std::string> probes;
+    std::vector<netlist_pin> probed;
+};
+
+}
+
+const netlist_pin* Netlist::find_pin(std::string_view name) const {
+    for (const std::vector<netlist_pin>* pins : { &inputs, &outputs, &internals }) {
+        for (const netlist_pin& pin : *pins) {
+            if (pin.name == name) {
+                return &pin;
+            }
+        }
+    }
+    return nullptr;
+}
+
+const netlist_memory* Netlist::find_memory(std::string_view name) const {
+    for (const netlist_memory& memory : memories) {
+        if (memory.chip == name) {
+            return &memory;
+        }
+    }
+    return nullptr;
+}
+
+tl::expected<Netlist, std::string> elaborate(ChipLibrary& library, const std::string& chip, bool models, const std::vector<std::string>& probes) {
+    return NetlistBuilder(library, models, probes).build(chip, false);
+}
+
+tl::expected<Netlist, std::string> elaborate_builtin(ChipLibrary& library, const std::string& chip) {
+    return NetlistBuilder(library, false, {}).build(chip, true);
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <tl/expected.hpp>
+
+#include "hdl.h"
+
+constexpr uint32_t kNodeFalse = 0;
+constexpr uint32_t kNodeTrue = 1;
+
+// Elaboration only produces Nand gates; compile_netlist maps chains of them onto the other operations.
+// kNot reads a, kAndNot is a & ~b, kOrNot is a | ~b and kMux is c ? b : a
+enum class gate_op : uint8_t {
+    kNand,
+    kAnd,
+    kOr,
+    kNor,
+    kXor,
+    kXnor,
+    kNot,
+    kAndNot,
+    kOrNot,
+    kMux,
+};
+
+// Operands a gate does not use read kNodeFalse
+struct netlist_gate {
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+};
+
+// Bit nodes of a pin, least significant first
+struct netlist_pin {
+    std::string name;
+    std::vector<uint32_t> bits;
+};
+
+struct dff_cell {
+    uint32_t q;
+    uint32_t d;
+};
+
+enum class port_kind : uint8_t {
+    kRom,
+    kRam,
+};
+
+// Native ROM32K or RAM: reads its address bits after the gates scheduled before it and drives 16 consecutive nodes.
+// A RAM samples in, load and the address at the rising edge and stores the word at the falling edge; a ROM's in and
+// load are kNodeFalse
+struct memory_port {
+    port_kind kind;
+    uint32_t address_width;
+    uint32_t address[15];
+    uint32_t in[16];
+    uint32_t load;
+    uint32_t out;
+};
+
+// Gates [begin, end), which all perform op, then the memory port with index port unless it is -1
+struct schedule_step {
+    gate_op op;
+    uint32_t begin;
+    uint32_t end;
+    int32_t port;
+};
+
+// 16-bit words stored by a built-in register or RAM chip, e.g. DRegister[] or RAM16K[5] in a test script: the
+// DFF outputs holding them, or the storage of a RAM port when port is not -1
+struct netlist_memory {
+    std::string chip;
+    std::vector<uint32_t> bits;
+    int32_t port;
+};
+
+// A chip flattened to gates and DFFs. Node 0 is false and node 1 true; inputs, DFF outputs, keyboard
+// and memory port outputs follow, then one node per gate in levelized order, so each gate only reads lower nodes
+struct Netlist {
+    std::string chip;
+    uint32_t node_count;
+    uint32_t gate_base;
+    uint32_t levels;
+
+    std::vector<netlist_pin> inputs;
+    std::vector<netlist_pin> outputs;
+    // Internal pins of the top-level chip, and pins of parts that elaboration was asked to probe
+    std::vector<netlist_pin> internals;
+
+    std::vector<netlist_gate> gates;
+    std::vector<dff_cell> dffs;
+    std::vector<memory_port> ports;
+    std::vector<uint32_t> keyboard;
+    std::vector<schedule_step> schedule;
+    // First instance of each chip that stores words, in elaboration order
+    std::vector<netlist_memory> memories;
+    // Chips of the directory that parts used the built-in model of instead, see verify_models
+    std::vector<std::string> models;
+
+    const netlist_pin* find_pin(std::string_view name) const;
+    const netlist_memory* find_memory(std::string_view chip) const;
+};
+
+// With models, parts that have a built-in model (see has_builtin_model) use it in place of the directory's definition.
+// Probes name pins of parts to keep as internal pins: part names joined with dots and then the pin, where a part is
+// named after its chip plus its index among parts of that chip when there are several, e.g. ALU.zx or
+// Mux16[1].sel. Probes that name no pin are left out
+tl::expected<Netlist, std::string> elaborate(ChipLibrary& library, const std::string& chip, bool models = false, const std::vector<std::string>& probes = {});
+
+// The simulator's own definition of a chip, e.g. the model that the directory's RAM8.hdl is checked against
+tl::expected<Netlist, std::string> elaborate_builtin(ChipLibrary& library, const std::string& chip);
@@ -0,0 +1,273 @@
+#include "simulator.h"
+
+#include <algorithm>
+
+#include "trace.h"
+
+Simulator::Simulator(const Netlist& netlist, size_t words) : netlist(netlist), words(std::max<size_t>(words, 1)), evaluations(0), sampled_pending(false), tracer(nullptr) {
+    values.assign(static_cast<size_t>(netlist.node_count) * this->words, 0);
+    sampled.assign(netlist.dffs.size() * this->words, 0);
+    ram.resize(netlist.ports.size());
+    for (size_t i = 0; i < netlist.ports.size(); i += 1) {
+        if (netlist.ports[i].kind == port_kind::kRam) {
+            ram[i].assign(lanes() << netlist.ports[i].address_width, 0);
+        }
+    }
+    std::fill_n(lane_words(kNodeTrue), this->words, ~0ull);
+    eval();
+}
+
+size_t Simulator::lanes() const {
+    return words * 64;
+}
+
+void Simulator::set_pin(const netlist_pin& pin, uint16_t value) {
+    write_bits(pin.bits, value);
+}
+
+uint16_t Simulator::pin_value(const netlist_pin& pin, size_t lane) const {
+    return read_bits(pin.bits, lane);
+}
+
+void Simulator::write_bits(const std::vector<uint32_t>& bits, uint16_t value) {
+    for (size_t bit = 0; bit < bits.size() && bit < 16; bit += 1) {
+        // Never overwrite the constant nodes, which unconnected pins share
+        if (bits[bit] > kNodeTrue) {
+            std::fill_n(lane_words(bits[bit]), words, (value >> bit) & 1 ? ~0ull : 0ull);
+        }
+    }
+}
+
+uint16_t Simulator::read_bits(const std::vector<uint32_t>& bits, size_t lane) const {
+    uint16_t value = 0;
+    for (size_t bit = 0; bit < bits.size() && bit < 16; bit += 1) {
+        value |= static_cast<uint16_t>((lane_words(bits[bit])[lane / 64] >> (lane % 64)) & 1) << bit;
+    }
+    return value;
+}
+
+size_t Simulator::dff_index(uint32_t q) const {
+    return q - netlist.dffs.front().q;
+}
+
+void Simulator::write_stored(const std::vector<uint32_t>& bits, uint16_t value) {
+    write_bits(bits, value);
+    if (sampled_pending) {
+        for (size_t bit = 0; bit < bits.size() && bit < 16; bit += 1) {
+            std::fill_n(sampled.data() + dff_index(bits[bit]) * words, words, (value >> bit) & 1 ? ~0ull : 0ull);
+        }
+    }
+}
+
+uint16_t Simulator::read_stored(const std::vector<uint32_t>& bits, size_t lane) const {
+    if (!sampled_pending) {
+        return read_bits(bits, lane);
+    }
+    uint16_t value = 0;
+    for (size_t bit = 0; bit < bits.size() && bit < 16; bit += 1) {
+        value |= static_cast<uint16_t>((sampled[dff_index(bits[bit]) * words + lane / 64] >> (lane % 64)) & 1) << bit;
+    }
+    return value;
+}
+
+size_t Simulator::word_count(const netlist_memory& memory) const {
+    return memory.port >= 0 ? size_t(1) << netlist.ports[memory.port].address_width : memory.bits.size() / 16;
+}
+
+void Simulator::write_word(const netlist_memory& memory, size_t index, uint16_t value) {
+    if (index >= word_count(memory)) {
+        return;
+    }
+    if (memory.port < 0) {
+        write_stored(std::vector<uint32_t>(memory.bits.begin() + index * 16, memory.bits.begin() + index * 16 + 16), value);
+        return;
+    }
+    const size_t size = word_count(memory);
+    for (size_t lane = 0; lane < lanes(); lane += 1) {
+        ram[memory.port][lane * size + index] = value;
+    }
+    // Like a DFF's sampled value, a store that is pending takes the new word too
+    for (ram_write& write : writes) {
+        if (write.port == static_cast<uint32_t>(memory.port) && write.address == index) {
+            write.value = value;
+        }
+    }
+}
+
+uint16_t Simulator::read_word(const netlist_memory& memory, size_t index, size_t lane) const {
+    if (index >= word_count(memory)) {
+        return 0;
+    }
+    if (memory.port < 0) {
+        return read_stored(std::vector<uint32_t>(memory.bits.begin() + index * 16, memory.bits.begin() + index * 16 + 16), lane);
+    }
+    for (auto write = writes.rbegin(); write != writes.rend(); ++write) {
+        if (write->port == static_cast<uint32_t>(memory.port) && write->lane == lane && write->address == index) {
+            return write->value;
+        }
+    }
+    return ram[memory.port][lane * word_count(memory) + index];
+}
+
+uint64_t* Simulator::lane_words(uint32_t node) {
+    return values.data() + static_cast<size_t>(node) * words;
+}
+
+const uint64_t* Simulator::lane_words(uint32_t node) const {
+    return values.data() + static_cast<size_t>(node) * words;
+}
+
+namespace {
+
+// Runs one step's gates; each has its own node, in order from the step's first
+template <size_t Words, typename Op>
+void run_gates(uint64_t* v, const netlist_gate* gates, uint32_t gate_base, const schedule_step& step, size_t runtime_width, Op op) {
+    const size_t width = Words == 0 ? runtime_width : Words;
+    uint64_t* out = v + (static_cast<size_t>(gate_base) + step.begin) * width;
+    for (uint32_t i = step.begin; i < step.end; i += 1, out += width) {
+        const uint64_t* a = v + static_cast<size_t>(gates[i].a) * width;
+        const uint64_t* b = v + static_cast<size_t>(gates[i].b) * width;
+        const uint64_t* c = v + static_cast<size_t>(gates[i].c) * width;
+        for (size_t w = 0; w < width; w += 1) {
+            out[w] = op(a[w], b[w], c[w]);
+        }
+    }
+}
+
+}
+
+template <size_t Words>
+void Simulator::evaluate() {
+    // Words == 0 handles any other width with a runtime loop
+    const size_t width = Words == 0 ? words : Words;
+    uint64_t* const v = values.data();
+    const netlist_gate* const gates = netlist.gates.data();
+    const uint32_t base = netlist.gate_base;
+
+    for (const schedule_step& step : netlist.schedule) {
+        switch (step.op) {
+            case gate_op::kNand: run_gates<Words>(v, gates, base, step, width, [] (uint64_t a, uint64_t b, uint64_t) { return ~(a & b); }); break;
+            case gate_op::kAnd: run_gates<Words>(v, gates, base, step, width, [] (uint64_t a, uint64_t b, uint64_t) { return a & b; }); break;
+            case gate_op::kOr: run_gates<Words>(v, gates, base, step, width, [] (uint64_t a, uint64_t b, uint64_t) { return a | b; }); break;
+            case gate_op::kNor: run_gates<Words>(v, gates, base, step, width, [] (uint64_t a, uint64_t b, uint64_t) { return ~(a | b); }); break;
+            case gate_op::kXor: run_gates<Words>(v, gates, base, step, width, [] (uint64_t a, uint64_t b, uint64_t) { return a ^ b; }); break;
+            case gate_op::kXnor: run_gates<Words>(v, gates, base, step, width, [] (uint64_t a, uint64_t b, uint64_t) { return ~(a ^ b); }); break;
+            case gate_op::kNot: run_gates<Words>(v, gates, base, step, width, [] (uint64_t a, uint64_t, uint64_t) { return ~a; }); break;
+            case gate_op::kAndNot: run_gates<Words>(v, gates, base, step, width, [] (uint64_t a, uint64_t b, uint64_t) { return a & ~b; }); break;
+            case gate_op::kOrNot: run_gates<Words>(v, gates, base, step, width, [] (uint64_t a, uint64_t b, uint64_t) { return a | ~b; }); break;
+            case gate_op::kMux: run_gates<Words>(v, gates, base, step, width, [] (uint64_t a, uint64_t b, uint64_t c) { return a ^ ((a ^ b) & c); }); break;
+        }
+        if (step.port >= 0) {
+            read_port(step.port);
+        }
+    }
+}
+
+void Simulator::eval() {
+    switch (words) {
+        case 1: evaluate<1>(); break;
+        case 4: evaluate<4>(); break;
+        case 8: evaluate<8>(); break;
+        default: evaluate<0>(); break;
+    }
+    evaluations += netlist.gates.size() * words * 64;
+#if HDLSIM_TRACE
+    if (tracer != nullptr) {
+        tracer->sample(*this);
+    }
+#endif
+}
+
+void Simulator::tick() {
+    eval();
+    for (size_t i = 0; i < netlist.dffs.size(); i += 1) {
+        std::copy_n(lane_words(netlist.dffs[i].d), words, sampled.data() + i * words);
+    }
+    writes.clear();
+    for (size_t i = 0; i < netlist.ports.size(); i += 1) {
+        const memory_port& port = netlist.ports[i];
+        if (port.kind != port_kind::kRam) {
+            continue;
+        }
+        for (size_t word = 0; word < words; word += 1) {
+            for (uint64_t load = lane_words(port.load)[word]; load != 0; load &= load - 1) {
+                const size_t lane = word * 64 + __builtin_ctzll(load);
+                uint16_t value = 0;
+                for (uint32_t bit = 0; bit < 16; bit += 1) {
+                    value |= static_cast<uint16_t>((lane_words(port.in[bit])[word] >> (lane % 64)) & 1) << bit;
+                }
+                writes.push_back({ static_cast<uint32_t>(i), static_cast<uint32_t>(lane), port_address(port, lane), value });
+            }
+        }
+    }
+    sampled_pending = true;
+#if HDLSIM_TRACE
+    if (tracer != nullptr) {
+        tracer->advance();
+    }
+#endif
+}
+
+void Simulator::tock() {
+#if HDLSIM_TRACE
+    if (tracer != nullptr) {
+        tracer->advance();
+    }
+#endif
+    // A tock without a tick before it leaves the DFFs as they are
+    for (size_t i = 0; sampled_pending && i < netlist.dffs.size(); i += 1) {
+        std::copy_n(sampled.data() + i * words, words, lane_words(netlist.dffs[i].q));
+    }
+    for (const ram_write& write : writes) {
+        ram[write.port][(static_cast<size_t>(write.lane) << netlist.ports[write.port].address_width) + write.address] = write.value;
+    }
+    writes.clear();
+    sampled_pending = false;
+    eval();
+}
+
+uint32_t Simulator::port_address(const memory_port& port, size_t lane) const {
+    uint32_t address = 0;
+    for (size_t bit = 0; bit < port.address_width; bit += 1) {
+        address |= static_cast<uint32_t>((lane_words(port.address[bit])[lane / 64] >> (lane % 64)) & 1) << bit;
+    }
+    return address;
+}
+
+void Simulator::read_port(size_t index) {
+    const memory_port& port = netlist.ports[index];
+    for (size_t lane = 0; lane < lanes(); lane += 1) {
+        const size_t word = lane / 64;
+        const uint64_t mask = 1ull << (lane % 64);
+
+        const uint32_t address = port_address(port, lane);
+        uint16_t value = 0;
+        if (port.kind == port_kind::kRam) {
+            value = ram[index][(lane << port.address_width) + address];
+        } else if (address < rom.size()) {
+            value = rom[address];
+        }
+        for (uint32_t bit = 0; bit < 16; bit += 1) {
+            uint64_t& out = lane_words(port.out + bit)[word];
+            out = (value >> bit) & 1 ? out | mask : out & ~mask;
+        }
+    }
+}
+
+void Simulator::set_keyboard(uint16_t key) {
+    for (size_t bit = 0; bit < netlist.keyboard.size(); bit += 1) {
+        std::fill_n(lane_words(netlist.keyboard[bit]), words, (key >> (bit % 16)) & 1 ? ~0ull : 0ull);
+    }
+}
+
+void Simulator::load_rom(std::vector<uint16_t> program) {
+    rom = std::move(program);
+}
+
+uint64_t Simulator::gate_evaluations() const {
+    return evaluations;
+}
+
+void Simulator::set_tracer(Tracer* tracer) {
+    this->tracer = tracer;
+}
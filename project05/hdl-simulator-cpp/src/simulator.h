@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "netlist.h"
+
+// Builds the calls into a Tracer; without them tracing costs nothing, not even the null check per eval
+#ifndef HDLSIM_TRACE
+#define HDLSIM_TRACE 1
+#endif
+
+class Tracer;
+
+// Evaluates a netlist bit-sliced: bit l of every node word belongs to lane l, so 64 * words independent
+// copies of the chip run at once. Widths of 4 and 8 words are unrolled so the compiler can use vector registers
+class Simulator {
+public:
+    explicit Simulator(const Netlist& netlist, size_t words = 1);
+
+    size_t lanes() const;
+
+    // Same value in every lane
+    void set_pin(const netlist_pin& pin, uint16_t value);
+    uint16_t pin_value(const netlist_pin& pin, size_t lane = 0) const;
+
+    // Overwrites node values directly; only inputs and DFF outputs keep the value past the next eval
+    void write_bits(const std::vector<uint32_t>& bits, uint16_t value);
+    uint16_t read_bits(const std::vector<uint32_t>& bits, size_t lane = 0) const;
+
+    // A word held by DFFs, given their output nodes: between tick and tock this is what they sampled
+    void write_stored(const std::vector<uint32_t>& bits, uint16_t value);
+    uint16_t read_stored(const std::vector<uint32_t>& bits, size_t lane = 0) const;
+
+    // Words of a register or RAM the netlist records, e.g. RAM16K[5]; between tick and tock this includes what a RAM
+    // is about to store. Out-of-range indices read 0
+    size_t word_count(const netlist_memory& memory) const;
+    void write_word(const netlist_memory& memory, size_t index, uint16_t value);
+    uint16_t read_word(const netlist_memory& memory, size_t index, size_t lane = 0) const;
+
+    // The words lanes of one node
+    uint64_t* lane_words(uint32_t node);
+    const uint64_t* lane_words(uint32_t node) const;
+
+    // Propagates inputs and DFF outputs through every gate
+    void eval();
+    // Rising edge: DFFs and RAMs sample their inputs but keep showing the old value
+    void tick();
+    // Falling edge: DFFs show what they sampled and RAMs store it
+    void tock();
+
+    void set_keyboard(uint16_t key);
+    void load_rom(std::vector<uint16_t> program);
+
+    uint64_t gate_evaluations() const;
+
+    // Samples traced pins after every eval and counts clock edges; nullptr stops tracing. Has no effect when built
+    // with HDLSIM_TRACE=0
+    void set_tracer(Tracer* tracer);
+
+private:
+    template <size_t Words>
+    void evaluate();
+    void read_port(size_t index);
+    uint32_t port_address(const memory_port& port, size_t lane) const;
+    // Index into dffs of the DFF with output node q; DFF outputs are numbered consecutively
+    size_t dff_index(uint32_t q) const;
+
+    const Netlist& netlist;
+    size_t words;
+    std::vector<uint64_t> values;
+    std::vector<uint64_t> sampled;
+    std::vector<uint16_t> rom;
+
+    // A RAM word one lane stores at the next tock
+    struct ram_write {
+        uint32_t port;
+        uint32_t lane;
+        uint32_t address;
+        uint16_t value;
+    };
+    // Per port, each lane's words one after another; empty for ROMs
+    std::vector<std::vector<uint16_t>> ram;
+    std::vector<ram_write> writes;
+    uint64_t evaluations;
+    bool sampled_pending;
+    Tracer* tracer;
+};
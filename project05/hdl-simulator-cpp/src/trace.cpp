@@ -0,0 +1,210 @@
+#include "trace.h"
+
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <numeric>
+
+namespace {
+
+constexpr size_t kRingWords = 1 << 16;
+// Followed by the number of half cycles since the previous mark; any other word is pin index << 16 | value
+constexpr uint32_t kTimeMark = UINT32_MAX;
+constexpr size_t kMaxPins = 0xffff;
+
+// VCD identifiers: printable characters from '!' to '~', like a base-94 number
+std::string identifier(size_t index) {
+    std::string code;
+    do {
+        code += static_cast<char>('!' + index % 94);
+        index /= 94;
+    } while (index > 0);
+    return code;
+}
+
+// "ALU.Mux16[1].sel" is pin sel in scope ALU > Mux16[1]
+std::vector<std::string_view> split_path(std::string_view name) {
+    std::vector<std::string_view> parts;
+    for (size_t dot = name.find('.'); dot != std::string_view::npos; dot = name.find('.')) {
+        parts.push_back(name.substr(0, dot));
+        name.remove_prefix(dot + 1);
+    }
+    parts.push_back(name);
+    return parts;
+}
+
+}
+
+Tracer::Tracer(const Netlist& netlist, std::vector<const netlist_pin*> pins, bool clocked)
+    : chip(netlist.chip), clocked(clocked), pins(std::move(pins)), time(0), marked_time(0), ring(kRingWords), pending(0), head(0), tail(0), stopping(false) {
+    for (size_t i = 0; i < this->pins.size(); i += 1) {
+        codes.push_back(identifier(i));
+    }
+    last.assign(this->pins.size(), UINT32_MAX);
+}
+
+Tracer::~Tracer() {
+    if (writer.joinable()) {
+        if (auto result = close(); !result.has_value()) {
+            spdlog::warn("{}", result.error());
+        }
+    }
+}
+
+tl::expected<void, std::string> Tracer::open(const std::filesystem::path& path) {
+    this->path = path;
+    file.open(path, std::ios::out | std::ios::trunc);
+    if (!file) {
+        return tl::unexpected(fmt::format("Cannot write {}: {}", path.string(), std::strerror(errno)));
+    }
+
+    file << "$version hdl-simulator-cpp $end\n";
+    if (clocked) {
+        file << fmt::format("$comment {}: one time unit is half a clock cycle, 2t is time t of the test script and 2t+1 is t+ $end\n", chip);
+    } else {
+        file << fmt::format("$comment {}: one time unit per eval of the test script, time 0 holds the starting values $end\n", chip);
+    }
+    file << "$timescale 1ns $end\n";
+    file << fmt::format("$scope module {} $end\n", chip);
+
+    // Pins sorted by name, so the pins of each part come together in its scope
+    std::vector<size_t> order(pins.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&] (size_t a, size_t b) { return pins[a]->name < pins[b]->name; });
+    std::vector<std::string_view> scopes;
+    for (const size_t pin : order) {
+        const std::vector<std::string_view> parts = split_path(pins[pin]->name);
+        size_t common = 0;
+        while (common < scopes.size() && common + 1 < parts.size() && scopes[common] == parts[common]) {
+            common += 1;
+        }
+        for (; scopes.size() > common; scopes.pop_back()) {
+            file << "$upscope $end\n";
+        }
+        for (; scopes.size() + 1 < parts.size(); scopes.push_back(parts[scopes.size()])) {
+            file << fmt::format("$scope module {} $end\n", parts[scopes.size()]);
+        }
+        file << fmt::format("$var wire {} {} {} $end\n", pins[pin]->bits.size(), codes[pin], parts.back());
+    }
+    for (; !scopes.empty(); scopes.pop_back()) {
+        file << "$upscope $end\n";
+    }
+    file << "$upscope $end\n";
+    file << "$enddefinitions $end\n";
+    file << "#0\n";
+
+    writer = std::thread(&Tracer::write_changes, this);
+    return {};
+}
+
+tl::expected<void, std::string> Tracer::close() {
+    if (!writer.joinable()) {
+        return {};
+    }
+    head.store(pending, std::memory_order_release);
+    stopping.store(true, std::memory_order_release);
+    writer.join();
+    file.close();
+    if (!file) {
+        return tl::unexpected(fmt::format("Failed to write {}", path.string()));
+    }
+    return {};
+}
+
+void Tracer::sample(const Simulator& simulator) {
+    for (size_t i = 0; i < pins.size(); i += 1) {
+        const uint16_t value = simulator.read_bits(pins[i]->bits);
+        if (value == last[i]) {
+            continue;
+        }
+        // Deltas longer than a word take several marks
+        for (; marked_time != time; ) {
+            const uint64_t delta = std::min<uint64_t>(time - marked_time, UINT32_MAX);
+            push(kTimeMark);
+            push(static_cast<uint32_t>(delta));
+            marked_time += delta;
+        }
+        push(static_cast<uint32_t>(i) << 16 | value);
+        last[i] = value;
+    }
+    head.store(pending, std::memory_order_release);
+}
+
+void Tracer::advance() {
+    time += 1;
+}
+
+void Tracer::push(uint32_t word) {
+    // A full ring waits for the writer rather than dropping changes
+    if (pending - tail.load(std::memory_order_acquire) == ring.size()) {
+        head.store(pending, std::memory_order_release);
+        while (pending - tail.load(std::memory_order_acquire) == ring.size()) {
+            std::this_thread::yield();
+        }
+    }
+    ring[pending % ring.size()] = word;
+    pending += 1;
+}
+
+void Tracer::write_changes() {
+    uint64_t read = 0;
+    uint64_t current = 0;
+    bool delta_next = false;
+    while (true) {
+        // Whatever was published before stopping was set is in head by now
+        const bool stop = stopping.load(std::memory_order_acquire);
+        const uint64_t end = head.load(std::memory_order_acquire);
+        if (read == end) {
+            if (stop) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        for (; read < end; read += 1) {
+            const uint32_t word = ring[read % ring.size()];
+            if (delta_next) {
+                current += word;
+                file << '#' << current << '\n';
+                delta_next = false;
+            } else if (word == kTimeMark) {
+                delta_next = true;
+            } else {
+                file << format_value(word >> 16, word & 0xffff) << '\n';
+            }
+        }
+        tail.store(read, std::memory_order_release);
+    }
+}
+
+std::string Tracer::format_value(size_t pin, uint16_t value) const {
+    const size_t width = pins[pin]->bits.size();
+    if (width == 1) {
+        return fmt::format("{}{}", value & 1, codes[pin]);
+    }
+    std::string bits(width, '0');
+    for (size_t bit = 0; bit < width; bit += 1) {
+        if ((value >> bit) & 1) {
+            bits[width - 1 - bit] = '1';
+        }
+    }
+    return fmt::format("b{} {}", bits, codes[pin]);
+}
+
+tl::expected<std::vector<const netlist_pin*>, std::string> find_trace_pins(const Netlist& netlist, const std::vector<std::string>& names, std::vector<std::string>* missing) {
+    if (names.size() > kMaxPins) {
+        return tl::unexpected(fmt::format("Cannot trace more than {} pins", kMaxPins));
+    }
+    std::vector<const netlist_pin*> pins;
+    for (const std::string& name : names) {
+        const netlist_pin* pin = netlist.find_pin(name);
+        if (pin == nullptr) {
+            missing->push_back(name);
+            continue;
+        }
+        pins.push_back(pin);
+    }
+    return pins;
+}
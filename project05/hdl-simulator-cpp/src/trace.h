@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <tl/expected.hpp>
+
+#include "netlist.h"
+#include "simulator.h"
+
+// Records pins of the first lane of a simulator into a VCD file. The simulating thread only compares the traced
+// pins against the values it last saw and appends the ones that changed to a ring buffer it alone writes, one word
+// per change plus a time delta when the time moved on; a writer thread turns the buffer into VCD text. VCD time
+// counts half clock cycles, so 2t is time t of a test script and 2t+1 is t+. Scripts without a clock only eval, so
+// for them each eval is a time unit of its own, or every change would land at time 0
+class Tracer {
+public:
+    Tracer(const Netlist& netlist, std::vector<const netlist_pin*> pins, bool clocked = true);
+    ~Tracer();
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    // Writes the VCD header and starts the writer thread
+    tl::expected<void, std::string> open(const std::filesystem::path& path);
+    // Waits for the writer to catch up and closes the file
+    tl::expected<void, std::string> close();
+
+    // Called by the simulator after every eval
+    void sample(const Simulator& simulator);
+    // Called by the simulator at every clock edge, and by an unclocked script before every eval
+    void advance();
+
+private:
+    void push(uint32_t word);
+    void write_changes();
+    std::string format_value(size_t pin, uint16_t value) const;
+
+    std::string chip;
+    bool clocked;
+    std::vector<const netlist_pin*> pins;
+    std::vector<std::string> codes;
+    // Last value seen of each pin, out of range of a uint16_t before the first sample
+    std::vector<uint32_t> last;
+    uint64_t time;
+    uint64_t marked_time;
+
+    // Written by the simulating thread up to head, read by the writer up to tail; both only ever grow
+    std::vector<uint32_t> ring;
+    uint64_t pending;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<bool> stopping;
+
+    std::filesystem::path path;
+    std::ofstream file;
+    std::thread writer;
+};
+
+// The pins named that the netlist has, adding the others to missing
+tl::expected<std::vector<const netlist_pin*>, std::string> find_trace_pins(const Netlist& netlist, const std::vector<std::string>& names, std::vector<std::string>* missing);
@@ -0,0 +1,168 @@
+#include "verify.h"
+
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <chrono>
+#include <optional>
+
+#include "builtins.h"
+#include "compile.h"
+#include "simulator.h"
+
+namespace {
+
+constexpr uint64_t kCycles = 4096;
+constexpr uint64_t kSeed = 0x9e3779b97f4a7c15ull;
+
+// The model's pins in the order the chip declares them, which may differ, e.g. PC(in, inc, load, reset)
+std::optional<std::vector<const netlist_pin*>> match_pins(const std::vector<netlist_pin>& pins, const std::vector<netlist_pin>& model_pins) {
+    if (pins.size() != model_pins.size()) {
+        return std::nullopt;
+    }
+    std::vector<const netlist_pin*> matched;
+    for (const netlist_pin& pin : pins) {
+        const auto same = [&] (const netlist_pin& other) { return other.name == pin.name && other.bits.size() == pin.bits.size(); };
+        const auto found = std::find_if(model_pins.begin(), model_pins.end(), same);
+        if (found == model_pins.end()) {
+            return std::nullopt;
+        }
+        matched.push_back(&*found);
+    }
+    return matched;
+}
+
+// Pin values of one lane, e.g. "in=5, load=1, address=3"
+std::string describe(const Simulator& simulator, const std::vector<const netlist_pin*>& pins, size_t lane) {
+    std::string text;
+    for (const netlist_pin* pin : pins) {
+        text += fmt::format("{}{}={}", text.empty() ? "" : ", ", pin->name, simulator.pin_value(*pin, lane));
+    }
+    return text;
+}
+
+std::vector<const netlist_pin*> all_pins(const std::vector<netlist_pin>& pins) {
+    std::vector<const netlist_pin*> result;
+    for (const netlist_pin& pin : pins) {
+        result.push_back(&pin);
+    }
+    return result;
+}
+
+tl::expected<void, std::string> compare(const Netlist& chip, const Netlist& model) {
+    const auto model_inputs = match_pins(chip.inputs, model.inputs);
+    const auto model_outputs = match_pins(chip.outputs, model.outputs);
+    if (!model_inputs.has_value() || !model_outputs.has_value()) {
+        return tl::unexpected(fmt::format("{} does not have the pins of the built-in {}", chip.chip, model.chip));
+    }
+    const std::vector<const netlist_pin*> inputs = all_pins(chip.inputs);
+    const std::vector<const netlist_pin*> outputs = all_pins(chip.outputs);
+
+    Simulator simulated(chip);
+    Simulator expected(model);
+
+    uint64_t state = kSeed;
+    auto random = [&] () {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545f4914f6cdd1dull;
+    };
+
+    auto check = [&] (uint64_t cycle, std::string_view when) -> tl::expected<void, std::string> {
+        uint64_t differ = 0;
+        for (size_t pin = 0; pin < chip.outputs.size(); pin += 1) {
+            for (size_t bit = 0; bit < chip.outputs[pin].bits.size(); bit += 1) {
+                differ |= simulated.lane_words(outputs[pin]->bits[bit])[0] ^ expected.lane_words(model_outputs->at(pin)->bits[bit])[0];
+            }
+        }
+        if (differ == 0) {
+            return {};
+        }
+        const size_t lane = __builtin_ctzll(differ);
+        return tl::unexpected(fmt::format("{} does not match the built-in {} {} cycle {}: {} gives {} instead of {}", chip.chip, model.chip, when, cycle,
+            describe(simulated, inputs, lane), describe(simulated, outputs, lane), describe(expected, model_outputs.value(), lane)));
+    };
+
+    for (uint64_t cycle = 0; cycle < kCycles; cycle += 1) {
+        // Every lane gets its own inputs. Clearing the high bits of buses now and then keeps addresses in a few
+        // words, so that reads often hit what earlier cycles stored
+        for (size_t pin = 0; pin < chip.inputs.size(); pin += 1) {
+            const size_t width = chip.inputs[pin].bits.size();
+            const size_t keep = width > 1 && random() % 2 == 0 ? random() % (width + 1) : width;
+            for (size_t bit = 0; bit < width; bit += 1) {
+                const uint64_t value = bit < keep ? random() : 0;
+                simulated.lane_words(inputs[pin]->bits[bit])[0] = value;
+                expected.lane_words(model_inputs->at(pin)->bits[bit])[0] = value;
+            }
+        }
+
+        simulated.eval();
+        expected.eval();
+        if (auto result = check(cycle, "before the clock in"); !result.has_value()) {
+            return result;
+        }
+        simulated.tick();
+        expected.tick();
+        simulated.tock();
+        expected.tock();
+        if (auto result = check(cycle, "after the clock in"); !result.has_value()) {
+            return result;
+        }
+    }
+    return {};
+}
+
+}
+
+tl::expected<void, std::string> verify_chip(ChipLibrary& library, const std::string& chip, const NetlistCache* cache) {
+    if (!has_builtin_model(chip)) {
+        return tl::unexpected(fmt::format("{} has no built-in model to check against", chip));
+    }
+    // Keyed by every definition below the chip, not just those elaborated with models, so that a change to
+    // Bit.hdl checks RAM8 again on the way down to Bit
+    const auto hash = chip_definition_hash(library, chip, false);
+    if (!hash.has_value()) {
+        return tl::unexpected(hash.error());
+    }
+    if (cache != nullptr && cache->is_verified(chip, hash.value())) {
+        return {};
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto structural = elaborate(library, chip, true);
+    if (!structural.has_value()) {
+        return tl::unexpected(structural.error());
+    }
+    if (auto parts = verify_models(library, structural.value(), cache); !parts.has_value()) {
+        return parts;
+    }
+    const auto model = elaborate_builtin(library, chip);
+    if (!model.has_value()) {
+        return tl::unexpected(model.error());
+    }
+    if (auto result = compare(structural.value(), model.value()); !result.has_value()) {
+        return result;
+    }
+    spdlog::debug("{} matches its built-in model after {} cycles in {:.3f} s", chip, kCycles,
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+    if (cache != nullptr) {
+        if (auto marked = cache->mark_verified(chip, hash.value()); !marked.has_value()) {
+            spdlog::warn("{}", marked.error());
+        }
+    }
+    return {};
+}
+
+tl::expected<void, std::string> verify_models(ChipLibrary& library, const Netlist& netlist, const NetlistCache* cache) {
+    for (const std::string& chip : netlist.models) {
+        // A chip that uses itself as a part is checked by whoever elaborated it
+        if (chip == netlist.chip) {
+            continue;
+        }
+        if (auto result = verify_chip(library, chip, cache); !result.has_value()) {
+            return result;
+        }
+    }
+    return {};
+}
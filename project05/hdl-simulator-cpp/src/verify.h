@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+#include <tl/expected.hpp>
+
+#include "hdl.h"
+#include "netcache.h"
+#include "netlist.h"
+
+// Runs a chip of the directory and its built-in model side by side on random inputs, 64 lanes over a few thousand
+// clock cycles, and compares their outputs after every eval and every tock. The chip is elaborated with models for
+// its own parts, which are checked first, so each level of e.g. RAM16K > RAM4K > ... > Bit is checked on its own.
+// With a cache, a definition that passed is not checked again
+tl::expected<void, std::string> verify_chip(ChipLibrary& library, const std::string& chip, const NetlistCache* cache);
+
+// Checks every chip a netlist used a built-in model in place of
+tl::expected<void, std::string> verify_models(ChipLibrary& library, const Netlist& netlist, const NetlistCache* cache);
@@ -3,12 +3,15 @@
 #include <spdlog/spdlog.h>
 #include <algorithm>
 #include <map>
+#include <optional>
 #include <regex>
-#include <sstream>
 #include <string>
+#include <string_view>
 #include <variant>
 #include <vector>
 
+#include "linescan.h"
+
 template <class... Ts>
 struct overloaded : Ts... { using Ts::operator()...; };
 
@@ -32,114 +35,186 @@ struct instr_c {
 };
 
 using instr_line = std::variant<instr_empty, instr_label, instr_a, instr_c>;
-using instruction = std::variant<instr_a, instr_c>;
 
-tl::expected<instr_line, std::string> parse_instruction_line(std::string line);
-tl::expected<uint16_t, std::string> assemble_instruction_line(const instruction& instr, std::map<std::string, uint16_t>& symbol_map, uint16_t& next_register);
+// Takes the code of a line, already without its comment and surrounding whitespace
+tl::expected<instr_line, std::string> parse_instruction_line(std::string_view line);
+tl::expected<uint16_t, std::string> assemble_constant(const instr_a& a);
+tl::expected<uint16_t, std::string> assemble_compute(const instr_c& c);
+
+static const std::map<std::string, uint16_t> predefined_symbols = {
+    { "SP",     0 },
+    { "LCL",    1 },
+    { "ARG",    2 },
+    { "THIS",   3 },
+    { "THAT",   4 },
+    { "R0",     0 },
+    { "R1",     1 },
+    { "R2",     2 },
+    { "R3",     3 },
+    { "R4",     4 },
+    { "R5",     5 },
+    { "R6",     6 },
+    { "R7",     7 },
+    { "R8",     8 },
+    { "R9",     9 },
+    { "R10",    10 },
+    { "R11",    11 },
+    { "R12",    12 },
+    { "R13",    13 },
+    { "R14",    14 },
+    { "R15",    15 },
+    { "SCREEN", 16384 },
+    { "KBD",    24576 },
+};
+
+Assembler::Assembler(const std::string& code) : code(code) {}
 
-std::string trim_whitespace(const std::string& str) {
-    const std::string whitespace = " \t\r";
-    const auto begin = str.find_first_not_of(whitespace);
-    if (begin == std::string::npos) {
-        return "";
+tl::expected<buffer, std::string> Assembler::parse() {
+    auto chunk = assemble_chunk(code);
+    if (!chunk.has_value()) {
+        return tl::unexpected(chunk.error());
     }
-    const auto end = str.find_last_not_of(whitespace);
-    return str.substr(begin, end - begin + 1);
-}
 
-std::string trim_comments(const std::string& str) {
-    const auto pos = str.find("//");
-    if (pos == std::string::npos) {
-        return str;
+    label_map.clear();
+    auto buf = link_chunks({ &chunk.value() }, &label_map);
+    if (!buf.has_value()) {
+        return tl::unexpected(buf.error());
     }
-    return str.substr(0, pos);
+
+    spdlog::info("Generated {} bytes of hack", buf.value().size());
+
+    return buf;
 }
 
-std::string remove_whitespace(const std::string& str) {
-    std::string out = str;
-    auto pos = std::remove_if(out.begin(), out.end(), [] (const auto& c) {
-        return c == ' ' || c == '\t' || c == '\r';
-    });
-    out.erase(pos, out.end());
-    return out;
+const std::map<std::string, uint16_t>& Assembler::labels() const {
+    return label_map;
 }
 
-Assembler::Assembler(const std::string& code) : code(code) {}
+tl::expected<void, std::string> add_chunk_line(std::string_view line, object_chunk* chunk) {
+    auto result = parse_instruction_line(line);
+    if (!result.has_value()) {
+        return tl::unexpected(result.error());
+    }
 
-tl::expected<buffer, std::string> Assembler::parse() {
-    std::stringstream ss(code);
-    std::string line;
-
-    std::vector<instruction> instructions;
-    std::map<std::string, uint16_t> symbol_map = {
-        { "SP",     0 },
-        { "LCL",    1 },
-        { "ARG",    2 },
-        { "THIS",   3 },
-        { "THAT",   4 },
-        { "R0",     0 },
-        { "R1",     1 },
-        { "R2",     2 },
-        { "R3",     3 },
-        { "R4",     4 },
-        { "R5",     5 },
-        { "R6",     6 },
-        { "R7",     7 },
-        { "R8",     8 },
-        { "R9",     9 },
-        { "R10",    10 },
-        { "R11",    11 },
-        { "R12",    12 },
-        { "R13",    13 },
-        { "R14",    14 },
-        { "R15",    15 },
-        { "SCREEN", 16384 },
-        { "KBD",    24576 },
-    };
+    auto word = std::visit(overloaded {
+        [&] (const instr_empty&) -> tl::expected<std::optional<uint16_t>, std::string> {
+            return std::nullopt;
+        },
+        [&] (const instr_label& instr) -> tl::expected<std::optional<uint16_t>, std::string> {
+            chunk->labels.emplace_back(instr.label, chunk->words.size());
+            return std::nullopt;
+        },
+        [&] (const instr_a& a) -> tl::expected<std::optional<uint16_t>, std::string> {
+            if (!isdigit(a.value[0])) {
+                chunk->fixups.emplace_back(chunk->words.size(), a.value);
+                return 0;
+            }
+            return assemble_constant(a);
+        },
+        [&] (const instr_c& c) -> tl::expected<std::optional<uint16_t>, std::string> {
+            return assemble_compute(c);
+        },
+    }, result.value());
+
+    if (!word.has_value()) {
+        return tl::unexpected(word.error());
+    }
+    if (word.value().has_value()) {
+        chunk->words.push_back(word.value().value());
+    }
+    return {};
+}
+
+tl::expected<object_chunk, std::string> assemble_chunk(const std::string& code) {
+    const std::vector<line_span> lines = scan_lines(code);
 
-    while (std::getline(ss, line)) {
-        auto result = parse_instruction_line(line);
-        if (!result.has_value()) {
+    object_chunk chunk;
+    chunk.words.reserve(lines.size());
+
+    for (const auto& span : lines) {
+        if (span.code_length == 0) {
+            continue;
+        }
+        if (auto result = add_chunk_line(code_of(code, span), &chunk); !result.has_value()) {
             return tl::unexpected(result.error());
         }
-
-        auto instr = result.value();
-        std::visit(overloaded {
-            [] (const instr_empty&) {},
-            [&] (const instr_label& instr) { symbol_map[instr.label] = instructions.size(); },
-            [&] (const instr_a& a) { instructions.push_back(a); },
-            [&] (const instr_c& c) { instructions.push_back(c); },
-        }, instr);
     }
+    return chunk;
+}
 
-    buffer buf;
-    buf.reserve(1024);
-    uint16_t next_register = 16;
+tl::expected<object_chunk, std::string> assemble_chunk(const std::vector<std::string>& lines) {
+    object_chunk chunk;
+    chunk.words.reserve(lines.size());
 
-    for (const auto& instr: instructions) {
-        auto result = assemble_instruction_line(instr, symbol_map, next_register);
-        if (!result.has_value()) {
+    for (const auto& line : lines) {
+        if (auto result = add_chunk_line(code_of(line, scan_line(line)), &chunk); !result.has_value()) {
             return tl::unexpected(result.error());
         }
+    }
+    return chunk;
+}
+
+tl::expected<buffer, std::string> link_chunks(const std::vector<const object_chunk*>& chunks, std::map<std::string, uint16_t>* labels) {
+    std::map<std::string, uint16_t> symbol_map = predefined_symbols;
 
-        buf.push_back(result.value());
+    auto chunk_name = [&] (size_t index) -> std::string {
+        if (!chunks[index]->name.empty()) {
+            return chunks[index]->name;
+        }
+        return chunks.size() == 1 ? "the program" : fmt::format("chunk {}", index);
+    };
+
+    // Chunk each label is defined in
+    std::map<std::string_view, size_t> defined_in;
+    size_t size = 0;
+    for (size_t index = 0; index < chunks.size(); index += 1) {
+        const auto* chunk = chunks[index];
+        for (const auto& [label, address] : chunk->labels) {
+            if (const auto [found, inserted] = defined_in.emplace(label, index); !inserted) {
+                if (found->second == index) {
+                    return tl::unexpected(fmt::format("Label {} is defined twice in {}", label, chunk_name(index)));
+                }
+                return tl::unexpected(fmt::format("Label {} is defined in {} and again in {}", label, chunk_name(found->second), chunk_name(index)));
+            }
+            symbol_map[label] = size + address;
+            if (labels != nullptr) {
+                (*labels)[label] = size + address;
+            }
+        }
+        size += chunk->words.size();
     }
 
-    spdlog::info("Generated {} bytes of hack", buf.size());
+    buffer buf;
+    buf.reserve(size);
+    uint16_t next_register = 16;
+
+    for (const auto* chunk : chunks) {
+        const size_t base = buf.size();
+        buf.insert(buf.end(), chunk->words.begin(), chunk->words.end());
+
+        for (const auto& [address, symbol] : chunk->fixups) {
+            spdlog::trace("A-instr: {}", symbol);
+
+            auto found = symbol_map.find(symbol);
+            if (found == symbol_map.end()) {
+                found = symbol_map.emplace(symbol, next_register++).first;
+            }
+            buf[base + address] = found->second;
+        }
+    }
 
     return buf;
 }
 
-tl::expected<instr_line, std::string> parse_instruction_line(std::string line) {
+tl::expected<instr_line, std::string> parse_instruction_line(std::string_view line) {
     spdlog::trace(">>> {}", line);
 
-    line = trim_whitespace(trim_comments(line));
     if (line.empty()) {
         return instr_empty {};
     }
 
     if (line[0] == '@') {
-        return instr_a { line.substr(1) };
+        return instr_a { std::string(line.substr(1)) };
     }
 
     if (line[0] == '(') {
@@ -147,7 +222,7 @@ tl::expected<instr_line, std::string> parse_instruction_line(std::string line) {
             return tl::unexpected(fmt::format("Unexpected instruction: {}", line));
         }
 
-        std::string label = line.substr(1, line.size() - 2);
+        std::string label(line.substr(1, line.size() - 2));
         return instr_label { label };
     }
 
@@ -155,12 +230,12 @@ tl::expected<instr_line, std::string> parse_instruction_line(std::string line) {
     auto eq_pos = line.find_first_of("=");
     auto semi_pos = line.find_last_of(";");
 
-    if (eq_pos == std::string::npos && semi_pos == std::string::npos) {
+    if (eq_pos == std::string_view::npos && semi_pos == std::string::npos) {
         comp = line;
-    } else if (eq_pos == std::string::npos) {
+    } else if (eq_pos == std::string_view::npos) {
         comp = line.substr(0, semi_pos);
         jump = line.substr(semi_pos + 1);
-    } else if (semi_pos == std::string::npos) {
+    } else if (semi_pos == std::string_view::npos) {
         dest = line.substr(0, eq_pos);
         comp = line.substr(eq_pos + 1);
     } else {
@@ -233,55 +308,42 @@ static std::map<std::string, uint16_t> jump_map = {
     { "JMP", 0b111 },
 };
 
-tl::expected<uint16_t, std::string> assemble_instruction_line(const instruction& instr, std::map<std::string, uint16_t>& symbol_map, uint16_t& next_register) {
-    if (std::holds_alternative<instr_a>(instr)) {
-        const auto& a = std::get<instr_a>(instr);
-        spdlog::trace("A-instr: {}", a.value);
+tl::expected<uint16_t, std::string> assemble_constant(const instr_a& a) {
+    spdlog::trace("A-instr: {}", a.value);
 
-        if (isdigit(a.value[0])) {
-            int value = stoi(a.value);
-            if (value > 32767) {
-                return tl::unexpected(fmt::format("A-instruction constant value '{}' exceeds maximum 32767", value));
-            }
-            return value;
-        }
-
-        auto found = symbol_map.find(a.value);
-        if (found == symbol_map.end()) {
-            uint16_t register_value = next_register++;
-            symbol_map[a.value] = register_value;
-            return register_value;
-        }
+    int value = stoi(a.value);
+    if (value > 32767) {
+        return tl::unexpected(fmt::format("A-instruction constant value '{}' exceeds maximum 32767", value));
+    }
+    return value;
+}
 
-        return found->second;
-    } else {
-        const auto& c = std::get<instr_c>(instr);
-        std::string dest = remove_whitespace(c.dest);
-        std::string comp = remove_whitespace(c.comp);
-        std::string jump = remove_whitespace(c.jump);
+tl::expected<uint16_t, std::string> assemble_compute(const instr_c& c) {
+    std::string dest = remove_whitespace(c.dest);
+    std::string comp = remove_whitespace(c.comp);
+    std::string jump = remove_whitespace(c.jump);
 
-        spdlog::trace("C-instr: [{}, {}, {}]", dest, comp, jump);
+    spdlog::trace("C-instr: [{}, {}, {}]", dest, comp, jump);
 
-        uint16_t jbits, dbits, cbits;
+    uint16_t jbits, dbits, cbits;
 
-        try {
-            cbits = comp_map.at(comp);
-        } catch (const std::exception&) {
-            return tl::unexpected(fmt::format("Invalid COMP: {}", comp));
-        }
-
-        try {
-            dbits = dest_map.at(dest);
-        } catch (const std::exception&) {
-            return tl::unexpected(fmt::format("Invalid DEST: {}", dest));
-        }
+    try {
+        cbits = comp_map.at(comp);
+    } catch (const std::exception&) {
+        return tl::unexpected(fmt::format("Invalid COMP: {}", comp));
+    }
 
-        try {
-            jbits = jump_map.at(jump);
-        } catch (const std::exception&) {
-            return tl::unexpected(fmt::format("Invalid JUMP: {}", jump));
-        }
+    try {
+        dbits = dest_map.at(dest);
+    } catch (const std::exception&) {
+        return tl::unexpected(fmt::format("Invalid DEST: {}", dest));
+    }
 
-        return jbits | (dbits << 3) | (cbits << 6) | (0b111 << 13);
+    try {
+        jbits = jump_map.at(jump);
+    } catch (const std::exception&) {
+        return tl::unexpected(fmt::format("Invalid JUMP: {}", jump));
     }
+
+    return jbits | (dbits << 3) | (cbits << 6) | (0b111 << 13);
 }
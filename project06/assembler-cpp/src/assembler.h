@@ -1,17 +1,40 @@
 #pragma once
 
+#include <map>
 #include <string>
+#include <utility>
 #include <vector>
 #include <tl/expected.hpp>
 
 using buffer = std::vector<uint16_t>;
 
+// Machine code for one piece of source, with label and variable references left for link_chunks
+struct object_chunk {
+    buffer words;
+    std::vector<std::pair<std::string, uint16_t>> labels;
+    std::vector<std::pair<uint16_t, std::string>> fixups;
+    // What the chunk was assembled from, e.g. a .vm file's stem, for errors
+    std::string name;
+};
+
+tl::expected<object_chunk, std::string> assemble_chunk(const std::string& code);
+tl::expected<object_chunk, std::string> assemble_chunk(const std::vector<std::string>& lines);
+
+// Lays chunks out in order and resolves symbols exactly as assembling their concatenated source would. A label
+// defined twice is an error, as it would be ambiguous which one the references mean. With labels, also returns the
+// ROM address of every label
+tl::expected<buffer, std::string> link_chunks(const std::vector<const object_chunk*>& chunks, std::map<std::string, uint16_t>* labels = nullptr);
+
 class Assembler {
 public:
     Assembler(const std::string& code);
 
     tl::expected<buffer, std::string> parse();
 
+    // The ROM address of every label of the last program parsed
+    const std::map<std::string, uint16_t>& labels() const;
+
 private:
     std::string code;
+    std::map<std::string, uint16_t> label_map;
 };
@@ -0,0 +1,334 @@
+#include "batch.h"
+
+#include <spdlog/spdlog.h>
+#include <algorithm>
+
+// The lockstep loop is compiled for AVX-512 (x86-64-v4 has AVX-512BW) and AVX2 as well and picked at load time by
+// the CPU it runs on
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__)
+#define HACK_BATCH_TARGETS __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "default")))
+#else
+#define HACK_BATCH_TARGETS
+#endif
+
+namespace {
+
+static_assert(kBatchLanes == 32, "lane sets are kept in a uint32_t");
+
+// One block's machines as the lockstep loop sees them, all arrays starting at lane 0
+struct lockstep_block {
+    uint16_t* a;
+    uint16_t* d;
+    uint16_t* pc;
+    uint64_t* cycles;
+    uint64_t* ran;
+    uint8_t* halted;
+    uint16_t* ram;
+    const decoded_instruction* rom;
+};
+
+inline uint16_t* ram_row(uint16_t* ram, uint16_t address) {
+    return ram + static_cast<size_t>(address & kAddressMask) * kBatchLanes;
+}
+
+// Steps the lanes of a group, all at pc, until the budget runs out, they reach a halt loop or fewer than two are
+// left. A lane whose jump disagrees with the first lane of the group leaves it after that instruction with its own
+// PC. Every lane loop runs over all kBatchLanes lanes and merges results under a mask, so it compiles to a few
+// vector instructions; only RAM accesses through an A that differs between lanes go lane by lane
+HACK_BATCH_TARGETS
+uint64_t lockstep(const lockstep_block& block, uint16_t pc, uint32_t* group, uint64_t max_cycles, uint64_t* divergences) {
+    uint16_t active[kBatchLanes];
+    for (size_t lane = 0; lane < kBatchLanes; lane += 1) {
+        active[lane] = (*group >> lane) & 1 ? 0xffff : 0;
+    }
+    uint16_t* a = block.a;
+    uint16_t* d = block.d;
+
+    // Whether every lane of the group holds shared_a in A, so that M is one row of adjacent words
+    const uint16_t shared_a = a[__builtin_ctz(*group)];
+    bool uniform = true;
+    for (size_t lane = 0; lane < kBatchLanes; lane += 1) {
+        uniform &= !active[lane] || a[lane] == shared_a;
+    }
+    uint16_t address = shared_a & kAddressMask;
+
+    uint64_t steps = 0;
+    while (steps < max_cycles) {
+        const decoded_instruction& instr = block.rom[pc];
+
+        if (instr.is_a) {
+            if (instr.halt) {
+                for (size_t lane = 0; lane < kBatchLanes; lane += 1) {
+                    block.halted[lane] |= active[lane] & 1;
+                }
+                break;
+            }
+            for (size_t lane = 0; lane < kBatchLanes; lane += 1) {
+                a[lane] = (a[lane] & ~active[lane]) | (instr.constant & active[lane]);
+            }
+            uniform = true;
+            address = instr.constant;
+            pc = (pc + 1) & kAddressMask;
+            steps += 1;
+            continue;
+        }
+
+        uint16_t y[kBatchLanes];
+        if (!instr.reads_m) {
+            std::copy(a, a + kBatchLanes, y);
+        } else if (uniform) {
+            std::copy(ram_row(block.ram, address), ram_row(block.ram, address) + kBatchLanes, y);
+        } else {
+            for (size_t lane = 0; lane < kBatchLanes; lane += 1) {
+                y[lane] = ram_row(block.ram, a[lane])[lane];
+            }
+        }
+
+        // The ALU from its six control bits, the same masks for every lane
+        const uint16_t zx = (instr.alu & 0b100000) ? 0 : 0xffff;
+        const uint16_t nx = (instr.alu & 0b010000) ? 0xffff : 0;
+        const uint16_t zy = (instr.alu & 0b001000) ? 0 : 0xffff;
+        const uint16_t ny = (instr.alu & 0b000100) ? 0xffff : 0;
+        const uint16_t f = (instr.alu & 0b000010) ? 0xffff : 0;
+        const uint16_t no = (instr.alu & 0b000001) ? 0xffff : 0;
+        uint16_t out[kBatchLanes];
+        for (size_t lane = 0; lane < kBatchLanes; lane += 1) {
+            const uint16_t x = (d[lane] & zx) ^ nx;
+            const uint16_t y2 = (y[lane] & zy) ^ ny;
+            out[lane] = ((static_cast<uint16_t>(x + y2) & f) | (x & y2 & ~f)) ^ no;
+        }
+
+        // Jump targets use A before this instruction updates it
+        const uint16_t next = (pc + 1) & kAddressMask;
+        uint16_t target[kBatchLanes];
+        if (instr.jump == 0) {
+            std::fill(target, target + kBatchLanes, next);
+        } else {
+            const uint16_t lt = (instr.jump & kJumpLT) ? 0xffff : 0;
+            const uint16_t eq = (instr.jump & kJumpEQ) ? 0xffff : 0;
+            const uint16_t gt = (instr.jump & kJumpGT) ? 0xffff : 0;
+            for (size_t lane = 0; lane < kBatchLanes; lane += 1) {
+                const uint16_t negative = static_cast<int16_t>(out[lane]) < 0 ? 0xffff : 0;
+                const uint16_t zero = out[lane] == 0 ? 0xffff : 0;
+                const uint16_t taken = (negative & lt) | (zero & eq) | (~(negative | zero) & gt);
+                target[lane] = (a[lane] & kAddressMask & taken) | (next & ~taken);
+            }
+        }
+
+        if (instr.dest & kDestM) {
+            if (uniform) {
+                if (address < kKeyboardAddress) {
+                    uint16_t* row = ram_row(block.ram, address);
+                    for (size_t lane = 0; lane < kBatchLanes; lane += 1) {
+                        row[lane] = (row[lane] & ~active[lane]) | (out[lane] & active[lane]);
+                    }
+                }
+            } else {
+                for (size_t lane = 0; lane < kBatchLanes; lane += 1) {
+                    if (active[lane] && (a[lane] & kAddressMask) < kKeyboardAddress) {
+                        ram_row(block.ram, a[lane])[lane] = out[lane];
+                    }
+                }
+            }
+        }
+        if (instr.dest & kDestD) {
+            for (size_t lane = 0; lane < kBatchLanes; lane += 1) {
+                d[lane] = (d[lane] & ~active[lane]) | (out[lane] & active[lane]);
+            }
+        }
+        if (instr.dest & kDestA) {
+            for (size_t lane = 0; lane < kBatchLanes; lane += 1) {
+                a[lane] = (a[lane] & ~active[lane]) | (out[lane] & active[lane]);
+            }
+            uniform = false;
+        }
+        steps += 1;
+
+        pc = target[__builtin_ctz(*group)];
+        uint16_t differ = 0;
+        for (size_t lane = 0; lane < kBatchLanes; lane += 1) {
+            differ |= active[lane] & (target[lane] ^ pc);
+        }
+        if (differ != 0) {
+            for (size_t lane = 0; lane < kBatchLanes; lane += 1) {
+                if (active[lane] && target[lane] != pc) {
+                    block.pc[lane] = target[lane];
+                    block.cycles[lane] += steps;
+                    block.ran[lane] += steps;
+                    active[lane] = 0;
+                    *group &= ~(1u << lane);
+                    *divergences += 1;
+                }
+            }
+            if (__builtin_popcount(*group) < 2) {
+                break;
+            }
+        }
+    }
+
+    for (size_t lane = 0; lane < kBatchLanes; lane += 1) {
+        if (active[lane]) {
+            block.pc[lane] = pc;
+            block.cycles[lane] += steps;
+            block.ran[lane] += steps;
+        }
+    }
+    return steps;
+}
+
+}
+
+BatchEmulator::BatchEmulator(size_t instances)
+    : instances(instances), blocks((instances + kBatchLanes - 1) / kBatchLanes), decoded(decode_rom({})),
+      a(blocks * kBatchLanes, 0), d(blocks * kBatchLanes, 0), pc(blocks * kBatchLanes, 0), cycles(blocks * kBatchLanes, 0),
+      is_halted(blocks * kBatchLanes, 0), ran(blocks * kBatchLanes, 0), ram(blocks * kRamSize * kBatchLanes, 0), counters {} {
+    solo.set_engine(emulator_engine::kComputedGoto);
+}
+
+tl::expected<void, std::string> BatchEmulator::load(const buffer& program) {
+    if (auto result = solo.load(program); !result.has_value()) {
+        return result;
+    }
+    this->program = program;
+    decoded = decode_rom(program);
+    std::fill(pc.begin(), pc.end(), 0);
+    std::fill(is_halted.begin(), is_halted.end(), 0);
+    return {};
+}
+
+size_t BatchEmulator::size() const {
+    return instances;
+}
+
+void BatchEmulator::run(uint64_t max_cycles) {
+    std::fill(ran.begin(), ran.end(), 0);
+    for (size_t block = 0; block < blocks; block += 1) {
+        while (true) {
+            uint32_t lanes = 0;
+            const uint16_t at = most_common_pc(block, max_cycles, &lanes);
+            if (lanes == 0) {
+                break;
+            }
+            if (__builtin_popcount(lanes) >= 2) {
+                step_group(block, at, lanes, max_cycles);
+                continue;
+            }
+            // No two machines left at the same PC
+            for (size_t lane = 0; lane < kBatchLanes; lane += 1) {
+                const size_t instance = block * kBatchLanes + lane;
+                if (instance < instances && !is_halted[instance] && ran[instance] < max_cycles) {
+                    run_solo(instance, max_cycles);
+                }
+            }
+            break;
+        }
+    }
+}
+
+// The PC shared by most of the machines of a block that can still run, and those machines
+uint16_t BatchEmulator::most_common_pc(size_t block, uint64_t max_cycles, uint32_t* lanes) const {
+    uint32_t runnable = 0;
+    for (size_t lane = 0; lane < kBatchLanes; lane += 1) {
+        const size_t instance = block * kBatchLanes + lane;
+        if (instance < instances && !is_halted[instance] && ran[instance] < max_cycles) {
+            runnable |= 1u << lane;
+        }
+    }
+
+    uint16_t best = 0;
+    *lanes = 0;
+    for (uint32_t left = runnable; left != 0; ) {
+        const uint16_t at = pc[block * kBatchLanes + __builtin_ctz(left)];
+        uint32_t same = 0;
+        for (uint32_t scan = left; scan != 0; scan &= scan - 1) {
+            const size_t lane = __builtin_ctz(scan);
+            if (pc[block * kBatchLanes + lane] == at) {
+                same |= 1u << lane;
+            }
+        }
+        if (__builtin_popcount(same) > __builtin_popcount(*lanes)) {
+            best = at;
+            *lanes = same;
+        }
+        left &= ~same;
+    }
+    return best;
+}
+
+void BatchEmulator::step_group(size_t block, uint16_t at, uint32_t lanes, uint64_t max_cycles) {
+    const size_t base = block * kBatchLanes;
+    uint64_t budget = max_cycles;
+    for (uint32_t scan = lanes; scan != 0; scan &= scan - 1) {
+        budget = std::min(budget, max_cycles - ran[base + __builtin_ctz(scan)]);
+    }
+
+    const lockstep_block view { &a[base], &d[base], &pc[base], &cycles[base], &ran[base], &is_halted[base], ram_lanes(block, 0), decoded.data() };
+    // Lanes that leave the group run part of the steps, so count what each lane ran
+    const uint32_t started = lanes;
+    uint64_t ran_before = 0;
+    for (uint32_t scan = started; scan != 0; scan &= scan - 1) {
+        ran_before += ran[base + __builtin_ctz(scan)];
+    }
+    const uint64_t steps = lockstep(view, at, &lanes, budget, &counters.divergences);
+    for (uint32_t scan = started; scan != 0; scan &= scan - 1) {
+        counters.lockstep_cycles += ran[base + __builtin_ctz(scan)];
+    }
+    counters.lockstep_cycles -= ran_before;
+    spdlog::trace("Block {}: {} machines from PC {} ran {} steps together, {} left", block, __builtin_popcount(started), at, steps,
+        __builtin_popcount(started & ~lanes));
+}
+
+void BatchEmulator::run_solo(size_t instance, uint64_t max_cycles) {
+    const size_t block = instance / kBatchLanes;
+    const size_t lane = instance % kBatchLanes;
+
+    solo.set_state(state(instance));
+    for (uint32_t address = 0; address < kRamSize; address += 1) {
+        solo.write(address, ram_lanes(block, address)[lane]);
+    }
+    const uint64_t executed = solo.run(max_cycles - ran[instance]);
+
+    const cpu_state& after = solo.state();
+    a[instance] = after.a;
+    d[instance] = after.d;
+    pc[instance] = after.pc;
+    cycles[instance] = after.cycles;
+    is_halted[instance] = solo.halted();
+    ran[instance] += executed;
+    for (uint32_t address = 0; address < kRamSize; address += 1) {
+        ram_lanes(block, address)[lane] = solo.ram()[address];
+    }
+    counters.solo_cycles += executed;
+}
+
+uint16_t* BatchEmulator::ram_lanes(size_t block, uint16_t address) {
+    return &ram[(block * kRamSize + (address & kAddressMask)) * kBatchLanes];
+}
+
+uint16_t BatchEmulator::read(size_t instance, uint16_t address) const {
+    return ram[((instance / kBatchLanes) * kRamSize + (address & kAddressMask)) * kBatchLanes + instance % kBatchLanes];
+}
+
+void BatchEmulator::write(size_t instance, uint16_t address, uint16_t value) {
+    ram_lanes(instance / kBatchLanes, address)[instance % kBatchLanes] = value;
+}
+
+cpu_state BatchEmulator::state(size_t instance) const {
+    return cpu_state { a[instance], d[instance], pc[instance], cycles[instance] };
+}
+
+void BatchEmulator::set_state(size_t instance, const cpu_state& state) {
+    a[instance] = state.a;
+    d[instance] = state.d;
+    pc[instance] = state.pc & kAddressMask;
+    cycles[instance] = state.cycles;
+    is_halted[instance] = false;
+}
+
+bool BatchEmulator::halted(size_t instance) const {
+    return is_halted[instance];
+}
+
+const batch_stats& BatchEmulator::stats() const {
+    return counters;
+}
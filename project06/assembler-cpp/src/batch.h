@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <tl/expected.hpp>
+
+#include "assembler.h"
+#include "emulator.h"
+#include "hackcpu.h"
+
+// Instances that step together: one AVX-512 register of 16-bit words, two AVX2 ones
+constexpr size_t kBatchLanes = 32;
+
+struct batch_stats {
+    // Instructions executed in lockstep, summed over the instances that took part
+    uint64_t lockstep_cycles;
+    // Instructions executed by instances running on their own
+    uint64_t solo_cycles;
+    // Times an instance branched away from the others it was stepping with
+    uint64_t divergences;
+};
+
+// Runs one program on many machines with their own A, D, PC and RAM, e.g. a test with a range of inputs. The
+// machines are split into blocks of kBatchLanes kept as structs of arrays, RAM interleaved so that the lanes of one
+// address are adjacent. The machines of a block that are at the same PC execute each instruction together, the
+// ALU evaluated for all lanes at once; a machine whose jump goes elsewhere is masked off and regrouped with those at
+// its PC later, and a machine left with no company runs on its own on a scalar Emulator
+class BatchEmulator {
+public:
+    explicit BatchEmulator(size_t instances);
+
+    tl::expected<void, std::string> load(const buffer& program);
+    size_t size() const;
+
+    // Runs every instance for up to max_cycles instructions or until it halts
+    void run(uint64_t max_cycles);
+
+    uint16_t read(size_t instance, uint16_t address) const;
+    void write(size_t instance, uint16_t address, uint16_t value);
+    cpu_state state(size_t instance) const;
+    void set_state(size_t instance, const cpu_state& state);
+    bool halted(size_t instance) const;
+
+    const batch_stats& stats() const;
+
+private:
+    uint16_t* ram_lanes(size_t block, uint16_t address);
+    uint16_t most_common_pc(size_t block, uint64_t max_cycles, uint32_t* lanes) const;
+    void step_group(size_t block, uint16_t pc, uint32_t lanes, uint64_t max_cycles);
+    void run_solo(size_t instance, uint64_t max_cycles);
+
+    size_t instances;
+    size_t blocks;
+    buffer program;
+    std::vector<decoded_instruction> decoded;
+    // Indexed by block * kBatchLanes + lane
+    std::vector<uint16_t> a;
+    std::vector<uint16_t> d;
+    std::vector<uint16_t> pc;
+    std::vector<uint64_t> cycles;
+    std::vector<uint8_t> is_halted;
+    // Instructions each instance ran during the current call to run
+    std::vector<uint64_t> ran;
+    // Indexed by (block * kRamSize + address) * kBatchLanes + lane
+    std::vector<uint16_t> ram;
+    Emulator solo;
+    batch_stats counters;
+};
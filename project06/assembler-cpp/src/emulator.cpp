@@ -0,0 +1,370 @@
+#include "emulator.h"
+
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <sstream>
+
+#include "profiler.h"
+
+namespace {
+
+// Polls a snapshot is kept for at most before it is replaced
+constexpr uint32_t kMaxPollInterval = 64;
+
+}
+
+tl::expected<buffer, std::string> parse_hack(const std::string& text) {
+    std::stringstream ss(text);
+    std::string line;
+    size_t line_number = 0;
+
+    buffer buf;
+    buf.reserve(1024);
+
+    while (std::getline(ss, line)) {
+        line_number += 1;
+
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            continue;
+        }
+
+        if (line.size() != 16) {
+            return tl::unexpected(fmt::format("Line {}: expected 16 binary digits, got '{}'", line_number, line));
+        }
+
+        uint16_t word = 0;
+        for (const char c : line) {
+            if (c != '0' && c != '1') {
+                return tl::unexpected(fmt::format("Line {}: invalid binary digit in '{}'", line_number, line));
+            }
+            word = (word << 1) | (c - '0');
+        }
+        buf.push_back(word);
+    }
+
+    if (buf.size() > kRomSize) {
+        return tl::unexpected(fmt::format("Program has {} words, ROM holds {}", buf.size(), kRomSize));
+    }
+    return buf;
+}
+
+std::vector<decoded_instruction> decode_rom(const buffer& program) {
+    std::vector<decoded_instruction> decoded(kRomSize);
+    for (size_t address = 0; address < kRomSize; address += 1) {
+        decoded[address] = decode_instruction(address < program.size() ? program[address] : 0);
+    }
+
+    // "(END) @END 0;JMP" never leaves its two instructions, so running it further is pointless
+    for (size_t address = 0; address + 1 < program.size(); address += 1) {
+        const decoded_instruction& at = decoded[address];
+        if (at.is_a && at.constant == address && is_unconditional_jump(program[address + 1])) {
+            decoded[address].halt = true;
+        }
+    }
+    return decoded;
+}
+
+Emulator::Emulator()
+    : cpu {}, is_halted(false), engine(emulator_engine::kDecoded), decoded(kRomSize, decode_instruction(0)), jit_verify(false), memory(kRamSize, 0),
+      fast_forward(true), snapshot { false, {}, {}, 0, 1 }, skipped(0), profiler(nullptr) {}
+
+tl::expected<void, std::string> Emulator::load(const buffer& program) {
+    if (program.size() > kRomSize) {
+        return tl::unexpected(fmt::format("Program has {} words, ROM holds {}", program.size(), kRomSize));
+    }
+
+    this->program = program;
+    decoded = decode_rom(program);
+    prepare_engines();
+    spdlog::debug("Loaded {} words of hack", program.size());
+
+    reset();
+    return {};
+}
+
+void Emulator::prepare_engines() {
+    for (size_t address = 0; address < program.size(); address += 1) {
+        decoded[address].poll = fast_forward && decoded[address].is_a && decoded[address].constant == kKeyboardAddress && !decoded[address].halt;
+    }
+
+    threaded.translate(decoded, program);
+    spdlog::debug("Threaded code uses {} handlers", threaded.handlers_used());
+
+    jit.load(decoded.data());
+}
+
+void Emulator::reset() {
+    cpu.pc = 0;
+    is_halted = false;
+    jit_failure.reset();
+    snapshot.valid = false;
+}
+
+void Emulator::set_engine(emulator_engine engine) {
+    this->engine = engine;
+}
+
+void Emulator::set_jit_verify(bool enabled) {
+    jit_verify = enabled;
+    jit.set_chaining(!enabled);
+}
+
+void Emulator::set_fast_forward(bool enabled) {
+    if (fast_forward != enabled) {
+        fast_forward = enabled;
+        snapshot.valid = false;
+        prepare_engines();
+    }
+}
+
+void Emulator::set_profiler(Profiler* profiler) {
+    this->profiler = profiler;
+}
+
+uint64_t Emulator::run(uint64_t max_cycles) {
+    // The engines stop in front of every @KBD and leave it to poll
+    uint64_t count = 0;
+    while (count < max_cycles) {
+        if (decoded[cpu.pc].poll) {
+            count += poll(max_cycles - count);
+            continue;
+        }
+        count += run_engine(max_cycles - count);
+        if (!decoded[cpu.pc].poll || jit_failure.has_value()) {
+            break;
+        }
+    }
+    return count;
+}
+
+// Between two calls to run nothing outside the CPU changes the machine, so it is deterministic: if A, D, PC and all
+// of RAM (the keyboard included) are what they were at an earlier @KBD, it is going round a loop of exactly that
+// many cycles, e.g. Fill repainting the screen with the same colour until a key is pressed, and will keep doing
+// so for the rest of the run. Whole rounds are then added to the cycle count without executing them. Comparing
+// RAM is only worth it when the registers match, and a program that never comes round again replaces its
+// snapshot less and less often
+uint64_t Emulator::poll(uint64_t max_cycles) {
+    uint64_t rounds = 0;
+    if (snapshot.valid && snapshot.cpu.pc == cpu.pc && snapshot.cpu.a == cpu.a && snapshot.cpu.d == cpu.d && snapshot.memory == memory) {
+        const uint64_t period = cpu.cycles - snapshot.cpu.cycles;
+        rounds = max_cycles / period * period;
+        cpu.cycles += rounds;
+        skipped += rounds;
+        snapshot.cpu.cycles = cpu.cycles;
+    } else if (!snapshot.valid || snapshot.visits_left == 0) {
+        snapshot.valid = true;
+        snapshot.cpu = cpu;
+        snapshot.memory = memory;
+        snapshot.visits_left = snapshot.interval;
+        snapshot.interval = std::min<uint32_t>(snapshot.interval * 2, kMaxPollInterval);
+    } else {
+        snapshot.visits_left -= 1;
+    }
+    if (rounds == max_cycles) {
+        return rounds;
+    }
+
+    // The @KBD itself
+    if (profiler != nullptr) {
+        profiler->count(cpu.pc);
+    }
+    cpu.a = kKeyboardAddress;
+    cpu.pc = (cpu.pc + 1) & kAddressMask;
+    cpu.cycles += 1;
+    return rounds + 1;
+}
+
+uint64_t Emulator::run_engine(uint64_t max_cycles) {
+    if (profiler != nullptr) {
+        return run_decoded<true>(max_cycles);
+    }
+    switch (engine) {
+        case emulator_engine::kJit:
+            if (jit.available()) {
+                return run_jit(max_cycles);
+            }
+            break;
+        case emulator_engine::kSwitch:
+            return run_switch(program, &cpu, memory.data(), max_cycles, &is_halted, fast_forward);
+        case emulator_engine::kComputedGoto:
+            return threaded.run<dispatch_mode::kComputedGoto>(&cpu, memory.data(), max_cycles, &is_halted);
+        case emulator_engine::kTailCall:
+            return threaded.run<dispatch_mode::kTailCall>(&cpu, memory.data(), max_cycles, &is_halted);
+        case emulator_engine::kDecoded:
+            break;
+    }
+    return run_decoded<false>(max_cycles);
+}
+
+template <bool Profile>
+uint64_t Emulator::run_decoded(uint64_t max_cycles) {
+    uint16_t a = cpu.a;
+    uint16_t d = cpu.d;
+    uint16_t pc = cpu.pc;
+    uint16_t* ram = memory.data();
+    const decoded_instruction* rom = decoded.data();
+
+    uint64_t count = 0;
+    while (count < max_cycles) {
+        const decoded_instruction& instr = rom[pc];
+
+        if (instr.is_a) {
+            if (instr.halt) {
+                is_halted = true;
+                break;
+            }
+            if (instr.poll) {
+                break;
+            }
+            if constexpr (Profile) {
+                profiler->count(pc);
+            }
+            a = instr.constant;
+            pc = (pc + 1) & kAddressMask;
+            count += 1;
+            continue;
+        }
+
+        if constexpr (Profile) {
+            profiler->count(pc);
+        }
+        const uint16_t address = a & kAddressMask;
+        const uint16_t out = alu_compute(instr.alu, d, instr.reads_m ? ram[address] : a);
+
+        // M is written to the address held in A before this instruction updates it
+        if ((instr.dest & kDestM) && address < kKeyboardAddress) {
+            ram[address] = out;
+        }
+        if (instr.dest & kDestD) {
+            d = out;
+        }
+        if (instr.dest & kDestA) {
+            a = out;
+        }
+
+        const bool taken = jump_taken(instr.jump, out);
+        if constexpr (Profile) {
+            if (taken) {
+                profiler->jump(pc, address);
+            }
+        }
+        pc = taken ? address : ((pc + 1) & kAddressMask);
+        count += 1;
+    }
+
+    cpu.a = a;
+    cpu.d = d;
+    cpu.pc = pc;
+    cpu.cycles += count;
+    return count;
+}
+
+uint64_t Emulator::run_jit(uint64_t max_cycles) {
+    uint64_t count = 0;
+    while (count < max_cycles && !is_halted && !jit_failure.has_value()) {
+        const uint64_t remaining = max_cycles - count;
+        const jit_block* block = jit.block(cpu.pc);
+
+        // Halt loops, budgets smaller than the block and a full code buffer are left to the interpreter
+        if (block == nullptr || block->cycles > remaining) {
+            const uint64_t executed = run_decoded<false>(1);
+            if (executed == 0 && !is_halted) {
+                break;
+            }
+            count += executed;
+            continue;
+        }
+
+        if (jit_verify) {
+            const uint64_t before = count;
+            if (!verify_block(block, remaining)) {
+                break;
+            }
+            count = before + block->cycles;
+            continue;
+        }
+        count += jit.execute(&cpu, memory.data(), block, remaining);
+    }
+
+    if (jit.available()) {
+        spdlog::debug("JIT compiled {} blocks into {} bytes", jit.blocks_compiled(), jit.code_size());
+    }
+    return count;
+}
+
+bool Emulator::verify_block(const jit_block* block, uint64_t max_cycles) {
+    const cpu_state start = cpu;
+    std::vector<uint16_t> native_ram = memory;
+
+    // Without chaining the native code stops at the end of this block
+    const uint64_t executed = jit.execute(&cpu, native_ram.data(), block, max_cycles);
+    const cpu_state native = cpu;
+
+    cpu = start;
+    run_decoded<false>(executed);
+
+    if (executed != block->cycles || cpu.a != native.a || cpu.d != native.d || cpu.pc != native.pc || memory != native_ram) {
+        size_t address = 0;
+        while (address < memory.size() && memory[address] == native_ram[address]) {
+            address += 1;
+        }
+        jit_failure = fmt::format("JIT block at {} ran {} of {} instructions: A={} D={} PC={}, interpreter A={} D={} PC={}{}",
+            start.pc, executed, block->cycles, native.a, native.d, native.pc, cpu.a, cpu.d, cpu.pc,
+            address < memory.size() ? fmt::format(", RAM[{}] = {} vs {}", address, native_ram[address], memory[address]) : "");
+        return false;
+    }
+    return true;
+}
+
+bool Emulator::halted() const {
+    return is_halted;
+}
+
+uint64_t Emulator::skipped_cycles() const {
+    return skipped;
+}
+
+const std::optional<std::string>& Emulator::jit_error() const {
+    return jit_failure;
+}
+
+uint16_t Emulator::read(uint16_t address) const {
+    return memory[address & kAddressMask];
+}
+
+void Emulator::write(uint16_t address, uint16_t value) {
+    memory[address & kAddressMask] = value;
+    snapshot.valid = false;
+}
+
+void Emulator::set_keyboard(uint16_t key) {
+    memory[kKeyboardAddress] = key;
+    snapshot.valid = false;
+}
+
+void Emulator::set_ram(const uint16_t* words) {
+    std::copy(words, words + kRamSize, memory.begin());
+    snapshot.valid = false;
+}
+
+const cpu_state& Emulator::state() const {
+    return cpu;
+}
+
+void Emulator::set_state(const cpu_state& state) {
+    cpu = state;
+    cpu.pc &= kAddressMask;
+    is_halted = false;
+    snapshot.valid = false;
+}
+
+const buffer& Emulator::rom() const {
+    return program;
+}
+
+const std::vector<uint16_t>& Emulator::ram() const {
+    return memory;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+#include <tl/expected.hpp>
+
+#include "assembler.h"
+#include "hackcpu.h"
+#include "jit.h"
+#include "threaded.h"
+
+class Profiler;
+
+enum class emulator_engine {
+    kDecoded,
+    kSwitch,
+    kComputedGoto,
+    kTailCall,
+    kJit,
+};
+
+// Reads a .hack file: one 16 character binary word per line
+tl::expected<buffer, std::string> parse_hack(const std::string& text);
+
+// The whole ROM decoded, with the halt loops of the program marked
+std::vector<decoded_instruction> decode_rom(const buffer& program);
+
+// The Hack computer of project05 (CPU, ROM32K and Memory) running a pre-decoded ROM
+class Emulator {
+public:
+    Emulator();
+
+    tl::expected<void, std::string> load(const buffer& program);
+    void reset();
+    void set_engine(emulator_engine engine);
+
+    // Runs every JIT block on a copy of the machine and checks the interpreter ends in the same state
+    void set_jit_verify(bool enabled);
+
+    // Skips the rounds of a program that waits for the keyboard without changing anything, see poll. On by default
+    void set_fast_forward(bool enabled);
+
+    // Runs every instruction through the decoded interpreter and tells the profiler about it, or stops with nullptr.
+    // Rounds that fast-forwarding skips are not profiled
+    void set_profiler(Profiler* profiler);
+
+    // Executes up to max_cycles instructions, stopping early at a halt loop; returns instructions run, including skipped ones
+    uint64_t run(uint64_t max_cycles);
+    bool halted() const;
+    // Cycles that fast-forwarding counted without executing them
+    uint64_t skipped_cycles() const;
+
+    // Set when JIT verification found a block that disagrees with the interpreter
+    const std::optional<std::string>& jit_error() const;
+
+    uint16_t read(uint16_t address) const;
+    void write(uint16_t address, uint16_t value);
+    void set_keyboard(uint16_t key);
+    // Overwrites all kRamSize words of RAM, e.g. from a snapshot
+    void set_ram(const uint16_t* words);
+
+    const cpu_state& state() const;
+
+    // Overwrites A, D, PC and the cycle count, e.g. for "set PC 0" in a test script; clears the halt flag
+    void set_state(const cpu_state& state);
+    const buffer& rom() const;
+    const std::vector<uint16_t>& ram() const;
+
+private:
+    // The machine as it was at one @KBD, to recognise it coming round to the same state again
+    struct poll_snapshot {
+        bool valid;
+        cpu_state cpu;
+        std::vector<uint16_t> memory;
+        // Polls left before the snapshot is replaced, and how many the next one is kept for
+        uint32_t visits_left;
+        uint32_t interval;
+    };
+
+    void prepare_engines();
+    uint64_t poll(uint64_t max_cycles);
+    uint64_t run_engine(uint64_t max_cycles);
+    template <bool Profile>
+    uint64_t run_decoded(uint64_t max_cycles);
+    uint64_t run_jit(uint64_t max_cycles);
+    bool verify_block(const jit_block* block, uint64_t max_cycles);
+
+    cpu_state cpu;
+    bool is_halted;
+    emulator_engine engine;
+    buffer program;
+    std::vector<decoded_instruction> decoded;
+    ThreadedCode threaded;
+    JitCompiler jit;
+    bool jit_verify;
+    std::optional<std::string> jit_failure;
+    std::vector<uint16_t> memory;
+    bool fast_forward;
+    poll_snapshot snapshot;
+    uint64_t skipped;
+    Profiler* profiler;
+};
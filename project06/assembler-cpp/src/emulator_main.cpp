@@ -0,0 +1,692 @@
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <argparse/argparse.hpp>
+#include <tl/expected.hpp>
+#include <charconv>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <thread>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "assembler.h"
+#include "batch.h"
+#include "emulator.h"
+#include "framebuffer.h"
+#include "profiler.h"
+#include "snapshot.h"
+#include "sourcemap.h"
+#include "tooling.h"
+
+tl::expected<int64_t, std::string> parse_number(std::string_view str) {
+    int64_t value = 0;
+    const auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+    if (ec != std::errc() || ptr != str.data() + str.size()) {
+        return tl::unexpected(fmt::format("Invalid number: {}", str));
+    }
+    return value;
+}
+
+// Parses "ADDR=VALUE,ADDR=VALUE" into RAM writes
+tl::expected<std::vector<std::pair<uint16_t, uint16_t>>, std::string> parse_ram_values(std::string_view str) {
+    std::vector<std::pair<uint16_t, uint16_t>> values;
+    while (!str.empty()) {
+        const auto comma = str.find(',');
+        const std::string_view item = str.substr(0, comma);
+        str = comma == std::string_view::npos ? std::string_view() : str.substr(comma + 1);
+
+        const auto eq = item.find('=');
+        if (eq == std::string_view::npos) {
+            return tl::unexpected(fmt::format("Expected ADDR=VALUE, got '{}'", item));
+        }
+
+        const auto address = parse_number(item.substr(0, eq));
+        const auto value = parse_number(item.substr(eq + 1));
+        if (!address.has_value() || !value.has_value()) {
+            return tl::unexpected(fmt::format("Expected ADDR=VALUE, got '{}'", item));
+        }
+        values.emplace_back(address.value(), value.value());
+    }
+    return values;
+}
+
+// Parses "BEGIN-END" or a single address into an inclusive range
+tl::expected<std::pair<uint16_t, uint16_t>, std::string> parse_ram_range(std::string_view str) {
+    const auto dash = str.find('-');
+    const auto begin = parse_number(str.substr(0, dash));
+    const auto end = dash == std::string_view::npos ? begin : parse_number(str.substr(dash + 1));
+    if (!begin.has_value() || !end.has_value() || begin.value() < 0 || begin.value() > end.value() || end.value() >= kRamSize) {
+        return tl::unexpected(fmt::format("Invalid RAM range: {}", str));
+    }
+    return std::make_pair(static_cast<uint16_t>(begin.value()), static_cast<uint16_t>(end.value()));
+}
+
+struct ram_sweep {
+    uint16_t address;
+    int64_t begin;
+    int64_t end;
+};
+
+// Parses "ADDR=BEGIN-END": one run for every value of RAM[ADDR] from BEGIN to END
+tl::expected<ram_sweep, std::string> parse_sweep(std::string_view str) {
+    const auto eq = str.find('=');
+    const auto dash = eq == std::string_view::npos ? eq : str.find('-', eq + 2);
+    if (dash == std::string_view::npos) {
+        return tl::unexpected(fmt::format("Expected ADDR=BEGIN-END, got '{}'", str));
+    }
+    const auto address = parse_number(str.substr(0, eq));
+    const auto begin = parse_number(str.substr(eq + 1, dash - eq - 1));
+    const auto end = parse_number(str.substr(dash + 1));
+    if (!address.has_value() || !begin.has_value() || !end.has_value() || address.value() < 0 || address.value() >= kRamSize
+        || begin.value() < INT16_MIN || end.value() > UINT16_MAX || begin.value() > end.value()) {
+        return tl::unexpected(fmt::format("Invalid sweep: {}", str));
+    }
+    return ram_sweep { static_cast<uint16_t>(address.value()), begin.value(), end.value() };
+}
+
+tl::expected<emulator_engine, std::string> parse_engine(const std::string& name) {
+    if (name == "decoded") {
+        return emulator_engine::kDecoded;
+    } else if (name == "switch") {
+        return emulator_engine::kSwitch;
+    } else if (name == "goto") {
+        return emulator_engine::kComputedGoto;
+    } else if (name == "tailcall") {
+        return emulator_engine::kTailCall;
+    } else if (name == "jit") {
+        return emulator_engine::kJit;
+    }
+    return tl::unexpected(fmt::format("Invalid engine \"{}\" - allowed options: {{decoded, switch, goto, tailcall, jit}}", name));
+}
+
+// Assembly also gives the address of every label
+tl::expected<buffer, std::string> load_program(const std::filesystem::path& filepath, std::map<std::string, uint16_t>* labels) {
+    std::ifstream file(filepath, std::ios::in);
+    const auto contents = get_file_contents(file);
+    if (!contents.has_value()) {
+        return tl::unexpected(contents.error());
+    }
+
+    if (filepath.extension() == ".asm") {
+        spdlog::info("Assembling file: {}", filepath.string());
+        Assembler assembler(contents.value());
+        auto program = assembler.parse();
+        *labels = assembler.labels();
+        return program;
+    }
+
+    return parse_hack(contents.value());
+}
+
+struct variant {
+    std::string line;
+    std::vector<std::pair<uint16_t, uint16_t>> values;
+};
+
+// One variant per line in the format of --set; blank lines are skipped
+tl::expected<std::vector<variant>, std::string> load_variants(const std::filesystem::path& filepath) {
+    std::ifstream file(filepath, std::ios::in);
+    const auto contents = get_file_contents(file);
+    if (!contents.has_value()) {
+        return tl::unexpected(fmt::format("Cannot read {}: {}", filepath.string(), contents.error()));
+    }
+
+    std::vector<variant> variants;
+    std::istringstream lines(contents.value());
+    std::string line;
+    for (size_t line_number = 1; std::getline(lines, line); line_number += 1) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            continue;
+        }
+        const auto values = parse_ram_values(line);
+        if (!values.has_value()) {
+            return tl::unexpected(fmt::format("{}:{}: {}", filepath.string(), line_number, values.error()));
+        }
+        variants.push_back(variant { line, values.value() });
+    }
+    return variants;
+}
+
+// The result line of one variant: the dumped RAM words, then the instructions it ran
+std::string describe_variant(const variant& run, const Emulator& emulator, uint64_t executed, const std::optional<std::pair<uint16_t, uint16_t>>& dump_range) {
+    std::string text = fmt::format("{}:", run.line);
+    if (dump_range.has_value()) {
+        for (uint32_t address = dump_range->first; address <= dump_range->second; address += 1) {
+            text += fmt::format(" {}", static_cast<int16_t>(emulator.read(address)));
+        }
+    }
+    return text + fmt::format(" ({} cycles{})\n", executed, emulator.halted() ? ", halted" : "");
+}
+
+// Runs every variant in a child forked from the emulator as it is now. The children share its RAM and compiled code
+// copy-on-write, so none of them repeats whatever ran before; at most jobs run at a time, and their results are
+// printed in the order of the variants
+tl::expected<void, std::string> run_variants(Emulator& emulator, const std::vector<variant>& variants, uint64_t cycles, size_t jobs,
+                                             const std::optional<std::pair<uint16_t, uint16_t>>& dump_range) {
+    struct child {
+        pid_t pid;
+        int fd;
+    };
+    std::deque<child> running;
+
+    // Collects the output of the oldest child
+    auto finish = [&] () -> tl::expected<void, std::string> {
+        const child oldest = running.front();
+        running.pop_front();
+        std::string output;
+        char chunk[4096];
+        for (ssize_t got; (got = ::read(oldest.fd, chunk, sizeof(chunk))) != 0; ) {
+            if (got < 0 && errno != EINTR) {
+                break;
+            }
+            output.append(chunk, std::max<ssize_t>(got, 0));
+        }
+        ::close(oldest.fd);
+        int status = 0;
+        if (waitpid(oldest.pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            return tl::unexpected(fmt::format("Variant run {} failed: {}", oldest.pid, output));
+        }
+        std::cout << output;
+        return {};
+    };
+
+    std::cout.flush();
+    for (const variant& run : variants) {
+        if (running.size() >= jobs) {
+            if (auto result = finish(); !result.has_value()) {
+                return result;
+            }
+        }
+
+        int fds[2];
+        if (pipe(fds) != 0) {
+            return tl::unexpected(fmt::format("Cannot create pipe: {}", std::strerror(errno)));
+        }
+        const pid_t pid = fork();
+        if (pid < 0) {
+            ::close(fds[0]);
+            ::close(fds[1]);
+            return tl::unexpected(fmt::format("Cannot fork: {}", std::strerror(errno)));
+        }
+        if (pid == 0) {
+            ::close(fds[0]);
+            for (const auto& [address, value] : run.values) {
+                emulator.write(address, value);
+            }
+            const uint64_t executed = emulator.run(cycles);
+            const std::string text = emulator.jit_error().has_value() ? emulator.jit_error().value() : describe_variant(run, emulator, executed, dump_range);
+            for (size_t written = 0; written < text.size(); ) {
+                const ssize_t put = ::write(fds[1], text.data() + written, text.size() - written);
+                if (put < 0 && errno != EINTR) {
+                    _exit(1);
+                }
+                written += std::max<ssize_t>(put, 0);
+            }
+            _exit(emulator.jit_error().has_value() ? 1 : 0);
+        }
+        ::close(fds[1]);
+        running.push_back(child { pid, fds[0] });
+    }
+    while (!running.empty()) {
+        if (auto result = finish(); !result.has_value()) {
+            return result;
+        }
+    }
+    return {};
+}
+
+int main(int argc, char* argv[]) {
+    auto logger = spdlog::stderr_color_mt("stderr");
+    spdlog::set_default_logger(logger);
+    spdlog::set_level(spdlog::level::info);
+
+    argparse::ArgumentParser program("emulator-cpp", "0.0.1");
+
+    program.add_argument("-l", "--log-level")
+        .help("Set verbosity for logging")
+        .default_value(std::string("info"))
+        .metavar("LEVEL")
+        .nargs(1);
+
+    program.add_argument("-n", "--cycles")
+        .help("Maximum number of instructions to execute")
+        .metavar("CYCLES")
+        .default_value(std::string("100000000"));
+
+    program.add_argument("--set")
+        .help("Initial RAM values, e.g. 0=256,1=300")
+        .metavar("VALUES")
+        .default_value("");
+
+    program.add_argument("--keyboard")
+        .help("Key code held down for the whole run")
+        .metavar("KEY")
+        .default_value(std::string("0"));
+
+    program.add_argument("--dump")
+        .help("RAM range to print after the run, e.g. 0-15")
+        .metavar("RANGE")
+        .default_value("");
+
+    program.add_argument("--engine")
+        .help("Execution engine: decoded, switch, goto, tailcall or jit")
+        .metavar("ENGINE")
+        .default_value(std::string("goto"));
+
+    program.add_argument("--benchmark")
+        .help("Run the program on every engine and check they end in the same state")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--jit-verify")
+        .help("Check every JIT block against the interpreter")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--no-fast-forward")
+        .help("Execute every round of a program waiting for the keyboard instead of skipping them")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--save-snapshot")
+        .help("Save the machine after the run to a snapshot that can be run again in place of a program")
+        .metavar("PATH")
+        .default_value(std::string(""));
+
+    program.add_argument("--variants")
+        .help("After the run, fork one run per line of the file from the machine as it is, each line RAM values as for --set")
+        .metavar("FILE")
+        .default_value(std::string(""));
+
+    program.add_argument("--variant-cycles")
+        .help("Maximum number of instructions each variant executes")
+        .metavar("CYCLES")
+        .default_value(std::string("100000000"));
+
+    program.add_argument("--jobs")
+        .help("Variants run at the same time; 0 for one per CPU")
+        .metavar("N")
+        .default_value(std::string("0"));
+
+    program.add_argument("--profile")
+        .help("Profile the run: write folded call stacks for a flame graph to PATH and print the hot blocks and functions")
+        .metavar("PATH")
+        .default_value(std::string(""));
+
+    program.add_argument("--profile-top")
+        .help("Number of hot blocks to print when profiling")
+        .metavar("N")
+        .default_value(std::string("20"));
+
+    program.add_argument("--source-map")
+        .help("Source map the VM translator wrote for the program, to name hot blocks and where the run stopped by source line")
+        .metavar("PATH")
+        .default_value(std::string(""));
+
+    program.add_argument("--sweep")
+        .help("Run one machine for every value of a RAM word, stepping them together, e.g. 0=1-1000")
+        .metavar("ADDR=BEGIN-END")
+        .default_value(std::string(""));
+
+    program.add_argument("--frame")
+        .help("Image of the screen to write after the run: .ppm, or packed bits (PBM) for any other name")
+        .metavar("PATH")
+        .default_value(std::string(""));
+
+    program.add_argument("--share-screen")
+        .help("Publish the screen in shared memory for a viewer to map while the program runs")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--frame-interval")
+        .help("Instructions between two frames of the shared screen")
+        .metavar("CYCLES")
+        .default_value(std::string("1000000"));
+
+    program.add_argument("filename")
+        .help("Program to run (.hack, .asm to assemble first, or a .snap snapshot to resume)")
+        .metavar("FILENAME")
+        .nargs(1);
+
+    auto args_error = [&] (const std::string& message) {
+        std::cerr << message << std::endl;
+        std::cerr << program;
+        return 1;
+    };
+
+    try {
+        program.parse_args(argc, argv);
+    } catch(const std::exception& err) {
+        return args_error(err.what());
+    }
+
+    const std::string level = program.get("--log-level");
+    if (auto result = set_logging_level(level); !result.has_value()) {
+        return args_error(result.error());
+    }
+
+    const auto cycles = parse_number(program.get("--cycles"));
+    const auto frame_interval = parse_number(program.get("--frame-interval"));
+    const auto variant_cycles = parse_number(program.get("--variant-cycles"));
+    const auto jobs = parse_number(program.get("--jobs"));
+    const auto profile_top = parse_number(program.get("--profile-top"));
+    const auto keyboard = parse_number(program.get("--keyboard"));
+    const auto ram_values = parse_ram_values(program.get("--set"));
+    if (!cycles.has_value() || cycles.value() < 0) {
+        return args_error(fmt::format("Invalid cycle count: {}", program.get("--cycles")));
+    }
+    if (!frame_interval.has_value() || frame_interval.value() <= 0) {
+        return args_error(fmt::format("Invalid frame interval: {}", program.get("--frame-interval")));
+    }
+    if (!variant_cycles.has_value() || variant_cycles.value() < 0) {
+        return args_error(fmt::format("Invalid cycle count: {}", program.get("--variant-cycles")));
+    }
+    if (!jobs.has_value() || jobs.value() < 0) {
+        return args_error(fmt::format("Invalid number of jobs: {}", program.get("--jobs")));
+    }
+    if (!profile_top.has_value() || profile_top.value() < 0) {
+        return args_error(fmt::format("Invalid number of blocks: {}", program.get("--profile-top")));
+    }
+    if (!keyboard.has_value()) {
+        return args_error(keyboard.error());
+    }
+    if (!ram_values.has_value()) {
+        return args_error(ram_values.error());
+    }
+
+    const auto engine = parse_engine(program.get("--engine"));
+    if (!engine.has_value()) {
+        return args_error(engine.error());
+    }
+
+    std::optional<std::pair<uint16_t, uint16_t>> dump_range;
+    if (const std::string dump = program.get("--dump"); !dump.empty()) {
+        const auto range = parse_ram_range(dump);
+        if (!range.has_value()) {
+            return args_error(range.error());
+        }
+        dump_range = range.value();
+    }
+
+    std::optional<ram_sweep> sweep;
+    if (const std::string text = program.get("--sweep"); !text.empty()) {
+        const auto parsed = parse_sweep(text);
+        if (!parsed.has_value()) {
+            return args_error(parsed.error());
+        }
+        sweep = parsed.value();
+    }
+
+    const std::filesystem::path filepath(program.get("filename"));
+    spdlog::info("Reading file: {}", filepath.string());
+
+    // A snapshot brings its own ROM and replaces the machine once that is loaded
+    Snapshot snapshot;
+    const bool from_snapshot = filepath.extension() == ".snap";
+    if (from_snapshot) {
+        if (auto result = snapshot.open(filepath); !result.has_value()) {
+            spdlog::error("Failed to load program: {}", result.error());
+            return 1;
+        }
+    }
+    std::map<std::string, uint16_t> labels;
+    const auto rom = from_snapshot ? tl::expected<buffer, std::string>(snapshot.rom()) : load_program(filepath, &labels);
+    if (!rom.has_value()) {
+        spdlog::error("Failed to load program: {}", rom.error());
+        return 1;
+    }
+
+    std::vector<variant> variants;
+    if (const std::string path = program.get("--variants"); !path.empty()) {
+        auto loaded = load_variants(path);
+        if (!loaded.has_value()) {
+            spdlog::error("{}", loaded.error());
+            return 1;
+        }
+        variants = std::move(loaded.value());
+    }
+
+    auto prepare = [&] (Emulator& emulator, emulator_engine engine) -> tl::expected<void, std::string> {
+        emulator.set_fast_forward(!program.get<bool>("--no-fast-forward"));
+        if (auto result = emulator.load(rom.value()); !result.has_value()) {
+            return result;
+        }
+        if (from_snapshot) {
+            const auto start = std::chrono::steady_clock::now();
+            if (auto result = snapshot.restore(emulator); !result.has_value()) {
+                return result;
+            }
+            spdlog::debug("Restored the machine at cycle {} in {:.1f} us", snapshot.state().cycles,
+                std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        }
+        for (const auto& [address, value] : ram_values.value()) {
+            emulator.write(address, value);
+        }
+        emulator.set_keyboard(keyboard.value());
+        emulator.set_engine(engine);
+        emulator.set_jit_verify(program.get<bool>("--jit-verify"));
+        return {};
+    };
+
+    if (sweep.has_value()) {
+        const size_t count = sweep->end - sweep->begin + 1;
+        BatchEmulator batch(count);
+        if (auto result = batch.load(rom.value()); !result.has_value()) {
+            spdlog::error("Failed to load program: {}", result.error());
+            return 1;
+        }
+        for (size_t instance = 0; instance < count; instance += 1) {
+            if (from_snapshot) {
+                batch.set_state(instance, snapshot.state());
+                for (uint32_t address = 0; address < kRamSize; address += 1) {
+                    batch.write(instance, address, snapshot.ram()[address]);
+                }
+            }
+            for (const auto& [address, value] : ram_values.value()) {
+                batch.write(instance, address, value);
+            }
+            batch.write(instance, sweep->address, sweep->begin + instance);
+            batch.write(instance, kKeyboardAddress, keyboard.value());
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        batch.run(cycles.value());
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const batch_stats& stats = batch.stats();
+        const uint64_t executed = stats.lockstep_cycles + stats.solo_cycles;
+        spdlog::info("Batch of {}: executed {} instructions in {:.3f} s ({:.1f} MIPS), {:.1f}% in lockstep, {} divergences", count, executed, seconds,
+            seconds > 0 ? executed / seconds / 1e6 : 0.0, executed > 0 ? 100.0 * stats.lockstep_cycles / executed : 0.0, stats.divergences);
+
+        if (program.get<bool>("--benchmark")) {
+            const auto scalar_start = std::chrono::steady_clock::now();
+            for (size_t instance = 0; instance < count; instance += 1) {
+                Emulator other;
+                if (auto result = prepare(other, engine.value()); !result.has_value()) {
+                    spdlog::error("Failed to load program: {}", result.error());
+                    return 1;
+                }
+                other.write(sweep->address, sweep->begin + instance);
+                other.run(cycles.value());
+
+                const cpu_state expected = other.state();
+                const cpu_state actual = batch.state(instance);
+                bool same_ram = true;
+                for (uint32_t address = 0; address < kRamSize; address += 1) {
+                    same_ram &= batch.read(instance, address) == other.read(address);
+                }
+                if (actual.a != expected.a || actual.d != expected.d || actual.pc != expected.pc || actual.cycles != expected.cycles || !same_ram
+                    || batch.halted(instance) != other.halted()) {
+                    spdlog::error("Batch machine {} diverged: A={} D={} PC={} after {} cycles, expected A={} D={} PC={} after {}", instance,
+                        actual.a, actual.d, actual.pc, actual.cycles, expected.a, expected.d, expected.pc, expected.cycles);
+                    return 1;
+                }
+            }
+            spdlog::info("{}: ran the {} machines one by one in {:.3f} s", program.get("--engine"), count,
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - scalar_start).count());
+        }
+
+        if (dump_range.has_value()) {
+            for (size_t instance = 0; instance < count; instance += 1) {
+                std::cout << fmt::format("RAM[{}] = {}:", sweep->address, sweep->begin + static_cast<int64_t>(instance));
+                for (uint32_t address = dump_range->first; address <= dump_range->second; address += 1) {
+                    std::cout << fmt::format(" {}", static_cast<int16_t>(batch.read(instance, address)));
+                }
+                std::cout << '\n';
+            }
+        }
+        return 0;
+    }
+
+    // Only the emulator that runs first draws frames
+    const std::filesystem::path frame_path(program.get("--frame"));
+    std::optional<Framebuffer> framebuffer;
+    if (!frame_path.empty() || program.get<bool>("--share-screen")) {
+        framebuffer.emplace();
+    }
+    if (program.get<bool>("--share-screen")) {
+        const auto fd = framebuffer->share();
+        if (!fd.has_value()) {
+            spdlog::error("{}", fd.error());
+            return 1;
+        }
+        spdlog::info("Screen shared at /proc/{}/fd/{}", getpid(), fd.value());
+    }
+
+    auto timed_run = [&] (Emulator& emulator, const std::string& name, Framebuffer* frames) {
+        const auto start = std::chrono::steady_clock::now();
+        uint64_t cycles_run = 0;
+        if (frames == nullptr) {
+            cycles_run = emulator.run(cycles.value());
+        } else {
+            // The run is cut into slices with a frame after each
+            while (cycles_run < static_cast<uint64_t>(cycles.value())) {
+                const uint64_t slice = emulator.run(std::min<uint64_t>(frame_interval.value(), cycles.value() - cycles_run));
+                cycles_run += slice;
+                frames->update(emulator.ram().data() + kScreenAddress, emulator.state().cycles);
+                if (slice == 0 || emulator.halted() || emulator.jit_error().has_value()) {
+                    break;
+                }
+            }
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        // Cycles skipped while the program waited for the keyboard count towards the run but not towards MIPS
+        const uint64_t executed = cycles_run - emulator.skipped_cycles();
+        spdlog::info("{}: executed {} instructions in {:.3f} s ({:.1f} MIPS){}{}", name, executed, seconds, seconds > 0 ? executed / seconds / 1e6 : 0.0,
+            emulator.skipped_cycles() > 0 ? fmt::format(", skipped {} idle cycles", emulator.skipped_cycles()) : "", emulator.halted() ? ", halted" : "");
+        if (emulator.jit_error().has_value()) {
+            spdlog::error("{}", emulator.jit_error().value());
+            return false;
+        }
+        return true;
+    };
+
+    Emulator emulator;
+    if (auto result = prepare(emulator, engine.value()); !result.has_value()) {
+        spdlog::error("Failed to load program: {}", result.error());
+        return 1;
+    }
+
+    std::optional<SourceMap> source_map;
+    if (const std::string path = program.get("--source-map"); !path.empty()) {
+        if (auto result = source_map.emplace().load(path); !result.has_value()) {
+            spdlog::error("{}", result.error());
+            return 1;
+        }
+    }
+
+    // Profiles every cycle, so nothing is fast-forwarded
+    const std::filesystem::path profile_path(program.get("--profile"));
+    std::optional<Profiler> profiler;
+    if (!profile_path.empty()) {
+        profiler.emplace(rom.value(), labels);
+        if (source_map.has_value()) {
+            profiler->set_source_map(&source_map.value());
+        }
+        emulator.set_fast_forward(false);
+        emulator.set_profiler(&profiler.value());
+    }
+    if (!timed_run(emulator, program.get("--engine"), framebuffer.has_value() ? &framebuffer.value() : nullptr)) {
+        return 1;
+    }
+    if (source_map.has_value()) {
+        const uint16_t pc = emulator.state().pc;
+        const std::string source = source_map->describe(pc);
+        spdlog::info("Stopped at PC {}{}", pc, source.empty() ? "" : fmt::format(", {}", source));
+    }
+    if (!frame_path.empty()) {
+        if (auto result = framebuffer->write(frame_path, frame_format_for(frame_path)); !result.has_value()) {
+            spdlog::error("{}", result.error());
+            return 1;
+        }
+    }
+
+    if (profiler.has_value()) {
+        emulator.set_profiler(nullptr);
+        std::ofstream folded(profile_path, std::ios::out | std::ios::trunc);
+        profiler->write_folded(folded);
+        folded.close();
+        if (!folded) {
+            spdlog::error("Failed to write {}", profile_path.string());
+            return 1;
+        }
+        profiler->write_report(std::cout, profile_top.value());
+        spdlog::info("Wrote the call stacks of {} cycles to {}", profiler->total_cycles(), profile_path.string());
+    }
+
+    if (program.get<bool>("--benchmark")) {
+        for (const std::string name : { "decoded", "switch", "goto", "tailcall", "jit" }) {
+            Emulator other;
+            if (auto result = prepare(other, parse_engine(name).value()); !result.has_value()) {
+                spdlog::error("Failed to load program: {}", result.error());
+                return 1;
+            }
+            if (!timed_run(other, name, nullptr)) {
+                return 1;
+            }
+
+            const cpu_state& expected = emulator.state();
+            const cpu_state& actual = other.state();
+            if (actual.a != expected.a || actual.d != expected.d || actual.pc != expected.pc || actual.cycles != expected.cycles || other.ram() != emulator.ram()) {
+                spdlog::error("Engine {} diverged: A={} D={} PC={} after {} cycles, expected A={} D={} PC={} after {}", name, actual.a, actual.d, actual.pc, actual.cycles, expected.a, expected.d, expected.pc, expected.cycles);
+                return 1;
+            }
+        }
+    }
+
+    if (const std::string path = program.get("--save-snapshot"); !path.empty()) {
+        if (auto result = save_snapshot(emulator, path); !result.has_value()) {
+            spdlog::error("{}", result.error());
+            return 1;
+        }
+        spdlog::info("Saved the machine at cycle {} to {}", emulator.state().cycles, path);
+    }
+
+    if (!variants.empty()) {
+        const size_t parallel = jobs.value() > 0 ? jobs.value() : std::max(1u, std::thread::hardware_concurrency());
+        const auto start = std::chrono::steady_clock::now();
+        if (auto result = run_variants(emulator, variants, variant_cycles.value(), parallel, dump_range); !result.has_value()) {
+            spdlog::error("{}", result.error());
+            return 1;
+        }
+        spdlog::info("Ran {} variants from cycle {} in {:.3f} s", variants.size(), emulator.state().cycles,
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        return 0;
+    }
+
+    if (dump_range.has_value()) {
+        for (uint32_t address = dump_range->first; address <= dump_range->second; address += 1) {
+            std::cout << fmt::format("RAM[{}] = {}\n", address, static_cast<int16_t>(emulator.read(address)));
+        }
+    }
+
+    return 0;
+}
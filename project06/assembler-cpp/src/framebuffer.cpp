@@ -0,0 +1,184 @@
+#include "framebuffer.h"
+
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <new>
+
+#if defined(__linux__)
+#define HACK_FRAMEBUFFER_MEMFD 1
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+constexpr uint32_t kMagic = 0x42464b48; // "HKFB"
+// The pixels start on a cache line of their own
+constexpr size_t kPixelsOffset = 64;
+constexpr size_t kRegionSize = kPixelsOffset + kScreenHeight * kScreenRowBytes;
+
+static_assert(sizeof(framebuffer_header) <= kPixelsOffset);
+static_assert(kScreenHeight * kScreenRowWords == kScreenSize);
+
+// SCREEN keeps the leftmost of 16 pixels in the low bit, PBM in the high bit of each byte
+constexpr std::array<uint8_t, 256> make_reversed() {
+    std::array<uint8_t, 256> table {};
+    for (uint32_t byte = 0; byte < 256; byte += 1) {
+        uint8_t reversed = 0;
+        for (uint32_t bit = 0; bit < 8; bit += 1) {
+            reversed |= ((byte >> bit) & 1) << (7 - bit);
+        }
+        table[byte] = reversed;
+    }
+    return table;
+}
+
+constexpr std::array<uint8_t, 256> kReversed = make_reversed();
+
+}
+
+Framebuffer::Framebuffer()
+    : region(new uint8_t[kRegionSize]()), region_size(kRegionSize), fd(-1), shadow(kScreenSize, 0),
+      rgb(kScreenWidth * kScreenHeight * 3, 0xff) {
+    // A blank screen is all zeros, and so is the image of one
+    head = new (region) framebuffer_header { kMagic, kScreenWidth, kScreenHeight, {}, {}, 0 };
+    packed = region + kPixelsOffset;
+}
+
+Framebuffer::~Framebuffer() {
+    head->~framebuffer_header();
+#if HACK_FRAMEBUFFER_MEMFD
+    if (fd >= 0) {
+        munmap(region, region_size);
+        ::close(fd);
+        return;
+    }
+#endif
+    delete[] region;
+}
+
+tl::expected<int, std::string> Framebuffer::share() {
+#if HACK_FRAMEBUFFER_MEMFD
+    if (fd >= 0) {
+        return fd;
+    }
+    const int shared_fd = memfd_create("hack-screen", MFD_CLOEXEC);
+    if (shared_fd < 0) {
+        return tl::unexpected(fmt::format("Cannot create shared screen: {}", std::strerror(errno)));
+    }
+    if (ftruncate(shared_fd, kRegionSize) != 0) {
+        const std::string error = std::strerror(errno);
+        ::close(shared_fd);
+        return tl::unexpected(fmt::format("Cannot size shared screen: {}", error));
+    }
+    void* mapped = mmap(nullptr, kRegionSize, PROT_READ | PROT_WRITE, MAP_SHARED, shared_fd, 0);
+    if (mapped == MAP_FAILED) {
+        const std::string error = std::strerror(errno);
+        ::close(shared_fd);
+        return tl::unexpected(fmt::format("Cannot map shared screen: {}", error));
+    }
+
+    uint8_t* shared = static_cast<uint8_t*>(mapped);
+    std::memcpy(shared + kPixelsOffset, packed, kScreenHeight * kScreenRowBytes);
+    framebuffer_header* shared_head = new (shared) framebuffer_header { kMagic, kScreenWidth, kScreenHeight, {}, {}, head->cycles };
+    std::copy(std::begin(head->dirty), std::end(head->dirty), shared_head->dirty);
+    shared_head->sequence.store(head->sequence.load(std::memory_order_relaxed), std::memory_order_release);
+
+    head->~framebuffer_header();
+    delete[] region;
+    region = shared;
+    fd = shared_fd;
+    head = shared_head;
+    packed = region + kPixelsOffset;
+    return fd;
+#else
+    return tl::unexpected(std::string("Sharing the screen needs memfd, which this platform does not have"));
+#endif
+}
+
+uint32_t Framebuffer::update(const uint16_t* screen, uint64_t cycles) {
+    const uint32_t sequence = head->sequence.load(std::memory_order_relaxed);
+    head->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    uint32_t changed = 0;
+    std::fill(std::begin(head->dirty), std::end(head->dirty), 0);
+    for (uint32_t row = 0; row < kScreenHeight; row += 1) {
+        const uint16_t* words = screen + row * kScreenRowWords;
+        uint16_t* previous = shadow.data() + row * kScreenRowWords;
+        if (std::equal(words, words + kScreenRowWords, previous)) {
+            continue;
+        }
+        std::copy(words, words + kScreenRowWords, previous);
+        convert_row(row, words);
+        head->dirty[row / 32] |= 1u << (row % 32);
+        rgb_stale.set(row);
+        changed += 1;
+    }
+    head->cycles = cycles;
+
+    head->sequence.store(sequence + 2, std::memory_order_release);
+    spdlog::trace("Frame at cycle {} changed {} rows", cycles, changed);
+    return changed;
+}
+
+void Framebuffer::convert_row(uint32_t row, const uint16_t* words) {
+    uint8_t* out = packed + row * kScreenRowBytes;
+    for (uint32_t word = 0; word < kScreenRowWords; word += 1) {
+        out[word * 2] = kReversed[words[word] & 0xff];
+        out[word * 2 + 1] = kReversed[words[word] >> 8];
+    }
+}
+
+void Framebuffer::refresh_rgb() {
+    for (uint32_t row = 0; row < kScreenHeight; row += 1) {
+        if (!rgb_stale.test(row)) {
+            continue;
+        }
+        const uint8_t* bits = packed + row * kScreenRowBytes;
+        uint8_t* out = rgb.data() + row * kScreenWidth * 3;
+        for (uint32_t x = 0; x < kScreenWidth; x += 1) {
+            const uint8_t shade = (bits[x / 8] >> (7 - x % 8)) & 1 ? 0x00 : 0xff;
+            std::fill(out + x * 3, out + x * 3 + 3, shade);
+        }
+    }
+    rgb_stale.reset();
+}
+
+tl::expected<void, std::string> Framebuffer::write(const std::filesystem::path& path, frame_format format) {
+    std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file) {
+        return tl::unexpected(fmt::format("Cannot write {}: {}", path.string(), std::strerror(errno)));
+    }
+
+    if (format == frame_format::kPpm) {
+        refresh_rgb();
+        file << fmt::format("P6\n{} {}\n255\n", kScreenWidth, kScreenHeight);
+        file.write(reinterpret_cast<const char*>(rgb.data()), rgb.size());
+    } else {
+        file << fmt::format("P4\n{} {}\n", kScreenWidth, kScreenHeight);
+        file.write(reinterpret_cast<const char*>(packed), kScreenHeight * kScreenRowBytes);
+    }
+
+    file.close();
+    if (!file) {
+        return tl::unexpected(fmt::format("Failed to write {}", path.string()));
+    }
+    return {};
+}
+
+const framebuffer_header& Framebuffer::header() const {
+    return *head;
+}
+
+const uint8_t* Framebuffer::pixels() const {
+    return packed;
+}
+
+frame_format frame_format_for(const std::filesystem::path& path) {
+    return path.extension() == ".ppm" ? frame_format::kPpm : frame_format::kPacked;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <bitset>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <tl/expected.hpp>
+
+#include "hackcpu.h"
+
+constexpr uint32_t kScreenWidth = 512;
+constexpr uint32_t kScreenHeight = 256;
+constexpr uint32_t kScreenRowWords = kScreenWidth / 16;
+constexpr uint32_t kScreenRowBytes = kScreenWidth / 8;
+
+enum class frame_format {
+    // PBM (P4): one bit per pixel, leftmost pixel in the high bit of each byte, 1 is black
+    kPacked,
+    // PPM (P6): three bytes per pixel
+    kPpm,
+};
+
+// Head of the shared view, followed by kScreenHeight rows of kScreenRowBytes packed pixels in the PBM bit order.
+// sequence is odd while a frame is being written; a viewer reads it, copies what it needs and reads it again, and
+// keeps the copy if both reads are the same even number
+struct framebuffer_header {
+    uint32_t magic;
+    uint16_t width;
+    uint16_t height;
+    std::atomic<uint32_t> sequence;
+    // Rows the latest frame changed, bit row % 32 of word row / 32
+    uint32_t dirty[kScreenHeight / 32];
+    uint64_t cycles;
+};
+
+// The screen as a packed 512x256 image, redrawn one row at a time: update compares the 32 words of each row with
+// what they were at the previous frame and converts only the rows that differ. Frames live in a mapping that
+// share can back with a memfd, so another process can map the image and watch it while the emulator runs
+class Framebuffer {
+public:
+    Framebuffer();
+    ~Framebuffer();
+
+    Framebuffer(const Framebuffer&) = delete;
+    Framebuffer& operator=(const Framebuffer&) = delete;
+
+    // Moves the frame into a memfd and returns its descriptor, e.g. for a viewer to open as /proc/PID/fd/FD
+    tl::expected<int, std::string> share();
+
+    // Takes a frame of the kScreenSize words of SCREEN; returns the number of rows that changed
+    uint32_t update(const uint16_t* screen, uint64_t cycles);
+
+    tl::expected<void, std::string> write(const std::filesystem::path& path, frame_format format);
+
+    const framebuffer_header& header() const;
+    const uint8_t* pixels() const;
+
+private:
+    void convert_row(uint32_t row, const uint16_t* words);
+    void refresh_rgb();
+
+    uint8_t* region;
+    size_t region_size;
+    int fd;
+    framebuffer_header* head;
+    uint8_t* packed;
+    // SCREEN as of the previous frame
+    std::vector<uint16_t> shadow;
+    // Three bytes a pixel, brought up to date only for the rows changed since the last PPM was written
+    std::vector<uint8_t> rgb;
+    std::bitset<kScreenHeight> rgb_stale;
+};
+
+// The format a file name asks for: PPM for .ppm, packed bits otherwise
+frame_format frame_format_for(const std::filesystem::path& path);
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+
+constexpr uint16_t kRomSize = 32768;
+constexpr uint16_t kRamSize = 32768;
+constexpr uint16_t kAddressMask = 0x7fff;
+constexpr uint16_t kScreenAddress = 16384;
+constexpr uint16_t kScreenSize = 8192;
+constexpr uint16_t kKeyboardAddress = 24576;
+
+// Destination bits of a C-instruction
+constexpr uint8_t kDestM = 0b001;
+constexpr uint8_t kDestD = 0b010;
+constexpr uint8_t kDestA = 0b100;
+
+// Jump bits of a C-instruction
+constexpr uint8_t kJumpGT = 0b001;
+constexpr uint8_t kJumpEQ = 0b010;
+constexpr uint8_t kJumpLT = 0b100;
+
+// ALU control bits zx nx zy ny f no, as they appear in instruction bits 11..6
+enum alu_op : uint8_t {
+    kAluZero     = 0b101010,
+    kAluOne      = 0b111111,
+    kAluMinusOne = 0b111010,
+    kAluX        = 0b001100,
+    kAluY        = 0b110000,
+    kAluNotX     = 0b001101,
+    kAluNotY     = 0b110001,
+    kAluNegX     = 0b001111,
+    kAluNegY     = 0b110011,
+    kAluXPlus1   = 0b011111,
+    kAluYPlus1   = 0b110111,
+    kAluXMinus1  = 0b001110,
+    kAluYMinus1  = 0b110010,
+    kAluXPlusY   = 0b000010,
+    kAluXMinusY  = 0b010011,
+    kAluYMinusX  = 0b000111,
+    kAluXAndY    = 0b000000,
+    kAluXOrY     = 0b010101,
+};
+
+// One ROM word split into the fields the CPU acts on, decoded once at load time
+struct decoded_instruction {
+    uint16_t constant;
+    uint8_t alu;
+    uint8_t dest;
+    uint8_t jump;
+    bool is_a;
+    bool reads_m;
+    bool halt;
+    // An @KBD that engines stop in front of, so that the emulator can check whether the program is idling
+    bool poll;
+};
+
+struct cpu_state {
+    uint16_t a;
+    uint16_t d;
+    uint16_t pc;
+    uint64_t cycles;
+};
+
+inline decoded_instruction decode_instruction(uint16_t word) {
+    decoded_instruction instr {};
+    if ((word & 0x8000) == 0) {
+        instr.is_a = true;
+        instr.constant = word;
+        return instr;
+    }
+
+    instr.reads_m = (word >> 12) & 1;
+    instr.alu = (word >> 6) & 0b111111;
+    instr.dest = (word >> 3) & 0b111;
+    instr.jump = word & 0b111;
+    return instr;
+}
+
+// True for a C-instruction that always jumps and stores nothing, e.g. "0;JMP"
+inline bool is_unconditional_jump(uint16_t word) {
+    return (word & 0x803f) == 0x8007;
+}
+
+// Evaluates the Hack ALU with x = D and y = A or M
+inline uint16_t alu_compute(uint8_t op, uint16_t x, uint16_t y) {
+    switch (op) {
+        case kAluZero: return 0;
+        case kAluOne: return 1;
+        case kAluMinusOne: return 0xffff;
+        case kAluX: return x;
+        case kAluY: return y;
+        case kAluNotX: return ~x;
+        case kAluNotY: return ~y;
+        case kAluNegX: return -x;
+        case kAluNegY: return -y;
+        case kAluXPlus1: return x + 1;
+        case kAluYPlus1: return y + 1;
+        case kAluXMinus1: return x - 1;
+        case kAluYMinus1: return y - 1;
+        case kAluXPlusY: return x + y;
+        case kAluXMinusY: return x - y;
+        case kAluYMinusX: return y - x;
+        case kAluXAndY: return x & y;
+        case kAluXOrY: return x | y;
+    }
+
+    if (op & 0b100000) x = 0;
+    if (op & 0b010000) x = ~x;
+    if (op & 0b001000) y = 0;
+    if (op & 0b000100) y = ~y;
+    uint16_t out = (op & 0b000010) ? x + y : x & y;
+    if (op & 0b000001) out = ~out;
+    return out;
+}
+
+inline bool jump_taken(uint8_t jump, uint16_t out) {
+    const int16_t value = static_cast<int16_t>(out);
+    const uint8_t flag = value < 0 ? kJumpLT : (value == 0 ? kJumpEQ : kJumpGT);
+    return (jump & flag) != 0;
+}
@@ -0,0 +1,647 @@
+#include "jit.h"
+
+#include <spdlog/spdlog.h>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__unix__)
+#define HACK_JIT_X64 1
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+constexpr size_t kCodeCapacity = 16 << 20;
+constexpr uint32_t kMaxBlockLength = 256;
+
+// Generous upper bound on the bytes one Hack instruction, or one block exit, compiles to
+constexpr size_t kMaxInstructionBytes = 160;
+
+enum reg : uint8_t {
+    rax = 0, rcx = 1, rdx = 2, rbx = 3, rsp = 4, rbp = 5, rsi = 6, rdi = 7,
+    r8 = 8, r9 = 9, r10 = 10, r11 = 11, r12 = 12, r13 = 13, r14 = 14, r15 = 15,
+};
+
+// Live across all generated code: A and D are zero-extended in 32-bit registers, only the low 16 bits count
+constexpr reg kRegA = r12;
+constexpr reg kRegD = r13;
+constexpr reg kRegRam = r14;
+constexpr reg kRegRemaining = r15;
+constexpr reg kRegContext = rbx;
+constexpr reg kRegEntries = rbp;
+
+constexpr uint8_t kOffsetRam = offsetof(jit_context, ram);
+constexpr uint8_t kOffsetEntries = offsetof(jit_context, entries);
+constexpr uint8_t kOffsetRemaining = offsetof(jit_context, remaining);
+constexpr uint8_t kOffsetA = offsetof(jit_context, a);
+constexpr uint8_t kOffsetD = offsetof(jit_context, d);
+constexpr uint8_t kOffsetPc = offsetof(jit_context, pc);
+constexpr uint8_t kOffsetScratch0 = offsetof(jit_context, scratch);
+constexpr uint8_t kOffsetScratch1 = offsetof(jit_context, scratch) + sizeof(uint32_t);
+
+// Second opcode byte of the rel32 conditional jumps
+constexpr uint8_t kCondBelow = 0x82;
+constexpr uint8_t kCondEqual = 0x84;
+constexpr uint8_t kCondNotEqual = 0x85;
+constexpr uint8_t kCondAboveEqual = 0x83;
+constexpr uint8_t kCondLess = 0x8c;
+constexpr uint8_t kCondGreaterEqual = 0x8d;
+constexpr uint8_t kCondLessEqual = 0x8e;
+constexpr uint8_t kCondGreater = 0x8f;
+
+// Hack jump bits to the condition on the 16-bit ALU output; 0 and 0b111 never branch conditionally
+constexpr uint8_t kJumpConditions[8] = {
+    0, kCondGreater, kCondEqual, kCondGreaterEqual, kCondLess, kCondNotEqual, kCondLessEqual, 0,
+};
+
+// Slow path for stores into SCREEN and KBD
+void store_io(jit_context* ctx, uint32_t address, uint32_t value) {
+    if (address < kKeyboardAddress) {
+        ctx->ram[address] = value;
+    }
+}
+
+// Just enough of an x86-64 assembler for the Hack instruction set
+class Emitter {
+public:
+    Emitter(uint8_t* code, size_t& used) : code(code), used(used) {}
+
+    uint8_t* here() const {
+        return code + used;
+    }
+
+    size_t offset() const {
+        return used;
+    }
+
+    void byte(uint8_t value) {
+        code[used++] = value;
+    }
+
+    void dword(uint32_t value) {
+        std::memcpy(code + used, &value, sizeof(value));
+        used += sizeof(value);
+    }
+
+    void qword(uint64_t value) {
+        std::memcpy(code + used, &value, sizeof(value));
+        used += sizeof(value);
+    }
+
+    void mov32(reg dst, reg src) { op_rr(0x89, dst, src, false); }
+    void mov64(reg dst, reg src) { op_rr(0x89, dst, src, true); }
+    void add32(reg dst, reg src) { op_rr(0x01, dst, src, false); }
+    void or32(reg dst, reg src) { op_rr(0x09, dst, src, false); }
+    void and32(reg dst, reg src) { op_rr(0x21, dst, src, false); }
+    void sub32(reg dst, reg src) { op_rr(0x29, dst, src, false); }
+    void xor32(reg dst, reg src) { op_rr(0x31, dst, src, false); }
+    void test64(reg dst, reg src) { op_rr(0x85, dst, src, true); }
+
+    void not32(reg r) { unary(2, r); }
+    void neg32(reg r) { unary(3, r); }
+
+    void add_imm(reg r, uint32_t imm, bool wide = false) { op_imm(0, r, imm, wide); }
+    void and_imm(reg r, uint32_t imm) { op_imm(4, r, imm, false); }
+    void sub_imm(reg r, uint32_t imm, bool wide = false) { op_imm(5, r, imm, wide); }
+    void cmp_imm(reg r, uint32_t imm, bool wide = false) { op_imm(7, r, imm, wide); }
+
+    void mov_imm(reg dst, uint32_t imm) {
+        rex(false, 0, 0, dst);
+        byte(0xb8 + (dst & 7));
+        dword(imm);
+    }
+
+    void mov_imm64(reg dst, uint64_t imm) {
+        rex(true, 0, 0, dst);
+        byte(0xb8 + (dst & 7));
+        qword(imm);
+    }
+
+    // test r16, r16: flags for the signed 16-bit ALU output
+    void test16(reg r) {
+        byte(0x66);
+        rex(false, r, 0, r);
+        byte(0x85);
+        modrm(3, r, r);
+    }
+
+    void load_context(reg dst, uint8_t offset, bool wide) {
+        rex(wide, dst, 0, kRegContext);
+        byte(0x8b);
+        modrm(1, dst, kRegContext);
+        byte(offset);
+    }
+
+    void store_context(uint8_t offset, reg src, bool wide) {
+        rex(wide, src, 0, kRegContext);
+        byte(0x89);
+        modrm(1, src, kRegContext);
+        byte(offset);
+    }
+
+    void store_context_imm(uint8_t offset, uint32_t imm) {
+        byte(0xc7);
+        modrm(1, 0, kRegContext);
+        byte(offset);
+        dword(imm);
+    }
+
+    // movzx dst, word [ram + address * 2]
+    void load_ram(reg dst, uint16_t address) {
+        rex(false, dst, 0, kRegRam);
+        byte(0x0f);
+        byte(0xb7);
+        modrm(2, dst, kRegRam);
+        dword(address * 2);
+    }
+
+    // movzx dst, word [ram + index * 2]
+    void load_ram_indexed(reg dst, reg index) {
+        rex(false, dst, index, kRegRam);
+        byte(0x0f);
+        byte(0xb7);
+        modrm(0, dst, 4);
+        sib(1, index, kRegRam);
+    }
+
+    void store_ram(uint16_t address, reg src) {
+        byte(0x66);
+        rex(false, src, 0, kRegRam);
+        byte(0x89);
+        modrm(2, src, kRegRam);
+        dword(address * 2);
+    }
+
+    void store_ram_indexed(reg index, reg src) {
+        byte(0x66);
+        rex(false, src, index, kRegRam);
+        byte(0x89);
+        modrm(0, src, 4);
+        sib(1, index, kRegRam);
+    }
+
+    // mov dst, [entries + index * 8]
+    void load_entry(reg dst, reg index) {
+        rex(true, dst, index, kRegEntries);
+        byte(0x8b);
+        modrm(1, dst, 4);
+        sib(3, index, kRegEntries);
+        byte(0);
+    }
+
+    void push(reg r) {
+        rex(false, 0, 0, r);
+        byte(0x50 + (r & 7));
+    }
+
+    void pop(reg r) {
+        rex(false, 0, 0, r);
+        byte(0x58 + (r & 7));
+    }
+
+    void ret() {
+        byte(0xc3);
+    }
+
+    void jmp_reg(reg r) {
+        rex(false, 0, 0, r);
+        byte(0xff);
+        modrm(3, 4, r);
+    }
+
+    void call_reg(reg r) {
+        rex(false, 0, 0, r);
+        byte(0xff);
+        modrm(3, 2, r);
+    }
+
+    // Jumps return the offset of their rel32 field for patch(); target may be null and patched later
+    size_t jmp(const uint8_t* target) {
+        byte(0xe9);
+        return rel32(target);
+    }
+
+    size_t jcc(uint8_t condition, const uint8_t* target) {
+        byte(0x0f);
+        byte(condition);
+        return rel32(target);
+    }
+
+    void patch(size_t field, const uint8_t* target) {
+        const int32_t rel = static_cast<int32_t>(target - (code + field + 4));
+        std::memcpy(code + field, &rel, sizeof(rel));
+    }
+
+private:
+    void rex(bool wide, uint8_t r, uint8_t x, uint8_t b) {
+        const uint8_t value = 0x40 | (wide << 3) | ((r >> 3) << 2) | ((x >> 3) << 1) | (b >> 3);
+        if (value != 0x40) {
+            byte(value);
+        }
+    }
+
+    void modrm(uint8_t mod, uint8_t r, uint8_t rm) {
+        byte((mod << 6) | ((r & 7) << 3) | (rm & 7));
+    }
+
+    void sib(uint8_t scale, uint8_t index, uint8_t base) {
+        byte((scale << 6) | ((index & 7) << 3) | (base & 7));
+    }
+
+    void op_rr(uint8_t opcode, reg dst, reg src, bool wide) {
+        rex(wide, src, 0, dst);
+        byte(opcode);
+        modrm(3, src, dst);
+    }
+
+    void op_imm(uint8_t ext, reg r, uint32_t imm, bool wide) {
+        rex(wide, 0, 0, r);
+        byte(0x81);
+        modrm(3, ext, r);
+        dword(imm);
+    }
+
+    void unary(uint8_t ext, reg r) {
+        rex(false, 0, 0, r);
+        byte(0xf7);
+        modrm(3, ext, r);
+    }
+
+    size_t rel32(const uint8_t* target) {
+        const size_t field = used;
+        dword(0);
+        if (target != nullptr) {
+            patch(field, target);
+        }
+        return field;
+    }
+
+    uint8_t* code;
+    size_t& used;
+};
+
+// out (eax) = ALU(D, y in edx)
+void emit_alu(Emitter& e, uint8_t op) {
+    switch (op) {
+        case kAluZero: e.xor32(rax, rax); return;
+        case kAluOne: e.mov_imm(rax, 1); return;
+        case kAluMinusOne: e.mov_imm(rax, 0xffff); return;
+        case kAluX: e.mov32(rax, kRegD); return;
+        case kAluY: e.mov32(rax, rdx); return;
+        case kAluNotX: e.mov32(rax, kRegD); e.not32(rax); return;
+        case kAluNotY: e.mov32(rax, rdx); e.not32(rax); return;
+        case kAluNegX: e.mov32(rax, kRegD); e.neg32(rax); return;
+        case kAluNegY: e.mov32(rax, rdx); e.neg32(rax); return;
+        case kAluXPlus1: e.mov32(rax, kRegD); e.add_imm(rax, 1); return;
+        case kAluYPlus1: e.mov32(rax, rdx); e.add_imm(rax, 1); return;
+        case kAluXMinus1: e.mov32(rax, kRegD); e.sub_imm(rax, 1); return;
+        case kAluYMinus1: e.mov32(rax, rdx); e.sub_imm(rax, 1); return;
+        case kAluXPlusY: e.mov32(rax, kRegD); e.add32(rax, rdx); return;
+        case kAluXMinusY: e.mov32(rax, kRegD); e.sub32(rax, rdx); return;
+        case kAluYMinusX: e.mov32(rax, rdx); e.sub32(rax, kRegD); return;
+        case kAluXAndY: e.mov32(rax, kRegD); e.and32(rax, rdx); return;
+        case kAluXOrY: e.mov32(rax, kRegD); e.or32(rax, rdx); return;
+    }
+
+    // Any other comp code, wired bit by bit like the ALU chip
+    e.mov32(rax, kRegD);
+    if (op & 0b100000) e.xor32(rax, rax);
+    if (op & 0b010000) e.not32(rax);
+    if (op & 0b001000) e.xor32(rdx, rdx);
+    if (op & 0b000100) e.not32(rdx);
+    if (op & 0b000010) {
+        e.add32(rax, rdx);
+    } else {
+        e.and32(rax, rdx);
+    }
+    if (op & 0b000001) e.not32(rax);
+}
+
+}
+
+JitCompiler::JitCompiler()
+    : rom(nullptr), chaining(true), unavailable(false), code(nullptr), used(0), trampoline_size(0),
+      enter(nullptr), exit(nullptr), compiled(0), blocks(kRomSize, jit_block {}), entries(kRomSize, nullptr) {}
+
+JitCompiler::~JitCompiler() {
+#if HACK_JIT_X64
+    if (code != nullptr) {
+        munmap(code, kCodeCapacity);
+    }
+#endif
+}
+
+bool JitCompiler::available() const {
+#if HACK_JIT_X64
+    return !unavailable;
+#else
+    return false;
+#endif
+}
+
+void JitCompiler::load(const decoded_instruction* rom) {
+    this->rom = rom;
+    used = trampoline_size;
+    compiled = 0;
+    std::fill(blocks.begin(), blocks.end(), jit_block {});
+    std::fill(entries.begin(), entries.end(), nullptr);
+    pending_links.clear();
+}
+
+void JitCompiler::set_chaining(bool enabled) {
+    if (chaining != enabled) {
+        chaining = enabled;
+        load(rom);
+    }
+}
+
+const jit_block* JitCompiler::block(uint16_t pc) {
+    if (blocks[pc].entry != nullptr) {
+        return &blocks[pc];
+    }
+    if (rom == nullptr || !compile(pc)) {
+        return nullptr;
+    }
+    return &blocks[pc];
+}
+
+uint64_t JitCompiler::execute(cpu_state* cpu, uint16_t* ram, const jit_block* block, uint64_t max_cycles) const {
+    jit_context ctx { ram, entries.data(), max_cycles, cpu->a, cpu->d, cpu->pc, {} };
+
+    using enter_function = void (*)(jit_context*, const uint8_t*);
+    reinterpret_cast<enter_function>(const_cast<uint8_t*>(enter))(&ctx, block->entry);
+
+    const uint64_t executed = max_cycles - ctx.remaining;
+    cpu->a = ctx.a;
+    cpu->d = ctx.d;
+    cpu->pc = ctx.pc;
+    cpu->cycles += executed;
+    return executed;
+}
+
+size_t JitCompiler::blocks_compiled() const {
+    return compiled;
+}
+
+size_t JitCompiler::code_size() const {
+    return used - trampoline_size;
+}
+
+bool JitCompiler::allocate() {
+#if HACK_JIT_X64
+    void* memory = mmap(nullptr, kCodeCapacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        spdlog::warn("JIT disabled: could not map code memory: {}", std::strerror(errno));
+        unavailable = true;
+        return false;
+    }
+    code = static_cast<uint8_t*>(memory);
+    used = 0;
+
+    // void enter(jit_context* ctx, const uint8_t* entry)
+    Emitter e(code, used);
+    enter = e.here();
+    e.push(rbx);
+    e.push(rbp);
+    e.push(r12);
+    e.push(r13);
+    e.push(r14);
+    e.push(r15);
+    // Six pushes leave rsp 8 bytes off the 16-byte alignment the slow path's call needs
+    e.sub_imm(rsp, 8, true);
+    e.mov64(kRegContext, rdi);
+    e.load_context(kRegA, kOffsetA, false);
+    e.load_context(kRegD, kOffsetD, false);
+    e.load_context(kRegRam, kOffsetRam, true);
+    e.load_context(kRegRemaining, kOffsetRemaining, true);
+    e.load_context(kRegEntries, kOffsetEntries, true);
+    e.jmp_reg(rsi);
+
+    // Blocks jump here after storing the next pc
+    exit = e.here();
+    e.store_context(kOffsetA, kRegA, false);
+    e.store_context(kOffsetD, kRegD, false);
+    e.store_context(kOffsetRemaining, kRegRemaining, true);
+    e.add_imm(rsp, 8, true);
+    e.pop(r15);
+    e.pop(r14);
+    e.pop(r13);
+    e.pop(r12);
+    e.pop(rbp);
+    e.pop(rbx);
+    e.ret();
+
+    trampoline_size = used;
+    return set_writable(false);
+#else
+    unavailable = true;
+    return false;
+#endif
+}
+
+bool JitCompiler::set_writable(bool writable) {
+#if HACK_JIT_X64
+    if (mprotect(code, kCodeCapacity, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0) {
+        return true;
+    }
+    spdlog::warn("JIT disabled: could not make code memory {}: {}", writable ? "writable" : "executable", std::strerror(errno));
+    // Compiled blocks may no longer be executable, so none of them is used again
+    load(rom);
+    unavailable = true;
+    return false;
+#else
+    return false;
+#endif
+}
+
+bool JitCompiler::compile(uint16_t start) {
+    if (unavailable || (code == nullptr && !allocate())) {
+        return false;
+    }
+
+    // The interpreter detects halt loops and the emulator handles polls, so neither starts a block
+    if (rom[start].halt || rom[start].poll) {
+        return false;
+    }
+
+    uint32_t length = 0;
+    while (length < kMaxBlockLength) {
+        const decoded_instruction& instr = rom[(start + length) & kAddressMask];
+        if (length > 0 && (instr.halt || instr.poll)) {
+            break;
+        }
+        length += 1;
+        if (!instr.is_a && instr.jump != 0) {
+            break;
+        }
+    }
+
+    if (used + (length + 2) * kMaxInstructionBytes > kCodeCapacity) {
+        spdlog::warn("JIT code buffer is full, interpreting from {}", start);
+        unavailable = true;
+        return false;
+    }
+
+    if (!set_writable(true)) {
+        return false;
+    }
+    Emitter e(code, used);
+    const uint8_t* entry = e.here();
+
+    auto emit_exit = [&] (uint16_t pc) {
+        e.store_context_imm(kOffsetPc, pc);
+        e.jmp(exit);
+    };
+
+    // Static successors jump straight to the target block, or to an exit until the target is compiled
+    auto emit_chain = [&] (uint16_t target) {
+        if (chaining && blocks[target].entry != nullptr) {
+            e.jmp(blocks[target].entry);
+            return;
+        }
+        if (chaining) {
+            const size_t field = e.jmp(nullptr);
+            e.patch(field, e.here());
+            pending_links[target].push_back(field);
+        }
+        emit_exit(target);
+    };
+
+    // Computed successors (pc in ecx) go through the entry table
+    auto emit_dynamic = [&] () {
+        if (chaining) {
+            e.load_entry(rax, rcx);
+            e.test64(rax, rax);
+            const size_t missing = e.jcc(kCondEqual, nullptr);
+            e.jmp_reg(rax);
+            e.patch(missing, e.here());
+        }
+        e.store_context(kOffsetPc, rcx, false);
+        e.jmp(exit);
+    };
+
+    // Exit without running anything if the block would overrun the cycle budget
+    e.cmp_imm(kRegRemaining, length, true);
+    const size_t short_budget = e.jcc(kCondBelow, nullptr);
+    e.sub_imm(kRegRemaining, length, true);
+
+    // Value of A when an earlier instruction in this block set it to a constant, -1 otherwise
+    int32_t known_a = -1;
+    bool ends_with_jump = false;
+    int32_t jump_target = -1;
+    uint8_t jump = 0;
+
+    for (uint32_t i = 0; i < length; i += 1) {
+        const decoded_instruction& instr = rom[(start + i) & kAddressMask];
+
+        if (instr.is_a) {
+            e.mov_imm(kRegA, instr.constant);
+            known_a = instr.constant;
+            continue;
+        }
+
+        const bool uses_y = (instr.alu & 0b001000) == 0;
+        const bool needs_address = (instr.reads_m && uses_y) || (instr.dest & kDestM) || instr.jump != 0;
+        const uint16_t address = known_a & kAddressMask;
+        if (needs_address && known_a < 0) {
+            e.mov32(rcx, kRegA);
+            e.and_imm(rcx, kAddressMask);
+        }
+
+        if (uses_y && instr.reads_m) {
+            if (known_a >= 0) {
+                e.load_ram(rdx, address);
+            } else {
+                e.load_ram_indexed(rdx, rcx);
+            }
+        } else if (uses_y) {
+            e.mov32(rdx, kRegA);
+        }
+        emit_alu(e, instr.alu);
+
+        if (instr.dest & kDestM) {
+            auto emit_slow_store = [&] () {
+                e.store_context(kOffsetScratch0, rax, false);
+                e.store_context(kOffsetScratch1, rcx, false);
+                e.mov64(rdi, kRegContext);
+                if (known_a >= 0) {
+                    e.mov_imm(rsi, address);
+                } else {
+                    e.mov32(rsi, rcx);
+                }
+                e.mov32(rdx, rax);
+                e.mov_imm64(rax, reinterpret_cast<uint64_t>(&store_io));
+                e.call_reg(rax);
+                e.load_context(rax, kOffsetScratch0, false);
+                e.load_context(rcx, kOffsetScratch1, false);
+            };
+
+            if (known_a >= 0 && address < kScreenAddress) {
+                e.store_ram(address, rax);
+            } else if (known_a >= 0) {
+                emit_slow_store();
+            } else {
+                e.cmp_imm(rcx, kScreenAddress);
+                const size_t slow = e.jcc(kCondAboveEqual, nullptr);
+                e.store_ram_indexed(rcx, rax);
+                const size_t done = e.jmp(nullptr);
+                e.patch(slow, e.here());
+                emit_slow_store();
+                e.patch(done, e.here());
+            }
+        }
+
+        if (instr.dest & kDestD) {
+            e.mov32(kRegD, rax);
+        }
+
+        if (instr.jump != 0) {
+            ends_with_jump = true;
+            jump = instr.jump;
+            jump_target = known_a < 0 ? -1 : address;
+        }
+
+        if (instr.dest & kDestA) {
+            e.mov32(kRegA, rax);
+            known_a = -1;
+        }
+    }
+
+    const uint16_t next = (start + length) & kAddressMask;
+    auto emit_taken = [&] () {
+        if (jump_target >= 0) {
+            emit_chain(jump_target);
+        } else {
+            emit_dynamic();
+        }
+    };
+
+    if (!ends_with_jump) {
+        emit_chain(next);
+    } else if (jump == 0b111) {
+        emit_taken();
+    } else {
+        e.test16(rax);
+        const size_t taken = e.jcc(kJumpConditions[jump], nullptr);
+        emit_chain(next);
+        e.patch(taken, e.here());
+        emit_taken();
+    }
+
+    e.patch(short_budget, e.here());
+    emit_exit(start);
+
+    blocks[start] = { entry, length };
+    entries[start] = const_cast<uint8_t*>(entry);
+    compiled += 1;
+
+    if (const auto found = pending_links.find(start); found != pending_links.end()) {
+        for (const size_t field : found->second) {
+            e.patch(field, entry);
+        }
+        pending_links.erase(found);
+    }
+
+    spdlog::trace("JIT block {} ({} instructions, {} bytes)", start, length, e.here() - entry);
+    return set_writable(false);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "hackcpu.h"
+
+// State handed to generated code; the field offsets are baked into the emitted instructions
+struct jit_context {
+    uint16_t* ram;
+    void* const* entries;
+    uint64_t remaining;
+    uint32_t a;
+    uint32_t d;
+    uint32_t pc;
+    uint32_t scratch[2];
+};
+
+struct jit_block {
+    const uint8_t* entry;
+    uint32_t cycles;
+};
+
+// Compiles straight-line runs of ROM, ending at the first jump, to x86-64 the first time they execute
+class JitCompiler {
+public:
+    JitCompiler();
+    ~JitCompiler();
+
+    JitCompiler(const JitCompiler&) = delete;
+    JitCompiler& operator=(const JitCompiler&) = delete;
+
+    // False on hosts without x86-64 support or when executable memory is unavailable
+    bool available() const;
+
+    // Drops all compiled code; rom must stay valid until the next load
+    void load(const decoded_instruction* rom);
+
+    // Without chaining every block returns to the caller, so each one can be checked on its own
+    void set_chaining(bool enabled);
+
+    // Native code for the block starting at pc, compiling it on first use; nullptr if pc has to be interpreted
+    const jit_block* block(uint16_t pc);
+
+    // Runs from block until control reaches code that is not compiled or too few cycles are left for a block
+    uint64_t execute(cpu_state* cpu, uint16_t* ram, const jit_block* block, uint64_t max_cycles) const;
+
+    size_t blocks_compiled() const;
+    size_t code_size() const;
+
+private:
+    bool allocate();
+    // The code buffer is never writable and executable at once, so compiling maps it RW and then back to RX
+    bool set_writable(bool writable);
+    bool compile(uint16_t start);
+
+    const decoded_instruction* rom;
+    bool chaining;
+    bool unavailable;
+
+    uint8_t* code;
+    size_t used;
+    size_t trampoline_size;
+    const uint8_t* enter;
+    const uint8_t* exit;
+
+    size_t compiled;
+    std::vector<jit_block> blocks;
+    std::vector<void*> entries;
+
+    // rel32 fields of jumps waiting for their target block to be compiled
+    std::unordered_map<uint16_t, std::vector<size_t>> pending_links;
+};
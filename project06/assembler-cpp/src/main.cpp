@@ -6,6 +6,7 @@
 #include <fstream>
 
 #include "assembler.h"
+#include "tooling.h"
 
 tl::expected<bool, std::string> write_asm_to_file(std::ostream& out, const buffer& buf, bool binary) {
     if (!out) {
@@ -24,45 +25,6 @@ tl::expected<bool, std::string> write_asm_to_file(std::ostream& out, const buffe
     return true;
 }
 
-tl::expected<std::string, std::string> get_file_contents(std::istream& in) {
-    if (!in) {
-        return tl::unexpected(std::strerror(errno));
-    }
-
-    std::ostringstream contents;
-    contents << in.rdbuf();
-    return(contents.str());
-}
-
-std::string replace_ext(const std::string& filename, const std::string& ext) {
-    auto dot_index = filename.find_last_of(".");
-    if (dot_index == std::string::npos) {
-        return filename + "." + ext;
-    }
-    return filename.substr(0, dot_index) + "." + ext;
-}
-
-tl::expected<void, std::string> set_logging_level(const std::string& level) {
-    if (level == "trace") {
-        spdlog::set_level(spdlog::level::trace);
-    } else if (level == "debug") {
-        spdlog::set_level(spdlog::level::debug);
-    } else if (level == "info") {
-        spdlog::set_level(spdlog::level::info);
-    } else if (level == "warn") {
-        spdlog::set_level(spdlog::level::warn);
-    } else if (level == "err") {
-        spdlog::set_level(spdlog::level::err);
-    } else if (level == "critical") {
-        spdlog::set_level(spdlog::level::critical);
-    } else if (level == "off") {
-        spdlog::set_level(spdlog::level::off);
-    } else {
-        return tl::unexpected(fmt::format("Invalid argument \"{}\" - allowed options: {{trace, debug, info, warn, err, critical, off}}", level));
-    }
-    return {};
-}
-
 int main(int argc, char* argv[]) {
     auto logger = spdlog::stderr_color_mt("stderr");
     spdlog::set_default_logger(logger);
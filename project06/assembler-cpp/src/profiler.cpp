@@ -0,0 +1,248 @@
+#include "profiler.h"
+
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <numeric>
+
+namespace {
+
+// The bootstrap calls it without a return label
+constexpr const char* kBootFunction = "Sys.init";
+
+// More than the Hack stack has room for, so calls that never return stop adding frames there
+constexpr size_t kMaxFrames = 4096;
+
+constexpr uint16_t kJumpAlways = 0b111;
+
+double percent(uint64_t part, uint64_t total) {
+    return total > 0 ? 100.0 * part / total : 0.0;
+}
+
+}
+
+Profiler::Profiler(const buffer& program, const std::map<std::string, uint16_t>& labels)
+    : program(program), source_map(nullptr), kinds(kRomSize, kPlain), call_sites(kRomSize, false), address_function(kRomSize, 0), functions { "(top)" }, calls { 0 },
+      counts(kRomSize, 0), cycles(0), charged(0), deepest(0) {
+    std::map<std::string, uint32_t> function_names { { kBootFunction, 0 } };
+    for (const auto& [label, address] : labels) {
+        if (const size_t ret = label.find("$ret."); ret != std::string::npos) {
+            function_names.emplace(label.substr(0, ret), 0);
+        }
+        // Keep the first label in name order when several share an address
+        names.emplace(address, label);
+    }
+    for (auto& [name, function] : function_names) {
+        const auto found = labels.find(name);
+        if (found == labels.end()) {
+            continue;
+        }
+        function = functions.size();
+        kinds[found->second] = kEntry;
+        address_function[found->second] = function;
+        functions.push_back(name);
+        calls.push_back(0);
+    }
+    // Returning from a function that is not in the program leaves the stack alone
+    for (const auto& [label, address] : labels) {
+        if (const size_t ret = label.find("$ret."); ret != std::string::npos && function_names.at(label.substr(0, ret)) != 0) {
+            kinds[address] = kReturn;
+            address_function[address] = function_names.at(label.substr(0, ret));
+        }
+    }
+
+    // A call jumps from right before its return label, or from the end of the outlined sequence that such a jump
+    // goes to instead of the function
+    auto jump_bits = [&] (size_t address) {
+        return address < program.size() && (program[address] & 0x8000) ? program[address] & kJumpAlways : 0;
+    };
+    for (size_t address = 1; address < program.size(); address += 1) {
+        if (kinds[address] != kReturn || jump_bits(address - 1) == 0) {
+            continue;
+        }
+        call_sites[address - 1] = true;
+        if (address < 2 || (program[address - 2] & 0x8000) || kinds[program[address - 2]] == kEntry) {
+            continue;
+        }
+        for (size_t at = program[address - 2]; at < program.size(); at += 1) {
+            if (jump_bits(at) == kJumpAlways) {
+                call_sites[at] = true;
+                break;
+            }
+        }
+    }
+
+    nodes.push_back(call_node { 0, 0, 0, {} });
+    stack.push_back(0);
+}
+
+void Profiler::set_source_map(const SourceMap* source_map) {
+    this->source_map = source_map;
+}
+
+void Profiler::follow(uint16_t from, uint16_t to) {
+    const uint32_t function = address_function[to];
+    if (kinds[to] == kReturn) {
+        // Out of the innermost frame of the function, dropping any frames above it that never returned
+        for (size_t depth = stack.size(); depth > 1; depth -= 1) {
+            if (nodes[stack[depth - 1]].function == function) {
+                charge();
+                stack.resize(depth - 1);
+                return;
+            }
+        }
+        return;
+    }
+
+    // Jumping to where a function without locals starts is also how a loop at its top goes round. Only the bootstrap
+    // calls from outside any function without a return label
+    if (!call_sites[from] && stack.size() > 1) {
+        return;
+    }
+    calls[function] += 1;
+    if (stack.size() > kMaxFrames) {
+        return;
+    }
+
+    charge();
+    const uint32_t parent = stack.back();
+    auto [child, inserted] = nodes[parent].children.emplace(function, nodes.size());
+    if (inserted) {
+        nodes.push_back(call_node { function, parent, 0, {} });
+    }
+    stack.push_back(child->second);
+    deepest = std::max(deepest, stack.size() - 1);
+}
+
+void Profiler::charge() {
+    nodes[stack.back()].self += cycles - charged;
+    charged = cycles;
+}
+
+uint64_t Profiler::total_cycles() const {
+    return cycles;
+}
+
+std::map<std::string, uint64_t> Profiler::function_calls() const {
+    std::map<std::string, uint64_t> called;
+    for (size_t function = 1; function < functions.size(); function += 1) {
+        if (calls[function] > 0) {
+            called.emplace(functions[function], calls[function]);
+        }
+    }
+    return called;
+}
+
+size_t Profiler::max_depth() const {
+    return deepest;
+}
+
+std::vector<uint64_t> Profiler::self_cycles() const {
+    std::vector<uint64_t> self(nodes.size());
+    for (size_t node = 0; node < nodes.size(); node += 1) {
+        self[node] = nodes[node].self;
+    }
+    self[stack.back()] += cycles - charged;
+    return self;
+}
+
+void Profiler::write_folded(std::ostream& out) const {
+    const std::vector<uint64_t> self = self_cycles();
+    for (size_t node = 0; node < nodes.size(); node += 1) {
+        if (self[node] == 0) {
+            continue;
+        }
+        std::vector<uint32_t> path;
+        for (size_t at = node; at != 0; at = nodes[at].parent) {
+            path.push_back(nodes[at].function);
+        }
+        std::string line = functions[0];
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+            line += ';' + functions[*it];
+        }
+        out << line << ' ' << self[node] << '\n';
+    }
+}
+
+// The nearest label at or before an address, e.g. "LOOP+3"
+std::string Profiler::block_name(uint16_t address) const {
+    auto found = names.upper_bound(address);
+    if (found == names.begin()) {
+        return fmt::format("ROM[{}]", address);
+    }
+    found = std::prev(found);
+    return found->first == address ? found->second : fmt::format("{}+{}", found->second, address - found->first);
+}
+
+void Profiler::write_report(std::ostream& out, size_t top) const {
+    // Basic blocks start at labels and after jumps
+    struct block {
+        uint16_t begin;
+        uint16_t end;
+        uint64_t cycles;
+    };
+    std::vector<block> blocks;
+    const size_t size = std::max<size_t>(program.size(), 1);
+    for (size_t begin = 0; begin < size; ) {
+        size_t end = begin + 1;
+        while (end < size && names.count(end) == 0 && !((program[end - 1] & 0x8000) && (program[end - 1] & 0b111))) {
+            end += 1;
+        }
+        const uint64_t block_cycles = std::accumulate(counts.begin() + begin, counts.begin() + end, uint64_t { 0 });
+        if (block_cycles > 0) {
+            blocks.push_back(block { static_cast<uint16_t>(begin), static_cast<uint16_t>(end), block_cycles });
+        }
+        begin = end;
+    }
+    std::sort(blocks.begin(), blocks.end(), [] (const block& a, const block& b) { return a.cycles > b.cycles; });
+
+    out << fmt::format("Hot blocks ({} of {}, {} cycles):\n", std::min(top, blocks.size()), blocks.size(), cycles);
+    out << fmt::format("{:>14} {:>7} {:>12}  {:<13} {}\n", "cycles", "%", "runs", "addresses", source_map != nullptr ? "block, source" : "block");
+    for (size_t index = 0; index < std::min(top, blocks.size()); index += 1) {
+        const block& at = blocks[index];
+        std::string name = block_name(at.begin);
+        if (source_map != nullptr) {
+            if (const std::string source = source_map->describe(at.begin); !source.empty()) {
+                name += fmt::format(", {}", source);
+            }
+        }
+        out << fmt::format("{:>14} {:>6.2f}% {:>12}  {:<13} {}\n", at.cycles, percent(at.cycles, cycles), counts[at.begin],
+            fmt::format("{}-{}", at.begin, at.end - 1), name);
+    }
+
+    // A function's inclusive cycles are those of every call tree node below a node of it that has no ancestor of
+    // the same function, so recursion is counted once
+    const std::vector<uint64_t> self = self_cycles();
+    std::vector<uint64_t> subtree = self;
+    for (size_t node = nodes.size(); node-- > 1; ) {
+        subtree[nodes[node].parent] += subtree[node];
+    }
+    std::vector<uint64_t> inclusive(functions.size(), 0);
+    std::vector<uint64_t> exclusive(functions.size(), 0);
+    for (size_t node = 0; node < nodes.size(); node += 1) {
+        const uint32_t function = nodes[node].function;
+        exclusive[function] += self[node];
+        bool outermost = true;
+        for (size_t at = node; at != 0 && outermost; ) {
+            at = nodes[at].parent;
+            outermost = nodes[at].function != function;
+        }
+        if (outermost) {
+            inclusive[function] += subtree[node];
+        }
+    }
+
+    std::vector<uint32_t> order;
+    for (uint32_t function = 0; function < functions.size(); function += 1) {
+        if (inclusive[function] > 0) {
+            order.push_back(function);
+        }
+    }
+    std::sort(order.begin(), order.end(), [&] (uint32_t a, uint32_t b) { return inclusive[a] > inclusive[b]; });
+
+    out << fmt::format("\nFunctions ({}):\n", order.size());
+    out << fmt::format("{:>14} {:>7} {:>14} {:>7} {:>10}  {}\n", "inclusive", "%", "self", "%", "calls", "function");
+    for (const uint32_t function : order) {
+        out << fmt::format("{:>14} {:>6.2f}% {:>14} {:>6.2f}% {:>10}  {}\n", inclusive[function], percent(inclusive[function], cycles),
+            exclusive[function], percent(exclusive[function], cycles), calls[function], functions[function]);
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "assembler.h"
+#include "hackcpu.h"
+#include "sourcemap.h"
+
+// Counts the cycles of every ROM address an emulator executes, and follows the call and return protocol of the VM
+// translator to charge them to a call stack. Every call leaves a "Callee$ret.N" label behind its jump, so the
+// functions are the names in front of "$ret." labels, plus Sys.init, which the bootstrap calls. A taken jump to a
+// function's label enters it and one to a "Callee$ret." label returns from the innermost frame of Callee, wherever
+// the call jumped from, as outlined calls do from a shared subroutine. Only a call's own jump enters a function, so
+// a loop back to the label of a function without locals stays in its frame. Without such labels, e.g. in
+// hand-written assembly, everything runs in "(top)"
+class Profiler {
+public:
+    Profiler(const buffer& program, const std::map<std::string, uint16_t>& labels);
+
+    // Called for every instruction, before it executes
+    void count(uint16_t pc) {
+        counts[pc] += 1;
+        cycles += 1;
+    }
+
+    // Called for every jump taken, after count
+    void jump(uint16_t from, uint16_t to) {
+        if (kinds[to] != kPlain) {
+            follow(from, to);
+        }
+    }
+
+    uint64_t total_cycles() const;
+    // Times the instruction at an address ran
+    uint64_t executions(uint16_t address) const {
+        return counts[address];
+    }
+
+    // Times each function that ran was called, by name
+    std::map<std::string, uint64_t> function_calls() const;
+    // Most frames the call stack held at once, not counting "(top)"
+    size_t max_depth() const;
+
+    // Names hot blocks by the source lines they were translated from as well
+    void set_source_map(const SourceMap* source_map);
+
+    // One line per call stack, "(top);Sys.init;Main.fibonacci 1234", the input of flamegraph.pl and speedscope
+    void write_folded(std::ostream& out) const;
+    // The top hot basic blocks, and the inclusive and self cycles of every function
+    void write_report(std::ostream& out, size_t top) const;
+
+private:
+    enum address_kind : uint8_t {
+        kPlain,
+        kEntry,
+        kReturn,
+    };
+
+    struct call_node {
+        uint32_t function;
+        uint32_t parent;
+        uint64_t self;
+        std::map<uint32_t, uint32_t> children;
+    };
+
+    void follow(uint16_t from, uint16_t to);
+    void charge();
+    std::vector<uint64_t> self_cycles() const;
+    std::string block_name(uint16_t address) const;
+
+    buffer program;
+    const SourceMap* source_map;
+    // Label at each address, for naming blocks, and the function each entry address starts or return label
+    // returns from
+    std::map<uint16_t, std::string> names;
+    std::vector<uint8_t> kinds;
+    // Jumps that call a function when they go to its entry, rather than loop back to it
+    std::vector<bool> call_sites;
+    std::vector<uint32_t> address_function;
+    std::vector<std::string> functions;
+    std::vector<uint64_t> calls;
+
+    std::vector<uint64_t> counts;
+    uint64_t cycles;
+    // Cycles up to here are charged to a node of the call tree, the rest belong to the top of the stack
+    uint64_t charged;
+    size_t deepest;
+    std::vector<call_node> nodes;
+    // Call tree node of every frame, from the bottom
+    std::vector<uint32_t> stack;
+};
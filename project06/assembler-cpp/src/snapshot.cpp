@@ -0,0 +1,134 @@
+#include "snapshot.h"
+
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+
+#if defined(__unix__)
+#define HACK_SNAPSHOT_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+constexpr uint32_t kMagic = 0x4e534b48; // "HKSN"
+constexpr uint32_t kVersion = 1;
+
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t rom_size;
+    uint16_t a;
+    uint16_t d;
+    uint16_t pc;
+    uint16_t reserved;
+    uint64_t cycles;
+};
+
+constexpr size_t kRomOffset = 64;
+// RAM starts on a page after the largest ROM
+constexpr size_t kRamOffset = 4096 + kRomSize * sizeof(uint16_t);
+constexpr size_t kFileSize = kRamOffset + kRamSize * sizeof(uint16_t);
+
+static_assert(sizeof(snapshot_header) <= kRomOffset);
+
+}
+
+Snapshot::Snapshot() : region(nullptr), region_size(0), cpu {} {}
+
+Snapshot::~Snapshot() {
+#if HACK_SNAPSHOT_MMAP
+    if (region != nullptr) {
+        munmap(const_cast<uint8_t*>(region), region_size);
+    }
+#endif
+}
+
+tl::expected<void, std::string> Snapshot::open(const std::filesystem::path& path) {
+#if HACK_SNAPSHOT_MMAP
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return tl::unexpected(fmt::format("Cannot open {}: {}", path.string(), std::strerror(errno)));
+    }
+    struct stat info {};
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) != kFileSize) {
+        ::close(fd);
+        return tl::unexpected(fmt::format("{} is not a snapshot", path.string()));
+    }
+    void* mapped = mmap(nullptr, kFileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        return tl::unexpected(fmt::format("Cannot map {}: {}", path.string(), std::strerror(errno)));
+    }
+
+    const snapshot_header* header = static_cast<const snapshot_header*>(mapped);
+    if (header->magic != kMagic || header->version != kVersion || header->rom_size > kRomSize) {
+        munmap(mapped, kFileSize);
+        return tl::unexpected(fmt::format("{} is not a snapshot", path.string()));
+    }
+    if (region != nullptr) {
+        munmap(const_cast<uint8_t*>(region), region_size);
+    }
+    region = static_cast<const uint8_t*>(mapped);
+    region_size = kFileSize;
+    cpu = cpu_state { header->a, header->d, header->pc, header->cycles };
+    return {};
+#else
+    return tl::unexpected(fmt::format("Cannot open {}: snapshots need mmap, which this platform does not have", path.string()));
+#endif
+}
+
+const cpu_state& Snapshot::state() const {
+    return cpu;
+}
+
+buffer Snapshot::rom() const {
+    const snapshot_header* header = reinterpret_cast<const snapshot_header*>(region);
+    const uint16_t* words = reinterpret_cast<const uint16_t*>(region + kRomOffset);
+    return buffer(words, words + header->rom_size);
+}
+
+const uint16_t* Snapshot::ram() const {
+    return reinterpret_cast<const uint16_t*>(region + kRamOffset);
+}
+
+tl::expected<void, std::string> Snapshot::restore(Emulator& emulator) const {
+    const snapshot_header* header = reinterpret_cast<const snapshot_header*>(region);
+    const uint16_t* words = reinterpret_cast<const uint16_t*>(region + kRomOffset);
+    const buffer& loaded = emulator.rom();
+    if (loaded.size() != header->rom_size || !std::equal(loaded.begin(), loaded.end(), words)) {
+        if (auto result = emulator.load(rom()); !result.has_value()) {
+            return result;
+        }
+    }
+    emulator.set_ram(ram());
+    emulator.set_state(cpu);
+    return {};
+}
+
+tl::expected<void, std::string> save_snapshot(const Emulator& emulator, const std::filesystem::path& path) {
+    const cpu_state& cpu = emulator.state();
+    const buffer& rom = emulator.rom();
+    std::vector<uint8_t> contents(kFileSize, 0);
+    const snapshot_header header { kMagic, kVersion, static_cast<uint32_t>(rom.size()), cpu.a, cpu.d, cpu.pc, 0, cpu.cycles };
+    std::memcpy(contents.data(), &header, sizeof(header));
+    std::memcpy(contents.data() + kRomOffset, rom.data(), rom.size() * sizeof(uint16_t));
+    std::memcpy(contents.data() + kRamOffset, emulator.ram().data(), kRamSize * sizeof(uint16_t));
+
+    std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file) {
+        return tl::unexpected(fmt::format("Cannot write {}: {}", path.string(), std::strerror(errno)));
+    }
+    file.write(reinterpret_cast<const char*>(contents.data()), contents.size());
+    file.close();
+    if (!file) {
+        return tl::unexpected(fmt::format("Failed to write {}", path.string()));
+    }
+    spdlog::debug("Saved snapshot of {} words of ROM at cycle {} to {}", rom.size(), cpu.cycles, path.string());
+    return {};
+}
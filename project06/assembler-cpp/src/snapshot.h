@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <tl/expected.hpp>
+
+#include "assembler.h"
+#include "emulator.h"
+#include "hackcpu.h"
+
+// A snapshot file holds a whole machine: a header with A, D, PC and the cycle count, the ROM, and RAM on a page
+// boundary of its own, so that the file can be mapped and RAM used from it in place
+class Snapshot {
+public:
+    Snapshot();
+    ~Snapshot();
+
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    // Maps a file written by save_snapshot; every process that opens it shares the pages of the page cache
+    tl::expected<void, std::string> open(const std::filesystem::path& path);
+
+    const cpu_state& state() const;
+    buffer rom() const;
+    const uint16_t* ram() const;
+
+    // Puts the emulator in the snapshot's state. An emulator already running the same ROM keeps its decoded,
+    // threaded and compiled code, which leaves copying RAM, a few microseconds
+    tl::expected<void, std::string> restore(Emulator& emulator) const;
+
+private:
+    const uint8_t* region;
+    size_t region_size;
+    cpu_state cpu;
+};
+
+tl::expected<void, std::string> save_snapshot(const Emulator& emulator, const std::filesystem::path& path);
@@ -0,0 +1,178 @@
+#include "sourcemap.h"
+
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+
+#include "hackcpu.h"
+
+namespace {
+
+constexpr uint32_t kMagic = 0x4d534b48; // "HKSM"
+constexpr uint32_t kVersion = 1;
+constexpr uint32_t kMaxNames = 65536;
+
+struct source_map_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t files;
+    uint32_t functions;
+    uint32_t entries;
+};
+
+bool same_location(const source_location& a, const source_location& b) {
+    return a.file == b.file && a.function == b.function && a.line == b.line;
+}
+
+template <typename T>
+void write_values(std::ostream& out, const T* values, size_t count) {
+    out.write(reinterpret_cast<const char*>(values), count * sizeof(T));
+}
+
+template <typename T>
+bool read_values(std::istream& in, T* values, size_t count) {
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(values), count * sizeof(T)));
+}
+
+void write_names(std::ostream& out, const std::vector<std::string>& names) {
+    for (const std::string& name : names) {
+        const uint16_t length = name.size();
+        write_values(out, &length, 1);
+        out.write(name.data(), length);
+    }
+}
+
+bool read_names(std::istream& in, size_t count, std::vector<std::string>* names) {
+    names->resize(count);
+    for (std::string& name : *names) {
+        uint16_t length = 0;
+        if (!read_values(in, &length, 1)) {
+            return false;
+        }
+        name.resize(length);
+        if (!in.read(name.data(), length)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+uint16_t SourceMap::intern(std::vector<std::string>& names, std::string_view name) {
+    // Consecutive entries mostly share their file and function, which were interned last or not long before
+    for (size_t index = names.size(); index-- > 0; ) {
+        if (names[index] == name) {
+            return index;
+        }
+    }
+    names.emplace_back(name);
+    return names.size() - 1;
+}
+
+void SourceMap::add(uint16_t address, std::string_view file, std::string_view function, uint32_t line) {
+    const source_location location { intern(files, file), intern(functions, function), line };
+    if (!addresses.empty() && addresses.back() == address) {
+        addresses.pop_back();
+        locations.pop_back();
+    }
+    if (!locations.empty() && same_location(locations.back(), location)) {
+        return;
+    }
+    addresses.push_back(address);
+    locations.push_back(location);
+}
+
+std::optional<source_location> SourceMap::find(uint16_t address) const {
+    const auto after = std::upper_bound(addresses.begin(), addresses.end(), address);
+    if (after == addresses.begin()) {
+        return std::nullopt;
+    }
+    return locations[after - addresses.begin() - 1];
+}
+
+std::string SourceMap::describe(uint16_t address) const {
+    const auto location = find(address);
+    if (!location.has_value()) {
+        return "";
+    }
+    return fmt::format("{}:{} {}", files[location->file], location->line, functions[location->function]);
+}
+
+size_t SourceMap::size() const {
+    return addresses.size();
+}
+
+const std::string& SourceMap::file_name(uint16_t file) const {
+    return files[file];
+}
+
+const std::string& SourceMap::function_name(uint16_t function) const {
+    return functions[function];
+}
+
+tl::expected<void, std::string> SourceMap::load(const std::filesystem::path& path) {
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    if (!in) {
+        return tl::unexpected(fmt::format("Cannot open {}: {}", path.string(), std::strerror(errno)));
+    }
+
+    source_map_header header {};
+    // No more entries than addresses, nor names than 16-bit indexes reach
+    if (!read_values(in, &header, 1) || header.magic != kMagic || header.version != kVersion || header.entries > kRomSize
+        || header.files > kMaxNames || header.functions > kMaxNames) {
+        return tl::unexpected(fmt::format("{} is not a source map", path.string()));
+    }
+
+    std::vector<uint16_t> entry_files(header.entries);
+    std::vector<uint16_t> entry_functions(header.entries);
+    std::vector<uint32_t> entry_lines(header.entries);
+    addresses.resize(header.entries);
+    if (!read_names(in, header.files, &files) || !read_names(in, header.functions, &functions) || !read_values(in, addresses.data(), header.entries)
+        || !read_values(in, entry_files.data(), header.entries) || !read_values(in, entry_functions.data(), header.entries)
+        || !read_values(in, entry_lines.data(), header.entries)) {
+        return tl::unexpected(fmt::format("{} is truncated", path.string()));
+    }
+
+    locations.resize(header.entries);
+    for (size_t entry = 0; entry < header.entries; entry += 1) {
+        if (entry_files[entry] >= files.size() || entry_functions[entry] >= functions.size() || (entry > 0 && addresses[entry] < addresses[entry - 1])) {
+            return tl::unexpected(fmt::format("{} is not a source map", path.string()));
+        }
+        locations[entry] = source_location { entry_files[entry], entry_functions[entry], entry_lines[entry] };
+    }
+    spdlog::debug("Loaded {} source map entries for {} files from {}", addresses.size(), files.size(), path.string());
+    return {};
+}
+
+tl::expected<void, std::string> SourceMap::save(const std::filesystem::path& path) const {
+    std::vector<uint16_t> entry_files(locations.size());
+    std::vector<uint16_t> entry_functions(locations.size());
+    std::vector<uint32_t> entry_lines(locations.size());
+    for (size_t entry = 0; entry < locations.size(); entry += 1) {
+        entry_files[entry] = locations[entry].file;
+        entry_functions[entry] = locations[entry].function;
+        entry_lines[entry] = locations[entry].line;
+    }
+
+    std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!out) {
+        return tl::unexpected(fmt::format("Cannot write {}: {}", path.string(), std::strerror(errno)));
+    }
+    const source_map_header header { kMagic, kVersion, static_cast<uint32_t>(files.size()), static_cast<uint32_t>(functions.size()),
+        static_cast<uint32_t>(addresses.size()) };
+    write_values(out, &header, 1);
+    write_names(out, files);
+    write_names(out, functions);
+    write_values(out, addresses.data(), addresses.size());
+    write_values(out, entry_files.data(), entry_files.size());
+    write_values(out, entry_functions.data(), entry_functions.size());
+    write_values(out, entry_lines.data(), entry_lines.size());
+    out.close();
+    if (!out) {
+        return tl::unexpected(fmt::format("Failed to write {}", path.string()));
+    }
+    return {};
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tl/expected.hpp>
+#include <vector>
+
+struct source_location {
+    uint16_t file;
+    uint16_t function;
+    uint32_t line;
+};
+
+// Where the code at each ROM address came from: a file, a line of it and the function around it. Each entry covers
+// the addresses from its own up to the next entry's, so a program needs about one per source line, not one per word.
+// The file is a small header, the file and function names, and one column per field of the entries
+class SourceMap {
+public:
+    // Addresses must not decrease from one call to the next; an entry at the same address replaces the last one
+    void add(uint16_t address, std::string_view file, std::string_view function, uint32_t line);
+
+    // The entry covering an address, or nothing before the first one
+    std::optional<source_location> find(uint16_t address) const;
+    // "Main.vm:12 Main.main", or an empty string without an entry
+    std::string describe(uint16_t address) const;
+
+    size_t size() const;
+    const std::string& file_name(uint16_t file) const;
+    const std::string& function_name(uint16_t function) const;
+
+    tl::expected<void, std::string> load(const std::filesystem::path& path);
+    tl::expected<void, std::string> save(const std::filesystem::path& path) const;
+
+private:
+    static uint16_t intern(std::vector<std::string>& names, std::string_view name);
+
+    std::vector<std::string> files;
+    std::vector<std::string> functions;
+    std::vector<uint16_t> addresses;
+    std::vector<source_location> locations;
+};
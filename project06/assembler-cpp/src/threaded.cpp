@@ -0,0 +1,425 @@
+#include "threaded.h"
+
+#include <algorithm>
+#include <array>
+#include <set>
+#include <utility>
+
+#if defined(__has_cpp_attribute)
+#if __has_cpp_attribute(clang::musttail)
+#define HACK_MUSTTAIL [[clang::musttail]]
+#endif
+#endif
+#ifndef HACK_MUSTTAIL
+#define HACK_MUSTTAIL
+#endif
+
+#if defined(__GNUC__)
+#define HACK_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define HACK_ALWAYS_INLINE inline
+#endif
+
+namespace {
+
+// The comp codes the assembler emits; any other code goes through the generic handler
+constexpr uint8_t kCanonicalAluOps[] = {
+    kAluZero, kAluOne, kAluMinusOne, kAluX, kAluY, kAluNotX, kAluNotY, kAluNegX, kAluNegY,
+    kAluXPlus1, kAluYPlus1, kAluXMinus1, kAluYMinus1, kAluXPlusY, kAluXMinusY, kAluYMinusX, kAluXAndY, kAluXOrY,
+};
+constexpr size_t kCanonicalAluCount = std::size(kCanonicalAluOps);
+
+constexpr uint16_t kHandlerA = 0;
+constexpr uint16_t kHandlerHalt = 1;
+constexpr uint16_t kHandlerPoll = 2;
+constexpr uint16_t kHandlerGeneric = 3;
+constexpr uint16_t kHandlerFirstC = 4;
+constexpr size_t kHandlerCount = kHandlerFirstC + kCanonicalAluCount * 2 * 8 * 8;
+
+// Tail-call chains return to the outer loop after this many instructions so the stack stays bounded without TCO
+constexpr uint64_t kTailChainLength = 256;
+
+constexpr uint16_t handler_index(size_t alu_index, bool reads_m, uint8_t dest, uint8_t jump) {
+    return kHandlerFirstC + ((alu_index * 2 + (reads_m ? 1 : 0)) * 8 + dest) * 8 + jump;
+}
+
+int canonical_alu_index(uint8_t op) {
+    for (size_t index = 0; index < kCanonicalAluCount; index += 1) {
+        if (kCanonicalAluOps[index] == op) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+inline uint16_t next_pc(uint16_t pc) {
+    return (pc + 1) & kAddressMask;
+}
+
+// alu_compute with the comp code folded away; the compiler will not always inline the switch by itself
+template <uint8_t Op>
+HACK_ALWAYS_INLINE uint16_t alu_fixed(uint16_t x, uint16_t y) {
+    if constexpr (Op == kAluZero) return 0;
+    else if constexpr (Op == kAluOne) return 1;
+    else if constexpr (Op == kAluMinusOne) return 0xffff;
+    else if constexpr (Op == kAluX) return x;
+    else if constexpr (Op == kAluY) return y;
+    else if constexpr (Op == kAluNotX) return ~x;
+    else if constexpr (Op == kAluNotY) return ~y;
+    else if constexpr (Op == kAluNegX) return -x;
+    else if constexpr (Op == kAluNegY) return -y;
+    else if constexpr (Op == kAluXPlus1) return x + 1;
+    else if constexpr (Op == kAluYPlus1) return y + 1;
+    else if constexpr (Op == kAluXMinus1) return x - 1;
+    else if constexpr (Op == kAluYMinus1) return y - 1;
+    else if constexpr (Op == kAluXPlusY) return x + y;
+    else if constexpr (Op == kAluXMinusY) return x - y;
+    else if constexpr (Op == kAluYMinusX) return y - x;
+    else if constexpr (Op == kAluXAndY) return x & y;
+    else if constexpr (Op == kAluXOrY) return x | y;
+    else return alu_compute(Op, x, y);
+}
+
+// One C-instruction with every field known at compile time; returns the next pc
+template <uint8_t Alu, bool ReadsM, uint8_t Dest, uint8_t Jump>
+HACK_ALWAYS_INLINE uint16_t execute_c(uint16_t& a, uint16_t& d, uint16_t* ram, uint16_t pc) {
+    const uint16_t address = a & kAddressMask;
+    const uint16_t out = alu_fixed<Alu>(d, ReadsM ? ram[address] : a);
+
+    if constexpr ((Dest & kDestM) != 0) {
+        if (address < kKeyboardAddress) {
+            ram[address] = out;
+        }
+    }
+    if constexpr ((Dest & kDestD) != 0) {
+        d = out;
+    }
+    if constexpr ((Dest & kDestA) != 0) {
+        a = out;
+    }
+
+    if constexpr (Jump == 0) {
+        return next_pc(pc);
+    } else if constexpr (Jump == 0b111) {
+        return address;
+    } else {
+        return jump_taken(Jump, out) ? address : next_pc(pc);
+    }
+}
+
+// A C-instruction with a non-canonical comp code, decoded as it runs
+inline uint16_t execute_generic(uint16_t word, uint16_t& a, uint16_t& d, uint16_t* ram, uint16_t pc) {
+    const decoded_instruction instr = decode_instruction(word);
+    const uint16_t address = a & kAddressMask;
+    const uint16_t out = alu_compute(instr.alu, d, instr.reads_m ? ram[address] : a);
+
+    if ((instr.dest & kDestM) && address < kKeyboardAddress) {
+        ram[address] = out;
+    }
+    if (instr.dest & kDestD) {
+        d = out;
+    }
+    if (instr.dest & kDestA) {
+        a = out;
+    }
+    return jump_taken(instr.jump, out) ? address : next_pc(pc);
+}
+
+// Expands X(alu, m, dest, jump) for every handler after kHandlerFirstC, in handler_index order
+#define HACK_JUMPS(X, alu, m, dest) \
+    X(alu, m, dest, 0) X(alu, m, dest, 1) X(alu, m, dest, 2) X(alu, m, dest, 3) \
+    X(alu, m, dest, 4) X(alu, m, dest, 5) X(alu, m, dest, 6) X(alu, m, dest, 7)
+#define HACK_DESTS(X, alu, m) \
+    HACK_JUMPS(X, alu, m, 0) HACK_JUMPS(X, alu, m, 1) HACK_JUMPS(X, alu, m, 2) HACK_JUMPS(X, alu, m, 3) \
+    HACK_JUMPS(X, alu, m, 4) HACK_JUMPS(X, alu, m, 5) HACK_JUMPS(X, alu, m, 6) HACK_JUMPS(X, alu, m, 7)
+#define HACK_READS(X, alu) HACK_DESTS(X, alu, 0) HACK_DESTS(X, alu, 1)
+#define HACK_COMBINATIONS(X) \
+    HACK_READS(X, 0) HACK_READS(X, 1) HACK_READS(X, 2) HACK_READS(X, 3) HACK_READS(X, 4) HACK_READS(X, 5) \
+    HACK_READS(X, 6) HACK_READS(X, 7) HACK_READS(X, 8) HACK_READS(X, 9) HACK_READS(X, 10) HACK_READS(X, 11) \
+    HACK_READS(X, 12) HACK_READS(X, 13) HACK_READS(X, 14) HACK_READS(X, 15) HACK_READS(X, 16) HACK_READS(X, 17)
+
+static_assert(kCanonicalAluCount == 18, "HACK_COMBINATIONS expands 18 comp codes");
+
+struct tail_context {
+    const threaded_op* code;
+    uint16_t* ram;
+    uint16_t a;
+    uint16_t d;
+    uint16_t pc;
+    uint64_t budget;
+    bool halted;
+    bool stopped;
+};
+
+using tail_handler = void (*)(tail_context& ctx, uint16_t pc, uint16_t a, uint16_t d, uint64_t budget);
+
+struct tail_table {
+    static const std::array<tail_handler, kHandlerCount> handlers;
+};
+
+#define HACK_TAIL_DISPATCH() \
+    if (--budget == 0) { \
+        ctx.a = a; \
+        ctx.d = d; \
+        ctx.pc = pc; \
+        ctx.budget = 0; \
+        return; \
+    } \
+    HACK_MUSTTAIL return tail_table::handlers[ctx.code[pc].handler](ctx, pc, a, d, budget)
+
+void tail_a(tail_context& ctx, uint16_t pc, uint16_t a, uint16_t d, uint64_t budget) {
+    a = ctx.code[pc].constant;
+    pc = next_pc(pc);
+    HACK_TAIL_DISPATCH();
+}
+
+void tail_halt(tail_context& ctx, uint16_t pc, uint16_t a, uint16_t d, uint64_t budget) {
+    ctx.a = a;
+    ctx.d = d;
+    ctx.pc = pc;
+    ctx.budget = budget;
+    ctx.halted = true;
+}
+
+void tail_poll(tail_context& ctx, uint16_t pc, uint16_t a, uint16_t d, uint64_t budget) {
+    ctx.a = a;
+    ctx.d = d;
+    ctx.pc = pc;
+    ctx.budget = budget;
+    ctx.stopped = true;
+}
+
+void tail_generic(tail_context& ctx, uint16_t pc, uint16_t a, uint16_t d, uint64_t budget) {
+    pc = execute_generic(ctx.code[pc].constant, a, d, ctx.ram, pc);
+    HACK_TAIL_DISPATCH();
+}
+
+template <uint8_t Alu, bool ReadsM, uint8_t Dest, uint8_t Jump>
+void tail_c(tail_context& ctx, uint16_t pc, uint16_t a, uint16_t d, uint64_t budget) {
+    pc = execute_c<Alu, ReadsM, Dest, Jump>(a, d, ctx.ram, pc);
+    HACK_TAIL_DISPATCH();
+}
+
+#undef HACK_TAIL_DISPATCH
+
+template <size_t Index>
+constexpr tail_handler make_tail_handler() {
+    if constexpr (Index == kHandlerA) {
+        return &tail_a;
+    } else if constexpr (Index == kHandlerHalt) {
+        return &tail_halt;
+    } else if constexpr (Index == kHandlerPoll) {
+        return &tail_poll;
+    } else if constexpr (Index == kHandlerGeneric) {
+        return &tail_generic;
+    } else {
+        constexpr size_t combination = Index - kHandlerFirstC;
+        return &tail_c<kCanonicalAluOps[combination / 128], ((combination / 64) % 2) != 0, (combination / 8) % 8, combination % 8>;
+    }
+}
+
+template <size_t... Indices>
+constexpr std::array<tail_handler, sizeof...(Indices)> make_tail_handlers(std::index_sequence<Indices...>) {
+    return { make_tail_handler<Indices>()... };
+}
+
+const std::array<tail_handler, kHandlerCount> tail_table::handlers = make_tail_handlers(std::make_index_sequence<kHandlerCount>());
+
+}
+
+void ThreadedCode::translate(const std::vector<decoded_instruction>& decoded, const buffer& program) {
+    ops.resize(decoded.size());
+
+    for (size_t address = 0; address < decoded.size(); address += 1) {
+        const decoded_instruction& instr = decoded[address];
+        if (instr.is_a) {
+            ops[address] = { instr.halt ? kHandlerHalt : instr.poll ? kHandlerPoll : kHandlerA, instr.constant };
+            continue;
+        }
+
+        const int alu_index = canonical_alu_index(instr.alu);
+        if (alu_index < 0) {
+            ops[address] = { kHandlerGeneric, program[address] };
+            continue;
+        }
+        ops[address] = { handler_index(alu_index, instr.reads_m, instr.dest, instr.jump), 0 };
+    }
+}
+
+size_t ThreadedCode::handlers_used() const {
+    std::set<uint16_t> used;
+    for (const threaded_op& op : ops) {
+        used.insert(op.handler);
+    }
+    return used.size();
+}
+
+uint64_t ThreadedCode::run_computed_goto(cpu_state* cpu, uint16_t* ram, uint64_t max_cycles, bool* halted) const {
+#if defined(__GNUC__)
+#define HACK_LABEL_NAME(alu, m, dest, jump) op_c_##alu##_##m##_##dest##_##jump
+#define HACK_LABEL_ADDRESS(alu, m, dest, jump) &&HACK_LABEL_NAME(alu, m, dest, jump),
+#define HACK_LABEL_BODY(alu, m, dest, jump) \
+    HACK_LABEL_NAME(alu, m, dest, jump): \
+        pc = execute_c<kCanonicalAluOps[alu], m != 0, dest, jump>(a, d, ram, pc); \
+        HACK_DISPATCH();
+#define HACK_DISPATCH() \
+    if (remaining == 0) { \
+        goto done; \
+    } \
+    remaining -= 1; \
+    goto *labels[code[pc].handler]
+
+    static void* const labels[kHandlerCount] = {
+        &&op_a, &&op_halt, &&op_poll, &&op_generic,
+        HACK_COMBINATIONS(HACK_LABEL_ADDRESS)
+    };
+
+    const threaded_op* code = ops.data();
+    uint16_t a = cpu->a;
+    uint16_t d = cpu->d;
+    uint16_t pc = cpu->pc;
+    uint64_t remaining = max_cycles;
+
+    HACK_DISPATCH();
+
+op_a:
+    a = code[pc].constant;
+    pc = next_pc(pc);
+    HACK_DISPATCH();
+
+op_halt:
+    // The halt loop itself is not counted as executed
+    *halted = true;
+    remaining += 1;
+    goto done;
+
+op_poll:
+    remaining += 1;
+    goto done;
+
+op_generic:
+    pc = execute_generic(code[pc].constant, a, d, ram, pc);
+    HACK_DISPATCH();
+
+    HACK_COMBINATIONS(HACK_LABEL_BODY)
+
+done:
+    cpu->a = a;
+    cpu->d = d;
+    cpu->pc = pc;
+    const uint64_t executed = max_cycles - remaining;
+    cpu->cycles += executed;
+    return executed;
+
+#undef HACK_DISPATCH
+#undef HACK_LABEL_BODY
+#undef HACK_LABEL_ADDRESS
+#undef HACK_LABEL_NAME
+#else
+    return run_tail_call(cpu, ram, max_cycles, halted);
+#endif
+}
+
+uint64_t ThreadedCode::run_tail_call(cpu_state* cpu, uint16_t* ram, uint64_t max_cycles, bool* halted) const {
+    tail_context ctx { ops.data(), ram, cpu->a, cpu->d, cpu->pc, 0, false, false };
+
+    uint64_t executed = 0;
+    while (executed < max_cycles && !ctx.halted && !ctx.stopped) {
+        const uint64_t chain = std::min(max_cycles - executed, kTailChainLength);
+        tail_table::handlers[ctx.code[ctx.pc].handler](ctx, ctx.pc, ctx.a, ctx.d, chain);
+        executed += chain - ctx.budget;
+    }
+
+    cpu->a = ctx.a;
+    cpu->d = ctx.d;
+    cpu->pc = ctx.pc;
+    cpu->cycles += executed;
+    if (ctx.halted) {
+        *halted = true;
+    }
+    return executed;
+}
+
+uint64_t run_switch(const buffer& program, cpu_state* cpu, uint16_t* ram, uint64_t max_cycles, bool* halted, bool polls) {
+    uint16_t a = cpu->a;
+    uint16_t d = cpu->d;
+    uint16_t pc = cpu->pc;
+
+    uint64_t count = 0;
+    while (count < max_cycles) {
+        const uint16_t word = pc < program.size() ? program[pc] : 0;
+
+        if ((word & 0x8000) == 0) {
+            if (word == pc && pc + 1u < program.size() && is_unconditional_jump(program[pc + 1])) {
+                *halted = true;
+                break;
+            }
+            if (polls && word == kKeyboardAddress) {
+                break;
+            }
+            a = word;
+            pc = next_pc(pc);
+            count += 1;
+            continue;
+        }
+
+        const uint16_t address = a & kAddressMask;
+        const uint16_t x = d;
+        const uint16_t y = (word & 0x1000) ? ram[address] : a;
+
+        uint16_t out;
+        switch ((word >> 6) & 0b111111) {
+            case kAluZero: out = 0; break;
+            case kAluOne: out = 1; break;
+            case kAluMinusOne: out = 0xffff; break;
+            case kAluX: out = x; break;
+            case kAluY: out = y; break;
+            case kAluNotX: out = ~x; break;
+            case kAluNotY: out = ~y; break;
+            case kAluNegX: out = -x; break;
+            case kAluNegY: out = -y; break;
+            case kAluXPlus1: out = x + 1; break;
+            case kAluYPlus1: out = y + 1; break;
+            case kAluXMinus1: out = x - 1; break;
+            case kAluYMinus1: out = y - 1; break;
+            case kAluXPlusY: out = x + y; break;
+            case kAluXMinusY: out = x - y; break;
+            case kAluYMinusX: out = y - x; break;
+            case kAluXAndY: out = x & y; break;
+            case kAluXOrY: out = x | y; break;
+            default: out = alu_compute((word >> 6) & 0b111111, x, y); break;
+        }
+
+        if ((word & 0x0008) && address < kKeyboardAddress) {
+            ram[address] = out;
+        }
+        if (word & 0x0010) {
+            d = out;
+        }
+        if (word & 0x0020) {
+            a = out;
+        }
+
+        bool taken;
+        const int16_t value = static_cast<int16_t>(out);
+        switch (word & 0b111) {
+            case 0: taken = false; break;
+            case 1: taken = value > 0; break;
+            case 2: taken = value == 0; break;
+            case 3: taken = value >= 0; break;
+            case 4: taken = value < 0; break;
+            case 5: taken = value != 0; break;
+            case 6: taken = value <= 0; break;
+            default: taken = true; break;
+        }
+
+        pc = taken ? address : next_pc(pc);
+        count += 1;
+    }
+
+    cpu->a = a;
+    cpu->d = d;
+    cpu->pc = pc;
+    cpu->cycles += count;
+    return count;
+}
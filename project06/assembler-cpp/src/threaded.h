@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "assembler.h"
+#include "hackcpu.h"
+
+enum class dispatch_mode {
+    kComputedGoto,
+    kTailCall,
+};
+
+// A ROM word translated to the index of a handler specialized for its comp, dest and jump fields
+struct threaded_op {
+    uint16_t handler;
+    uint16_t constant;
+};
+
+// ROM pre-translated into threaded code
+class ThreadedCode {
+public:
+    void translate(const std::vector<decoded_instruction>& decoded, const buffer& program);
+
+    template <dispatch_mode Mode>
+    uint64_t run(cpu_state* cpu, uint16_t* ram, uint64_t max_cycles, bool* halted) const {
+        if constexpr (Mode == dispatch_mode::kComputedGoto) {
+            return run_computed_goto(cpu, ram, max_cycles, halted);
+        } else {
+            return run_tail_call(cpu, ram, max_cycles, halted);
+        }
+    }
+
+    // Number of distinct handlers the translated program uses
+    size_t handlers_used() const;
+
+private:
+    uint64_t run_computed_goto(cpu_state* cpu, uint16_t* ram, uint64_t max_cycles, bool* halted) const;
+    uint64_t run_tail_call(cpu_state* cpu, uint16_t* ram, uint64_t max_cycles, bool* halted) const;
+
+    std::vector<threaded_op> ops;
+};
+
+// Baseline interpreter that decodes every word each time it executes; with polls it stops in front of every @KBD
+uint64_t run_switch(const buffer& program, cpu_state* cpu, uint16_t* ram, uint64_t max_cycles, bool* halted, bool polls);
@@ -0,0 +1,125 @@
+#include "codegen_metrics.h"
+
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string_view>
+#include <tuple>
+#include <utility>
+
+namespace {
+
+using metrics_key = std::pair<std::string, std::string>;
+
+std::map<metrics_key, codegen_metrics> by_key(const std::vector<codegen_metrics>& metrics) {
+    std::map<metrics_key, codegen_metrics> entries;
+    for (const codegen_metrics& entry : metrics) {
+        entries[{ entry.program, entry.setting }] = entry;
+    }
+    return entries;
+}
+
+std::string delta(uint64_t now, uint64_t before) {
+    if (now == before) {
+        return "";
+    }
+    const double change = 100.0 * (static_cast<double>(now) - static_cast<double>(before)) / std::max<uint64_t>(before, 1);
+    return fmt::format("({:+.1f}%)", change);
+}
+
+}
+
+tl::expected<std::vector<codegen_metrics>, std::string> read_codegen_baseline(const std::filesystem::path& path) {
+    std::ifstream file(path);
+    if (!file) {
+        return tl::unexpected(fmt::format("Cannot read {}: {}", path.string(), std::strerror(errno)));
+    }
+
+    std::vector<codegen_metrics> metrics;
+    std::string line;
+    for (size_t number = 1; std::getline(file, line); number += 1) {
+        const size_t comment = line.find('#');
+        if (comment != std::string::npos) {
+            line.erase(comment);
+        }
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        codegen_metrics entry {};
+        std::string rest;
+        if (!(fields >> entry.program >> entry.setting >> entry.rom_words >> entry.cycles) || (fields >> rest)) {
+            return tl::unexpected(fmt::format("{}:{}: expected \"program setting rom_words cycles\"", path.string(), number));
+        }
+        metrics.push_back(std::move(entry));
+    }
+    return metrics;
+}
+
+tl::expected<void, std::string> write_codegen_baseline(const std::filesystem::path& path, std::vector<codegen_metrics> metrics) {
+    std::sort(metrics.begin(), metrics.end(), [] (const codegen_metrics& a, const codegen_metrics& b) {
+        return std::tie(a.program, a.setting) < std::tie(b.program, b.setting);
+    });
+
+    std::ofstream file(path, std::ios::out | std::ios::trunc);
+    if (!file) {
+        return tl::unexpected(fmt::format("Cannot write {}: {}", path.string(), std::strerror(errno)));
+    }
+    file << "# Translated VM programs: ROM words and instructions run until they halt or run off the end, per codegen setting\n";
+    file << "# program setting rom_words cycles\n";
+    for (const codegen_metrics& entry : metrics) {
+        file << fmt::format("{} {} {} {}\n", entry.program, entry.setting, entry.rom_words, entry.cycles);
+    }
+    file.close();
+    if (!file) {
+        return tl::unexpected(fmt::format("Failed to write {}", path.string()));
+    }
+    return {};
+}
+
+std::vector<codegen_metrics> merge_codegen_metrics(const std::vector<codegen_metrics>& baseline, const std::vector<codegen_metrics>& measured) {
+    std::map<metrics_key, codegen_metrics> entries = by_key(baseline);
+    for (const codegen_metrics& entry : measured) {
+        entries[{ entry.program, entry.setting }] = entry;
+    }
+    std::vector<codegen_metrics> merged;
+    for (auto& [key, entry] : entries) {
+        merged.push_back(std::move(entry));
+    }
+    return merged;
+}
+
+size_t compare_codegen_metrics(const std::vector<codegen_metrics>& measured, const std::vector<codegen_metrics>& baseline, std::ostream& out) {
+    const std::map<metrics_key, codegen_metrics> before = by_key(baseline);
+    size_t regressions = 0;
+    size_t setting_width = std::string_view("setting").size();
+    for (const codegen_metrics& entry : measured) {
+        setting_width = std::max(setting_width, entry.setting.size());
+    }
+    out << fmt::format("{:<20} {:<{}} {:>10} {:>9} {:>12} {:>9}\n", "program", "setting", setting_width, "rom words", "", "cycles", "");
+    for (const codegen_metrics& entry : measured) {
+        const auto found = before.find({ entry.program, entry.setting });
+        std::string status = "new";
+        std::string words_delta;
+        std::string cycles_delta;
+        if (found != before.end()) {
+            const codegen_metrics& old = found->second;
+            words_delta = delta(entry.rom_words, old.rom_words);
+            cycles_delta = delta(entry.cycles, old.cycles);
+            if (entry.rom_words > old.rom_words || entry.cycles > old.cycles) {
+                status = fmt::format("WORSE than {} words, {} cycles", old.rom_words, old.cycles);
+                regressions += 1;
+            } else {
+                status = entry.rom_words < old.rom_words || entry.cycles < old.cycles ? "better" : "";
+            }
+        }
+        out << fmt::format("{:<20} {:<{}} {:>10} {:>9} {:>12} {:>9}  {}\n", entry.program, entry.setting, setting_width, entry.rom_words, words_delta,
+            entry.cycles, cycles_delta, status);
+    }
+    return regressions;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <tl/expected.hpp>
+
+// Size and speed of one program translated with one codegen setting
+struct codegen_metrics {
+    std::string program;
+    std::string setting;
+    uint64_t rom_words;
+    uint64_t cycles;
+};
+
+// A baseline file has one "program setting rom_words cycles" line per entry; blank lines and # comments are ignored
+tl::expected<std::vector<codegen_metrics>, std::string> read_codegen_baseline(const std::filesystem::path& path);
+// Writes the entries sorted by program and setting, so that a change to the baseline diffs line by line
+tl::expected<void, std::string> write_codegen_baseline(const std::filesystem::path& path, std::vector<codegen_metrics> metrics);
+
+// The baseline with every measured entry replaced or added
+std::vector<codegen_metrics> merge_codegen_metrics(const std::vector<codegen_metrics>& baseline, const std::vector<codegen_metrics>& measured);
+
+// Prints every measured entry against its baseline and returns how many got bigger or slower. Entries without a
+// baseline are new and never count
+size_t compare_codegen_metrics(const std::vector<codegen_metrics>& measured, const std::vector<codegen_metrics>& baseline, std::ostream& out);
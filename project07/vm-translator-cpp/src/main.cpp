@@ -2,21 +2,16 @@
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <argparse/argparse.hpp>
 #include <tl/expected.hpp>
+#include <charconv>
 #include <fstream>
 #include <filesystem>
+#include <optional>
 
 #include "vmtranslator.h"
 #include "bootstrap.h"
-
-tl::expected<std::string, std::string> get_file_contents(const std::istream& in) {
-    if (!in) {
-        return tl::unexpected(std::strerror(errno));
-    }
-
-    std::ostringstream contents;
-    contents << in.rdbuf();
-    return contents.str();
-}
+#include "tooling.h"
+#include "vminterpreter.h"
+#include "watcher.h"
 
 tl::expected<bool, std::string> write_file_contents(std::ostream& out, const std::vector<std::string>& lines) {
     if (!out) {
@@ -29,35 +24,6 @@ tl::expected<bool, std::string> write_file_contents(std::ostream& out, const std
     return true;
 }
 
-std::string replace_ext(const std::string& filename, const std::string& ext) {
-    auto dot_index = filename.find_last_of(".");
-    if (dot_index == std::string::npos) {
-        return filename + "." + ext;
-    }
-    return filename.substr(0, dot_index) + "." + ext;
-}
-
-tl::expected<void, std::string> set_logging_level(const std::string& level) {
-    if (level == "trace") {
-        spdlog::set_level(spdlog::level::trace);
-    } else if (level == "debug") {
-        spdlog::set_level(spdlog::level::debug);
-    } else if (level == "info") {
-        spdlog::set_level(spdlog::level::info);
-    } else if (level == "warn") {
-        spdlog::set_level(spdlog::level::warn);
-    } else if (level == "err") {
-        spdlog::set_level(spdlog::level::err);
-    } else if (level == "critical") {
-        spdlog::set_level(spdlog::level::critical);
-    } else if (level == "off") {
-        spdlog::set_level(spdlog::level::off);
-    } else {
-        return tl::unexpected(fmt::format("Invalid argument \"{}\" - allowed options: {{trace, debug, info, warn, err, critical, off}}", level));
-    }
-    return {};
-}
-
 auto main(int argc, char* argv[]) -> int {
     auto logger = spdlog::stderr_color_mt("stderr");
     spdlog::set_default_logger(logger);
@@ -87,6 +53,56 @@ auto main(int argc, char* argv[]) -> int {
         .default_value(false)
         .implicit_value(true);
 
+    program.add_argument("--cache-dir")
+        .help("Directory for cached per-file translations (default: $XDG_CACHE_HOME/vm-translator-cpp or ~/.cache/vm-translator-cpp)")
+        .metavar("CACHE_DIR")
+        .default_value("");
+
+    program.add_argument("--no-cache")
+        .help("Translate every file in a directory instead of reusing cached output")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--intrinsics")
+        .help("Inline calls to these functions instead of calling them: comma-separated multiply, divide, or FUNCTION=multiply and FUNCTION=divide for other names than Math.multiply and Math.divide")
+        .metavar("LIST")
+        .default_value(std::string(""));
+
+    program.add_argument("--outline")
+        .help("Move instruction sequences repeated across the program into subroutines, trading a few cycles for ROM")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--outline-budget")
+        .help("Share of the program's profiled cycles that outlining may add")
+        .metavar("FRACTION")
+        .default_value(std::string("0.05"));
+
+    program.add_argument("--release")
+        .help("Leave comments out of the assembly; use --source-map to keep track of where code came from")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--source-map")
+        .help("Write a binary map from ROM addresses to VM files, lines and functions to PATH, for the emulator's --source-map")
+        .metavar("PATH")
+        .default_value(std::string(""));
+
+    program.add_argument("-w", "--watch")
+        .help("Keep running and rebuild the .asm and .hack outputs whenever a .vm file in DIRECTORY changes")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--check")
+        .help("Run the program in the VM interpreter and the translated code in the emulator, and compare the results")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--check-steps")
+        .help("VM commands the program may run under --check before it counts as not halting")
+        .metavar("STEPS")
+        .default_value(std::string("10000000"));
+
     program.add_argument("filename")
         .help("File to assemble.")
         .default_value("")
@@ -128,13 +144,78 @@ auto main(int argc, char* argv[]) -> int {
         spdlog::info("Translating entire directory: {}", filepath.string());
     }
 
+    codegen_options codegen;
+    if (auto intrinsics = parse_intrinsics(program.get("--intrinsics")); intrinsics.has_value()) {
+        codegen.intrinsics = std::move(intrinsics.value());
+    } else {
+        return args_error(intrinsics.error());
+    }
+    codegen.outline = program.get<bool>("--outline");
+    const std::string budget = program.get("--outline-budget");
+    const auto [budget_end, budget_error] = std::from_chars(budget.data(), budget.data() + budget.size(), codegen.outline_budget);
+    if (budget_error != std::errc() || budget_end != budget.data() + budget.size() || codegen.outline_budget < 0.0) {
+        return args_error(fmt::format("Invalid outline budget: {}", budget));
+    }
+
+    codegen.comments = !program.get<bool>("--release");
+
+    const std::string source_map_path = program.get("--source-map");
+    if (!source_map_path.empty() && write_to_stdout && read_from_stdin) {
+        return args_error("--source-map cannot be used while streaming");
+    }
+
     if (output.empty() && !filepath.filename().empty() && !read_from_stdin) {
         output = replace_ext(filepath.filename(), "asm");
     } else if(output.empty()) {
         output = "out.asm";
     }
 
-    VMTranslator translator;
+    if (program.get<bool>("--watch")) {
+        if (!is_directory || write_to_stdout) {
+            return args_error("--watch requires a DIRECTORY and an output file");
+        }
+        if (!source_map_path.empty()) {
+            return args_error("--source-map cannot be used with --watch");
+        }
+
+        ProjectWatcher watcher(filepath, output, replace_ext(output, "hack"), codegen);
+        if (auto result = watcher.run(); !result.has_value()) {
+            spdlog::error("Watch failed: {}", result.error());
+            return 1;
+        }
+        return 0;
+    }
+
+    const bool check = program.get<bool>("--check");
+    uint64_t check_steps = 0;
+    if (check) {
+        const std::string steps_arg = program.get("--check-steps");
+        if (const auto [ptr, ec] = std::from_chars(steps_arg.data(), steps_arg.data() + steps_arg.size(), check_steps); ec != std::errc() || ptr != steps_arg.data() + steps_arg.size()) {
+            return args_error(fmt::format("Invalid step count: {}", steps_arg));
+        }
+        if (write_to_stdout && read_from_stdin) {
+            return args_error("--check cannot be used while streaming");
+        }
+    }
+
+    VMTranslator translator(codegen);
+
+    // Gets its own copy of every file so the translation can be checked against it
+    std::optional<VMInterpreter> reference;
+    if (check) {
+        reference.emplace();
+    }
+
+    std::optional<TranslationCache> cache;
+    if (is_directory && !program.get<bool>("--no-cache")) {
+        std::filesystem::path cache_dir(program.get("--cache-dir"));
+        if (cache_dir.empty()) {
+            cache_dir = default_cache_directory("vm-translator-cpp");
+        }
+        spdlog::debug("Using translation cache: {}", cache_dir.string());
+        cache.emplace(cache_dir);
+        translator.set_cache(&cache.value());
+    }
 
     if (is_directory) {
         spdlog::debug("Adding boot assembly");
@@ -144,6 +225,19 @@ auto main(int argc, char* argv[]) -> int {
         }
     }
 
+    if (read_from_stdin && write_to_stdout) {
+        spdlog::info("Streaming from STDIN to STDOUT");
+
+        // Unsynced streams buffer stdin, which lets the translator tell when a read would block
+        std::ios::sync_with_stdio(false);
+
+        if (auto result = translator.translate_stream(filepath.stem(), std::cin, std::cout); !result.has_value()) {
+            spdlog::error("Translation failed: {}", result.error());
+            return 1;
+        }
+        return 0;
+    }
+
     if (is_directory) {
         for (auto const& dir_entry : std::filesystem::directory_iterator {filepath}) {
             if (!dir_entry.is_regular_file()) {
@@ -157,20 +251,27 @@ auto main(int argc, char* argv[]) -> int {
             const std::string filename = dir_entry.path();
             spdlog::info("Reading file: {}", filename);
             std::ifstream file(filename, std::ios::in);
-            const auto contents = get_file_contents(file);
+            auto contents = get_file_contents(file);
 
             if (!contents.has_value()) {
                 spdlog::error("Failed to load file: {}", contents.error());
                 return 1;
             }
 
-            if (auto add_result = translator.add_file(dir_entry.path().stem(), contents.value()); !add_result.has_value()) {
+            if (reference.has_value()) {
+                if (auto add_result = reference->add_file(dir_entry.path().stem(), contents.value()); !add_result.has_value()) {
+                    spdlog::error("Add file failed: {}", add_result.error());
+                    return 1;
+                }
+            }
+
+            if (auto add_result = translator.add_file(dir_entry.path().stem(), std::move(contents.value())); !add_result.has_value()) {
                 spdlog::error("Add file failed: {}", add_result.error());
                 return 1;
             }
         }
     } else {
-        const auto contents = ([&] () {
+        auto contents = ([&] () {
             if (read_from_stdin) {
                 spdlog::info("Reading from STDIN");
                 return get_file_contents(std::cin);
@@ -187,7 +288,14 @@ auto main(int argc, char* argv[]) -> int {
             return 1;
         }
 
-        if (auto add_result = translator.add_file(filepath.stem(), contents.value()); !add_result.has_value()) {
+        if (reference.has_value()) {
+            if (auto add_result = reference->add_file(filepath.stem(), contents.value()); !add_result.has_value()) {
+                spdlog::error("Add file failed: {}", add_result.error());
+                return 1;
+            }
+        }
+
+        if (auto add_result = translator.add_file(filepath.stem(), std::move(contents.value())); !add_result.has_value()) {
             spdlog::error("Add file failed: {}", add_result.error());
             return 1;
         }
@@ -216,5 +324,26 @@ auto main(int argc, char* argv[]) -> int {
         return 1;
     }
 
+    if (!source_map_path.empty()) {
+        if (auto saved = translator.source_map().save(source_map_path); !saved.has_value()) {
+            spdlog::error("{}", saved.error());
+            return 1;
+        }
+        spdlog::info("Wrote {} source map entries to {}", translator.source_map().size(), source_map_path);
+    }
+
+    if (reference.has_value()) {
+        if (auto linked = reference->link(); !linked.has_value()) {
+            spdlog::error("Check failed: {}", linked.error());
+            return 1;
+        }
+        const auto checked = check_translation(reference.value(), result.value(), is_directory, !codegen.intrinsics.empty(), check_steps);
+        if (!checked.has_value()) {
+            spdlog::error("Check failed: {}", checked.error());
+            return 1;
+        }
+        spdlog::info("Translation matches the VM interpreter after {} commands", checked.value());
+    }
+
     return 0;
 }
@@ -0,0 +1,573 @@
+#include "outliner.h"
+
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <numeric>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include "assembler.h"
+#include "emulator.h"
+#include "hackcpu.h"
+#include "linescan.h"
+#include "profiler.h"
+
+namespace {
+
+// A call is @return, D=A, @R15, M=D, @subroutine, 0;JMP and the return @R15, A=M, 0;JMP, which also take a cycle
+// each. A sequence ending in a jump is reached with @subroutine, 0;JMP and needs no return
+constexpr int64_t kCallWords = 6;
+constexpr int64_t kReturnWords = 3;
+constexpr int64_t kJumpWords = 2;
+
+const std::vector<std::string> kHalt { "(outlined.halt)", "@outlined.halt", "0;JMP" };
+constexpr int64_t kHaltWords = 2;
+
+// The shortest sequence that can pay for itself, as a jump with at least four call sites
+constexpr size_t kMinLength = 3;
+
+// Guessed runs per enclosing loop, and the deepest nesting that counts, for programs too big to profile
+constexpr double kLoopRuns = 8.0;
+constexpr int kMaxLoopDepth = 5;
+
+struct instruction_info {
+    bool is_a;
+    bool reads_a;
+    bool writes_a;
+    bool reads_d;
+    bool writes_d;
+    bool reads_m;
+    bool writes_m;
+    bool jumps;
+    bool always_jumps;
+    // Names R15, which calls keep the return address in
+    bool barrier;
+};
+
+instruction_info inspect(std::string_view text) {
+    instruction_info info {};
+    if (text.front() == '@') {
+        info.is_a = true;
+        info.writes_a = true;
+        info.barrier = text == "@R15" || text == "@15";
+        return info;
+    }
+
+    const size_t equals = text.find('=');
+    const size_t semicolon = text.find(';');
+    const std::string_view dest = equals == std::string_view::npos ? std::string_view() : text.substr(0, equals);
+    const size_t comp_begin = equals == std::string_view::npos ? 0 : equals + 1;
+    const std::string_view comp = text.substr(comp_begin, semicolon == std::string_view::npos ? std::string_view::npos : semicolon - comp_begin);
+    const std::string_view jump = semicolon == std::string_view::npos ? std::string_view() : text.substr(semicolon + 1);
+
+    // Writing M and jumping both use A as an address
+    info.jumps = !jump.empty();
+    info.always_jumps = jump == "JMP";
+    info.reads_a = comp.find_first_of("AM") != std::string_view::npos || dest.find('M') != std::string_view::npos || info.jumps;
+    info.reads_d = comp.find('D') != std::string_view::npos;
+    info.reads_m = comp.find('M') != std::string_view::npos;
+    info.writes_m = dest.find('M') != std::string_view::npos;
+    info.writes_a = dest.find('A') != std::string_view::npos;
+    info.writes_d = dest.find('D') != std::string_view::npos;
+    return info;
+}
+
+// Suffixes of seq in order, by prefix doubling
+std::vector<int32_t> suffix_array(const std::vector<int32_t>& seq) {
+    const size_t n = seq.size();
+    std::vector<int32_t> sa(n);
+    std::iota(sa.begin(), sa.end(), 0);
+    if (n < 2) {
+        return sa;
+    }
+
+    std::vector<int64_t> rank(seq.begin(), seq.end());
+    std::vector<int64_t> next(n);
+    for (size_t k = 1; ; k <<= 1) {
+        auto key = [&] (int32_t i) {
+            return std::make_pair(rank[i], i + k < n ? rank[i + k] : -1);
+        };
+        std::sort(sa.begin(), sa.end(), [&] (int32_t a, int32_t b) { return key(a) < key(b); });
+        next[sa[0]] = 0;
+        for (size_t i = 1; i < n; i += 1) {
+            next[sa[i]] = next[sa[i - 1]] + (key(sa[i - 1]) < key(sa[i]) ? 1 : 0);
+        }
+        rank.swap(next);
+        if (rank[sa[n - 1]] == static_cast<int64_t>(n - 1) || k >= n) {
+            break;
+        }
+    }
+    return sa;
+}
+
+// lcp[i] is the length of the common prefix of the suffixes at sa[i - 1] and sa[i] (Kasai et al.)
+std::vector<int32_t> lcp_array(const std::vector<int32_t>& seq, const std::vector<int32_t>& sa) {
+    const size_t n = seq.size();
+    std::vector<int32_t> rank(n);
+    for (size_t i = 0; i < n; i += 1) {
+        rank[sa[i]] = i;
+    }
+    std::vector<int32_t> lcp(n, 0);
+    int32_t h = 0;
+    for (size_t i = 0; i < n; i += 1) {
+        if (rank[i] == 0) {
+            h = 0;
+            continue;
+        }
+        const size_t j = sa[rank[i] - 1];
+        while (i + h < n && j + h < n && seq[i + h] == seq[j + h]) {
+            h += 1;
+        }
+        lcp[rank[i]] = h;
+        if (h > 0) {
+            h -= 1;
+        }
+    }
+    return lcp;
+}
+
+struct candidate {
+    // Range of the suffix array whose suffixes all start with the sequence
+    int32_t lb;
+    int32_t rb;
+    int32_t length;
+    bool tail;
+    int64_t estimate;
+};
+
+int64_t words_saved(int64_t sites, int64_t length, bool tail) {
+    return tail ? sites * length - sites * kJumpWords - length : sites * length - sites * kCallWords - length - kReturnWords;
+}
+
+class Outliner {
+public:
+    explicit Outliner(const std::vector<std::string>& lines) : lines(lines) {}
+
+    tl::expected<std::vector<std::string>, std::string> run(double cycle_budget, uint64_t profile_cycles, outline_stats* stats, std::vector<uint32_t>* origins);
+
+private:
+    void tokenize();
+    tl::expected<void, std::string> measure(uint64_t profile_cycles);
+    void find_live_r15();
+    bool a_dead(size_t position) const;
+    bool d_dead(size_t position) const;
+    bool legal(size_t position, size_t length, bool tail) const;
+    std::vector<candidate> find_candidates() const;
+    std::vector<std::string> rewrite(std::vector<uint32_t>* origins) const;
+
+    const std::vector<std::string>& lines;
+
+    // Instructions in program order, which is their ROM address, and the line of each
+    std::vector<std::string_view> texts;
+    std::vector<instruction_info> infos;
+    std::vector<size_t> instruction_lines;
+    std::map<std::string_view, size_t> label_addresses;
+
+    // One token per instruction and label, where labels and barriers get a token of their own that matches nothing
+    std::vector<int32_t> seq;
+    std::vector<int32_t> seq_instruction;
+    std::vector<int32_t> sa;
+
+    // Whether R15 holds a return address that is still to be jumped through, before each instruction
+    std::vector<bool> r15_live;
+
+    std::vector<double> counts;
+    double total_cycles = 0.0;
+    bool profiled = false;
+
+    struct subroutine {
+        size_t first;
+        size_t length;
+        bool tail;
+    };
+    std::vector<subroutine> subroutines;
+    // Subroutine called from each instruction that starts an outlined sequence
+    std::unordered_map<size_t, size_t> call_sites;
+};
+
+void Outliner::tokenize() {
+    std::unordered_map<std::string_view, int32_t> tokens;
+    std::vector<size_t> unique_positions;
+    for (size_t index = 0; index < lines.size(); index += 1) {
+        const std::string_view code = trim_whitespace(trim_comment(lines[index]));
+        if (code.empty()) {
+            continue;
+        }
+        if (code.front() == '(') {
+            label_addresses.emplace(code.substr(1, code.size() - 2), texts.size());
+            unique_positions.push_back(seq.size());
+            seq.push_back(0);
+            seq_instruction.push_back(-1);
+            continue;
+        }
+
+        const instruction_info info = inspect(code);
+        if (info.barrier) {
+            unique_positions.push_back(seq.size());
+            seq.push_back(0);
+        } else {
+            seq.push_back(tokens.emplace(code, tokens.size()).first->second);
+        }
+        seq_instruction.push_back(texts.size());
+        texts.push_back(code);
+        infos.push_back(info);
+        instruction_lines.push_back(index);
+    }
+
+    int32_t unique = tokens.size();
+    for (const size_t position : unique_positions) {
+        seq[position] = unique++;
+    }
+}
+
+tl::expected<void, std::string> Outliner::measure(uint64_t profile_cycles) {
+    counts.assign(texts.size(), 0.0);
+
+    if (texts.size() + kHaltWords <= kRomSize) {
+        // Behind the same halt loop as the output, so a program that runs off its end stops there instead of
+        // wrapping around to address 0
+        std::vector<std::string> halting = lines;
+        halting.insert(halting.end(), kHalt.begin(), kHalt.end());
+        const auto chunk = assemble_chunk(halting);
+        if (!chunk.has_value()) {
+            return tl::unexpected(chunk.error());
+        }
+        std::map<std::string, uint16_t> labels;
+        const auto program = link_chunks({ &chunk.value() }, &labels);
+        if (!program.has_value()) {
+            return tl::unexpected(program.error());
+        }
+
+        Emulator emulator;
+        if (auto loaded = emulator.load(program.value()); !loaded.has_value()) {
+            return tl::unexpected(loaded.error());
+        }
+        Profiler profiler(program.value(), labels);
+        emulator.set_profiler(&profiler);
+        emulator.run(profile_cycles);
+        for (size_t address = 0; address < texts.size(); address += 1) {
+            counts[address] = profiler.executions(address);
+            total_cycles += counts[address];
+        }
+        profiled = true;
+        return {};
+    }
+
+    // The only jump to a label, when it jumps back, closes a loop around everything from the label to the jump.
+    // Labels jumped to from several places are taken for functions, which calls from further down also jump back to
+    std::map<std::string_view, std::vector<size_t>> jumps_to;
+    for (size_t address = 1; address < texts.size(); address += 1) {
+        if (infos[address].jumps && infos[address - 1].is_a) {
+            jumps_to[texts[address - 1].substr(1)].push_back(address);
+        }
+    }
+    std::vector<int> depth(texts.size() + 1, 0);
+    for (const auto& [label, sites] : jumps_to) {
+        const auto target = label_addresses.find(label);
+        if (sites.size() == 1 && target != label_addresses.end() && target->second <= sites.front()) {
+            depth[target->second] += 1;
+            depth[sites.front() + 1] -= 1;
+        }
+    }
+    int nesting = 0;
+    for (size_t address = 0; address < texts.size(); address += 1) {
+        nesting += depth[address];
+        counts[address] = std::pow(kLoopRuns, std::min(nesting, kMaxLoopDepth));
+        total_cycles += counts[address];
+    }
+    return {};
+}
+
+// R15 is live from where a call stores the return address in it to where the routine jumps back through it, and
+// an outlined call in between would overwrite it. Found backwards over the control flow, where a jump through a
+// label goes there, and one through a computed address to any label whose address the program takes
+void Outliner::find_live_r15() {
+    const size_t size = texts.size();
+    std::vector<bool> uses(size, false);
+    std::vector<bool> kills(size, false);
+    std::vector<size_t> taken;
+    for (size_t address = 1; address < size; address += 1) {
+        const instruction_info& info = infos[address];
+        if (infos[address - 1].barrier) {
+            uses[address] = info.reads_m;
+            kills[address] = info.writes_m && !info.reads_m;
+        }
+        if (infos[address - 1].is_a && !info.jumps) {
+            if (const auto label = label_addresses.find(texts[address - 1].substr(1)); label != label_addresses.end()) {
+                taken.push_back(label->second);
+            }
+        }
+    }
+
+    // Jumping somewhere the program does not name, it might as well be needed there
+    auto live_at_target = [&] (size_t address, bool taken_live) {
+        if (!infos[address - 1].is_a) {
+            return taken_live;
+        }
+        const auto label = label_addresses.find(texts[address - 1].substr(1));
+        return label == label_addresses.end() || r15_live[label->second];
+    };
+
+    // Past the end is the halt loop
+    r15_live.assign(size + 1, false);
+    for (bool changed = true; changed; ) {
+        changed = false;
+        const bool taken_live = std::any_of(taken.begin(), taken.end(), [&] (size_t target) { return r15_live[target]; });
+        for (size_t address = size; address-- > 0; ) {
+            const instruction_info& info = infos[address];
+            bool live = uses[address];
+            if (!live && !kills[address]) {
+                live = (!info.always_jumps && r15_live[address + 1]) || (info.jumps && (address == 0 || live_at_target(address, taken_live)));
+            }
+            if (live && !r15_live[address]) {
+                r15_live[address] = true;
+                changed = true;
+            }
+        }
+    }
+}
+
+// Whether A is written before it is read from seq[position] on, giving up at labels, jumps and the end
+bool Outliner::a_dead(size_t position) const {
+    for (; position < seq.size() && seq_instruction[position] >= 0; position += 1) {
+        const instruction_info& info = infos[seq_instruction[position]];
+        if (info.reads_a) {
+            return false;
+        }
+        if (info.writes_a) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Outliner::d_dead(size_t position) const {
+    for (; position < seq.size() && seq_instruction[position] >= 0; position += 1) {
+        const instruction_info& info = infos[seq_instruction[position]];
+        if (info.reads_d || info.jumps) {
+            return false;
+        }
+        if (info.writes_d) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The call site clobbers A, and D and R15 too unless it is a jump; a return clobbers A
+bool Outliner::legal(size_t position, size_t length, bool tail) const {
+    if (!a_dead(position)) {
+        return false;
+    }
+    return tail || (!r15_live[seq_instruction[position]] && d_dead(position) && a_dead(position + length));
+}
+
+// Every repeat is an lcp-interval of the suffix array, found bottom-up with a stack (Abouelhoda et al.). Each
+// gives up to three lengths: the whole repeat, the longest prefix followed by an A-instruction, after which A is
+// dead wherever it occurs, and the longest prefix ending in a jump
+std::vector<candidate> Outliner::find_candidates() const {
+    const std::vector<int32_t> lcp = lcp_array(seq, sa);
+    std::vector<candidate> candidates;
+
+    auto report = [&] (int32_t length, int32_t lb, int32_t rb) {
+        if (length < static_cast<int32_t>(kMinLength)) {
+            return;
+        }
+        const size_t start = sa[lb];
+        const int64_t sites = rb - lb + 1;
+        std::vector<int32_t> lengths { length };
+        for (int32_t prefix = length - 1; prefix >= static_cast<int32_t>(kMinLength); prefix -= 1) {
+            if (infos[seq_instruction[start + prefix]].is_a) {
+                lengths.push_back(prefix);
+                break;
+            }
+        }
+        for (int32_t prefix = length; prefix >= static_cast<int32_t>(kMinLength); prefix -= 1) {
+            if (infos[seq_instruction[start + prefix - 1]].always_jumps) {
+                lengths.push_back(prefix);
+                break;
+            }
+        }
+        std::sort(lengths.begin(), lengths.end());
+        lengths.erase(std::unique(lengths.begin(), lengths.end()), lengths.end());
+        for (const int32_t candidate_length : lengths) {
+            const bool tail = infos[seq_instruction[start + candidate_length - 1]].always_jumps;
+            const int64_t estimate = words_saved(sites, candidate_length, tail);
+            if (estimate > 0) {
+                candidates.push_back(candidate { lb, rb, candidate_length, tail, estimate });
+            }
+        }
+    };
+
+    std::vector<std::pair<int32_t, int32_t>> stack { { 0, 0 } };
+    for (size_t i = 1; i <= seq.size(); i += 1) {
+        const int32_t height = i < seq.size() ? lcp[i] : 0;
+        int32_t lb = i - 1;
+        while (height < stack.back().first) {
+            const auto [length, begin] = stack.back();
+            stack.pop_back();
+            report(length, begin, i - 1);
+            lb = begin;
+        }
+        if (height > stack.back().first) {
+            stack.emplace_back(height, lb);
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end(), [] (const candidate& a, const candidate& b) {
+        return a.estimate > b.estimate;
+    });
+    return candidates;
+}
+
+std::vector<std::string> Outliner::rewrite(std::vector<uint32_t>* origins) const {
+    std::vector<std::string> out;
+    out.reserve(lines.size());
+    origins->clear();
+    auto emit = [&] (std::string instruction, size_t origin) {
+        out.push_back(std::move(instruction));
+        origins->push_back(origin);
+    };
+
+    size_t skip_until = 0;
+    size_t returns = 0;
+    for (size_t index = 0, instruction = 0; index < lines.size(); index += 1) {
+        if (instruction >= instruction_lines.size() || instruction_lines[instruction] != index) {
+            out.push_back(lines[index]);
+            continue;
+        }
+        const size_t address = instruction++;
+        if (address < skip_until) {
+            continue;
+        }
+        const auto site = call_sites.find(address);
+        if (site == call_sites.end()) {
+            emit(lines[index], address);
+            continue;
+        }
+
+        const subroutine& called = subroutines[site->second];
+        const std::string name = fmt::format("outlined.{}", site->second);
+        if (!called.tail) {
+            // Not "$ret.", which the profiler would take for the return of a function
+            const std::string return_label = fmt::format("{}.ret.{}", name, returns++);
+            emit(fmt::format("@{}", return_label), address);
+            emit("D=A", address);
+            emit("@R15", address);
+            emit("M=D", address);
+            emit(fmt::format("@{}", name), address);
+            emit("0;JMP", address);
+            out.push_back(fmt::format("({})", return_label));
+        } else {
+            emit(fmt::format("@{}", name), address);
+            emit("0;JMP", address);
+        }
+        skip_until = address + called.length;
+    }
+
+    // Outlined sequences go behind a halt loop, which belongs to the last instruction, in case the program runs off
+    // its end. They belong to the instructions they were taken from the first time
+    out.push_back(kHalt[0]);
+    emit(kHalt[1], texts.size() - 1);
+    emit(kHalt[2], texts.size() - 1);
+    for (size_t index = 0; index < subroutines.size(); index += 1) {
+        const subroutine& outlined = subroutines[index];
+        out.push_back(fmt::format("(outlined.{})", index));
+        for (size_t address = outlined.first; address < outlined.first + outlined.length; address += 1) {
+            emit(std::string(texts[address]), address);
+        }
+        if (!outlined.tail) {
+            const size_t last = outlined.first + outlined.length - 1;
+            emit("@R15", last);
+            emit("A=M", last);
+            emit("0;JMP", last);
+        }
+    }
+    return out;
+}
+
+tl::expected<std::vector<std::string>, std::string> Outliner::run(double cycle_budget, uint64_t profile_cycles, outline_stats* stats, std::vector<uint32_t>* origins) {
+    tokenize();
+    find_live_r15();
+    if (auto measured = measure(profile_cycles); !measured.has_value()) {
+        return tl::unexpected(measured.error());
+    }
+    sa = suffix_array(seq);
+
+    double budget = cycle_budget * total_cycles;
+    double added = 0.0;
+    int64_t saved = 0;
+    std::vector<bool> used(seq.size(), false);
+    for (const candidate& next : find_candidates()) {
+        std::vector<size_t> starts(sa.begin() + next.lb, sa.begin() + next.rb + 1);
+        std::sort(starts.begin(), starts.end());
+
+        std::vector<size_t> free;
+        size_t free_from = 0;
+        for (const size_t start : starts) {
+            if (start < free_from || std::any_of(used.begin() + start, used.begin() + start + next.length, [] (bool taken) { return taken; })) {
+                continue;
+            }
+            if (legal(start, next.length, next.tail)) {
+                free.push_back(start);
+                free_from = start + next.length;
+            }
+        }
+
+        // Coldest sites first, for as long as the cycles they add fit the budget
+        std::sort(free.begin(), free.end(), [&] (size_t a, size_t b) {
+            return counts[seq_instruction[a]] < counts[seq_instruction[b]];
+        });
+        const double overhead = next.tail ? kJumpWords : kCallWords + kReturnWords;
+        double cost = 0.0;
+        size_t sites = 0;
+        while (sites < free.size() && cost + overhead * counts[seq_instruction[free[sites]]] <= budget) {
+            cost += overhead * counts[seq_instruction[free[sites]]];
+            sites += 1;
+        }
+        if (words_saved(sites, next.length, next.tail) <= 0) {
+            continue;
+        }
+
+        budget -= cost;
+        added += cost;
+        saved += words_saved(sites, next.length, next.tail);
+        const size_t id = subroutines.size();
+        subroutines.push_back(subroutine { static_cast<size_t>(seq_instruction[free[0]]), static_cast<size_t>(next.length), next.tail });
+        for (size_t site = 0; site < sites; site += 1) {
+            std::fill(used.begin() + free[site], used.begin() + free[site] + next.length, true);
+            call_sites.emplace(seq_instruction[free[site]], id);
+        }
+    }
+
+    if (saved <= kHaltWords) {
+        if (stats != nullptr) {
+            *stats = outline_stats { texts.size(), texts.size(), 0, 0, 0, static_cast<uint64_t>(total_cycles), profiled };
+        }
+        if (origins != nullptr) {
+            origins->resize(texts.size());
+            std::iota(origins->begin(), origins->end(), 0);
+        }
+        return lines;
+    }
+
+    std::vector<uint32_t> kept;
+    std::vector<std::string> out = rewrite(origins != nullptr ? origins : &kept);
+    const size_t words_after = origins != nullptr ? origins->size() : kept.size();
+    spdlog::info("Outlined {} sequences into {} subroutines: {} words down to {}, adding {:.0f} of {:.0f} {} cycles",
+        call_sites.size(), subroutines.size(), texts.size(), words_after, added, total_cycles, profiled ? "profiled" : "estimated");
+    if (stats != nullptr) {
+        *stats = outline_stats { texts.size(), words_after, subroutines.size(), call_sites.size(), static_cast<uint64_t>(added),
+            static_cast<uint64_t>(total_cycles), profiled };
+    }
+    return out;
+}
+
+}
+
+tl::expected<std::vector<std::string>, std::string> outline_program(const std::vector<std::string>& lines, double cycle_budget, uint64_t profile_cycles, outline_stats* stats, std::vector<uint32_t>* origins) {
+    return Outliner(lines).run(cycle_budget, profile_cycles, stats, origins);
+}
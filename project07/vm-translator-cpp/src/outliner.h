@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <tl/expected.hpp>
+
+struct outline_stats {
+    size_t words_before;
+    size_t words_after;
+    size_t subroutines;
+    size_t call_sites;
+    // Cycles the call sites add to the profiled run, or to the static estimate when the program was too big to run
+    uint64_t added_cycles;
+    uint64_t profiled_cycles;
+    bool profiled;
+};
+
+// Procedural abstraction of a whole assembly program: instruction sequences repeated across it, found with a
+// suffix array, become subroutines. A call site stores its return address in R15 and jumps there, and the
+// subroutine jumps back through R15; a sequence that ends in an unconditional jump is jumped to and never returns.
+// A sequence is only taken out where neither register is live across the call: D must be written before it is
+// read, and A after returning. Labels and instructions naming R15 are never part of a sequence.
+//
+// How often each instruction runs comes from running the program from address 0 for up to profile_cycles, or,
+// when it is too big for ROM, from a guess of 8 runs per enclosing loop. Call sites are picked coldest first, and
+// the cycles they add stay within cycle_budget of the total.
+//
+// origins receives, for every instruction of the result, the address in the input of the instruction it stands for
+tl::expected<std::vector<std::string>, std::string> outline_program(const std::vector<std::string>& lines, double cycle_budget, uint64_t profile_cycles, outline_stats* stats = nullptr, std::vector<uint32_t>* origins = nullptr);
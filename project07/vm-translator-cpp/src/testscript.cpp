@@ -0,0 +1,1139 @@
+#include "testscript.h"
+
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <sstream>
+
+#include "assembler.h"
+#include "bootstrap.h"
+#include "compile.h"
+#include "netlist.h"
+#include "profiler.h"
+#include "simulator.h"
+#include "tooling.h"
+#include "trace.h"
+#include "verify.h"
+#include "vminterpreter.h"
+#include "vmtranslator.h"
+
+namespace {
+
+struct script_token {
+    std::string_view text;
+    size_t line;
+};
+
+bool is_separator(char c) {
+    return c == ',' || c == ';' || c == '!' || c == '{' || c == '}';
+}
+
+bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+tl::expected<std::vector<script_token>, std::string> tokenize_script(std::string_view source) {
+    std::vector<script_token> tokens;
+    size_t line = 1;
+    size_t i = 0;
+
+    while (i < source.size()) {
+        const char c = source[i];
+        if (c == '\n') {
+            line += 1;
+            i += 1;
+        } else if (is_space(c)) {
+            i += 1;
+        } else if (source.compare(i, 2, "//") == 0) {
+            i = std::min(source.find('\n', i), source.size());
+        } else if (source.compare(i, 2, "/*") == 0) {
+            const size_t end = source.find("*/", i + 2);
+            if (end == std::string_view::npos) {
+                return tl::unexpected(fmt::format("Line {}: unterminated comment", line));
+            }
+            line += std::count(source.begin() + i, source.begin() + end, '\n');
+            i = end + 2;
+        } else if (c == '"') {
+            const size_t end = source.find('"', i + 1);
+            if (end == std::string_view::npos) {
+                return tl::unexpected(fmt::format("Line {}: unterminated string", line));
+            }
+            tokens.push_back({ source.substr(i + 1, end - i - 1), line });
+            i = end + 1;
+        } else if (is_separator(c)) {
+            tokens.push_back({ source.substr(i, 1), line });
+            i += 1;
+        } else {
+            const size_t begin = i;
+            while (i < source.size() && !is_space(source[i]) && !is_separator(source[i]) && source.compare(i, 2, "//") != 0) {
+                i += 1;
+            }
+            tokens.push_back({ source.substr(begin, i - begin), line });
+        }
+    }
+    return tokens;
+}
+
+tl::expected<int64_t, std::string> parse_integer(std::string_view text) {
+    int64_t value = 0;
+    const auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (ec != std::errc() || ptr != text.data() + text.size()) {
+        return tl::unexpected(fmt::format("Invalid number: {}", text));
+    }
+    return value;
+}
+
+// RAM[256]%D2.6.2; hardware scripts may leave out the format of single-bit pins, which means %B1.1.1
+tl::expected<output_column, std::string> parse_output_column(std::string_view text) {
+    const size_t percent = text.find('%');
+    if (percent == std::string_view::npos && !text.empty()) {
+        return output_column { std::string(text), 'B', 1, 1, 1 };
+    }
+    if (percent == std::string_view::npos || percent + 1 >= text.size()) {
+        return tl::unexpected(fmt::format("Invalid output column: {}", text));
+    }
+
+    output_column column { std::string(text.substr(0, percent)), text[percent + 1], 0, 0, 0 };
+    uint8_t* fields[] = { &column.left, &column.width, &column.right };
+
+    std::string_view rest = text.substr(percent + 2);
+    for (size_t index = 0; index < 3; index += 1) {
+        const size_t dot = rest.find('.');
+        const auto value = parse_integer(rest.substr(0, dot));
+        if (!value.has_value() || value.value() < 0 || value.value() > 64 || (index < 2) == (dot == std::string_view::npos)) {
+            return tl::unexpected(fmt::format("Invalid output column: {}", text));
+        }
+        *fields[index] = value.value();
+        rest = dot == std::string_view::npos ? std::string_view() : rest.substr(dot + 1);
+    }
+
+    if (column.format != 'D' && column.format != 'X' && column.format != 'B' && column.format != 'S') {
+        return tl::unexpected(fmt::format("Invalid output format in column: {}", text));
+    }
+    return column;
+}
+
+tl::expected<script_command, std::string> make_command(std::string_view word, const std::vector<std::string_view>& args, size_t line) {
+    script_command command { script_command_kind::kIgnored, std::string(word), "", 0, {}, {}, line };
+
+    auto need_args = [&] (size_t count) -> tl::expected<void, std::string> {
+        if (args.size() < count) {
+            return tl::unexpected(fmt::format("Line {}: {} expects {} argument(s)", line, word, count));
+        }
+        return {};
+    };
+
+    if (word == "load") {
+        command.kind = script_command_kind::kLoad;
+        command.name = args.empty() ? "" : std::string(args[0]);
+    } else if (word == "output-file" || word == "compare-to") {
+        if (auto result = need_args(1); !result.has_value()) {
+            return tl::unexpected(result.error());
+        }
+        command.kind = word == "output-file" ? script_command_kind::kOutputFile : script_command_kind::kCompareTo;
+        command.name = args[0];
+    } else if (word == "output-list") {
+        command.kind = script_command_kind::kOutputList;
+        for (const std::string_view arg : args) {
+            auto column = parse_output_column(arg);
+            if (!column.has_value()) {
+                return tl::unexpected(fmt::format("Line {}: {}", line, column.error()));
+            }
+            command.columns.push_back(std::move(column.value()));
+        }
+    } else if (word == "set") {
+        if (auto result = need_args(2); !result.has_value()) {
+            return tl::unexpected(result.error());
+        }
+        command.kind = script_command_kind::kSet;
+        command.name = args[0];
+        command.argument = args[1];
+    } else if (word == "ticktock" || word == "tick" || word == "tock" || word == "eval" || word == "vmstep") {
+        command.kind = script_command_kind::kStep;
+    } else if (word == "output") {
+        command.kind = script_command_kind::kOutput;
+    } else if (word == "echo") {
+        command.kind = script_command_kind::kEcho;
+        for (const std::string_view arg : args) {
+            command.argument += command.argument.empty() ? "" : " ";
+            command.argument += arg;
+        }
+    } else {
+        // Kept so that scripts for other simulators still parse; running one reports the command
+        for (const std::string_view arg : args) {
+            command.argument += command.argument.empty() ? "" : " ";
+            command.argument += arg;
+        }
+    }
+    return command;
+}
+
+tl::expected<std::vector<script_command>, std::string> parse_commands(const std::vector<script_token>& tokens, size_t& pos, bool nested) {
+    std::vector<script_command> commands;
+
+    while (pos < tokens.size()) {
+        const script_token& token = tokens[pos];
+        if (token.text == "}") {
+            if (!nested) {
+                return tl::unexpected(fmt::format("Line {}: unexpected '}}'", token.line));
+            }
+            pos += 1;
+            return commands;
+        }
+        pos += 1;
+        if (token.text == "," || token.text == ";" || token.text == "!") {
+            continue;
+        }
+        if (token.text == "{") {
+            return tl::unexpected(fmt::format("Line {}: unexpected '{{'", token.line));
+        }
+
+        std::vector<std::string_view> args;
+        while (pos < tokens.size() && !(tokens[pos].text.size() == 1 && is_separator(tokens[pos].text[0]))) {
+            args.push_back(tokens[pos].text);
+            pos += 1;
+        }
+
+        if (token.text == "repeat" || token.text == "while") {
+            // Count -1 marks "repeat { ... }", which runs until the user stops it, and while loops, which are not evaluated
+            int64_t count = -1;
+            std::string condition;
+            if (token.text == "repeat" && args.size() == 1) {
+                const auto parsed = parse_integer(args[0]);
+                if (!parsed.has_value() || parsed.value() < 0) {
+                    return tl::unexpected(fmt::format("Line {}: invalid repeat count '{}'", token.line, args[0]));
+                }
+                count = parsed.value();
+            } else {
+                for (const std::string_view arg : args) {
+                    condition += condition.empty() ? "" : " ";
+                    condition += arg;
+                }
+            }
+            if (pos >= tokens.size() || tokens[pos].text != "{") {
+                return tl::unexpected(fmt::format("Line {}: expected '{{' after {}", token.line, token.text));
+            }
+            pos += 1;
+
+            auto body = parse_commands(tokens, pos, true);
+            if (!body.has_value()) {
+                return body;
+            }
+            commands.push_back({ script_command_kind::kRepeat, std::string(token.text), condition, count, {}, std::move(body.value()), token.line });
+            continue;
+        }
+
+        auto command = make_command(token.text, args, token.line);
+        if (!command.has_value()) {
+            return tl::unexpected(command.error());
+        }
+        commands.push_back(std::move(command.value()));
+    }
+
+    if (nested) {
+        return tl::unexpected("Unterminated repeat block");
+    }
+    return commands;
+}
+
+// Translates the .vm files next to a missing .asm the way the VM translator would: with bootstrap code when there is a Sys.vm
+tl::expected<buffer, std::string> translate_program(const std::filesystem::path& asm_path, const codegen_options& codegen, std::map<std::string, uint16_t>* labels) {
+    const std::filesystem::path directory = asm_path.parent_path();
+    std::vector<std::filesystem::path> sources;
+    for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+        if (entry.is_regular_file() && entry.path().extension() == ".vm") {
+            sources.push_back(entry.path());
+        }
+    }
+    std::sort(sources.begin(), sources.end());
+
+    const bool has_sys = std::filesystem::exists(directory / "Sys.vm");
+    const std::filesystem::path single = std::filesystem::path(asm_path).replace_extension(".vm");
+    if (!has_sys && std::filesystem::exists(single)) {
+        sources = { single };
+    }
+    if (sources.empty()) {
+        return tl::unexpected(fmt::format("{} not found and there are no .vm files to translate", asm_path.string()));
+    }
+
+    VMTranslator translator(codegen);
+    if (has_sys) {
+        if (auto result = translator.add_boot_code(kDefaultBootstrapCode); !result.has_value()) {
+            return tl::unexpected(result.error());
+        }
+    }
+    for (const auto& source : sources) {
+        auto contents = get_file_contents(source);
+        if (!contents.has_value()) {
+            return tl::unexpected(contents.error());
+        }
+        if (auto result = translator.add_file(source.stem(), std::move(contents.value())); !result.has_value()) {
+            return tl::unexpected(result.error());
+        }
+    }
+
+    const auto lines = translator.translate();
+    if (!lines.has_value()) {
+        return tl::unexpected(lines.error());
+    }
+    const auto chunk = assemble_chunk(lines.value());
+    if (!chunk.has_value()) {
+        return tl::unexpected(chunk.error());
+    }
+    return link_chunks({ &chunk.value() }, labels);
+}
+
+bool has_step(const std::vector<script_command>& commands, std::string_view name) {
+    return std::any_of(commands.begin(), commands.end(), [&] (const script_command& command) {
+        return (command.kind == script_command_kind::kStep && command.name == name) || has_step(command.body, name);
+    });
+}
+
+bool has_endless_loop(const std::vector<script_command>& commands) {
+    return std::any_of(commands.begin(), commands.end(), [] (const script_command& command) {
+        return command.kind == script_command_kind::kRepeat && (command.count < 0 || has_endless_loop(command.body));
+    });
+}
+
+// RAM[123] or ROM[123]
+tl::expected<uint16_t, std::string> memory_address(std::string_view variable, std::string_view memory) {
+    if (variable.size() < memory.size() + 3 || variable.substr(0, memory.size()) != memory || variable[memory.size()] != '[' || variable.back() != ']') {
+        return tl::unexpected(fmt::format("Unknown variable: {}", variable));
+    }
+    const auto address = parse_integer(variable.substr(memory.size() + 1, variable.size() - memory.size() - 2));
+    if (!address.has_value() || address.value() < 0 || address.value() >= kRamSize) {
+        return tl::unexpected(fmt::format("Invalid address: {}", variable));
+    }
+    return address.value();
+}
+
+// State of one emulator script while it runs; subclasses supply the machine behind load, set, get and stepping
+class ScriptRun {
+public:
+    ScriptRun(const std::filesystem::path& directory, std::vector<std::string_view> step_commands) : directory(directory), step_commands(std::move(step_commands)), time(0), load_time(0.0) {}
+    virtual ~ScriptRun() = default;
+
+    tl::expected<void, std::string> execute(const std::vector<script_command>& commands) {
+        for (const script_command& command : commands) {
+            if (auto result = execute(command); !result.has_value()) {
+                return result;
+            }
+        }
+        return {};
+    }
+
+    tl::expected<void, std::string> write_output() const {
+        if (output_path.empty()) {
+            return {};
+        }
+        std::ofstream file(output_path, std::ios::out | std::ios::trunc);
+        if (!file) {
+            return tl::unexpected(fmt::format("Cannot write {}: {}", output_path.string(), std::strerror(errno)));
+        }
+        for (const std::string& line : output) {
+            file << line << '\n';
+        }
+        return {};
+    }
+
+    // Finishes files other than the .out file that the script wrote along the way
+    virtual tl::expected<void, std::string> close() {
+        return {};
+    }
+
+    uint64_t cycles() const {
+        return time;
+    }
+
+    virtual std::optional<translated_program> translated() const {
+        return std::nullopt;
+    }
+
+    // Time spent in load commands so far
+    double load_seconds() const {
+        return load_time;
+    }
+
+protected:
+    virtual tl::expected<void, std::string> load(const std::string& name) = 0;
+    virtual tl::expected<void, std::string> set(const std::string& variable, uint16_t value) = 0;
+    virtual tl::expected<int32_t, std::string> get(const std::string& variable) const = 0;
+    // Runs one of the script's step commands count times
+    virtual tl::expected<void, std::string> advance(std::string_view step, uint64_t count) = 0;
+    // Commands addressed to a part of the machine, e.g. "ROM32K load Max.hack"
+    virtual tl::expected<void, std::string> part_command(const script_command& command) {
+        return tl::unexpected(fmt::format("Line {}: unsupported command '{}'", command.line, command.name));
+    }
+    // The time column, which hardware scripts print as cycles plus a '+' between tick and tock
+    virtual std::string time_label() const {
+        return std::to_string(time);
+    }
+
+    std::filesystem::path directory;
+    std::vector<std::string_view> step_commands;
+    uint64_t time;
+
+private:
+    tl::expected<void, std::string> execute(const script_command& command) {
+        switch (command.kind) {
+            case script_command_kind::kLoad: {
+                const auto start = std::chrono::steady_clock::now();
+                auto result = load(command.name);
+                load_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                return result;
+            }
+            case script_command_kind::kOutputFile:
+                output_path = directory / command.name;
+                return {};
+            case script_command_kind::kCompareTo:
+                return load_compare(directory / command.name);
+            case script_command_kind::kOutputList:
+                columns = command.columns;
+                return emit(format_output_header(columns));
+            case script_command_kind::kSet: {
+                const auto value = parse_script_value(command.argument);
+                if (!value.has_value()) {
+                    return tl::unexpected(value.error());
+                }
+                return set(command.name, value.value());
+            }
+            case script_command_kind::kRepeat:
+                if (command.count < 0) {
+                    return tl::unexpected(fmt::format("Line {}: loop without a count never ends", command.line));
+                }
+                // A loop of nothing but steps runs as a single burst
+                if (command.body.size() == 1 && command.body[0].kind == script_command_kind::kStep && is_step(command.body[0].name)) {
+                    return advance(command.body[0].name, command.count);
+                }
+                for (int64_t i = 0; i < command.count; i += 1) {
+                    if (auto result = execute(command.body); !result.has_value()) {
+                        return result;
+                    }
+                }
+                return {};
+            case script_command_kind::kStep:
+                if (!is_step(command.name)) {
+                    return tl::unexpected(fmt::format("Line {}: '{}' is not a {} script command", command.line, command.name, step_commands.front()));
+                }
+                return advance(command.name, 1);
+            case script_command_kind::kOutput:
+                return output_row();
+            case script_command_kind::kEcho:
+                spdlog::debug("echo: {}", command.argument);
+                return {};
+            case script_command_kind::kIgnored:
+                if (command.name == "clear-echo" || command.name == "breakpoint" || command.name == "clear-breakpoints") {
+                    return {};
+                }
+                return part_command(command);
+        }
+        return {};
+    }
+
+    bool is_step(std::string_view name) const {
+        return std::find(step_commands.begin(), step_commands.end(), name) != step_commands.end();
+    }
+
+    tl::expected<void, std::string> load_compare(const std::filesystem::path& path) {
+        const auto contents = get_file_contents(path);
+        if (!contents.has_value()) {
+            return tl::unexpected(contents.error());
+        }
+
+        std::istringstream lines(contents.value());
+        std::string line;
+        while (std::getline(lines, line)) {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            compare.push_back(std::move(line));
+        }
+        return {};
+    }
+
+    tl::expected<void, std::string> output_row() {
+        std::string line = "|";
+        for (const output_column& column : columns) {
+            if (column.name == "time" && column.format == 'S') {
+                line += format_output_text(column, time_label());
+                line += "|";
+                continue;
+            }
+            const auto value = get(column.name);
+            if (!value.has_value()) {
+                return tl::unexpected(value.error());
+            }
+            line += format_output_value(column, value.value());
+            line += "|";
+        }
+        return emit(std::move(line));
+    }
+
+    tl::expected<void, std::string> emit(std::string line) {
+        output.push_back(std::move(line));
+        const size_t index = output.size() - 1;
+        if (compare.empty()) {
+            return {};
+        }
+        if (index >= compare.size()) {
+            return tl::unexpected(fmt::format("Comparison failure at line {}: more output than the compare file has", index + 1));
+        }
+        // '*' in the compare file matches any character, e.g. an output that is undefined at that time
+        const std::string& expected = compare[index];
+        const bool matches = output[index].size() == expected.size() && std::equal(expected.begin(), expected.end(), output[index].begin(), [] (char e, char o) {
+            return e == '*' || e == o;
+        });
+        if (!matches) {
+            return tl::unexpected(fmt::format("Comparison failure at line {}: expected '{}', got '{}'", index + 1, compare[index], output[index]));
+        }
+        return {};
+    }
+
+    std::vector<output_column> columns;
+    std::filesystem::path output_path;
+    std::vector<std::string> output;
+    std::vector<std::string> compare;
+    double load_time;
+};
+
+// CPU emulator scripts: .hack or .asm programs stepped with ticktock
+class CpuScriptRun : public ScriptRun {
+public:
+    CpuScriptRun(const std::filesystem::path& directory, emulator_engine engine, const codegen_options& codegen, bool profile_calls)
+        : ScriptRun(directory, { "ticktock" }), engine(engine), codegen(codegen), profile_calls(profile_calls), from_vm(false),
+          runs_off_end(false), completed(false), program_cycles(0) {}
+
+    std::optional<translated_program> translated() const override {
+        if (!from_vm) {
+            return std::nullopt;
+        }
+        std::optional<call_profile> profile;
+        if (profiler.has_value() && completed) {
+            profile = call_profile { profiler->function_calls(), profiler->max_depth() };
+        }
+        return translated_program { emulator.rom().size(), program_cycles, std::move(profile) };
+    }
+
+protected:
+    tl::expected<void, std::string> load(const std::string& name) override {
+        const std::filesystem::path path = directory / name;
+        tl::expected<buffer, std::string> rom = tl::unexpected(fmt::format("Cannot load {}: expected a .asm or .hack file", name));
+        std::map<std::string, uint16_t> labels;
+
+        if (path.extension() == ".hack") {
+            const auto contents = get_file_contents(path);
+            rom = contents.has_value() ? parse_hack(contents.value()) : tl::unexpected(contents.error());
+        } else if (path.extension() == ".asm" && std::filesystem::exists(path)) {
+            const auto contents = get_file_contents(path);
+            rom = contents.has_value() ? Assembler(contents.value()).parse() : tl::unexpected(contents.error());
+        } else if (path.extension() == ".asm") {
+            spdlog::debug("{} not found, translating its .vm files in memory", path.string());
+            rom = translate_program(path, codegen, &labels);
+        }
+        from_vm = path.extension() == ".asm" && !std::filesystem::exists(path);
+        runs_off_end = from_vm && !std::filesystem::exists(directory / "Sys.vm");
+        completed = false;
+        program_cycles = 0;
+
+        if (!rom.has_value()) {
+            return tl::unexpected(rom.error());
+        }
+        if (auto result = emulator.load(rom.value()); !result.has_value()) {
+            return result;
+        }
+        emulator.set_engine(engine);
+        profiler.reset();
+        if (from_vm && profile_calls) {
+            profiler.emplace(rom.value(), labels);
+        }
+        emulator.set_profiler(profiler.has_value() ? &profiler.value() : nullptr);
+        return {};
+    }
+
+    tl::expected<void, std::string> set(const std::string& variable, uint16_t word) override {
+        cpu_state state = emulator.state();
+        if (variable == "A") {
+            state.a = word;
+        } else if (variable == "D") {
+            state.d = word;
+        } else if (variable == "PC") {
+            state.pc = word;
+        } else {
+            const auto address = memory_address(variable, "RAM");
+            if (!address.has_value()) {
+                return tl::unexpected(address.error());
+            }
+            emulator.write(address.value(), word);
+            return {};
+        }
+        emulator.set_state(state);
+        return {};
+    }
+
+    tl::expected<int32_t, std::string> get(const std::string& variable) const override {
+        const cpu_state& state = emulator.state();
+        if (variable == "A") {
+            return static_cast<int16_t>(state.a);
+        } else if (variable == "D") {
+            return static_cast<int16_t>(state.d);
+        } else if (variable == "PC") {
+            return state.pc;
+        } else if (variable == "time") {
+            return static_cast<int32_t>(time);
+        } else if (variable.rfind("ROM", 0) == 0) {
+            const auto address = memory_address(variable, "ROM");
+            if (!address.has_value()) {
+                return tl::unexpected(address.error());
+            }
+            const buffer& rom = emulator.rom();
+            return static_cast<int16_t>(address.value() < rom.size() ? rom[address.value()] : 0);
+        }
+
+        const auto address = memory_address(variable, "RAM");
+        if (!address.has_value()) {
+            return tl::unexpected(address.error());
+        }
+        return static_cast<int16_t>(emulator.read(address.value()));
+    }
+
+    tl::expected<void, std::string> advance(std::string_view, uint64_t count) override {
+        // Without bootstrap code a translated program has no halt loop and is done once it runs off the end of its
+        // code or returns to an address past it. Such programs are a few hundred instructions that test one VM
+        // command or function, so step them one at a time until then
+        uint64_t executed = 0;
+        const uint64_t end = emulator.rom().size();
+        while (runs_off_end && !completed && executed < count && !emulator.halted()) {
+            const uint64_t ran = emulator.run(1);
+            if (emulator.jit_error().has_value()) {
+                return tl::unexpected(emulator.jit_error().value());
+            }
+            executed += ran;
+            program_cycles += ran;
+            completed = emulator.state().pc >= end;
+        }
+        if (executed < count && !emulator.halted()) {
+            const uint64_t ran = emulator.run(count - executed);
+            if (emulator.jit_error().has_value()) {
+                return tl::unexpected(emulator.jit_error().value());
+            }
+            executed += ran;
+            program_cycles += completed ? 0 : ran;
+        }
+        completed = completed || emulator.halted();
+
+        // Past a halt loop the CPU only alternates between its two instructions, so finish the count directly
+        if (executed < count && emulator.halted()) {
+            const uint64_t idle = count - executed;
+            cpu_state state = emulator.state();
+            const uint16_t loop = state.pc;
+            state.a = loop;
+            state.pc = idle % 2 == 1 ? loop + 1 : loop;
+            state.cycles += idle;
+            emulator.set_state(state);
+        }
+
+        time += count;
+        return {};
+    }
+
+private:
+    emulator_engine engine;
+    codegen_options codegen;
+    bool profile_calls;
+    bool from_vm;
+    bool runs_off_end;
+    // Set once the program halts or runs off the end, after which program_cycles stops counting
+    bool completed;
+    uint64_t program_cycles;
+    Emulator emulator;
+    std::optional<Profiler> profiler;
+};
+
+// VM emulator scripts: a .vm file or a directory of them, stepped one VM command at a time with vmstep
+class VmScriptRun : public ScriptRun {
+public:
+    explicit VmScriptRun(const std::filesystem::path& directory) : ScriptRun(directory, { "vmstep" }) {}
+
+protected:
+    tl::expected<void, std::string> load(const std::string& name) override {
+        const std::filesystem::path path = name.empty() ? directory : directory / name;
+        std::vector<std::filesystem::path> sources;
+        if (std::filesystem::is_directory(path)) {
+            for (const auto& entry : std::filesystem::directory_iterator(path)) {
+                if (entry.is_regular_file() && entry.path().extension() == ".vm") {
+                    sources.push_back(entry.path());
+                }
+            }
+            std::sort(sources.begin(), sources.end());
+        } else if (path.extension() == ".vm") {
+            sources.push_back(path);
+        } else {
+            return tl::unexpected(fmt::format("Cannot load {}: expected a .vm file or a directory", name));
+        }
+
+        interpreter = VMInterpreter();
+        for (const auto& source : sources) {
+            auto contents = get_file_contents(source);
+            if (!contents.has_value()) {
+                return tl::unexpected(contents.error());
+            }
+            if (auto result = interpreter.add_file(source.stem(), std::move(contents.value())); !result.has_value()) {
+                return result;
+            }
+        }
+        return interpreter.link();
+    }
+
+    tl::expected<void, std::string> set(const std::string& variable, uint16_t word) override {
+        const auto address = variable_address(variable);
+        if (!address.has_value()) {
+            return tl::unexpected(address.error());
+        }
+        interpreter.write(address.value(), word);
+        return {};
+    }
+
+    tl::expected<int32_t, std::string> get(const std::string& variable) const override {
+        if (variable == "time") {
+            return static_cast<int32_t>(time);
+        }
+        const auto address = variable_address(variable);
+        if (!address.has_value()) {
+            return tl::unexpected(address.error());
+        }
+        return static_cast<int16_t>(interpreter.read(address.value()));
+    }
+
+    tl::expected<void, std::string> advance(std::string_view, uint64_t count) override {
+        if (auto result = interpreter.run(count); !result.has_value()) {
+            return tl::unexpected(result.error());
+        }
+        // A halted program leaves the machine as it is for the remaining steps
+        time += count;
+        return {};
+    }
+
+private:
+    // sp, local, argument, this and that name RAM[0..4]; local[2], temp[0], static[1], ... name segment entries
+    tl::expected<uint16_t, std::string> variable_address(const std::string& variable) const {
+        constexpr std::string_view kPointers[] = { "sp", "local", "argument", "this", "that" };
+        constexpr std::pair<std::string_view, segment_pointer> kSegments[] = {
+            { "local", kSegmentLocal },
+            { "argument", kSegmentArgument },
+            { "this", kSegmentThis },
+            { "that", kSegmentThat },
+            { "temp", kSegmentTemp },
+            { "pointer", kSegmentPointer },
+            { "static", kSegmentStatic },
+        };
+
+        for (uint16_t address = 0; address < 5; address += 1) {
+            if (variable == kPointers[address]) {
+                return address;
+            }
+        }
+        if (variable.rfind("RAM", 0) == 0) {
+            return memory_address(variable, "RAM");
+        }
+
+        const size_t bracket = variable.find('[');
+        if (bracket != std::string::npos && variable.back() == ']') {
+            const std::string_view name = std::string_view(variable).substr(0, bracket);
+            for (const auto& [segment_name, segment] : kSegments) {
+                if (name != segment_name) {
+                    continue;
+                }
+                const auto offset = parse_integer(std::string_view(variable).substr(bracket + 1, variable.size() - bracket - 2));
+                if (!offset.has_value() || offset.value() < 0 || offset.value() >= kRamSize) {
+                    return tl::unexpected(fmt::format("Invalid segment offset: {}", variable));
+                }
+                return interpreter.segment_address(segment, offset.value());
+            }
+        }
+        return tl::unexpected(fmt::format("Unknown variable: {}", variable));
+    }
+
+    VMInterpreter interpreter;
+};
+
+// Hardware simulator scripts: a .hdl chip elaborated to gates, stepped with tick, tock and eval
+class HdlScriptRun : public ScriptRun {
+public:
+    HdlScriptRun(const std::filesystem::path& script, HdlChipCache& chips, const std::vector<std::string>& trace, bool clocked)
+        : ScriptRun(script.parent_path(), { "tick", "tock", "eval" }), script(script), chips(chips), trace(trace), clocked(clocked),
+          between_edges(false) {}
+
+    // Tracing never fails a script, which passes or fails the same without it
+    tl::expected<void, std::string> close() override {
+        if (tracer) {
+            if (auto closed = tracer->close(); !closed.has_value()) {
+                spdlog::warn("{}: {}", script.string(), closed.error());
+            }
+        }
+        return {};
+    }
+
+protected:
+    tl::expected<void, std::string> load(const std::string& name) override {
+        const std::filesystem::path path(name);
+        if (path.extension() != ".hdl" || path.has_parent_path()) {
+            return tl::unexpected(fmt::format("Cannot load {}: expected a .hdl file in the script's directory", name));
+        }
+        simulator.reset();
+        if (auto closed = close(); !closed.has_value()) {
+            return closed;
+        }
+        tracer.reset();
+        auto loaded = chips.load(directory, path.stem().string());
+        if (!loaded.has_value()) {
+            return tl::unexpected(loaded.error());
+        }
+        netlist = std::move(loaded.value());
+        simulator = std::make_unique<Simulator>(*netlist);
+        if (!trace.empty()) {
+            start_trace();
+        }
+        return {};
+    }
+
+    tl::expected<void, std::string> set(const std::string& variable, uint16_t word) override {
+        if (!simulator) {
+            return tl::unexpected("No chip loaded");
+        }
+        if (const netlist_pin* pin = netlist->find_pin(variable); pin != nullptr) {
+            simulator->set_pin(*pin, word);
+            return {};
+        }
+        const auto stored = stored_word(variable);
+        if (!stored.has_value()) {
+            return tl::unexpected(stored.error());
+        }
+        // Stored words show on the chip's outputs straight away
+        simulator->write_word(*stored->first, stored->second, word);
+        simulator->eval();
+        return {};
+    }
+
+    tl::expected<int32_t, std::string> get(const std::string& variable) const override {
+        if (!simulator) {
+            return tl::unexpected("No chip loaded");
+        }
+        if (variable == "time") {
+            return static_cast<int32_t>(time);
+        }
+        if (const netlist_pin* pin = netlist->find_pin(variable); pin != nullptr) {
+            const uint16_t value = simulator->pin_value(*pin);
+            return pin->bits.size() == 16 ? static_cast<int16_t>(value) : value;
+        }
+        const auto stored = stored_word(variable);
+        if (!stored.has_value()) {
+            return tl::unexpected(stored.error());
+        }
+        return static_cast<int16_t>(simulator->read_word(*stored->first, stored->second));
+    }
+
+    tl::expected<void, std::string> advance(std::string_view step, uint64_t count) override {
+        if (!simulator) {
+            return tl::unexpected("No chip loaded");
+        }
+        for (uint64_t i = 0; i < count; i += 1) {
+            if (step == "eval") {
+                // Without a clock, time in the trace moves on with every eval instead
+                if (tracer && !clocked) {
+                    tracer->advance();
+                }
+                simulator->eval();
+            } else if (step == "tick") {
+                simulator->tick();
+                between_edges = true;
+            } else {
+                simulator->tock();
+                between_edges = false;
+                time += 1;
+            }
+        }
+        return {};
+    }
+
+    // ROM32K load Program.hack fills the instruction memory of the computer
+    tl::expected<void, std::string> part_command(const script_command& command) override {
+        constexpr std::string_view kLoad = "load ";
+        if (command.name != "ROM32K" || command.argument.rfind(kLoad, 0) != 0) {
+            return ScriptRun::part_command(command);
+        }
+        if (!simulator) {
+            return tl::unexpected("No chip loaded");
+        }
+        const auto contents = get_file_contents(directory / command.argument.substr(kLoad.size()));
+        if (!contents.has_value()) {
+            return tl::unexpected(contents.error());
+        }
+        auto program = parse_hack(contents.value());
+        if (!program.has_value()) {
+            return tl::unexpected(program.error());
+        }
+        simulator->load_rom(std::move(program.value()));
+        simulator->eval();
+        return {};
+    }
+
+    std::string time_label() const override {
+        return between_edges ? fmt::format("{}+", time) : std::to_string(time);
+    }
+
+private:
+    // A directory of scripts is traced with one list of pins, so a chip traces those it has and the others are
+    // only warned about
+    void start_trace() {
+        if (!HDLSIM_TRACE) {
+            spdlog::warn("Cannot trace: the hardware simulator was built with HDLSIM_TRACE off");
+            return;
+        }
+        std::vector<std::string> missing;
+        auto pins = find_trace_pins(*netlist, trace, &missing);
+        if (!pins.has_value()) {
+            spdlog::warn("{}: {}", script.string(), pins.error());
+            return;
+        }
+        for (const std::string& name : missing) {
+            spdlog::warn("{}: not tracing {}, which {} has no pin for", script.string(), name, netlist->chip);
+        }
+        if (pins->empty()) {
+            return;
+        }
+        tracer = std::make_unique<Tracer>(*netlist, std::move(pins.value()), clocked);
+        if (auto opened = tracer->open(std::filesystem::path(script).replace_extension(".vcd")); !opened.has_value()) {
+            spdlog::warn("{}: {}", script.string(), opened.error());
+            tracer.reset();
+            return;
+        }
+        simulator->set_tracer(tracer.get());
+        // The values the chip starts with
+        tracer->sample(*simulator);
+    }
+
+    // DRegister[] or RAM16K[5]: a word stored by a built-in register or RAM inside the chip, and its index
+    tl::expected<std::pair<const netlist_memory*, size_t>, std::string> stored_word(const std::string& variable) const {
+        const size_t bracket = variable.find('[');
+        if (bracket == std::string::npos || variable.back() != ']') {
+            return tl::unexpected(fmt::format("Unknown pin: {}", variable));
+        }
+        const netlist_memory* memory = netlist->find_memory(std::string_view(variable).substr(0, bracket));
+        if (memory == nullptr) {
+            return tl::unexpected(fmt::format("Unknown variable: {}", variable));
+        }
+
+        const std::string_view index_text = std::string_view(variable).substr(bracket + 1, variable.size() - bracket - 2);
+        int64_t index = 0;
+        if (!index_text.empty()) {
+            const auto parsed = parse_integer(index_text);
+            if (!parsed.has_value()) {
+                return tl::unexpected(parsed.error());
+            }
+            index = parsed.value();
+        }
+        if (index < 0 || static_cast<size_t>(index) >= simulator->word_count(*memory)) {
+            return tl::unexpected(fmt::format("Invalid address: {}", variable));
+        }
+        return std::pair { memory, static_cast<size_t>(index) };
+    }
+
+    std::filesystem::path script;
+    HdlChipCache& chips;
+    const std::vector<std::string>& trace;
+    // Whether the script ticks and tocks at all
+    bool clocked;
+    // Shared with the other scripts that load the same chip; each script steps its own simulator over it
+    std::shared_ptr<const Netlist> netlist;
+    std::unique_ptr<Simulator> simulator;
+    std::unique_ptr<Tracer> tracer;
+    bool between_edges;
+};
+
+}
+
+tl::expected<std::vector<script_command>, std::string> parse_test_script(std::string_view source) {
+    const auto tokens = tokenize_script(source);
+    if (!tokens.has_value()) {
+        return tl::unexpected(tokens.error());
+    }
+    size_t pos = 0;
+    return parse_commands(tokens.value(), pos, false);
+}
+
+tl::expected<int32_t, std::string> parse_script_value(std::string_view text) {
+    int base = 10;
+    if (text.size() > 2 && text[0] == '%') {
+        switch (text[1]) {
+            case 'B': base = 2; break;
+            case 'X': base = 16; break;
+            case 'D': base = 10; break;
+            default: return tl::unexpected(fmt::format("Invalid value: {}", text));
+        }
+        text.remove_prefix(2);
+    }
+
+    int32_t value = 0;
+    const auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value, base);
+    if (ec != std::errc() || ptr != text.data() + text.size() || value < -32768 || value > 65535) {
+        return tl::unexpected(fmt::format("Invalid value: {}", text));
+    }
+    return value;
+}
+
+std::string format_output_header(const std::vector<output_column>& columns) {
+    std::string line = "|";
+    for (const output_column& column : columns) {
+        const size_t total = column.left + column.width + column.right;
+        const std::string name = column.name.substr(0, total);
+        const size_t left = (total - name.size()) / 2;
+        line += std::string(left, ' ') + name + std::string(total - name.size() - left, ' ') + "|";
+    }
+    return line;
+}
+
+std::string format_output_text(const output_column& column, std::string text) {
+    text.resize(std::max<size_t>(text.size(), column.width), ' ');
+    return std::string(column.left, ' ') + text + std::string(column.right, ' ');
+}
+
+std::string format_output_value(const output_column& column, int32_t value) {
+    std::string text;
+    switch (column.format) {
+        case 'B':
+            for (int bit = column.width - 1; bit >= 0; bit -= 1) {
+                text += bit < 32 && ((value >> bit) & 1) ? '1' : '0';
+            }
+            break;
+        case 'X':
+            text = fmt::format("{:0{}X}", value & 0xffff, column.width);
+            text = text.substr(text.size() - std::min<size_t>(text.size(), column.width));
+            break;
+        case 'S':
+            return format_output_text(column, std::to_string(value));
+        default:
+            text = std::to_string(value);
+            text.insert(0, column.width > text.size() ? column.width - text.size() : 0, ' ');
+            break;
+    }
+    return std::string(column.left, ' ') + text + std::string(column.right, ' ');
+}
+
+HdlChipCache::HdlChipCache(const test_options& options) : options(options) {}
+
+tl::expected<std::shared_ptr<const Netlist>, std::string> HdlChipCache::load(const std::filesystem::path& directory, const std::string& chip) {
+    const std::string key = (directory.lexically_normal() / chip).string();
+    std::promise<entry> promise;
+    std::shared_future<entry> building;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto [found, inserted] = chips.try_emplace(key);
+        if (inserted) {
+            found->second = promise.get_future().share();
+        } else {
+            building = found->second;
+        }
+    }
+    if (building.valid()) {
+        return building.get();
+    }
+
+    // Built outside the lock, so that different chips elaborate in parallel
+    entry built = build(directory, chip);
+    promise.set_value(built);
+    return built;
+}
+
+HdlChipCache::entry HdlChipCache::build(const std::filesystem::path& directory, const std::string& chip) const {
+    // Parsing is cheap next to elaboration, so every build reads the directory on its own rather than sharing a library between threads
+    ChipLibrary library(directory);
+    const NetlistCache cache(default_cache_directory("hdl-simulator-cpp"));
+    const NetlistCache* cache_used = options.hdl_cache ? &cache : nullptr;
+    auto elaborated = options.hdl == hdl_engine::kCompiled
+        ? compile_chip(library, chip, options.hdl_models, cache_used, options.trace)
+        : elaborate(library, chip, options.hdl_models, options.trace);
+    if (!elaborated.has_value()) {
+        return tl::unexpected(elaborated.error());
+    }
+    if (auto verified = verify_models(library, elaborated.value(), cache_used); !verified.has_value()) {
+        return tl::unexpected(verified.error());
+    }
+    return std::make_shared<const Netlist>(std::move(elaborated.value()));
+}
+
+test_result run_test_script(const std::filesystem::path& script, const test_options& options, HdlChipCache& chips) {
+    const auto start = std::chrono::steady_clock::now();
+    test_result result { script, test_status::kFailed, "", 0, 0.0, {}, std::nullopt };
+    auto since = [] (std::chrono::steady_clock::time_point from) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - from).count();
+    };
+
+    auto finish = [&] (test_status status, std::string message) {
+        result.status = status;
+        result.message = std::move(message);
+        result.seconds = since(start);
+        return result;
+    };
+
+    const auto contents = get_file_contents(script);
+    if (!contents.has_value()) {
+        return finish(test_status::kFailed, contents.error());
+    }
+    const auto commands = parse_test_script(contents.value());
+    if (!commands.has_value()) {
+        return finish(test_status::kFailed, commands.error());
+    }
+    result.phases.parse = since(start);
+
+    // CPU emulator scripts load .asm or .hack programs, VM emulator scripts a .vm file or a directory, hardware scripts a .hdl chip
+    const auto load = std::find_if(commands->begin(), commands->end(), [] (const script_command& command) {
+        return command.kind == script_command_kind::kLoad;
+    });
+    if (load == commands->end()) {
+        return finish(test_status::kSkipped, "no load command");
+    }
+    const std::string extension = std::filesystem::path(load->name).extension().string();
+    const bool cpu_script = extension == ".asm" || extension == ".hack";
+    const bool hdl_script = extension == ".hdl";
+    const bool vm_script = extension == ".vm" || load->name.empty() || std::filesystem::is_directory(script.parent_path() / load->name);
+    if (!cpu_script && !hdl_script && !vm_script) {
+        return finish(test_status::kSkipped, fmt::format("not a CPU, VM or hardware simulator script (loads {})", load->name));
+    }
+    if (has_endless_loop(commands.value())) {
+        return finish(test_status::kSkipped, "interactive script with an endless loop");
+    }
+
+    std::unique_ptr<ScriptRun> run;
+    if (cpu_script) {
+        run = std::make_unique<CpuScriptRun>(script.parent_path(), options.engine, options.codegen, options.profile_calls);
+    } else if (hdl_script) {
+        const bool clocked = has_step(commands.value(), "tick") || has_step(commands.value(), "tock");
+        run = std::make_unique<HdlScriptRun>(script, chips, options.trace, clocked);
+    } else {
+        run = std::make_unique<VmScriptRun>(script.parent_path());
+    }
+    const auto executing = std::chrono::steady_clock::now();
+    const auto executed = run->execute(commands.value());
+    const auto writing = std::chrono::steady_clock::now();
+    auto written = options.write_output ? run->write_output() : tl::expected<void, std::string>();
+    if (auto closed = run->close(); written.has_value() && !closed.has_value()) {
+        written = std::move(closed);
+    }
+    result.cycles = run->cycles();
+    result.translated = run->translated();
+    result.phases.load = run->load_seconds();
+    result.phases.run = std::chrono::duration<double>(writing - executing).count() - result.phases.load;
+    result.phases.write = since(writing);
+
+    if (!executed.has_value()) {
+        return finish(test_status::kFailed, executed.error());
+    }
+    if (!written.has_value()) {
+        return finish(test_status::kFailed, written.error());
+    }
+    return finish(test_status::kPassed, "");
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <tl/expected.hpp>
+
+#include "emulator.h"
+#include "netlist.h"
+#include "vmtranslator.h"
+
+// One entry of an output-list, e.g. RAM[256]%D2.6.2: left padding, field width and right padding
+struct output_column {
+    std::string name;
+    char format;
+    uint8_t left;
+    uint8_t width;
+    uint8_t right;
+};
+
+enum class script_command_kind : uint8_t {
+    kLoad,
+    kOutputFile,
+    kCompareTo,
+    kOutputList,
+    kSet,
+    kRepeat,
+    kStep,
+    kOutput,
+    kEcho,
+    kIgnored,
+};
+
+struct script_command {
+    script_command_kind kind;
+    // Command word for steps ("ticktock", "vmstep", ...), the variable for set, the file for load
+    std::string name;
+    std::string argument;
+    // Repeat count, or -1 for endless repeats and while loops
+    int64_t count;
+    std::vector<output_column> columns;
+    std::vector<script_command> body;
+    size_t line;
+};
+
+// Parses a .tst script as used by the nand2tetris CPU, VM and hardware simulators
+tl::expected<std::vector<script_command>, std::string> parse_test_script(std::string_view source);
+
+// Parses a script value: decimal, or %B binary, %X hex and %D decimal
+tl::expected<int32_t, std::string> parse_script_value(std::string_view text);
+
+std::string format_output_header(const std::vector<output_column>& columns);
+std::string format_output_value(const output_column& column, int32_t value);
+// Left-aligned text, as %S columns print it
+std::string format_output_text(const output_column& column, std::string text);
+
+enum class test_status : uint8_t {
+    kPassed,
+    kFailed,
+    kSkipped,
+};
+
+// Where a script's time went, in seconds
+struct test_phases {
+    // Reading and parsing the .tst file
+    double parse;
+    // Load commands: assembling, translating, or elaborating, checking and compiling a chip
+    double load;
+    // Everything else the script does, including comparing each output line against the .cmp file
+    double run;
+    // Writing the .out file
+    double write;
+};
+
+// Functions a translated program called on its way to its halt loop, which no codegen setting should change
+// unless it turns calls into something else, as intrinsics do
+struct call_profile {
+    std::map<std::string, uint64_t> calls;
+    size_t max_depth;
+
+    bool operator==(const call_profile& other) const {
+        return calls == other.calls && max_depth == other.max_depth;
+    }
+};
+
+// The program of a CPU script that loads a missing .asm, which the runner translates from the .vm files next to it
+struct translated_program {
+    uint64_t rom_words;
+    // Instructions run until the program reached its halt loop, or every step of the script if it never did
+    uint64_t cycles;
+    // When the runner profiled it and it halted
+    std::optional<call_profile> profile;
+};
+
+struct test_result {
+    std::filesystem::path script;
+    test_status status;
+    std::string message;
+    uint64_t cycles;
+    double seconds;
+    test_phases phases;
+    std::optional<translated_program> translated;
+};
+
+enum class hdl_engine : uint8_t {
+    // Every Nand gate of the elaborated chip
+    kGates,
+    // The netlist rewritten into word operations, cached where the hardware simulator keeps it
+    kCompiled,
+};
+
+struct test_options {
+    emulator_engine engine;
+    hdl_engine hdl;
+    bool hdl_cache;
+    // Parts with a built-in model use it, once the directory's own definition has been checked against it
+    bool hdl_models;
+    // Pins that hardware simulator scripts record into a .vcd file next to the script, e.g. "zr" or "ALU.zx"
+    std::vector<std::string> trace;
+    // Settings for CPU scripts whose program is translated from .vm files
+    codegen_options codegen;
+    // Profiles translated programs for their calls, which runs them on the decoded engine instead
+    bool profile_calls = false;
+    // Off for reruns of scripts that already wrote their .out file, which then keeps the first run's output
+    bool write_output = true;
+};
+
+// Chips loaded by the hardware simulator scripts of one test run. Each chip of a directory is elaborated, checked
+// against its built-in models and compiled once, by whichever script asks for it first, and the netlist is then
+// shared read-only by every script that loads it, e.g. all the Computer*.tst of project 5
+class HdlChipCache {
+public:
+    explicit HdlChipCache(const test_options& options);
+
+    // Safe to call from several threads; a script asking for a chip that another one is building waits for it
+    tl::expected<std::shared_ptr<const Netlist>, std::string> load(const std::filesystem::path& directory, const std::string& chip);
+
+private:
+    using entry = tl::expected<std::shared_ptr<const Netlist>, std::string>;
+
+    entry build(const std::filesystem::path& directory, const std::string& chip) const;
+
+    test_options options;
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_future<entry>> chips;
+};
+
+// Runs a CPU emulator, VM emulator or hardware simulator script, writing its .out file next to it and comparing against its .cmp file
+test_result run_test_script(const std::filesystem::path& script, const test_options& options, HdlChipCache& chips);
@@ -0,0 +1,345 @@
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <argparse/argparse.hpp>
+#include <tl/expected.hpp>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <thread>
+
+#include "codegen_metrics.h"
+#include "testscript.h"
+#include "tooling.h"
+
+tl::expected<emulator_engine, std::string> parse_engine(const std::string& name) {
+    if (name == "decoded") {
+        return emulator_engine::kDecoded;
+    } else if (name == "switch") {
+        return emulator_engine::kSwitch;
+    } else if (name == "goto") {
+        return emulator_engine::kComputedGoto;
+    } else if (name == "tailcall") {
+        return emulator_engine::kTailCall;
+    } else if (name == "jit") {
+        return emulator_engine::kJit;
+    }
+    return tl::unexpected(fmt::format("Invalid engine \"{}\" - allowed options: {{decoded, switch, goto, tailcall, jit}}", name));
+}
+
+tl::expected<hdl_engine, std::string> parse_hdl_engine(const std::string& name) {
+    if (name == "gates") {
+        return hdl_engine::kGates;
+    } else if (name == "compiled") {
+        return hdl_engine::kCompiled;
+    }
+    return tl::unexpected(fmt::format("Invalid HDL engine \"{}\" - allowed options: {{gates, compiled}}", name));
+}
+
+// The first way a program's calls differ from those it made with another setting, e.g. "Main.fibonacci called 9 times, not 15"
+std::string call_difference(const call_profile& profile, const call_profile& expected) {
+    for (const auto& [function, calls] : expected.calls) {
+        const auto found = profile.calls.find(function);
+        const uint64_t made = found != profile.calls.end() ? found->second : 0;
+        if (made != calls) {
+            return fmt::format("{} called {} times, not {}", function, made, calls);
+        }
+    }
+    for (const auto& [function, calls] : profile.calls) {
+        if (expected.calls.count(function) == 0) {
+            return fmt::format("{} called {} times, not 0", function, calls);
+        }
+    }
+    return fmt::format("call stack {} frames deep, not {}", profile.max_depth, expected.max_depth);
+}
+
+// Every .tst file under the given files and directories, skipping hidden directories such as .git
+std::vector<std::filesystem::path> find_test_scripts(const std::vector<std::string>& paths) {
+    std::vector<std::filesystem::path> scripts;
+    for (const std::string& path : paths) {
+        if (std::filesystem::is_regular_file(path)) {
+            scripts.emplace_back(path);
+            continue;
+        }
+
+        std::filesystem::recursive_directory_iterator it(path), end;
+        for (; it != end; ++it) {
+            const std::filesystem::path& entry = it->path();
+            if (it->is_directory() && entry.filename().string().rfind(".", 0) == 0) {
+                it.disable_recursion_pending();
+            } else if (it->is_regular_file() && entry.extension() == ".tst") {
+                scripts.push_back(entry);
+            }
+        }
+    }
+
+    std::sort(scripts.begin(), scripts.end());
+    scripts.erase(std::unique(scripts.begin(), scripts.end()), scripts.end());
+    return scripts;
+}
+
+int main(int argc, char* argv[]) {
+    auto logger = spdlog::stderr_color_mt("stderr");
+    spdlog::set_default_logger(logger);
+    spdlog::set_level(spdlog::level::info);
+
+    argparse::ArgumentParser program("tst-runner-cpp", "0.0.1");
+
+    program.add_argument("-l", "--log-level")
+        .help("Set verbosity for logging")
+        .default_value(std::string("warn"))
+        .metavar("LEVEL")
+        .nargs(1);
+
+    program.add_argument("-j", "--jobs")
+        .help("Number of tests to run at once (default: one per core)")
+        .metavar("JOBS")
+        .default_value(std::string("0"));
+
+    program.add_argument("--engine")
+        .help("Emulator engine: decoded, switch, goto, tailcall or jit")
+        .metavar("ENGINE")
+        .default_value(std::string("jit"));
+
+    program.add_argument("--hdl-engine")
+        .help("Hardware simulator engine: gates or compiled")
+        .metavar("ENGINE")
+        .default_value(std::string("compiled"));
+
+    program.add_argument("--no-hdl-cache")
+        .help("Compile chips on every run instead of reusing the hardware simulator's cache")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--no-hdl-models")
+        .help("Simulate every part of a chip from its .hdl, instead of built-in models for registers, RAMs and the screen")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--trace")
+        .help("Comma-separated pins of hardware simulator scripts to record into a .vcd next to each script, e.g. zr,ALU.zx,ALU.Mux16[1].out; chips without some of them trace the rest")
+        .metavar("PINS")
+        .default_value(std::string(""));
+
+    program.add_argument("--codegen-baseline")
+        .help("Measure the ROM words and cycles of every program translated from .vm files, at every codegen setting, and fail when one is worse than in this file")
+        .metavar("FILE")
+        .default_value(std::string(""));
+
+    program.add_argument("--update-baseline")
+        .help("Write the measurements into the --codegen-baseline file instead of failing on regressions")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("paths")
+        .help(".tst files or directories to search for them (default: current directory)")
+        .metavar("PATHS")
+        .remaining();
+
+    auto args_error = [&] (const std::string& message) {
+        std::cerr << message << std::endl;
+        std::cerr << program;
+        return 1;
+    };
+
+    try {
+        program.parse_args(argc, argv);
+    } catch(const std::exception& err) {
+        return args_error(err.what());
+    }
+
+    const std::string level = program.get("--log-level");
+    if (auto result = set_logging_level(level); !result.has_value()) {
+        return args_error(result.error());
+    }
+
+    const auto engine = parse_engine(program.get("--engine"));
+    if (!engine.has_value()) {
+        return args_error(engine.error());
+    }
+    const auto hdl = parse_hdl_engine(program.get("--hdl-engine"));
+    if (!hdl.has_value()) {
+        return args_error(hdl.error());
+    }
+    std::vector<std::string> trace;
+    const std::string trace_arg = program.get("--trace");
+    for (size_t start = 0; start < trace_arg.size(); ) {
+        const size_t comma = std::min(trace_arg.find(',', start), trace_arg.size());
+        if (comma > start) {
+            trace.push_back(trace_arg.substr(start, comma - start));
+        }
+        start = comma + 1;
+    }
+    const std::vector<codegen_setting> settings = codegen_settings();
+    test_options options { engine.value(), hdl.value(), !program.get<bool>("--no-hdl-cache"), !program.get<bool>("--no-hdl-models"), trace, settings.front().options };
+
+    const std::filesystem::path baseline_path = program.get("--codegen-baseline");
+    const bool update_baseline = program.get<bool>("--update-baseline");
+    if (update_baseline && baseline_path.empty()) {
+        return args_error("--update-baseline needs --codegen-baseline");
+    }
+    std::vector<codegen_metrics> baseline;
+    if (!baseline_path.empty() && std::filesystem::exists(baseline_path)) {
+        auto read = read_codegen_baseline(baseline_path);
+        if (!read.has_value()) {
+            spdlog::error("{}", read.error());
+            return 1;
+        }
+        baseline = std::move(read.value());
+    } else if (!baseline_path.empty() && !update_baseline) {
+        spdlog::error("{} not found, create it with --update-baseline", baseline_path.string());
+        return 1;
+    }
+    options.profile_calls = !baseline_path.empty();
+
+    const std::string jobs_arg = program.get("--jobs");
+    size_t jobs = 0;
+    if (const auto [ptr, ec] = std::from_chars(jobs_arg.data(), jobs_arg.data() + jobs_arg.size(), jobs); ec != std::errc() || ptr != jobs_arg.data() + jobs_arg.size()) {
+        return args_error(fmt::format("Invalid job count: {}", jobs_arg));
+    }
+    if (jobs == 0) {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    std::vector<std::string> paths;
+    try {
+        paths = program.get<std::vector<std::string>>("paths");
+    } catch (const std::logic_error&) {
+        paths = { "." };
+    }
+
+    std::vector<std::filesystem::path> scripts;
+    try {
+        scripts = find_test_scripts(paths);
+    } catch (const std::filesystem::filesystem_error& err) {
+        spdlog::error("{}", err.what());
+        return 1;
+    }
+    spdlog::info("Running {} test scripts on {} threads", scripts.size(), jobs);
+
+    const auto start = std::chrono::steady_clock::now();
+
+    // Threads take the next script as they finish one, so a slow script never holds up a queue behind it
+    HdlChipCache chips(options);
+    auto run_scripts = [&] (const std::vector<std::filesystem::path>& batch, const test_options& batch_options) {
+        std::vector<test_result> results(batch.size());
+        std::atomic<size_t> next { 0 };
+        auto worker = [&] () {
+            for (size_t index = next++; index < batch.size(); index = next++) {
+                results[index] = run_test_script(batch[index], batch_options, chips);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < std::min(jobs, batch.size()); i += 1) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        return results;
+    };
+    const std::vector<test_result> results = run_scripts(scripts, options);
+
+    // Programs the runner translated, measured at the first setting and then run again with each of the others.
+    // Each must make the same calls as with the first setting that lowers the same intrinsics
+    std::vector<codegen_metrics> measured;
+    std::vector<test_result> setting_failures;
+    if (!baseline_path.empty()) {
+        std::vector<std::filesystem::path> translated;
+        for (const test_result& result : results) {
+            if (result.translated.has_value()) {
+                translated.push_back(result.script);
+            }
+        }
+        std::vector<std::map<std::filesystem::path, call_profile>> profiles(settings.size());
+        options.write_output = false;
+        for (size_t index = 0; index < settings.size(); index += 1) {
+            options.codegen = settings[index].options;
+            size_t reference = 0;
+            while (settings[reference].options.intrinsics != settings[index].options.intrinsics) {
+                reference += 1;
+            }
+
+            const std::vector<test_result> setting_results = index == 0 ? results : run_scripts(translated, options);
+            for (const test_result& result : setting_results) {
+                std::string message = result.message;
+                if (result.status == test_status::kPassed && result.translated.has_value() && result.translated->profile.has_value()) {
+                    const call_profile& profile = result.translated->profile.value();
+                    profiles[index].emplace(result.script, profile);
+                    const auto expected = profiles[reference].find(result.script);
+                    if (expected != profiles[reference].end() && !(profile == expected->second)) {
+                        message = fmt::format("calls differ from {}: {}", settings[reference].name, call_difference(profile, expected->second));
+                    }
+                }
+
+                if (index > 0 && (result.status != test_status::kPassed || message != result.message)) {
+                    test_result failure = result;
+                    if (failure.status == test_status::kPassed) {
+                        failure.status = test_status::kFailed;
+                    }
+                    failure.message = fmt::format("with codegen setting {}: {}", settings[index].name, message);
+                    setting_failures.push_back(std::move(failure));
+                } else if (result.status == test_status::kPassed && result.translated.has_value()) {
+                    measured.push_back(codegen_metrics { result.script.stem().string(), settings[index].name, result.translated->rom_words, result.translated->cycles });
+                }
+            }
+        }
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t passed = 0;
+    size_t failed = 0;
+    size_t skipped = 0;
+    test_phases total {};
+    std::vector<test_result> reported = results;
+    reported.insert(reported.end(), setting_failures.begin(), setting_failures.end());
+    for (const test_result& result : reported) {
+        total.parse += result.phases.parse;
+        total.load += result.phases.load;
+        total.run += result.phases.run;
+        total.write += result.phases.write;
+
+        const char* status = "PASS";
+        if (result.status == test_status::kPassed) {
+            passed += 1;
+        } else if (result.status == test_status::kFailed) {
+            status = "FAIL";
+            failed += 1;
+        } else {
+            status = "SKIP";
+            skipped += 1;
+        }
+
+        std::cout << fmt::format("{}  {:8.3f} ms  load {:8.3f} ms  run {:8.3f} ms  {:>10} cycles  {}", status, result.seconds * 1000.0,
+            result.phases.load * 1000.0, result.phases.run * 1000.0, result.cycles, result.script.string());
+        if (!result.message.empty()) {
+            std::cout << fmt::format("  ({})", result.message);
+        }
+        std::cout << '\n';
+    }
+
+    std::cout << fmt::format("{} passed, {} failed, {} skipped in {:.3f} s\n", passed, failed, skipped, seconds);
+    // Summed over the scripts, so with several threads the phases add up to more than the time taken
+    std::cout << fmt::format("parse {:.3f} s, load {:.3f} s, run {:.3f} s, write {:.3f} s\n", total.parse, total.load, total.run, total.write);
+
+    if (baseline_path.empty()) {
+        return failed == 0 ? 0 : 1;
+    }
+    std::cout << '\n';
+    const size_t regressions = compare_codegen_metrics(measured, baseline, std::cout);
+    if (update_baseline) {
+        if (auto written = write_codegen_baseline(baseline_path, merge_codegen_metrics(baseline, measured)); !written.has_value()) {
+            spdlog::error("{}", written.error());
+            return 1;
+        }
+        std::cout << fmt::format("Wrote {} measurements to {}\n", measured.size(), baseline_path.string());
+    } else if (regressions > 0) {
+        std::cout << fmt::format("{} of {} measurements are worse than {}\n", regressions, measured.size(), baseline_path.string());
+    }
+    return failed == 0 && (update_baseline || regressions == 0) ? 0 : 1;
+}
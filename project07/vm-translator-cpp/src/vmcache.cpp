@@ -0,0 +1,123 @@
+#include "vmcache.h"
+
+#include <spdlog/spdlog.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <system_error>
+#include <thread>
+
+namespace {
+
+constexpr uint64_t kFnvOffsetBasis = 0xcbf29ce484222325ull;
+constexpr uint64_t kFnvPrime = 0x100000001b3ull;
+
+// Ends the assembly of an entry, and starts its source marks; no translated line can read like this
+constexpr const char* kMarksLine = "// vmcache marks";
+
+uint64_t fnv1a(std::string_view data, uint64_t hash = kFnvOffsetBasis) {
+    for (const char c : data) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= kFnvPrime;
+    }
+    return hash;
+}
+
+}
+
+TranslationCache::TranslationCache(const std::filesystem::path& directory) : directory(directory) {}
+
+cache_key TranslationCache::make_key(std::string_view stem, std::string_view code, std::string_view options) const {
+    const uint64_t content_hash = fnv1a(code);
+
+    // The header holds every input exactly but the content, which the entry keeps a copy of behind it. The hash
+    // only names the entry and skips reading those whose content differs in size or hash
+    std::string header = fmt::format("// vmcache {:016x} {} {} {}", content_hash, code.size(), options, stem);
+    return cache_key { fnv1a(header), std::move(header) };
+}
+
+std::filesystem::path TranslationCache::entry_path(const cache_key& key) const {
+    return directory / fmt::format("{:016x}.asm", key.hash);
+}
+
+std::optional<cache_entry> TranslationCache::load(const cache_key& key, std::string_view code) const {
+    std::ifstream in(entry_path(key), std::ios::in | std::ios::binary);
+    if (!in) {
+        return std::nullopt;
+    }
+
+    std::string line;
+    if (!std::getline(in, line) || line != key.header) {
+        spdlog::debug("Cache entry {:016x} does not match, ignoring", key.hash);
+        return std::nullopt;
+    }
+    std::string source(code.size(), '\0');
+    if (!in.read(source.data(), source.size()) || source != code || in.get() != '\n') {
+        spdlog::debug("Cache entry {:016x} was translated from other code, ignoring", key.hash);
+        return std::nullopt;
+    }
+
+    // Every entry is written in full before it is renamed into place, so one without its marks line is broken
+    cache_entry entry;
+    bool marked = false;
+    while (!marked && std::getline(in, line)) {
+        marked = line == kMarksLine;
+        if (!marked) {
+            entry.lines.emplace_back(std::move(line));
+        }
+    }
+    if (!marked) {
+        spdlog::debug("Cache entry {:016x} is cut short, ignoring", key.hash);
+        return std::nullopt;
+    }
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        source_mark& mark = entry.marks.emplace_back();
+        if (!(fields >> mark.line_index >> mark.line) || mark.line_index > entry.lines.size()) {
+            spdlog::debug("Cache entry {:016x} has a broken source mark, ignoring", key.hash);
+            return std::nullopt;
+        }
+        fields >> mark.function;
+    }
+    return entry;
+}
+
+tl::expected<void, std::string> TranslationCache::store(const cache_key& key, std::string_view code, const std::vector<std::string>& lines, const std::vector<source_mark>& marks) const {
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    if (ec) {
+        return tl::unexpected(fmt::format("Failed to create cache directory {}: {}", directory.string(), ec.message()));
+    }
+
+    // Write to a temporary file first so an interrupted run never leaves a partial entry behind. Runs on the same
+    // project at once store the same entries, so each writer gets its own
+    const std::filesystem::path path = entry_path(key);
+    std::filesystem::path tmp_path = path;
+    tmp_path += fmt::format(".{}.{}.tmp", getpid(), std::hash<std::thread::id>()(std::this_thread::get_id()));
+
+    {
+        std::ofstream out(tmp_path, std::ios::out | std::ios::trunc | std::ios::binary);
+        out << key.header << '\n';
+        out.write(code.data(), code.size());
+        out.write("\n", 1);
+        for (const auto &line : lines) {
+            out.write(line.c_str(), line.size());
+            out.write("\n", 1);
+        }
+        out << kMarksLine << '\n';
+        for (const auto& mark : marks) {
+            out << mark.line_index << ' ' << mark.line << ' ' << mark.function << '\n';
+        }
+        if (!out) {
+            return tl::unexpected(fmt::format("Failed to write cache entry: {}", tmp_path.string()));
+        }
+    }
+
+    std::filesystem::rename(tmp_path, path, ec);
+    if (ec) {
+        const std::string message = ec.message();
+        std::filesystem::remove(tmp_path, ec);
+        return tl::unexpected(fmt::format("Failed to write cache entry {}: {}", path.string(), message));
+    }
+    return {};
+}
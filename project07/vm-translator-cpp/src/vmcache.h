@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <tl/expected.hpp>
+
+// Where a VM command's code starts in its file's translation: the index of its first line, the command's line in
+// the .vm file and the function it is in
+struct source_mark {
+    uint32_t line_index;
+    uint32_t line;
+    std::string function;
+};
+
+struct cache_entry {
+    std::vector<std::string> lines;
+    std::vector<source_mark> marks;
+};
+
+struct cache_key {
+    uint64_t hash;
+    std::string header;
+};
+
+// Translated assembly per .vm file, stored on disk and keyed by content, stem and codegen options. An entry keeps a
+// copy of the .vm file it was translated from and is only used for exactly the same content
+class TranslationCache {
+public:
+    TranslationCache(const std::filesystem::path& directory);
+
+    cache_key make_key(std::string_view stem, std::string_view code, std::string_view options) const;
+    std::optional<cache_entry> load(const cache_key& key, std::string_view code) const;
+    tl::expected<void, std::string> store(const cache_key& key, std::string_view code, const std::vector<std::string>& lines, const std::vector<source_mark>& marks) const;
+
+private:
+    std::filesystem::path entry_path(const cache_key& key) const;
+
+    std::filesystem::path directory;
+};
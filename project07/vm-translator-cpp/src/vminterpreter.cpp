@@ -0,0 +1,488 @@
+#include "vminterpreter.h"
+
+#include <spdlog/spdlog.h>
+#include <algorithm>
+
+#include "assembler.h"
+#include "emulator.h"
+#include "linescan.h"
+#include "vmparser.h"
+
+namespace {
+
+constexpr uint32_t kUnresolved = UINT32_MAX;
+constexpr uint16_t kStackBase = 256;
+constexpr uint16_t kStaticBase = 16;
+constexpr uint16_t kFrameSize = 5;
+// Temp 0-2, which the intrinsic routines work in
+constexpr uint16_t kIntrinsicTemps = 3;
+
+constexpr vm_opcode kArithmeticOpcodes[] = { kOpAdd, kOpSub, kOpNeg, kOpEq, kOpGt, kOpLt, kOpAnd, kOpOr, kOpNot };
+
+uint64_t label_key(symbol_id scope, symbol_id label) {
+    return (static_cast<uint64_t>(scope) << 32) | label;
+}
+
+tl::expected<vm_op, std::string> segment_op(bool push, uint8_t segment, uint16_t offset, uint16_t static_base) {
+    switch (segment) {
+        case kSegmentConstant:
+            if (!push) {
+                return tl::unexpected("Cannot pop to the constant segment");
+            }
+            return vm_op { kOpPushConstant, 0, offset, 0 };
+        case kSegmentLocal:
+        case kSegmentArgument:
+        case kSegmentThis:
+        case kSegmentThat: {
+            // LCL, ARG, THIS and THAT live in RAM[1..4]
+            const uint8_t base = segment == kSegmentLocal ? 1 : segment == kSegmentArgument ? 2 : segment == kSegmentThis ? 3 : 4;
+            return vm_op { push ? kOpPushIndirect : kOpPopIndirect, base, offset, 0 };
+        }
+        case kSegmentStatic:
+            return vm_op { push ? kOpPushFixed : kOpPopFixed, 0, static_cast<uint16_t>(static_base + offset), 0 };
+        case kSegmentTemp:
+            if (offset >= 8) {
+                return tl::unexpected(fmt::format("Invalid temp offset: {}", offset));
+            }
+            return vm_op { push ? kOpPushFixed : kOpPopFixed, 0, static_cast<uint16_t>(5 + offset), 0 };
+        case kSegmentPointer:
+            if (offset >= 2) {
+                return tl::unexpected(fmt::format("Invalid pointer offset: {}", offset));
+            }
+            return vm_op { push ? kOpPushFixed : kOpPopFixed, 0, static_cast<uint16_t>(3 + offset), 0 };
+    }
+    return tl::unexpected(fmt::format("Invalid segment: {}", segment));
+}
+
+}
+
+VMInterpreter::VMInterpreter() : ram(kRamSize, 0), pc(0), is_halted(false) {}
+
+tl::expected<void, std::string> VMInterpreter::add_file(const std::string& filename, std::string code) {
+    vm_file& file = files.emplace_back(vm_file { symbols.intern(filename), std::move(code), program.size(), program.size() });
+    const std::string_view source = file.source;
+
+    const std::vector<line_span> lines = scan_lines(source);
+    for (size_t index = 0; index < lines.size(); index += 1) {
+        const source_span span { lines[index].code_begin, lines[index].code_length };
+        const size_t line_number = index + 1;
+        if (span.length == 0) {
+            continue;
+        }
+
+        auto result = parse_vm_line(file.line(span), symbols);
+        if (!result.has_value()) {
+            return tl::unexpected(fmt::format("{}:{}: {}", filename, line_number, result.error()));
+        }
+        program.push(result.value(), span);
+    }
+
+    file.end = program.size();
+    return {};
+}
+
+tl::expected<void, std::string> VMInterpreter::link() {
+    ops.clear();
+    ops.reserve(program.size());
+    functions.clear();
+    unresolved.clear();
+    static_bases.clear();
+
+    struct pending_jump {
+        uint32_t op;
+        uint64_t key;
+        size_t file;
+        size_t command;
+    };
+    std::unordered_map<uint64_t, uint32_t> labels;
+    std::vector<pending_jump> jumps;
+    std::vector<std::pair<uint32_t, symbol_id>> calls;
+
+    uint16_t next_static = kStaticBase;
+    for (size_t index = 0; index < files.size(); index += 1) {
+        const vm_file& file = files[index];
+        auto error = [&] (size_t command, const std::string& message) {
+            return tl::unexpected(fmt::format("{}: {} in '{}'", symbols.name(file.name), message, file.line(program.spans[command])));
+        };
+
+        uint16_t statics = 0;
+        for (size_t i = file.begin; i < file.end; i += 1) {
+            if ((program.commands[i] == kCommandPush || program.commands[i] == kCommandPop) && program.operands[i] == kSegmentStatic) {
+                statics = std::max<uint16_t>(statics, program.values[i] + 1);
+            }
+        }
+        if (next_static + statics > kStackBase) {
+            return tl::unexpected(fmt::format("{}: static variables do not fit below the stack", symbols.name(file.name)));
+        }
+        static_bases.push_back(next_static);
+
+        // Labels are local to the enclosing function, or to the file before its first function
+        symbol_id scope = file.name;
+        for (size_t i = file.begin; i < file.end; i += 1) {
+            const uint8_t operand = program.operands[i];
+            const uint16_t value = program.values[i];
+            const symbol_id symbol = program.symbols[i];
+            const uint32_t next = ops.size();
+
+            switch (program.commands[i]) {
+                case kCommandArithmetic:
+                    ops.push_back({ kArithmeticOpcodes[operand], 0, 0, 0 });
+                    break;
+                case kCommandPush:
+                case kCommandPop: {
+                    const auto op = segment_op(program.commands[i] == kCommandPush, operand, value, next_static);
+                    if (!op.has_value()) {
+                        return error(i, op.error());
+                    }
+                    ops.push_back(op.value());
+                    break;
+                }
+                case kCommandLabel:
+                    if (!labels.emplace(label_key(scope, symbol), next).second) {
+                        return error(i, fmt::format("duplicate label {}", symbols.name(symbol)));
+                    }
+                    break;
+                case kCommandGoto:
+                case kCommandIf:
+                    jumps.push_back({ next, label_key(scope, symbol), index, i });
+                    ops.push_back({ program.commands[i] == kCommandGoto ? kOpGoto : kOpIfGoto, 0, 0, kUnresolved });
+                    break;
+                case kCommandFunction:
+                    scope = symbol;
+                    if (!functions.emplace(symbol, next).second) {
+                        return error(i, fmt::format("duplicate function {}", symbols.name(symbol)));
+                    }
+                    ops.push_back({ kOpFunction, 0, value, 0 });
+                    break;
+                case kCommandReturn:
+                    ops.push_back({ kOpReturn, 0, 0, 0 });
+                    break;
+                case kCommandCall:
+                    calls.emplace_back(next, symbol);
+                    ops.push_back({ kOpCall, 0, value, kUnresolved });
+                    break;
+            }
+        }
+        next_static += statics;
+    }
+
+    for (const pending_jump& jump : jumps) {
+        const auto label = labels.find(jump.key);
+        if (label == labels.end()) {
+            const vm_file& file = files[jump.file];
+            return tl::unexpected(fmt::format("{}: undefined label in '{}'", symbols.name(file.name), file.line(program.spans[jump.command])));
+        }
+        ops[jump.op].target = label->second;
+    }
+    for (const auto& [op, name] : calls) {
+        const auto function = functions.find(name);
+        if (function == functions.end()) {
+            unresolved.emplace(op, name);
+        } else {
+            ops[op].target = function->second;
+        }
+    }
+
+    // Return addresses are op indices saved in 16-bit RAM
+    if (ops.size() > UINT16_MAX) {
+        return tl::unexpected(fmt::format("Program has {} commands, more than return addresses can hold", ops.size()));
+    }
+
+    const auto sys_init = functions.find(symbols.find("Sys.init"));
+    pc = sys_init != functions.end() ? sys_init->second : 0;
+    is_halted = ops.empty();
+    spdlog::debug("Linked {} VM commands, starting at {}", ops.size(), pc);
+    return {};
+}
+
+tl::expected<void, std::string> VMInterpreter::bootstrap() {
+    const auto sys_init = functions.find(symbols.find("Sys.init"));
+    if (sys_init == functions.end()) {
+        return tl::unexpected("Bootstrapping needs a Sys.init function");
+    }
+
+    // Same frame as "call Sys.init 0" from the bootstrap code, with return address 0
+    uint16_t sp = kStackBase;
+    ram[sp++] = 0;
+    for (uint16_t pointer = 1; pointer <= 4; pointer += 1) {
+        ram[sp++] = ram[pointer];
+    }
+    ram[0] = sp;
+    ram[1] = sp;
+    ram[2] = sp - kFrameSize;
+    pc = sys_init->second;
+    is_halted = false;
+    return {};
+}
+
+tl::expected<uint64_t, std::string> VMInterpreter::run(uint64_t max_steps) {
+    uint16_t* const m = ram.data();
+    const vm_op* const code = ops.data();
+    const uint32_t count = ops.size();
+    uint32_t at = pc;
+
+    auto push = [m] (uint16_t value) {
+        m[m[0] & kAddressMask] = value;
+        m[0] += 1;
+    };
+    auto pop = [m] () -> uint16_t {
+        m[0] -= 1;
+        return m[m[0] & kAddressMask];
+    };
+    auto top = [m] () -> uint16_t& {
+        return m[(m[0] - 1) & kAddressMask];
+    };
+
+    uint64_t steps = 0;
+    for (; steps < max_steps; steps += 1) {
+        if (at >= count) {
+            is_halted = true;
+            break;
+        }
+
+        const vm_op op = code[at];
+        at += 1;
+
+        switch (op.code) {
+            case kOpPushConstant:
+                push(op.value);
+                break;
+            case kOpPushFixed:
+                push(m[op.value]);
+                break;
+            case kOpPushIndirect:
+                push(m[(m[op.base] + op.value) & kAddressMask]);
+                break;
+            case kOpPopFixed:
+                m[op.value] = pop();
+                break;
+            case kOpPopIndirect: {
+                const uint16_t value = pop();
+                m[(m[op.base] + op.value) & kAddressMask] = value;
+                break;
+            }
+            case kOpAdd: {
+                const uint16_t y = pop();
+                top() += y;
+                break;
+            }
+            case kOpSub: {
+                const uint16_t y = pop();
+                top() -= y;
+                break;
+            }
+            case kOpNeg:
+                top() = -top();
+                break;
+            case kOpEq: {
+                const uint16_t y = pop();
+                top() = top() == y ? 0xffff : 0;
+                break;
+            }
+            case kOpGt: {
+                const int16_t y = pop();
+                top() = static_cast<int16_t>(top()) > y ? 0xffff : 0;
+                break;
+            }
+            case kOpLt: {
+                const int16_t y = pop();
+                top() = static_cast<int16_t>(top()) < y ? 0xffff : 0;
+                break;
+            }
+            case kOpAnd: {
+                const uint16_t y = pop();
+                top() &= y;
+                break;
+            }
+            case kOpOr: {
+                const uint16_t y = pop();
+                top() |= y;
+                break;
+            }
+            case kOpNot:
+                top() = ~top();
+                break;
+            case kOpGoto:
+                // A goto to itself never changes the machine again, so treat it as the program's end
+                if (op.target + 1 == at) {
+                    pc = op.target;
+                    is_halted = true;
+                    return steps;
+                }
+                at = op.target;
+                break;
+            case kOpIfGoto:
+                if (pop() != 0) {
+                    at = op.target;
+                }
+                break;
+            case kOpFunction:
+                for (uint16_t i = 0; i < op.value; i += 1) {
+                    push(0);
+                }
+                break;
+            case kOpCall: {
+                if (op.target == kUnresolved) {
+                    pc = at - 1;
+                    return tl::unexpected(fmt::format("Call to undefined function {}", symbols.name(unresolved.at(at - 1))));
+                }
+                const uint16_t args = m[0] - op.value;
+                push(at);
+                push(m[1]);
+                push(m[2]);
+                push(m[3]);
+                push(m[4]);
+                m[2] = args;
+                m[1] = m[0];
+                at = op.target;
+                break;
+            }
+            case kOpReturn: {
+                const uint16_t frame = m[1];
+                const uint16_t address = m[(frame - 5) & kAddressMask];
+                m[m[2] & kAddressMask] = pop();
+                m[0] = m[2] + 1;
+                m[4] = m[(frame - 1) & kAddressMask];
+                m[3] = m[(frame - 2) & kAddressMask];
+                m[2] = m[(frame - 3) & kAddressMask];
+                m[1] = m[(frame - 4) & kAddressMask];
+                at = address;
+                break;
+            }
+        }
+    }
+
+    pc = at;
+    return steps;
+}
+
+bool VMInterpreter::halted() const {
+    return is_halted;
+}
+
+uint16_t VMInterpreter::read(uint16_t address) const {
+    return ram[address & kAddressMask];
+}
+
+void VMInterpreter::write(uint16_t address, uint16_t value) {
+    ram[address & kAddressMask] = value;
+}
+
+tl::expected<uint16_t, std::string> VMInterpreter::segment_address(segment_pointer segment, uint16_t offset) const {
+    if (segment == kSegmentConstant) {
+        return tl::unexpected("The constant segment has no address");
+    }
+    if (segment == kSegmentStatic && static_bases.empty()) {
+        return tl::unexpected("No program is loaded");
+    }
+    const auto op = segment_op(true, segment, offset, segment == kSegmentStatic ? static_bases.front() : 0);
+    if (!op.has_value()) {
+        return tl::unexpected(op.error());
+    }
+    if (op->code == kOpPushIndirect) {
+        return static_cast<uint16_t>((ram[op->base] + offset) & kAddressMask);
+    }
+    return op->value;
+}
+
+std::vector<uint16_t> VMInterpreter::return_slots() const {
+    std::vector<uint16_t> slots;
+    uint16_t frame = ram[1];
+    while (frame >= kStackBase + kFrameSize && frame <= ram[0]) {
+        slots.push_back(frame - kFrameSize);
+        // Saved LCL values only ever point further down the stack
+        const uint16_t caller = ram[frame - 4];
+        if (caller >= frame) {
+            break;
+        }
+        frame = caller;
+    }
+    return slots;
+}
+
+size_t VMInterpreter::size() const {
+    return ops.size();
+}
+
+tl::expected<uint64_t, std::string> check_translation(VMInterpreter& reference, const std::vector<std::string>& asm_lines, bool bootstrapped, bool intrinsics, uint64_t max_steps) {
+    // Without bootstrap code both sides start from the pointers the project 07 tests set
+    constexpr uint16_t kInitialPointers[] = { 256, 300, 400, 3000, 3010 };
+
+    if (bootstrapped) {
+        if (auto result = reference.bootstrap(); !result.has_value()) {
+            return tl::unexpected(result.error());
+        }
+    } else {
+        for (uint16_t i = 0; i < 5; i += 1) {
+            reference.write(i, kInitialPointers[i]);
+        }
+    }
+
+    const auto steps = reference.run(max_steps);
+    if (!steps.has_value()) {
+        return tl::unexpected(steps.error());
+    }
+    if (!reference.halted()) {
+        return tl::unexpected(fmt::format("The VM program did not halt within {} commands", max_steps));
+    }
+
+    // Translated code without a closing loop runs off its end, so park it in a halt loop
+    std::vector<std::string> lines = asm_lines;
+    lines.insert(lines.end(), { "(__CHECK_HALT)", "@__CHECK_HALT", "0;JMP" });
+    const auto chunk = assemble_chunk(lines);
+    if (!chunk.has_value()) {
+        return tl::unexpected(chunk.error());
+    }
+    const auto rom = link_chunks({ &chunk.value() });
+    if (!rom.has_value()) {
+        return tl::unexpected(rom.error());
+    }
+
+    Emulator emulator;
+    if (auto result = emulator.load(rom.value()); !result.has_value()) {
+        return tl::unexpected(result.error());
+    }
+    if (!bootstrapped) {
+        for (uint16_t i = 0; i < 5; i += 1) {
+            emulator.write(i, kInitialPointers[i]);
+        }
+    }
+
+    // No VM command translates to more than a few dozen instructions
+    const uint64_t max_cycles = steps.value() * 64 + 1024;
+    emulator.run(max_cycles);
+    if (!emulator.halted()) {
+        return tl::unexpected(fmt::format("The translated program did not halt within {} cycles", max_cycles));
+    }
+
+    auto compare = [&] (uint16_t address, std::string_view what) -> tl::expected<void, std::string> {
+        if (reference.read(address) != emulator.read(address)) {
+            return tl::unexpected(fmt::format("{} (RAM[{}]) is {} in the VM interpreter but {} in the translation",
+                what, address, static_cast<int16_t>(reference.read(address)), static_cast<int16_t>(emulator.read(address))));
+        }
+        return {};
+    };
+
+    constexpr std::string_view kPointerNames[] = { "SP", "LCL", "ARG", "THIS", "THAT" };
+    for (uint16_t i = 0; i < 5; i += 1) {
+        if (auto result = compare(i, kPointerNames[i]); !result.has_value()) {
+            return tl::unexpected(result.error());
+        }
+    }
+    for (uint16_t i = intrinsics ? kIntrinsicTemps : 0; i < 8; i += 1) {
+        if (auto result = compare(5 + i, fmt::format("temp {}", i)); !result.has_value()) {
+            return tl::unexpected(result.error());
+        }
+    }
+
+    const std::vector<uint16_t> skipped = reference.return_slots();
+    for (uint16_t address = kStackBase; address < reference.read(0); address += 1) {
+        if (std::find(skipped.begin(), skipped.end(), address) != skipped.end()) {
+            continue;
+        }
+        if (auto result = compare(address, "Stack entry"); !result.has_value()) {
+            return tl::unexpected(result.error());
+        }
+    }
+    return steps.value();
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <tl/expected.hpp>
+
+#include "vmir.h"
+
+enum vm_opcode : uint8_t {
+    kOpPushConstant,
+    kOpPushFixed,
+    kOpPushIndirect,
+    kOpPopFixed,
+    kOpPopIndirect,
+    kOpAdd,
+    kOpSub,
+    kOpNeg,
+    kOpEq,
+    kOpGt,
+    kOpLt,
+    kOpAnd,
+    kOpOr,
+    kOpNot,
+    kOpGoto,
+    kOpIfGoto,
+    kOpFunction,
+    kOpCall,
+    kOpReturn,
+};
+
+// A VM command with its label, function or segment resolved; labels themselves take no op
+struct vm_op {
+    vm_opcode code;
+    // Pointer register (LCL, ARG, THIS or THAT) for indirect push and pop
+    uint8_t base;
+    // Constant, absolute address, segment offset or local/argument count
+    uint16_t value;
+    // Op index for goto, if-goto and call
+    uint32_t target;
+};
+
+// Runs .vm programs directly, the way the VM emulator does: one step per command, starting at Sys.init when it exists
+class VMInterpreter {
+public:
+    VMInterpreter();
+
+    tl::expected<void, std::string> add_file(const std::string& filename, std::string code);
+
+    // Resolves labels per function, calls to op indices and each file's statics to addresses from 16
+    tl::expected<void, std::string> link();
+
+    // Sets up the frame the translator's bootstrap code builds before calling Sys.init
+    tl::expected<void, std::string> bootstrap();
+
+    // Executes up to max_steps commands; stops early once the program runs off its end or spins on a goto to itself
+    tl::expected<uint64_t, std::string> run(uint64_t max_steps);
+    bool halted() const;
+
+    uint16_t read(uint16_t address) const;
+    void write(uint16_t address, uint16_t value);
+
+    // Address of a segment entry such as local 2 or static 0 of the first file
+    tl::expected<uint16_t, std::string> segment_address(segment_pointer segment, uint16_t offset) const;
+
+    // Slots holding the return addresses of active calls, found by walking the saved LCL chain
+    std::vector<uint16_t> return_slots() const;
+
+    size_t size() const;
+
+private:
+    SymbolTable symbols;
+    VMProgram program;
+    std::vector<vm_file> files;
+    std::vector<uint16_t> static_bases;
+
+    std::vector<vm_op> ops;
+    std::unordered_map<symbol_id, uint32_t> functions;
+    // Calls to functions no file defines, reported when they execute
+    std::unordered_map<uint32_t, symbol_id> unresolved;
+
+    std::vector<uint16_t> ram;
+    uint32_t pc;
+    bool is_halted;
+};
+
+// Runs the interpreter and the assembled translation of the same program until both halt, then compares
+// the pointers, temp segment and live stack; return addresses and statics are laid out differently and skipped.
+// Code translated with intrinsics works in temp 0-2, which are skipped as well
+tl::expected<uint64_t, std::string> check_translation(VMInterpreter& reference, const std::vector<std::string>& asm_lines, bool bootstrapped, bool intrinsics, uint64_t max_steps);
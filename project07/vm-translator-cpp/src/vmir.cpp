@@ -0,0 +1,109 @@
+#include "vmir.h"
+
+#include <stdexcept>
+
+template <class... Ts>
+struct overloaded : Ts... { using Ts::operator()...; };
+
+template <class... Ts>
+overloaded(Ts...) -> overloaded<Ts...>;
+
+symbol_id SymbolTable::intern(std::string_view name) {
+    auto found = ids.find(name);
+    if (found != ids.end()) {
+        return found->second;
+    }
+
+    symbol_id id = names.size();
+    const std::string& stored = names.emplace_back(name);
+    ids.emplace(stored, id);
+    return id;
+}
+
+symbol_id SymbolTable::find(std::string_view name) const {
+    auto found = ids.find(name);
+    if (found == ids.end()) {
+        return kNoSymbol;
+    }
+    return found->second;
+}
+
+std::string_view SymbolTable::name(symbol_id id) const {
+    if (id >= names.size()) {
+        throw std::out_of_range("Invalid symbol id");
+    }
+    return names[id];
+}
+
+size_t SymbolTable::size() const {
+    return names.size();
+}
+
+void SymbolTable::clear() {
+    ids.clear();
+    names.clear();
+}
+
+void VMProgram::push(const vm_instruction& instr, source_span span) {
+    vm_command cmd;
+    uint8_t operand = 0;
+    uint16_t value = 0;
+    symbol_id symbol = kNoSymbol;
+
+    std::visit(overloaded {
+        [&] (const cmd_arithmetic& c) { cmd = kCommandArithmetic; operand = c.op; },
+        [&] (const cmd_push& c) { cmd = kCommandPush; operand = c.seg; value = c.offset; },
+        [&] (const cmd_pop& c) { cmd = kCommandPop; operand = c.seg; value = c.offset; },
+        [&] (const cmd_label& c) { cmd = kCommandLabel; symbol = c.label; },
+        [&] (const cmd_goto& c) { cmd = kCommandGoto; symbol = c.label; },
+        [&] (const cmd_if& c) { cmd = kCommandIf; symbol = c.label; },
+        [&] (const cmd_function& c) { cmd = kCommandFunction; symbol = c.name; value = c.count; },
+        [&] (const cmd_return&) { cmd = kCommandReturn; },
+        [&] (const cmd_call& c) { cmd = kCommandCall; symbol = c.name; value = c.count; },
+    }, instr);
+
+    commands.push_back(cmd);
+    operands.push_back(operand);
+    values.push_back(value);
+    symbols.push_back(symbol);
+    spans.push_back(span);
+}
+
+vm_instruction VMProgram::at(size_t index) const {
+    const uint8_t operand = operands[index];
+    const uint16_t value = values[index];
+    const symbol_id symbol = symbols[index];
+
+    switch (commands[index]) {
+        case kCommandArithmetic: return cmd_arithmetic { static_cast<arithmetic_op>(operand) };
+        case kCommandPush: return cmd_push { static_cast<segment_pointer>(operand), value };
+        case kCommandPop: return cmd_pop { static_cast<segment_pointer>(operand), value };
+        case kCommandLabel: return cmd_label { symbol };
+        case kCommandGoto: return cmd_goto { symbol };
+        case kCommandIf: return cmd_if { symbol };
+        case kCommandFunction: return cmd_function { symbol, static_cast<uint8_t>(value) };
+        case kCommandReturn: return cmd_return {};
+        case kCommandCall: return cmd_call { symbol, static_cast<uint8_t>(value) };
+    }
+    throw std::invalid_argument("Invalid command");
+}
+
+void VMProgram::reserve(size_t count) {
+    commands.reserve(count);
+    operands.reserve(count);
+    values.reserve(count);
+    symbols.reserve(count);
+    spans.reserve(count);
+}
+
+void VMProgram::clear() {
+    commands.clear();
+    operands.clear();
+    values.clear();
+    symbols.clear();
+    spans.clear();
+}
+
+size_t VMProgram::size() const {
+    return commands.size();
+}
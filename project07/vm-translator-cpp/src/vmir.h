@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+enum arithmetic_op : uint8_t {
+    kArithmeticOpAdd,
+    kArithmeticOpSub,
+    kArithmeticOpNeg,
+    kArithmeticOpEq,
+    kArithmeticOpGt,
+    kArithmeticOpLt,
+    kArithmeticOpAnd,
+    kArithmeticOpOr,
+    kArithmeticOpNot,
+};
+
+enum segment_pointer : uint8_t {
+    kSegmentLocal,
+    kSegmentArgument,
+    kSegmentStatic,
+    kSegmentConstant,
+    kSegmentThis,
+    kSegmentThat,
+    kSegmentPointer,
+    kSegmentTemp,
+};
+
+enum vm_command : uint8_t {
+    kCommandArithmetic,
+    kCommandPush,
+    kCommandPop,
+    kCommandLabel,
+    kCommandGoto,
+    kCommandIf,
+    kCommandFunction,
+    kCommandReturn,
+    kCommandCall,
+};
+
+using symbol_id = uint32_t;
+
+constexpr symbol_id kNoSymbol = UINT32_MAX;
+
+struct cmd_arithmetic {
+    arithmetic_op op;
+};
+
+struct cmd_push {
+    segment_pointer seg;
+    uint16_t offset;
+};
+
+struct cmd_pop {
+    segment_pointer seg;
+    uint16_t offset;
+};
+
+struct cmd_label {
+    symbol_id label;
+};
+
+struct cmd_goto {
+    symbol_id label;
+};
+
+struct cmd_if {
+    symbol_id label;
+};
+
+struct cmd_function {
+    symbol_id name;
+    uint8_t count;
+};
+
+struct cmd_return {
+};
+
+struct cmd_call {
+    symbol_id name;
+    uint8_t count;
+};
+
+using vm_instruction = std::variant<cmd_arithmetic, cmd_push, cmd_pop, cmd_label, cmd_goto, cmd_if, cmd_function, cmd_return, cmd_call>;
+
+// Every label, function and file name is stored once and referred to by id
+class SymbolTable {
+public:
+    symbol_id intern(std::string_view name);
+    symbol_id find(std::string_view name) const;
+    std::string_view name(symbol_id id) const;
+    size_t size() const;
+    void clear();
+
+private:
+    std::deque<std::string> names;
+    std::unordered_map<std::string_view, symbol_id> ids;
+};
+
+// Location of a command as an offset into its file's source buffer
+struct source_span {
+    uint32_t offset;
+    uint32_t length;
+};
+
+// Struct-of-arrays storage for parsed commands, one fixed-size field per array
+class VMProgram {
+public:
+    void push(const vm_instruction& instr, source_span span);
+    vm_instruction at(size_t index) const;
+    void reserve(size_t count);
+    void clear();
+    size_t size() const;
+
+    std::vector<vm_command> commands;
+    std::vector<uint8_t> operands;
+    std::vector<uint16_t> values;
+    std::vector<symbol_id> symbols;
+    std::vector<source_span> spans;
+};
+
+struct vm_file {
+    symbol_id name;
+    std::string source;
+    size_t begin;
+    size_t end;
+
+    std::string_view line(source_span span) const {
+        return std::string_view(source).substr(span.offset, span.length);
+    }
+};
@@ -0,0 +1,230 @@
+#include "vmparser.h"
+
+#include <array>
+#include <charconv>
+#include <spdlog/spdlog.h>
+#include <utility>
+
+namespace {
+
+constexpr size_t kMaxTokens = 3;
+
+struct command_keyword {
+    vm_command cmd;
+    arithmetic_op op;
+    size_t args;
+};
+
+// Collision-free for every command and segment keyword, checked below
+constexpr size_t keyword_hash(std::string_view word) {
+    return static_cast<unsigned char>(word[0])
+        + static_cast<unsigned char>(word[1]) * 5
+        + static_cast<unsigned char>(word.back()) * 8
+        + word.size();
+}
+
+template <class T, size_t N>
+struct keyword_table {
+    std::array<std::string_view, N> words {};
+    std::array<T, N> values {};
+    bool perfect = true;
+};
+
+template <size_t N, class T, size_t M>
+constexpr keyword_table<T, N> make_keyword_table(const std::pair<std::string_view, T> (&entries)[M]) {
+    keyword_table<T, N> table {};
+    for (size_t i = 0; i < M; i += 1) {
+        const size_t slot = keyword_hash(entries[i].first) % N;
+        if (!table.words[slot].empty()) {
+            table.perfect = false;
+        }
+        table.words[slot] = entries[i].first;
+        table.values[slot] = entries[i].second;
+    }
+    return table;
+}
+
+template <class T, size_t N>
+constexpr const T* find_keyword(const keyword_table<T, N>& table, std::string_view word) {
+    if (word.size() < 2) {
+        return nullptr;
+    }
+    const size_t slot = keyword_hash(word) % N;
+    if (table.words[slot] != word) {
+        return nullptr;
+    }
+    return &table.values[slot];
+}
+
+constexpr std::pair<std::string_view, command_keyword> kCommandEntries[] = {
+    { "add",      { kCommandArithmetic, kArithmeticOpAdd, 0 } },
+    { "sub",      { kCommandArithmetic, kArithmeticOpSub, 0 } },
+    { "neg",      { kCommandArithmetic, kArithmeticOpNeg, 0 } },
+    { "eq",       { kCommandArithmetic, kArithmeticOpEq, 0 } },
+    { "gt",       { kCommandArithmetic, kArithmeticOpGt, 0 } },
+    { "lt",       { kCommandArithmetic, kArithmeticOpLt, 0 } },
+    { "and",      { kCommandArithmetic, kArithmeticOpAnd, 0 } },
+    { "or",       { kCommandArithmetic, kArithmeticOpOr, 0 } },
+    { "not",      { kCommandArithmetic, kArithmeticOpNot, 0 } },
+    { "push",     { kCommandPush, kArithmeticOpAdd, 2 } },
+    { "pop",      { kCommandPop, kArithmeticOpAdd, 2 } },
+    { "label",    { kCommandLabel, kArithmeticOpAdd, 1 } },
+    { "goto",     { kCommandGoto, kArithmeticOpAdd, 1 } },
+    { "if-goto",  { kCommandIf, kArithmeticOpAdd, 1 } },
+    { "function", { kCommandFunction, kArithmeticOpAdd, 2 } },
+    { "call",     { kCommandCall, kArithmeticOpAdd, 2 } },
+    { "return",   { kCommandReturn, kArithmeticOpAdd, 0 } },
+};
+
+constexpr std::pair<std::string_view, segment_pointer> kSegmentEntries[] = {
+    { "local",    kSegmentLocal },
+    { "argument", kSegmentArgument },
+    { "static",   kSegmentStatic },
+    { "constant", kSegmentConstant },
+    { "this",     kSegmentThis },
+    { "that",     kSegmentThat },
+    { "pointer",  kSegmentPointer },
+    { "temp",     kSegmentTemp },
+};
+
+constexpr auto kCommandKeywords = make_keyword_table<32>(kCommandEntries);
+constexpr auto kSegmentKeywords = make_keyword_table<16>(kSegmentEntries);
+
+static_assert(kCommandKeywords.perfect, "Command keyword hash has collisions");
+static_assert(kSegmentKeywords.perfect, "Segment keyword hash has collisions");
+
+bool is_separator(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Splits line into at most kMaxTokens views, returns kMaxTokens + 1 when there are more
+size_t tokenize(std::string_view line, std::array<std::string_view, kMaxTokens>& tokens) {
+    size_t count = 0;
+    size_t pos = 0;
+
+    while (pos < line.size()) {
+        while (pos < line.size() && is_separator(line[pos])) {
+            pos += 1;
+        }
+        if (pos == line.size()) {
+            break;
+        }
+
+        const size_t begin = pos;
+        while (pos < line.size() && !is_separator(line[pos])) {
+            pos += 1;
+        }
+
+        if (count == kMaxTokens) {
+            return kMaxTokens + 1;
+        }
+        tokens[count++] = line.substr(begin, pos - begin);
+    }
+
+    return count;
+}
+
+tl::expected<int, std::string> parse_int_value(std::string_view num) {
+    int value = 0;
+    const char* end = num.data() + num.size();
+    const auto [ptr, ec] = std::from_chars(num.data(), end, value);
+    if (ec != std::errc() || ptr != end) {
+        return tl::unexpected(fmt::format("Invalid number: {}", num));
+    }
+    return value;
+}
+
+tl::expected<uint16_t, std::string> parse_uint16_value(std::string_view num) {
+    const auto value = parse_int_value(num);
+    if (!value.has_value()) {
+        return tl::unexpected(value.error());
+    }
+    if (value.value() > 32767 || value.value() < -32768) {
+        return tl::unexpected(fmt::format("Value '{}' not in range [-32768, 32767]", value.value()));
+    }
+    return static_cast<uint16_t>(value.value());
+}
+
+tl::expected<uint8_t, std::string> parse_uint8_value(std::string_view num) {
+    const auto value = parse_int_value(num);
+    if (!value.has_value()) {
+        return tl::unexpected(value.error());
+    }
+    if (value.value() > 127 || value.value() < -128) {
+        return tl::unexpected(fmt::format("Value '{}' not in range [-128, 127]", value.value()));
+    }
+    return static_cast<uint8_t>(value.value());
+}
+
+}
+
+tl::expected<vm_instruction, std::string> parse_vm_line(std::string_view line, SymbolTable& symbols) {
+    std::array<std::string_view, kMaxTokens> tokens;
+    const size_t count = tokenize(line, tokens);
+
+    if (count == 0) {
+        return tl::unexpected("Unexpected empty instruction line");
+    }
+
+    const command_keyword* keyword = find_keyword(kCommandKeywords, tokens[0]);
+    if (keyword == nullptr || count != keyword->args + 1) {
+        return tl::unexpected(fmt::format("Unknown command: {}", line));
+    }
+
+    switch (keyword->cmd) {
+        case kCommandArithmetic:
+            return cmd_arithmetic { keyword->op };
+
+        case kCommandPush:
+        case kCommandPop:
+            {
+                const segment_pointer* seg = find_keyword(kSegmentKeywords, tokens[1]);
+                if (seg == nullptr) {
+                    return tl::unexpected(fmt::format("Invalid segment: {}", tokens[1]));
+                }
+
+                const auto value = parse_uint16_value(tokens[2]);
+                if (!value.has_value()) {
+                    return tl::unexpected(value.error());
+                }
+
+                if (keyword->cmd == kCommandPush) {
+                    return cmd_push { *seg, value.value() };
+                }
+
+                if (*seg == kSegmentConstant) {
+                    return tl::unexpected("Constant segment cannot be used with pop command");
+                }
+
+                return cmd_pop { *seg, value.value() };
+            }
+
+        case kCommandLabel:
+            return cmd_label { symbols.intern(tokens[1]) };
+
+        case kCommandGoto:
+            return cmd_goto { symbols.intern(tokens[1]) };
+
+        case kCommandIf:
+            return cmd_if { symbols.intern(tokens[1]) };
+
+        case kCommandFunction:
+        case kCommandCall:
+            {
+                const auto value = parse_uint8_value(tokens[2]);
+                if (!value.has_value()) {
+                    return tl::unexpected(value.error());
+                }
+
+                if (keyword->cmd == kCommandFunction) {
+                    return cmd_function { symbols.intern(tokens[1]), value.value() };
+                }
+                return cmd_call { symbols.intern(tokens[1]), value.value() };
+            }
+
+        case kCommandReturn:
+            return cmd_return {};
+    }
+
+    return tl::unexpected(fmt::format("Unknown command: {}", line));
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <tl/expected.hpp>
+
+#include "vmir.h"
+
+tl::expected<vm_instruction, std::string> parse_vm_line(std::string_view line, SymbolTable& symbols);
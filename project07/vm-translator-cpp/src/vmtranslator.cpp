@@ -1,9 +1,16 @@
 #include "vmtranslator.h"
+#include "hackcpu.h"
+#include "linescan.h"
+#include "outliner.h"
+#include "sourcemap.h"
+#include "vmparser.h"
 
 #include <algorithm>
+#include <istream>
 #include <iterator>
+#include <optional>
+#include <set>
 #include <spdlog/spdlog.h>
-#include <sstream>
 #include <utility>
 
 template <class... Ts>
@@ -12,159 +19,190 @@ struct overloaded : Ts... { using Ts::operator()...; };
 template <class... Ts>
 overloaded(Ts...) -> overloaded<Ts...>;
 
-enum arithmetic_op {
-    kArithmeticOpAdd,
-    kArithmeticOpSub,
-    kArithmeticOpNeg,
-    kArithmeticOpEq,
-    kArithmeticOpGt,
-    kArithmeticOpLt,
-    kArithmeticOpAnd,
-    kArithmeticOpOr,
-    kArithmeticOpNot,
+// What build_asm carries from one command of a file to the next
+struct build_state {
+    int label_counter = 0;
+    // Intrinsics whose routine the file already has, for later calls to jump to
+    std::set<intrinsic_op> routines;
+
+    // Source marks count lines of output from first_line, and lines of the source up to line_offset
+    size_t first_line = 0;
+    size_t line_offset = 0;
+    uint32_t line_number = 1;
+    std::string function;
+    std::vector<source_mark> marks;
 };
 
-enum segment_pointer {
-    kSegmentLocal,
-    kSegmentArgument,
-    kSegmentStatic,
-    kSegmentConstant,
-    kSegmentThis,
-    kSegmentThat,
-    kSegmentPointer,
-    kSegmentTemp,
-};
-
-struct cmd_arithmetic {
-    arithmetic_op op;
-};
-
-struct cmd_push {
-    segment_pointer seg;
-    uint16_t offset;
-};
-
-struct cmd_pop {
-    segment_pointer seg;
-    uint16_t offset;
-};
+tl::expected<void, std::string> build_asm(std::string_view filename, std::string_view source, const VMProgram& program, size_t begin, size_t end, const SymbolTable& symbols, const codegen_options& options, build_state* state, std::vector<std::string>* out_lines);
 
-struct cmd_label {
-    std::string label;
-};
-
-struct cmd_goto {
-    std::string label;
-};
+// Labels, comments and blank lines take no ROM
+bool is_instruction(std::string_view line) {
+    return !line.empty() && line.front() != '(' && line.rfind("//", 0) != 0;
+}
 
-struct cmd_if {
-    std::string label;
-};
+std::string segment_name_string(const segment_pointer& seg) {
+    switch (seg) {
+        case kSegmentLocal: return "LCL";
+        case kSegmentArgument: return "ARG";
+        case kSegmentThis: return "THIS";
+        case kSegmentThat: return "THAT";
+        default: throw std::invalid_argument("Invalid segment");
+    }
+}
 
-struct cmd_function {
-    std::string name;
-    uint8_t count;
-};
+// Bump whenever build_asm output changes for the same input so stale cache entries are ignored
+constexpr int kCodegenVersion = 4;
 
-struct cmd_return {
-};
+std::string_view intrinsic_name(intrinsic_op op) {
+    return op == kIntrinsicMultiply ? "multiply" : "divide";
+}
 
-struct cmd_call {
-    std::string name;
-    uint8_t count;
-};
+std::string codegen_options::fingerprint() const {
+    std::string fingerprint = fmt::format("v{}", kCodegenVersion);
+    if (!comments) {
+        fingerprint += ";release";
+    }
+    for (const auto& [function, op] : intrinsics) {
+        fingerprint += fmt::format(";{}={}", function, intrinsic_name(op));
+    }
+    return fingerprint;
+}
 
-using vm_instruction = std::variant<cmd_arithmetic, cmd_push, cmd_pop, cmd_label, cmd_goto, cmd_if, cmd_function, cmd_return, cmd_call>;
+std::map<std::string, intrinsic_op, std::less<>> jack_os_intrinsics() {
+    return { { "Math.multiply", kIntrinsicMultiply }, { "Math.divide", kIntrinsicDivide } };
+}
 
-tl::expected<vm_instruction, std::string> parse_vm_line(const std::string& filename, const std::string& line);
-tl::expected<void, std::string> build_asm(const std::string& filename, const std::vector<std::pair<vm_instruction, std::string>>& instructions, std::vector<std::string>* out_lines);
+tl::expected<std::map<std::string, intrinsic_op, std::less<>>, std::string> parse_intrinsics(std::string_view list) {
+    std::map<std::string, intrinsic_op, std::less<>> intrinsics;
+    for (size_t start = 0; start < list.size(); ) {
+        const size_t comma = std::min(list.find(',', start), list.size());
+        const std::string_view item = list.substr(start, comma - start);
+        start = comma + 1;
+        if (item.empty()) {
+            continue;
+        }
 
-std::string trim_whitespace(const std::string& str) {
-    const std::string whitespace = " \t\r";
-    const auto begin = str.find_first_not_of(whitespace);
-    if (begin == std::string::npos) {
-        return "";
+        const size_t equals = item.find('=');
+        const std::string_view kind = equals == std::string_view::npos ? item : item.substr(equals + 1);
+        std::string function(equals == std::string_view::npos ? "" : item.substr(0, equals));
+        intrinsic_op op;
+        if (kind == "multiply") {
+            op = kIntrinsicMultiply;
+        } else if (kind == "divide") {
+            op = kIntrinsicDivide;
+        } else {
+            return tl::unexpected(fmt::format("Invalid intrinsic \"{}\" - allowed kinds: {{multiply, divide}}", item));
+        }
+        if (function.empty()) {
+            function = op == kIntrinsicMultiply ? "Math.multiply" : "Math.divide";
+        }
+        intrinsics[function] = op;
     }
-    const auto end = str.find_last_not_of(whitespace);
-    return str.substr(begin, end - begin + 1);
+    return intrinsics;
 }
 
-std::string trim_comments(const std::string& str) {
-    const auto pos = str.find("//");
-    if (pos == std::string::npos) {
-        return str;
-    }
-    return str.substr(0, pos);
+std::vector<codegen_setting> codegen_settings() {
+    codegen_options intrinsics;
+    intrinsics.intrinsics = jack_os_intrinsics();
+    codegen_options outline;
+    outline.outline = true;
+    // Outlined calls return through R15 like the intrinsic routines, so the two have to stay out of each other's way
+    codegen_options both = intrinsics;
+    both.outline = true;
+    return { codegen_setting { "default", codegen_options {} }, codegen_setting { "intrinsics", intrinsics },
+        codegen_setting { "outline", outline }, codegen_setting { "intrinsics+outline", both } };
 }
 
-std::string remove_whitespace(const std::string& str) {
-    std::string out = str;
-    auto pos = std::remove_if(out.begin(), out.end(), [] (const auto& c) {
-        return c == ' ' || c == '\t' || c == '\r';
-    });
-    out.erase(pos, out.end());
-    return out;
+tl::expected<void, std::string> check_divide_fallbacks(const std::vector<std::string>& lines, const codegen_options& options) {
+    std::set<std::string_view> defined;
+    std::set<std::string_view> used;
+    for (const std::string& line : lines) {
+        const std::string_view code = trim_whitespace(trim_comment(line));
+        if (!code.empty() && code.front() == '(') {
+            defined.insert(code.substr(1, code.size() - 2));
+        } else if (!code.empty() && code.front() == '@') {
+            used.insert(code.substr(1));
+        }
+    }
+    for (const auto& [function, op] : options.intrinsics) {
+        if (op == kIntrinsicDivide && used.count(function) > 0 && defined.count(function) == 0) {
+            return tl::unexpected(fmt::format("Dividing by zero calls {}, which no file defines", function));
+        }
+    }
+    return {};
 }
 
-std::string segment_name_string(const segment_pointer& seg) {
-    switch (seg) {
-        case kSegmentLocal: return "LCL";
-        case kSegmentArgument: return "ARG";
-        case kSegmentThis: return "THIS";
-        case kSegmentThat: return "THAT";
-        default: throw std::invalid_argument("Invalid segment");
-    }
+VMTranslator::VMTranslator(const codegen_options& options) : options(options) {}
+
+void VMTranslator::set_cache(const TranslationCache* cache) {
+    this->cache = cache;
 }
 
 tl::expected<void, std::string> VMTranslator::add_boot_code(const std::string& code) {
-    std::stringstream ss(code);
-    std::string line;
-
-    while(std::getline(ss, line)) {
-        bootcode.emplace_back(trim_whitespace(line));
+    for (const line_span& span : scan_lines(code)) {
+        if (!options.comments) {
+            if (span.code_length > 0) {
+                bootcode.emplace_back(code_of(code, span));
+            }
+            continue;
+        }
+        bootcode.emplace_back(trim_whitespace(std::string_view(code).substr(span.begin, span.end - span.begin)));
     }
 
     return {};
 }
 
-tl::expected<void, std::string> VMTranslator::add_file(const std::string& filename, const std::string& code) {
-    spdlog::debug("Adding code for file: {}", filename);
+const SourceMap& VMTranslator::source_map() const {
+    return sources;
+}
 
-    std::vector<std::string> lines;
+const std::vector<std::string>& VMTranslator::boot_code() const {
+    return bootcode;
+}
 
-    std::stringstream ss(code);
-    std::string line;
+tl::expected<void, std::string> VMTranslator::add_file(const std::string& filename, std::string code) {
+    spdlog::debug("Adding code for file: {}", filename);
 
-    while(std::getline(ss, line)) {
-        line = trim_whitespace(trim_comments(line));
-        if (line.empty()) {
-            continue;
+    file_output& output = outputs.emplace_back(file_output { {}, false, {}, {} });
+    if (cache != nullptr) {
+        output.key = cache->make_key(filename, code, options.fingerprint());
+        if (auto entry = cache->load(output.key, code); entry.has_value()) {
+            spdlog::debug("Using cached translation for file: {}", filename);
+            output.cached = true;
+            output.lines = std::move(entry->lines);
+            output.marks = std::move(entry->marks);
+            files.emplace_back(vm_file { symbols.intern(filename), {}, program.size(), program.size() });
+            return {};
         }
-        lines.emplace_back(line);
     }
 
-    files.emplace_back(std::make_pair(filename, std::move(lines)));
+    vm_file& file = files.emplace_back(vm_file { symbols.intern(filename), std::move(code), program.size(), program.size() });
+    const std::string_view source = file.source;
 
-    return {};
-}
+    const std::vector<line_span> lines = scan_lines(source);
+    for (size_t index = 0; index < lines.size(); index += 1) {
+        const source_span span { lines[index].code_begin, lines[index].code_length };
+        const size_t line_number = index + 1;
+        if (span.length == 0) {
+            continue;
+        }
 
-std::vector<std::string> tokenize(const std::string& line) {
-    std::vector<std::string> tokens;
-    std::stringstream ss(line);
-    std::string token;
+        const std::string_view line = file.line(span);
+        spdlog::trace(">>> {}", line);
 
-    while (getline(ss, token, ' ')) {
-        token = trim_whitespace(token);
-        if (token.empty()) {
-            continue;
+        auto result = parse_vm_line(line, symbols);
+        if (!result.has_value()) {
+            return tl::unexpected(fmt::format("{}:{}: {}", filename, line_number, result.error()));
         }
-        tokens.push_back(token);
+        program.push(result.value(), span);
     }
 
-    return tokens;
+    file.end = program.size();
+
+    return {};
 }
 
-tl::expected<std::vector<std::string>, std::string> VMTranslator::translate() {
+tl::expected<std::vector<std::string>, std::string> VMTranslator::translate(bool whole_program) {
     std::vector<std::string> asm_lines;
     asm_lines.reserve(1024);
 
@@ -174,192 +212,633 @@ tl::expected<std::vector<std::string>, std::string> VMTranslator::translate() {
         return tl::unexpected("No files to translate");
     }
 
-    for (const auto &[filename, lines] : files) {
-        std::vector<std::pair<vm_instruction, std::string>> instructions;
+    // The line of asm_lines each file's output starts at
+    std::vector<size_t> first_lines(files.size());
+    size_t reused = 0;
+    for (size_t index = 0; index < files.size(); index += 1) {
+        const vm_file& file = files[index];
+        file_output& output = outputs[index];
+        first_lines[index] = asm_lines.size();
 
-        for (const auto &line : lines) {
-            spdlog::trace(">>> {}", line);
-            auto result = parse_vm_line(filename, line);
+        if (!output.cached) {
+            std::vector<std::string>* out_lines = cache != nullptr ? &output.lines : &asm_lines;
+
+            build_state state;
+            state.first_line = out_lines->size();
+            auto result = build_asm(symbols.name(file.name), file.source, program, file.begin, file.end, symbols, options, &state, out_lines);
             if (!result.has_value()) {
                 return tl::unexpected(result.error());
             }
-            instructions.push_back(std::make_pair(result.value(), line));
-        }
+            output.marks = std::move(state.marks);
 
-        auto result = build_asm(filename, instructions, &asm_lines);
-        if (!result.has_value()) {
-            return tl::unexpected(result.error());
-        }
-    }
+            if (cache == nullptr) {
+                continue;
+            }
 
-    return asm_lines;
-}
+            if (auto stored = cache->store(output.key, file.source, output.lines, output.marks); !stored.has_value()) {
+                spdlog::warn("{}", stored.error());
+            }
+        } else {
+            reused += 1;
+        }
 
-tl::expected<segment_pointer, std::string> parse_segment_pointer(const std::string& segment) {
-    if (segment == "local") {
-        return kSegmentLocal;
-    }
-    if (segment == "argument") {
-        return kSegmentArgument;
-    }
-    if (segment == "this") {
-        return kSegmentThis;
-    }
-    if (segment == "that") {
-        return kSegmentThat;
+        std::copy(output.lines.begin(), output.lines.end(), std::back_inserter(asm_lines));
     }
-    if (segment == "constant") {
-        return kSegmentConstant;
-    }
-    if (segment == "static") {
-        return kSegmentStatic;
-    }
-    if (segment == "pointer") {
-        return kSegmentPointer;
-    }
-    if (segment == "temp") {
-        return kSegmentTemp;
-    }
-    return tl::unexpected(fmt::format("Invalid segment: {}", segment));
-}
 
-tl::expected<uint16_t, std::string> parse_uint16_value(const std::string& num) {
-    int value = stoi(num);
-    if (value > 32767 || value < -32768) {
-        return tl::unexpected(fmt::format("Value '{}' not in range [-32768, 32767]", value));
+    if (cache != nullptr) {
+        spdlog::info("Reused cached translation for {} of {} files", reused, files.size());
     }
-    uint16_t val = value;
-    return val;
-}
 
-tl::expected<uint8_t, std::string> parse_uint8_value(const std::string& num) {
-    int value = stoi(num);
-    if (value > 127 || value < -128) {
-        return tl::unexpected(fmt::format("Value '{}' not in range [-128, 127]", value));
+    // ROM address of every mark, counting the instructions in front of its line
+    struct placed_mark {
+        uint32_t address;
+        size_t file;
+        const source_mark* mark;
+    };
+    std::vector<placed_mark> placed;
+    size_t line_index = 0;
+    uint32_t address = 0;
+    for (size_t index = 0; index < files.size(); index += 1) {
+        for (const source_mark& mark : outputs[index].marks) {
+            for (; line_index < first_lines[index] + mark.line_index; line_index += 1) {
+                address += is_instruction(asm_lines[line_index]) ? 1 : 0;
+            }
+            placed.push_back(placed_mark { address, index, &mark });
+        }
     }
-    uint8_t val = value;
-    return val;
-}
-
-tl::expected<vm_instruction, std::string> parse_vm_line(const std::string& filename, const std::string& line) {
-    std::vector<std::string> tokens = tokenize(line);
 
-    if (tokens.empty()) {
-        return tl::unexpected("Unexpected empty instruction line");
+    if (whole_program) {
+        if (auto checked = check_divide_fallbacks(asm_lines, options); !checked.has_value()) {
+            return tl::unexpected(checked.error());
+        }
     }
 
-    const std::string& cmd = tokens[0];
-
-    if (tokens.size() == 1) {
-        if (cmd == "add") {
-            return cmd_arithmetic { kArithmeticOpAdd };
-        }
-        if (cmd == "sub") {
-            return cmd_arithmetic { kArithmeticOpSub };
+    const bool outline = whole_program && options.outline;
+    std::vector<uint32_t> origins;
+    if (outline) {
+        auto outlined = outline_program(asm_lines, options.outline_budget, kOutlineProfileCycles, nullptr, &origins);
+        if (!outlined.has_value()) {
+            return tl::unexpected(outlined.error());
         }
-        if (cmd == "neg") {
-            return cmd_arithmetic { kArithmeticOpNeg };
-        }
-        if (cmd == "eq") {
-            return cmd_arithmetic { kArithmeticOpEq };
-        }
-        if (cmd == "gt") {
-            return cmd_arithmetic { kArithmeticOpGt };
-        }
-        if (cmd == "lt") {
-            return cmd_arithmetic { kArithmeticOpLt };
-        }
-        if (cmd == "and") {
-            return cmd_arithmetic { kArithmeticOpAnd };
+        asm_lines = std::move(outlined.value());
+    }
+
+    // Without outlining every address stands for itself, and the marks are already in order
+    sources = SourceMap();
+    auto add_source = [&] (uint32_t at, const placed_mark& placed_at) {
+        if (at < kRomSize) {
+            sources.add(at, fmt::format("{}.vm", symbols.name(files[placed_at.file].name)), placed_at.mark->function, placed_at.mark->line);
         }
-        if (cmd == "or") {
-            return cmd_arithmetic { kArithmeticOpOr };
+    };
+    if (!outline) {
+        for (const placed_mark& at : placed) {
+            add_source(at.address, at);
         }
-        if (cmd == "not") {
-            return cmd_arithmetic { kArithmeticOpNot };
+    } else {
+        for (uint32_t at = 0; at < origins.size(); at += 1) {
+            const auto after = std::upper_bound(placed.begin(), placed.end(), origins[at], [] (uint32_t origin, const placed_mark& mark) {
+                return origin < mark.address;
+            });
+            if (after != placed.begin()) {
+                add_source(at, *std::prev(after));
+            }
         }
     }
 
-    if (cmd == "push" && tokens.size() == 3) {
-        const auto segment = parse_segment_pointer(tokens[1]);
-        if (!segment.has_value()) {
-            return tl::unexpected(segment.error());
-        }
+    return asm_lines;
+}
 
-        const auto value = parse_uint16_value(tokens[2]);
-        if (!value.has_value()) {
-            return tl::unexpected(value.error());
+tl::expected<void, std::string> VMTranslator::translate_stream(const std::string& filename, std::istream& in, std::ostream& out) {
+    auto write_lines = [&] (const std::vector<std::string>& lines) {
+        for (const auto &line : lines) {
+            out.write(line.c_str(), line.size());
+            out.write("\n", 1);
         }
+    };
 
-        return cmd_push { segment.value(), value.value() };
-    }
+    write_lines(bootcode);
 
-    if (cmd == "pop" && tokens.size() == 3) {
-        const auto segment = parse_segment_pointer(tokens[1]);
-        if (!segment.has_value()) {
-            return tl::unexpected(segment.error());
+    // Scratch state is reset for every line so memory use does not grow with the input
+    SymbolTable line_symbols;
+    VMProgram line_program;
+    std::vector<std::string> asm_lines;
+    std::string line;
+    size_t line_number = 0;
+    build_state state;
+
+    while (std::getline(in, line)) {
+        line_number += 1;
+
+        const line_span scanned = scan_line(line);
+        const source_span span { scanned.code_begin, scanned.code_length };
+        if (span.length == 0) {
+            continue;
         }
 
-        const auto value = parse_uint16_value(tokens[2]);
-        if (!value.has_value()) {
-            return tl::unexpected(value.error());
+        const std::string_view text = std::string_view(line).substr(span.offset, span.length);
+        spdlog::trace(">>> {}", text);
+
+        line_symbols.clear();
+        line_program.clear();
+        asm_lines.clear();
+
+        auto result = parse_vm_line(text, line_symbols);
+        if (!result.has_value()) {
+            return tl::unexpected(fmt::format("{}:{}: {}", filename, line_number, result.error()));
         }
+        line_program.push(result.value(), span);
 
-        segment_pointer seg = segment.value();
-        if (seg == kSegmentConstant) {
-            return tl::unexpected("Constant segment cannot be used with pop command");
+        auto built = build_asm(filename, line, line_program, 0, line_program.size(), line_symbols, options, &state, &asm_lines);
+        if (!built.has_value()) {
+            return tl::unexpected(built.error());
         }
 
-        uint16_t val = value.value();
+        write_lines(asm_lines);
 
-        return cmd_pop { seg, value.value() };
-    }
+        // Nothing maps a stream to its source, and each line's source starts over
+        state.marks.clear();
+        state.line_offset = 0;
 
-    if (cmd == "label" && tokens.size() == 2) {
-        return cmd_label { tokens[1] };
+        // Only flush when the next read could block, so buffered input is still written in batches
+        if (in.rdbuf()->in_avail() <= 0) {
+            out.flush();
+        }
     }
 
-    if (cmd == "goto" && tokens.size() == 2) {
-        return cmd_goto { tokens[1] };
+    out.flush();
+    if (!out) {
+        return tl::unexpected("Failed to write output");
     }
 
-    if (cmd == "if-goto" && tokens.size() == 2) {
-        return cmd_if { tokens[1] };
+    return {};
+}
+
+// D = value, for any 16-bit value: @ only takes 15 bits, so the upper half loads its complement
+void load_constant(uint16_t value, std::vector<std::string>* out_lines) {
+    if (value <= 0x7fff) {
+        out_lines->push_back(fmt::format("@{}", value));
+        out_lines->push_back("D=A");
+    } else {
+        out_lines->push_back(fmt::format("@{}", static_cast<uint16_t>(~value)));
+        out_lines->push_back("D=!A");
     }
+}
 
-    if (cmd == "function" && tokens.size() == 3) {
-        const auto value = parse_uint8_value(tokens[2]);
-        if (!value.has_value()) {
-            return tl::unexpected(value.error());
-        }
+void push_constant(uint16_t value, std::vector<std::string>* out_lines) {
+    load_constant(value, out_lines);
+    out_lines->push_back("@SP");
+    out_lines->push_back("A=M");
+    out_lines->push_back("M=D");
+    out_lines->push_back("@SP");
+    out_lines->push_back("M=M+1");
+}
 
-        return cmd_function { tokens[1], value.value() };
-    }
+void push_call(std::string_view function, int count, const std::string& return_label, std::vector<std::string>* out_lines) {
+    // RAM[SP+0] <- return address
+    out_lines->push_back(fmt::format("@{}", return_label));
+    out_lines->push_back("D=A");
+    out_lines->push_back("@SP");
+    out_lines->push_back("A=M");
+    out_lines->push_back("M=D");
+    // SP++
+    out_lines->push_back("@SP");
+    out_lines->push_back("M=M+1");
+
+    // RAM[SP+1] <- LCL
+    out_lines->push_back("@LCL");
+    out_lines->push_back("D=M");
+    out_lines->push_back("@SP");
+    out_lines->push_back("A=M");
+    out_lines->push_back("M=D");
+    // SP++
+    out_lines->push_back("@SP");
+    out_lines->push_back("M=M+1");
+
+    // RAM[SP+1] <- ARG
+    out_lines->push_back("@ARG");
+    out_lines->push_back("D=M");
+    out_lines->push_back("@SP");
+    out_lines->push_back("A=M");
+    out_lines->push_back("M=D");
+    // SP++
+    out_lines->push_back("@SP");
+    out_lines->push_back("M=M+1");
+
+    // RAM[SP+1] <- THIS
+    out_lines->push_back("@THIS");
+    out_lines->push_back("D=M");
+    out_lines->push_back("@SP");
+    out_lines->push_back("A=M");
+    out_lines->push_back("M=D");
+    // SP++
+    out_lines->push_back("@SP");
+    out_lines->push_back("M=M+1");
+
+    // RAM[SP+1] <- THAT
+    out_lines->push_back("@THAT");
+    out_lines->push_back("D=M");
+    out_lines->push_back("@SP");
+    out_lines->push_back("A=M");
+    out_lines->push_back("M=D");
+    // SP++
+    out_lines->push_back("@SP");
+    out_lines->push_back("M=M+1");
+
+    // ARG = SP - 5 - nArgs
+    out_lines->push_back("@5");
+    out_lines->push_back("D=A");
+    out_lines->push_back(fmt::format("@{}", count));
+    out_lines->push_back("D=D+A");
+    out_lines->push_back("@SP");
+    out_lines->push_back("D=M-D");
+    out_lines->push_back("@ARG");
+    out_lines->push_back("M=D");
+
+    // LCL = SP
+    out_lines->push_back("@SP");
+    out_lines->push_back("D=M");
+    out_lines->push_back("@LCL");
+    out_lines->push_back("M=D");
+
+    // jump to function
+    out_lines->push_back(fmt::format("@{}", function));
+    out_lines->push_back("0;JMP");
+
+    // (return_label)
+    out_lines->push_back(fmt::format("({})", return_label));
+}
 
-    if (cmd == "call" && tokens.size() == 3) {
-        const auto value = parse_uint8_value(tokens[2]);
-        if (!value.has_value()) {
-            return tl::unexpected(value.error());
+// Routine for x * y, the two values on top of the stack, which returns to the address in R15 with the product in
+// place of x. y's bits are cleared as they are added in, so the loop stops after its highest one
+void multiply_routine(const std::string& label, std::vector<std::string>* out_lines) {
+    // R14 = y, R13 = x, R6 = product, R5 = mask
+    out_lines->push_back(fmt::format("({})", label));
+    out_lines->push_back("@SP");
+    out_lines->push_back("AM=M-1");
+    out_lines->push_back("D=M");
+    out_lines->push_back("@R14");
+    out_lines->push_back("M=D");
+    out_lines->push_back("@SP");
+    out_lines->push_back("A=M-1");
+    out_lines->push_back("D=M");
+    out_lines->push_back("@R13");
+    out_lines->push_back("M=D");
+    out_lines->push_back("@R6");
+    out_lines->push_back("M=0");
+    out_lines->push_back("@R5");
+    out_lines->push_back("M=1");
+
+    out_lines->push_back(fmt::format("({}.loop)", label));
+    out_lines->push_back("@R14");
+    out_lines->push_back("D=M");
+    out_lines->push_back(fmt::format("@{}.done", label));
+    out_lines->push_back("D;JEQ");
+    out_lines->push_back("@R5");
+    out_lines->push_back("D=M");
+    out_lines->push_back("@R14");
+    out_lines->push_back("D=D&M");
+    out_lines->push_back(fmt::format("@{}.next", label));
+    out_lines->push_back("D;JEQ");
+    // y -= mask, product += x
+    out_lines->push_back("@R14");
+    out_lines->push_back("M=M-D");
+    out_lines->push_back("@R13");
+    out_lines->push_back("D=M");
+    out_lines->push_back("@R6");
+    out_lines->push_back("M=D+M");
+    out_lines->push_back(fmt::format("({}.next)", label));
+    // x <<= 1, mask <<= 1
+    out_lines->push_back("@R13");
+    out_lines->push_back("D=M");
+    out_lines->push_back("M=D+M");
+    out_lines->push_back("@R5");
+    out_lines->push_back("D=M");
+    out_lines->push_back("M=D+M");
+    out_lines->push_back(fmt::format("@{}.loop", label));
+    out_lines->push_back("0;JMP");
+
+    // RAM[SP-1] <- product
+    out_lines->push_back(fmt::format("({}.done)", label));
+    out_lines->push_back("@R6");
+    out_lines->push_back("D=M");
+    out_lines->push_back("@SP");
+    out_lines->push_back("A=M-1");
+    out_lines->push_back("M=D");
+    out_lines->push_back("@R15");
+    out_lines->push_back("A=M");
+    out_lines->push_back("0;JMP");
+}
+
+// Non-adjacent form of value, lowest digit first: digits of -1, 0 and 1 with no two neighbours non-zero, so a
+// run of ones such as 15 = 16 - 1 costs one subtraction instead of three additions
+std::vector<int> non_adjacent_form(uint32_t value) {
+    std::vector<int> digits;
+    while (value != 0) {
+        int digit = 0;
+        if (value & 1) {
+            digit = (value & 3) == 3 ? -1 : 1;
+            value = digit < 0 ? value + 1 : value - 1;
         }
+        digits.push_back(digit);
+        value >>= 1;
+    }
+    return digits;
+}
 
-        return cmd_call { tokens[1], value.value() };
+// x * constant for x on top of the stack, without a loop: Horner's way from the top digit, each doubling is
+// A=D, D=D+A and each other non-zero digit adds or subtracts the multiplicand kept in R13
+void push_multiply_constant(uint16_t constant, std::vector<std::string>* out_lines) {
+    if (constant == 0) {
+        out_lines->push_back("@SP");
+        out_lines->push_back("A=M-1");
+        out_lines->push_back("M=0");
+        return;
     }
 
-    if (cmd == "return" && tokens.size() == 1) {
-        return cmd_return {};
+    if (constant == 1) {
+        return;
     }
+    const std::vector<int> digits = non_adjacent_form(constant);
+    out_lines->push_back("@SP");
+    out_lines->push_back("A=M-1");
+    out_lines->push_back("D=M");
+    if (std::any_of(digits.begin(), digits.end() - 1, [] (int digit) { return digit != 0; })) {
+        out_lines->push_back("@R13");
+        out_lines->push_back("M=D");
+    }
+    for (size_t index = digits.size() - 1; index-- > 0; ) {
+        out_lines->push_back("A=D");
+        out_lines->push_back("D=D+A");
+        if (digits[index] != 0) {
+            out_lines->push_back("@R13");
+            out_lines->push_back(digits[index] > 0 ? "D=D+M" : "D=D-M");
+        }
+    }
+    out_lines->push_back("@SP");
+    out_lines->push_back("A=M-1");
+    out_lines->push_back("M=D");
+}
 
-    return tl::unexpected(fmt::format("Unknown command: {}", line));
+// Routine for x / y rounded towards zero, the two values on top of the stack, which returns to the address in R15
+// with the quotient in place of x. The magnitudes are divided as unsigned 16-bit words, shifting x into the
+// remainder a bit at a time, so -32768 / -1 wraps round to -32768
+void divide_routine(const std::string& label, std::string_view function, const std::string& return_label, std::vector<std::string>* out_lines) {
+    // R14 = |y|, R6 < 0 when the quotient is negative
+    out_lines->push_back(fmt::format("({})", label));
+    out_lines->push_back("@SP");
+    out_lines->push_back("AM=M-1");
+    out_lines->push_back("D=M");
+    out_lines->push_back(fmt::format("@{}.zero", label));
+    out_lines->push_back("D;JEQ");
+    out_lines->push_back("@R6");
+    out_lines->push_back("M=D");
+    out_lines->push_back(fmt::format("@{}.ypos", label));
+    out_lines->push_back("D;JGE");
+    out_lines->push_back("D=-D");
+    out_lines->push_back(fmt::format("({}.ypos)", label));
+    out_lines->push_back("@R14");
+    out_lines->push_back("M=D");
+
+    // R13 = |x|, flipping the sign of R6 when x is negative
+    out_lines->push_back("@SP");
+    out_lines->push_back("A=M-1");
+    out_lines->push_back("D=M");
+    out_lines->push_back(fmt::format("@{}.xpos", label));
+    out_lines->push_back("D;JGE");
+    out_lines->push_back("@R6");
+    out_lines->push_back("M=!M");
+    out_lines->push_back("D=-D");
+    out_lines->push_back(fmt::format("({}.xpos)", label));
+    out_lines->push_back("@R13");
+    out_lines->push_back("M=D");
+    // R7 = remainder, R5 = bits left
+    out_lines->push_back("@R7");
+    out_lines->push_back("M=0");
+    out_lines->push_back("@16");
+    out_lines->push_back("D=A");
+    out_lines->push_back("@R5");
+    out_lines->push_back("M=D");
+
+    // Leading zeros of x leave the remainder at zero and put zeros in the quotient, so shift them out quickly
+    out_lines->push_back(fmt::format("({}.skip)", label));
+    out_lines->push_back("@R13");
+    out_lines->push_back("D=M");
+    out_lines->push_back(fmt::format("@{}.loop", label));
+    out_lines->push_back("D;JLT");
+    out_lines->push_back(fmt::format("@{}.sign", label));
+    out_lines->push_back("D;JEQ");
+    out_lines->push_back("@R13");
+    out_lines->push_back("M=D+M");
+    out_lines->push_back("@R5");
+    out_lines->push_back("M=M-1");
+    out_lines->push_back(fmt::format("@{}.skip", label));
+    out_lines->push_back("0;JMP");
+
+    // remainder = remainder * 2 + top bit of R13, R13 <<= 1
+    out_lines->push_back(fmt::format("({}.loop)", label));
+    out_lines->push_back("@R7");
+    out_lines->push_back("D=M");
+    out_lines->push_back("M=D+M");
+    out_lines->push_back("@R13");
+    out_lines->push_back("D=M");
+    out_lines->push_back("M=D+M");
+    out_lines->push_back(fmt::format("@{}.low", label));
+    out_lines->push_back("D;JGE");
+    out_lines->push_back("@R7");
+    out_lines->push_back("M=M+1");
+    out_lines->push_back(fmt::format("({}.low)", label));
+    // A remainder of 32768 or more is past any divisor; below that the signed difference decides
+    out_lines->push_back("@R7");
+    out_lines->push_back("D=M");
+    out_lines->push_back(fmt::format("@{}.sub", label));
+    out_lines->push_back("D;JLT");
+    out_lines->push_back("@R14");
+    out_lines->push_back("D=D-M");
+    out_lines->push_back(fmt::format("@{}.next", label));
+    out_lines->push_back("D;JLT");
+    // remainder -= |y|, and the freed low bit of R13 takes a one of the quotient
+    out_lines->push_back(fmt::format("({}.sub)", label));
+    out_lines->push_back("@R14");
+    out_lines->push_back("D=M");
+    out_lines->push_back("@R7");
+    out_lines->push_back("M=M-D");
+    out_lines->push_back("@R13");
+    out_lines->push_back("M=M+1");
+    out_lines->push_back(fmt::format("({}.next)", label));
+    out_lines->push_back("@R5");
+    out_lines->push_back("MD=M-1");
+    out_lines->push_back(fmt::format("@{}.loop", label));
+    out_lines->push_back("D;JGT");
+
+    // RAM[SP-1] <- quotient, negated when the signs differed
+    out_lines->push_back(fmt::format("({}.sign)", label));
+    out_lines->push_back("@R6");
+    out_lines->push_back("D=M");
+    out_lines->push_back(fmt::format("@{}.positive", label));
+    out_lines->push_back("D;JGE");
+    out_lines->push_back("@R13");
+    out_lines->push_back("M=-M");
+    out_lines->push_back(fmt::format("({}.positive)", label));
+    out_lines->push_back("@R13");
+    out_lines->push_back("D=M");
+    out_lines->push_back("@SP");
+    out_lines->push_back("A=M-1");
+    out_lines->push_back("M=D");
+    out_lines->push_back("@R15");
+    out_lines->push_back("A=M");
+    out_lines->push_back("0;JMP");
+
+    // Dividing by zero calls the function after all, for its error. The call may use R15 itself, so the return
+    // address goes on the stack under the arguments: x, 0 becomes return, x, 0 and then return, result
+    out_lines->push_back(fmt::format("({}.zero)", label));
+    out_lines->push_back("@SP");
+    out_lines->push_back("A=M-1");
+    out_lines->push_back("D=M");
+    out_lines->push_back("@SP");
+    out_lines->push_back("A=M");
+    out_lines->push_back("M=D");
+    out_lines->push_back("@R15");
+    out_lines->push_back("D=M");
+    out_lines->push_back("@SP");
+    out_lines->push_back("A=M-1");
+    out_lines->push_back("M=D");
+    out_lines->push_back("@SP");
+    out_lines->push_back("M=M+1");
+    out_lines->push_back("A=M");
+    out_lines->push_back("M=0");
+    out_lines->push_back("@SP");
+    out_lines->push_back("M=M+1");
+    push_call(function, 2, return_label, out_lines);
+    out_lines->push_back("@SP");
+    out_lines->push_back("AM=M-1");
+    out_lines->push_back("D=M");
+    out_lines->push_back("@R13");
+    out_lines->push_back("M=D");
+    out_lines->push_back("@SP");
+    out_lines->push_back("A=M-1");
+    out_lines->push_back("D=M");
+    out_lines->push_back("@R15");
+    out_lines->push_back("M=D");
+    out_lines->push_back("@R13");
+    out_lines->push_back("D=M");
+    out_lines->push_back("@SP");
+    out_lines->push_back("A=M-1");
+    out_lines->push_back("M=D");
+    out_lines->push_back("@R15");
+    out_lines->push_back("A=M");
+    out_lines->push_back("0;JMP");
 }
 
-tl::expected<void, std::string> build_asm(const std::string& filename, const std::vector<std::pair<vm_instruction, std::string>>& instructions, std::vector<std::string>* out_lines) {
-    std::string segment_name;
-    int counter = 0;
-    for (const auto& instr_pair : instructions) {
-        const vm_instruction& instr = std::get<0>(instr_pair);
-        const std::string& line = std::get<1>(instr_pair);
+// The intrinsic a call lowers to, if any
+std::optional<intrinsic_op> find_intrinsic(const VMProgram& program, size_t index, const SymbolTable& symbols, const codegen_options& options) {
+    if (options.intrinsics.empty() || program.commands[index] != kCommandCall) {
+        return std::nullopt;
+    }
+    const cmd_call call = std::get<cmd_call>(program.at(index));
+    const auto found = options.intrinsics.find(symbols.name(call.name));
+    if (found == options.intrinsics.end() || call.count != 2) {
+        return std::nullopt;
+    }
+    return found->second;
+}
+
+tl::expected<void, std::string> build_asm(std::string_view filename, std::string_view source, const VMProgram& program, size_t begin, size_t end, const SymbolTable& symbols, const codegen_options& options, build_state* state, std::vector<std::string>* out_lines) {
+    int& counter = state->label_counter;
+    // Files are linked into one program, so generated labels carry the file and VM labels their function
+    auto scoped_label = [&] (symbol_id label) {
+        return state->function.empty() ? std::string(symbols.name(label)) : fmt::format("{}${}", state->function, symbols.name(label));
+    };
+    // Constant arguments of an intrinsic call that follows, which its lowering uses instead of pushing them
+    std::optional<uint16_t> constant_x;
+    std::optional<uint16_t> constant_y;
+    for (size_t index = begin; index < end; index += 1) {
+        const vm_instruction instr = program.at(index);
+        const std::string_view line = source.substr(program.spans[index].offset, program.spans[index].length);
+
+        // Commands come in source order, so their line numbers only need the newlines since the last one
+        const size_t offset = program.spans[index].offset;
+        state->line_number += std::count(source.begin() + state->line_offset, source.begin() + offset, '\n');
+        state->line_offset = offset;
+        if (program.commands[index] == kCommandFunction) {
+            state->function = symbols.name(std::get<cmd_function>(instr).name);
+        }
+        state->marks.push_back(source_mark { static_cast<uint32_t>(out_lines->size() - state->first_line), state->line_number, state->function });
+
+        if (options.comments) {
+            out_lines->push_back(fmt::format("// {}", line));
+        }
+
+        // "push constant c, call" makes c the second argument, and "push constant c, push ..., call" the first,
+        // which only helps multiplying, unless the second is a constant as well
+        if (program.commands[index] == kCommandPush && program.operands[index] == kSegmentConstant) {
+            const auto next = index + 1 < end ? find_intrinsic(program, index + 1, symbols, options) : std::nullopt;
+            const auto after = index + 2 < end ? find_intrinsic(program, index + 2, symbols, options) : std::nullopt;
+            if (next.has_value()) {
+                constant_y = program.values[index];
+                if (options.comments) {
+                    out_lines->push_back("");
+                }
+                continue;
+            }
+            const bool push_next = after.has_value() && program.commands[index + 1] == kCommandPush;
+            if (push_next && (after.value() == kIntrinsicMultiply || program.operands[index + 1] == kSegmentConstant)) {
+                constant_x = program.values[index];
+                if (options.comments) {
+                    out_lines->push_back("");
+                }
+                continue;
+            }
+        }
+        if (const auto intrinsic = find_intrinsic(program, index, symbols, options); intrinsic.has_value()) {
+            const std::optional<uint16_t> x = std::exchange(constant_x, std::nullopt);
+            const std::optional<uint16_t> y = std::exchange(constant_y, std::nullopt);
+            if (intrinsic.value() == kIntrinsicMultiply && x.has_value() && y.has_value()) {
+                push_constant(static_cast<uint16_t>(x.value() * y.value()), out_lines);
+            } else if (intrinsic.value() == kIntrinsicMultiply && (x.has_value() || y.has_value())) {
+                push_multiply_constant(x.has_value() ? x.value() : y.value(), out_lines);
+            } else if (x.has_value() && y.has_value() && y.value() != 0) {
+                // Signed like the routine, since "push constant -6" is a constant too, and rounded towards zero the
+                // way C++ does. -32768 / -1 wraps round to -32768 as well
+                push_constant(static_cast<uint16_t>(static_cast<int16_t>(x.value()) / static_cast<int16_t>(y.value())), out_lines);
+            } else if (y.has_value() && y.value() == 1) {
+                if (x.has_value()) {
+                    push_constant(x.value(), out_lines);
+                }
+            } else {
+                for (const auto& constant : { x, y }) {
+                    if (constant.has_value()) {
+                        push_constant(constant.value(), out_lines);
+                    }
+                }
+
+                // The file's first call brings the routine along, jumped over on the way through
+                const std::string routine = fmt::format("{}${}", filename, intrinsic_name(intrinsic.value()));
+                if (state->routines.insert(intrinsic.value()).second) {
+                    out_lines->push_back(fmt::format("@{}.end", routine));
+                    out_lines->push_back("0;JMP");
+                    if (intrinsic.value() == kIntrinsicMultiply) {
+                        multiply_routine(routine, out_lines);
+                    } else {
+                        const std::string_view function = symbols.name(std::get<cmd_call>(instr).name);
+                        divide_routine(routine, function, fmt::format("{}$ret.{}.{}", function, filename, counter++), out_lines);
+                    }
+                    out_lines->push_back(fmt::format("({}.end)", routine));
+                }
 
-        out_lines->push_back(fmt::format("// {}", line));
+                const std::string return_label = fmt::format("{}.ret.{}", routine, counter++);
+                out_lines->push_back(fmt::format("@{}", return_label));
+                out_lines->push_back("D=A");
+                out_lines->push_back("@R15");
+                out_lines->push_back("M=D");
+                out_lines->push_back(fmt::format("@{}", routine));
+                out_lines->push_back("0;JMP");
+                out_lines->push_back(fmt::format("({})", return_label));
+            }
+            if (options.comments) {
+                out_lines->push_back("");
+            }
+            continue;
+        }
 
         auto res = std::visit(overloaded {
             [&] (const cmd_arithmetic& cmd) -> tl::expected<void, std::string> {
@@ -394,7 +873,7 @@ tl::expected<void, std::string> build_asm(const std::string& filename, const std
                     return {};
                 case kArithmeticOpEq:
                     {
-                        std::string label = fmt::format("kArithmeticOpEq.{}", ++counter);
+                        std::string label = fmt::format("{}.kArithmeticOpEq.{}", filename, ++counter);
 
                         out_lines->push_back("@SP");
                         out_lines->push_back("AM=M-1");
@@ -421,7 +900,7 @@ tl::expected<void, std::string> build_asm(const std::string& filename, const std
                     }
                 case kArithmeticOpGt:
                     {
-                        std::string label = fmt::format("kArithmeticOpGt.{}", ++counter);
+                        std::string label = fmt::format("{}.kArithmeticOpGt.{}", filename, ++counter);
 
                         out_lines->push_back("@SP");
                         out_lines->push_back("AM=M-1");
@@ -448,7 +927,7 @@ tl::expected<void, std::string> build_asm(const std::string& filename, const std
                     }
                 case kArithmeticOpLt:
                     {
-                        std::string label = fmt::format("kArithmeticOpGt.{}", ++counter);
+                        std::string label = fmt::format("{}.kArithmeticOpGt.{}", filename, ++counter);
 
                         out_lines->push_back("@SP");
                         out_lines->push_back("AM=M-1");
@@ -508,9 +987,8 @@ tl::expected<void, std::string> build_asm(const std::string& filename, const std
                     switch (cmd.seg)
                     {
                     case kSegmentConstant:
-                        // RAM[SP] = i
-                        out_lines->push_back(fmt::format("@{}", cmd.offset));
-                        out_lines->push_back("D=A");
+                        // RAM[SP] = i, which may be negative
+                        load_constant(cmd.offset, out_lines);
                         out_lines->push_back("@SP");
                         out_lines->push_back("A=M");
                         out_lines->push_back("M=D");
@@ -723,11 +1201,11 @@ tl::expected<void, std::string> build_asm(const std::string& filename, const std
                 }
             },
             [&] (const cmd_label& cmd) -> tl::expected<void, std::string> {
-                out_lines->push_back(fmt::format("({})", cmd.label));
+                out_lines->push_back(fmt::format("({})", scoped_label(cmd.label)));
                 return {};
             },
             [&] (const cmd_goto& cmd) -> tl::expected<void, std::string> {
-                out_lines->push_back(fmt::format("@{}", cmd.label));
+                out_lines->push_back(fmt::format("@{}", scoped_label(cmd.label)));
                 out_lines->push_back("0;JMP");
                 return {};
             },
@@ -740,7 +1218,7 @@ tl::expected<void, std::string> build_asm(const std::string& filename, const std
                 out_lines->push_back("D=M");
 
                 // jump if D != 0
-                out_lines->push_back(fmt::format("@{}", cmd.label));
+                out_lines->push_back(fmt::format("@{}", scoped_label(cmd.label)));
                 out_lines->push_back("D;JNE");
 
                 return {};
@@ -748,7 +1226,7 @@ tl::expected<void, std::string> build_asm(const std::string& filename, const std
             [&] (const cmd_function& cmd) -> tl::expected<void, std::string> {
 
                 // function label
-                out_lines->push_back(fmt::format("({})", cmd.name));
+                out_lines->push_back(fmt::format("({})", symbols.name(cmd.name)));
 
                 // initialize local vars
                 for (int i = 0; i < cmd.count; i += 1) {
@@ -833,81 +1311,8 @@ tl::expected<void, std::string> build_asm(const std::string& filename, const std
                 return {};
             },
             [&] (const cmd_call& cmd) -> tl::expected<void, std::string> {
-                std::string return_label = fmt::format("{}$ret.{}", cmd.name, counter++);
-
-                // RAM[SP+0] <- return address
-                out_lines->push_back(fmt::format("@{}", return_label));
-                out_lines->push_back("D=A");
-                out_lines->push_back("@SP");
-                out_lines->push_back("A=M");
-                out_lines->push_back("M=D");
-                // SP++
-                out_lines->push_back("@SP");
-                out_lines->push_back("M=M+1");
-
-                // RAM[SP+1] <- LCL
-                out_lines->push_back("@LCL");
-                out_lines->push_back("D=M");
-                out_lines->push_back("@SP");
-                out_lines->push_back("A=M");
-                out_lines->push_back("M=D");
-                // SP++
-                out_lines->push_back("@SP");
-                out_lines->push_back("M=M+1");
-
-                // RAM[SP+1] <- ARG
-                out_lines->push_back("@ARG");
-                out_lines->push_back("D=M");
-                out_lines->push_back("@SP");
-                out_lines->push_back("A=M");
-                out_lines->push_back("M=D");
-                // SP++
-                out_lines->push_back("@SP");
-                out_lines->push_back("M=M+1");
-
-                // RAM[SP+1] <- THIS
-                out_lines->push_back("@THIS");
-                out_lines->push_back("D=M");
-                out_lines->push_back("@SP");
-                out_lines->push_back("A=M");
-                out_lines->push_back("M=D");
-                // SP++
-                out_lines->push_back("@SP");
-                out_lines->push_back("M=M+1");
-
-                // RAM[SP+1] <- THAT
-                out_lines->push_back("@THAT");
-                out_lines->push_back("D=M");
-                out_lines->push_back("@SP");
-                out_lines->push_back("A=M");
-                out_lines->push_back("M=D");
-                // SP++
-                out_lines->push_back("@SP");
-                out_lines->push_back("M=M+1");
-
-                // ARG = SP - 5 - nArgs
-                out_lines->push_back("@5");
-                out_lines->push_back("D=A");
-                out_lines->push_back(fmt::format("@{}", cmd.count));
-                out_lines->push_back("D=D+A");
-                out_lines->push_back("@SP");
-                out_lines->push_back("D=M-D");
-                out_lines->push_back("@ARG");
-                out_lines->push_back("M=D");
-
-                // LCL = SP
-                out_lines->push_back("@SP");
-                out_lines->push_back("D=M");
-                out_lines->push_back("@LCL");
-                out_lines->push_back("M=D");
-
-                // jump to function
-                out_lines->push_back(fmt::format("@{}", cmd.name));
-                out_lines->push_back("0;JMP");
-
-                // (return_label)
-                out_lines->push_back(fmt::format("({})", return_label));
-
+                std::string return_label = fmt::format("{}$ret.{}.{}", symbols.name(cmd.name), filename, counter++);
+                push_call(symbols.name(cmd.name), cmd.count, return_label, out_lines);
                 return {};
             },
             [&] (auto&&) -> tl::expected<void, std::string> {
@@ -919,7 +1324,9 @@ tl::expected<void, std::string> build_asm(const std::string& filename, const std
             return tl::unexpected(res.error());
         }
 
-        out_lines->push_back("");
+        if (options.comments) {
+            out_lines->push_back("");
+        }
     }
     return {};
 }
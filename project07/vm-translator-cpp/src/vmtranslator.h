@@ -1,18 +1,101 @@
 #pragma once
 
 #include <filesystem>
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <map>
+#include <ostream>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 #include <tl/expected.hpp>
 
+#include "sourcemap.h"
+#include "vmcache.h"
+#include "vmir.h"
+
+enum intrinsic_op : uint8_t {
+    kIntrinsicMultiply,
+    kIntrinsicDivide,
+};
+
+struct codegen_options {
+    // Functions of two arguments whose calls are lowered to a shift-and-add or restoring division routine that each
+    // file using it carries once. Calls jump there with the return address in R15, and the routine works in temp
+    // 0-2 (R5-R7) and R13-R14 instead of a call frame. A multiplication by a constant pushed right before the
+    // call is unrolled instead, and dividing by zero still calls the function, for its error
+    std::map<std::string, intrinsic_op, std::less<>> intrinsics;
+
+    // Writes a "// <vm line>" comment in front of every command's code and keeps those of the bootstrap. Release
+    // builds leave them out, so the assembler has less text to read, and map addresses to sources with a SourceMap
+    bool comments = true;
+
+    // Runs outline_program over the whole translated program, after the per-file cache, so it is not part of the
+    // fingerprint. Streaming translation never sees the whole program and skips it
+    bool outline = false;
+    // Share of the profiled cycles the outlined call sites may add
+    double outline_budget = 0.05;
+
+    // Identifies every setting that affects generated assembly, used to key cached translations
+    std::string fingerprint() const;
+};
+
+// Divide routines call the function they stand in for when dividing by zero, which the assembler would take for a
+// variable if no file defines it
+tl::expected<void, std::string> check_divide_fallbacks(const std::vector<std::string>& lines, const codegen_options& options);
+
+// Cycles a program is profiled for before outlining, long enough to see it through its start-up and into its main loops
+constexpr uint64_t kOutlineProfileCycles = 20'000'000;
+
+// Math.multiply and Math.divide of the Jack OS
+std::map<std::string, intrinsic_op, std::less<>> jack_os_intrinsics();
+
+// A comma-separated list of "Function=multiply" or "Function=divide", where a bare "multiply" or "divide" names the
+// Jack OS function
+tl::expected<std::map<std::string, intrinsic_op, std::less<>>, std::string> parse_intrinsics(std::string_view list);
+
+// A named combination of codegen options, e.g. for measuring what each one does to the generated code
+struct codegen_setting {
+    std::string name;
+    codegen_options options;
+};
+
+// Every setting worth measuring, starting with the defaults
+std::vector<codegen_setting> codegen_settings();
+
 class VMTranslator {
 public:
+    VMTranslator(const codegen_options& options = {});
+
+    void set_cache(const TranslationCache* cache);
     tl::expected<void, std::string> add_boot_code(const std::string& code);
-    tl::expected<void, std::string> add_file(const std::string& filename, const std::string& code);
-    tl::expected<std::vector<std::string>, std::string> translate();
+    const std::vector<std::string>& boot_code() const;
+    tl::expected<void, std::string> add_file(const std::string& filename, std::string code);
+    // A whole program is outlined and checked for the functions its divide routines fall back to. Watch mode
+    // translates one file at a time and does both over the linked program instead
+    tl::expected<std::vector<std::string>, std::string> translate(bool whole_program = true);
+    // Where the code of the last translate() came from, by ROM address, one entry per VM command
+    const SourceMap& source_map() const;
+
+    // Translates one line at a time, writing its assembly before the next line is read
+    tl::expected<void, std::string> translate_stream(const std::string& filename, std::istream& in, std::ostream& out);
 
 private:
-    std::vector<std::pair<std::string, std::vector<std::string>>> files;
+    struct file_output {
+        cache_key key;
+        bool cached;
+        std::vector<std::string> lines;
+        std::vector<source_mark> marks;
+    };
+
+    codegen_options options;
+    const TranslationCache* cache = nullptr;
+    std::vector<file_output> outputs;
+    SymbolTable symbols;
+    VMProgram program;
+    std::vector<vm_file> files;
     std::vector<std::string> bootcode;
+    SourceMap sources;
 };
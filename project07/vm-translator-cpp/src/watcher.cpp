@@ -0,0 +1,260 @@
+#include "watcher.h"
+#include "bootstrap.h"
+#include "outliner.h"
+#include "tooling.h"
+
+#include <spdlog/spdlog.h>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <system_error>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace {
+
+// Editors often save with several events in a row, so changes are gathered for this long before rebuilding
+constexpr int kSettleMillis = 50;
+
+constexpr uint32_t kWatchMask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE;
+
+struct inotify_handle {
+    int fd;
+
+    ~inotify_handle() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+tl::expected<void, std::string> read_events(int fd, std::set<std::string>* changed) {
+    alignas(struct inotify_event) char events[4096];
+
+    ssize_t length = read(fd, events, sizeof(events));
+    if (length < 0) {
+        if (errno == EINTR) {
+            return {};
+        }
+        return tl::unexpected(fmt::format("Failed to read inotify events: {}", std::strerror(errno)));
+    }
+
+    for (ssize_t offset = 0; offset < length;) {
+        const auto* event = reinterpret_cast<const struct inotify_event*>(events + offset);
+        offset += sizeof(struct inotify_event) + event->len;
+
+        if (event->len == 0) {
+            continue;
+        }
+
+        const std::filesystem::path name(event->name);
+        if (name.extension() == ".vm") {
+            changed->insert(name.string());
+        }
+    }
+    return {};
+}
+
+double elapsed_millis(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+}
+
+ProjectWatcher::ProjectWatcher(const std::filesystem::path& directory, const std::filesystem::path& asm_output, const std::filesystem::path& hack_output, const codegen_options& options)
+    : directory(directory), asm_output(asm_output), hack_output(hack_output), options(options) {}
+
+tl::expected<void, std::string> ProjectWatcher::load_file(const std::filesystem::path& path) {
+    auto contents = get_file_contents(path);
+    if (!contents.has_value()) {
+        return tl::unexpected(contents.error());
+    }
+
+    const std::string stem = path.stem();
+    VMTranslator translator(options);
+    if (auto result = translator.add_file(stem, std::move(contents.value())); !result.has_value()) {
+        return tl::unexpected(result.error());
+    }
+
+    auto lines = translator.translate(false);
+    if (!lines.has_value()) {
+        return tl::unexpected(lines.error());
+    }
+
+    auto object = assemble_chunk(lines.value());
+    if (!object.has_value()) {
+        return tl::unexpected(fmt::format("{}: {}", stem, object.error()));
+    }
+    object->name = stem;
+
+    files.insert_or_assign(stem, watched_file { std::move(translator), std::move(lines.value()), std::move(object.value()) });
+    return {};
+}
+
+// The order a directory build reads the files in, so both lay the program out the same way
+tl::expected<std::vector<const ProjectWatcher::watched_file*>, std::string> ProjectWatcher::link_order() const {
+    std::error_code ec;
+    std::filesystem::directory_iterator it(directory, ec);
+    std::vector<const watched_file*> order;
+    for (; !ec && it != std::filesystem::directory_iterator(); it.increment(ec)) {
+        if (const auto found = files.find(it->path().stem()); it->path().extension() == ".vm" && found != files.end()) {
+            order.push_back(&found->second);
+        }
+    }
+    if (ec) {
+        return tl::unexpected(fmt::format("Failed to list {}: {}", directory.string(), ec.message()));
+    }
+    return order;
+}
+
+tl::expected<void, std::string> ProjectWatcher::write_outputs() {
+    const auto listed = link_order();
+    if (!listed.has_value()) {
+        return tl::unexpected(listed.error());
+    }
+    const std::vector<const watched_file*>& order = listed.value();
+    std::vector<const object_chunk*> chunks { &boot_object };
+    for (const watched_file* file : order) {
+        chunks.push_back(&file->object);
+    }
+
+    auto buf = link_chunks(chunks);
+    if (!buf.has_value()) {
+        return tl::unexpected(buf.error());
+    }
+
+    std::vector<std::string> lines = boot_lines;
+    for (const watched_file* file : order) {
+        lines.insert(lines.end(), file->asm_lines.begin(), file->asm_lines.end());
+    }
+    if (auto checked = check_divide_fallbacks(lines, options); !checked.has_value()) {
+        return tl::unexpected(checked.error());
+    }
+    if (options.outline) {
+        auto outlined = outline_program(lines, options.outline_budget, kOutlineProfileCycles);
+        if (!outlined.has_value()) {
+            return tl::unexpected(outlined.error());
+        }
+        lines = std::move(outlined.value());
+
+        auto object = assemble_chunk(lines);
+        if (!object.has_value()) {
+            return tl::unexpected(object.error());
+        }
+        buf = link_chunks({ &object.value() });
+        if (!buf.has_value()) {
+            return tl::unexpected(buf.error());
+        }
+    }
+
+    std::ofstream asm_file(asm_output, std::ios::out | std::ios::trunc);
+    for (const auto& line : lines) {
+        asm_file.write(line.c_str(), line.size());
+        asm_file.write("\n", 1);
+    }
+    if (!asm_file) {
+        return tl::unexpected(fmt::format("Failed to write {}", asm_output.string()));
+    }
+
+    std::ofstream hack_file(hack_output, std::ios::out | std::ios::trunc);
+    for (const auto& word : buf.value()) {
+        hack_file << fmt::format("{:016b}\n", word);
+    }
+    if (!hack_file) {
+        return tl::unexpected(fmt::format("Failed to write {}", hack_output.string()));
+    }
+
+    return {};
+}
+
+tl::expected<void, std::string> ProjectWatcher::run() {
+    inotify_handle handle { inotify_init1(IN_CLOEXEC) };
+    if (handle.fd < 0) {
+        return tl::unexpected(fmt::format("Failed to start inotify: {}", std::strerror(errno)));
+    }
+
+    if (inotify_add_watch(handle.fd, directory.c_str(), kWatchMask) < 0) {
+        return tl::unexpected(fmt::format("Failed to watch {}: {}", directory.string(), std::strerror(errno)));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    VMTranslator boot(options);
+    if (auto result = boot.add_boot_code(kDefaultBootstrapCode); !result.has_value()) {
+        return tl::unexpected(result.error());
+    }
+    boot_lines = boot.boot_code();
+
+    auto boot_object_result = assemble_chunk(boot_lines);
+    if (!boot_object_result.has_value()) {
+        return tl::unexpected(boot_object_result.error());
+    }
+    boot_object = std::move(boot_object_result.value());
+    boot_object.name = "bootstrap";
+
+    for (auto const& dir_entry : std::filesystem::directory_iterator {directory}) {
+        if (!dir_entry.is_regular_file() || dir_entry.path().extension() != ".vm") {
+            continue;
+        }
+        if (auto result = load_file(dir_entry.path()); !result.has_value()) {
+            return tl::unexpected(result.error());
+        }
+    }
+
+    if (auto result = write_outputs(); !result.has_value()) {
+        return tl::unexpected(result.error());
+    }
+    spdlog::info("Built {} file(s) into {} in {:.2f} ms, watching {}", files.size(), hack_output.string(), elapsed_millis(start), directory.string());
+
+    while (true) {
+        std::set<std::string> changed;
+        if (auto result = read_events(handle.fd, &changed); !result.has_value()) {
+            return tl::unexpected(result.error());
+        }
+
+        struct pollfd pfd { handle.fd, POLLIN, 0 };
+        while (poll(&pfd, 1, kSettleMillis) > 0) {
+            if (auto result = read_events(handle.fd, &changed); !result.has_value()) {
+                return tl::unexpected(result.error());
+            }
+        }
+
+        if (changed.empty()) {
+            continue;
+        }
+
+        start = std::chrono::steady_clock::now();
+
+        for (const auto& name : changed) {
+            const std::filesystem::path path = directory / name;
+            if (!std::filesystem::is_regular_file(path)) {
+                spdlog::info("Removed: {}", name);
+                files.erase(path.stem());
+                failing.erase(path.stem());
+                continue;
+            }
+
+            spdlog::info("Changed: {}", name);
+            if (auto result = load_file(path); !result.has_value()) {
+                spdlog::error("Translation failed: {}", result.error());
+                failing.insert(path.stem());
+            } else {
+                failing.erase(path.stem());
+            }
+        }
+
+        // Keep the last good outputs until every changed file translates again, including those of earlier changes
+        if (!failing.empty()) {
+            spdlog::info("Keeping the last outputs until {} failing file(s) translate", failing.size());
+            continue;
+        }
+
+        if (auto result = write_outputs(); !result.has_value()) {
+            spdlog::error("Failed to write outputs: {}", result.error());
+            continue;
+        }
+        spdlog::info("Rebuilt {} file(s) of {} in {:.2f} ms", changed.size(), files.size(), elapsed_millis(start));
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <filesystem>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <tl/expected.hpp>
+
+#include "assembler.h"
+#include "vmtranslator.h"
+
+// Keeps every .vm file of a directory parsed, translated and assembled in memory,
+// and rewrites the .asm and .hack outputs whenever a file changes. Outlining and checking what divide routines fall
+// back to look across files, so they run over the linked program on every rebuild instead
+class ProjectWatcher {
+public:
+    ProjectWatcher(const std::filesystem::path& directory, const std::filesystem::path& asm_output, const std::filesystem::path& hack_output, const codegen_options& options);
+
+    tl::expected<void, std::string> run();
+
+private:
+    struct watched_file {
+        VMTranslator translator;
+        std::vector<std::string> asm_lines;
+        object_chunk object;
+    };
+
+    tl::expected<void, std::string> load_file(const std::filesystem::path& path);
+    tl::expected<std::vector<const watched_file*>, std::string> link_order() const;
+    tl::expected<void, std::string> write_outputs();
+
+    std::filesystem::path directory;
+    std::filesystem::path asm_output;
+    std::filesystem::path hack_output;
+    codegen_options options;
+
+    std::vector<std::string> boot_lines;
+    object_chunk boot_object;
+    std::map<std::string, watched_file> files;
+    // Files whose last change failed to translate, by stem, which hold back the outputs until they translate again
+    std::set<std::string> failing;
+};
@@ -0,0 +1,18 @@
+// Tests the .vm files of this folder in the VM emulator.
+
+load,  // loads all the VM files from the current folder
+output-file MathTest.out,
+compare-to MathTest.cmp,
+
+set sp 261,
+
+repeat 200000 {
+	vmstep;
+}
+
+output-list RAM[3000]%D1.6.1 RAM[3001]%D1.6.1 RAM[3002]%D1.6.1 RAM[3003]%D1.6.1 RAM[3004]%D1.6.1 RAM[3005]%D1.6.1;
+output;
+output-list RAM[3006]%D1.6.1 RAM[3007]%D1.6.1 RAM[3008]%D1.6.1 RAM[3009]%D1.6.1 RAM[3010]%D1.6.1 RAM[3011]%D1.6.1;
+output;
+output-list RAM[3012]%D1.6.1 RAM[3013]%D1.6.1 RAM[3014]%D1.6.1 RAM[3015]%D1.6.1 RAM[3016]%D1.6.1 RAM[3017]%D1.6.1;
+output;